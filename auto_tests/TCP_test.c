@@ -472,8 +472,11 @@ START_TEST(test_client)
     c_sleep(50);
     do_TCP_server(tcp_s);
     c_sleep(50);
-    do_TCP_connection(conn, NULL);
-    do_TCP_connection(conn2, NULL);
+    poll_TCP_connections();
+    ck_assert_msg(do_TCP_connection_if_ready(conn, NULL) == 1, "connection with data to read was not run");
+#ifdef __linux__
+    ck_assert_msg(do_TCP_connection_if_ready(conn2, NULL) == 0, "idle connection was run");
+#endif
     ck_assert_msg(data_callback_good == 1, "data callback not called");
     status_callback_good = 0;
     send_disconnect_request(conn2, 0);
@@ -738,16 +741,243 @@ START_TEST(test_tcp_connection2)
 }
 END_TEST
 
+#ifdef TCP_SERVER_USE_EPOLL
+#define NUM_SERVER_THREADS 4
+
+START_TEST(test_threads)
+{
+    uint8_t self_public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t self_secret_key[CRYPTO_SECRET_KEY_SIZE];
+    crypto_new_keypair(self_public_key, self_secret_key);
+    TCP_Server *tcp_s = new_TCP_server(1, NUM_PORTS, ports, self_secret_key, NULL);
+    ck_assert_msg(tcp_s != NULL, "Failed to create TCP relay server");
+    ck_assert_msg(tcp_server_set_threads(tcp_s, NUM_SERVER_THREADS) == 0, "Failed to start server threads");
+    ck_assert_msg(tcp_server_set_threads(tcp_s, NUM_SERVER_THREADS) == -1, "Started server threads twice");
+
+    /* Connections are handed out round robin, so each of these is on a
+     * different thread.
+     */
+    struct sec_TCP_con *con1 = new_TCP_con(tcp_s);
+    struct sec_TCP_con *con2 = new_TCP_con(tcp_s);
+    struct sec_TCP_con *con3 = new_TCP_con(tcp_s);
+    struct sec_TCP_con *con4 = new_TCP_con(tcp_s);
+
+    uint8_t requ_p[1 + CRYPTO_PUBLIC_KEY_SIZE];
+    requ_p[0] = 0;
+    memcpy(requ_p + 1, con3->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    write_packet_TCP_secure_connection(con1, requ_p, sizeof(requ_p));
+    c_sleep(50);
+    memcpy(requ_p + 1, con1->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    write_packet_TCP_secure_connection(con3, requ_p, sizeof(requ_p));
+    c_sleep(50);
+    uint8_t data[2048];
+    int len = read_packet_sec_TCP(con1, data, 2 + 1 + 1 + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_MAC_SIZE);
+    ck_assert_msg(data[0] == 1 && data[1] == 16, "wrong routing response %u %u", data[0], data[1]);
+    len = read_packet_sec_TCP(con3, data, 2 + 1 + 1 + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_MAC_SIZE);
+    ck_assert_msg(data[0] == 1 && data[1] == 16, "wrong routing response %u %u", data[0], data[1]);
+    len = read_packet_sec_TCP(con1, data, 2 + 2 + CRYPTO_MAC_SIZE);
+    ck_assert_msg(data[0] == 2 && data[1] == 16, "no connect notification %u %u", data[0], data[1]);
+    len = read_packet_sec_TCP(con3, data, 2 + 2 + CRYPTO_MAC_SIZE);
+    ck_assert_msg(data[0] == 2 && data[1] == 16, "no connect notification %u %u", data[0], data[1]);
+
+    uint8_t test_packet[512] = {16, 17, 16, 86, 99, 127, 255, 189, 78};
+    write_packet_TCP_secure_connection(con3, test_packet, sizeof(test_packet));
+    write_packet_TCP_secure_connection(con1, test_packet, sizeof(test_packet));
+    c_sleep(50);
+    len = read_packet_sec_TCP(con1, data, 2 + sizeof(test_packet) + CRYPTO_MAC_SIZE);
+    ck_assert_msg(len == sizeof(test_packet), "wrong len %u", len);
+    ck_assert_msg(memcmp(data, test_packet, sizeof(test_packet)) == 0, "packet is wrong");
+    len = read_packet_sec_TCP(con3, data, 2 + sizeof(test_packet) + CRYPTO_MAC_SIZE);
+    ck_assert_msg(len == sizeof(test_packet), "wrong len %u", len);
+    ck_assert_msg(memcmp(data, test_packet, sizeof(test_packet)) == 0, "packet is wrong");
+
+    /* A connection is only confirmed once it sent its first packet. */
+    uint8_t ping_packet[1 + sizeof(uint64_t)] = {4, 8, 6, 9, 67};
+    write_packet_TCP_secure_connection(con4, ping_packet, sizeof(ping_packet));
+    c_sleep(50);
+    len = read_packet_sec_TCP(con4, data, 2 + sizeof(ping_packet) + CRYPTO_MAC_SIZE);
+    ck_assert_msg(data[0] == 5, "wrong packet id %u", data[0]);
+
+    uint8_t oob_packet[1 + CRYPTO_PUBLIC_KEY_SIZE + 10] = {6};
+    memcpy(oob_packet + 1, con4->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    write_packet_TCP_secure_connection(con2, oob_packet, sizeof(oob_packet));
+    c_sleep(50);
+    len = read_packet_sec_TCP(con4, data, 2 + sizeof(oob_packet) + CRYPTO_MAC_SIZE);
+    ck_assert_msg(len == sizeof(oob_packet), "wrong len %u", len);
+    ck_assert_msg(data[0] == 7, "wrong packet id %u", data[0]);
+    ck_assert_msg(public_key_cmp(data + 1, con2->public_key) == 0, "wrong oob sender");
+
+    kill_TCP_con(con3);
+    do_TCP_server(tcp_s);
+    c_sleep(50);
+    len = read_packet_sec_TCP(con1, data, 2 + 2 + CRYPTO_MAC_SIZE);
+    ck_assert_msg(data[0] == 3 && data[1] == 16, "no disconnect notification %u %u", data[0], data[1]);
+
+    kill_TCP_server(tcp_s);
+    kill_TCP_con(con1);
+    kill_TCP_con(con2);
+    kill_TCP_con(con4);
+}
+END_TEST
+#endif
+
+#ifndef _WIN32
+#include <sys/socket.h>
+
+START_TEST(test_recv_buffer)
+{
+    int fds[2];
+    ck_assert_msg(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0, "socketpair failed");
+    ck_assert_msg(set_socket_nonblock(fds[1]), "failed to make socket non-blocking");
+
+    struct sec_TCP_con con;
+    memset(&con, 0, sizeof(con));
+    con.sock = fds[0];
+    random_bytes(con.shared_key, sizeof(con.shared_key));
+    random_nonce(con.sent_nonce);
+
+    TCP_Recv_Buffer recv_buffer;
+    memset(&recv_buffer, 0, sizeof(recv_buffer));
+    uint8_t recv_nonce[CRYPTO_NONCE_SIZE];
+    memcpy(recv_nonce, con.sent_nonce, CRYPTO_NONCE_SIZE);
+
+    uint8_t packet[MAX_PACKET_SIZE];
+    uint8_t data[MAX_PACKET_SIZE];
+    memset(packet, 0, sizeof(packet));
+    int len = read_packet_TCP_secure_connection(fds[1], &recv_buffer, con.shared_key, recv_nonce, data, sizeof(data));
+    ck_assert_msg(len == 0, "read a packet from an empty socket: %i", len);
+
+    /* Several packets that arrive together are all handled. */
+    for (uint32_t i = 0; i < 8; ++i) {
+        packet[0] = i;
+        write_packet_TCP_secure_connection(&con, packet, 100 + i * 200);
+    }
+
+    for (uint32_t i = 0; i < 8; ++i) {
+        do {
+            len = read_packet_TCP_secure_connection(fds[1], &recv_buffer, con.shared_key, recv_nonce, data, sizeof(data));
+        } while (len == 0);
+
+        ck_assert_msg(len == 100 + i * 200, "wrong length %i for packet %u", len, i);
+        ck_assert_msg(data[0] == i, "packets out of order");
+    }
+
+    /* A packet that arrives in pieces is only handled once it is complete. */
+    uint8_t encrypted[sizeof(uint16_t) + 500 + CRYPTO_MAC_SIZE];
+    uint16_t length = net_htons(500 + CRYPTO_MAC_SIZE);
+    memcpy(encrypted, &length, sizeof(uint16_t));
+    encrypt_data_symmetric(con.shared_key, con.sent_nonce, packet, 500, encrypted + sizeof(uint16_t));
+
+    ck_assert_msg(send(fds[0], (const char *)encrypted, 1, 0) == 1, "send failed");
+    ck_assert_msg(read_packet_TCP_secure_connection(fds[1], &recv_buffer, con.shared_key, recv_nonce, data,
+                  sizeof(data)) == 0, "read a packet from a partial length");
+    ck_assert_msg(send(fds[0], (const char *)encrypted + 1, 200, 0) == 200, "send failed");
+    ck_assert_msg(read_packet_TCP_secure_connection(fds[1], &recv_buffer, con.shared_key, recv_nonce, data,
+                  sizeof(data)) == 0, "read a partial packet");
+    ck_assert_msg(send(fds[0], (const char *)encrypted + 201, sizeof(encrypted) - 201, 0) == sizeof(encrypted) - 201,
+                  "send failed");
+
+    do {
+        len = read_packet_TCP_secure_connection(fds[1], &recv_buffer, con.shared_key, recv_nonce, data, sizeof(data));
+    } while (len == 0);
+
+    ck_assert_msg(len == 500, "wrong length %i for split packet", len);
+
+    /* Lengths above the maximum packet size kill the connection. */
+    length = net_htons(MAX_PACKET_SIZE + 1);
+    ck_assert_msg(send(fds[0], (const char *)&length, sizeof(uint16_t), 0) == sizeof(uint16_t), "send failed");
+
+    do {
+        len = read_packet_TCP_secure_connection(fds[1], &recv_buffer, con.shared_key, recv_nonce, data, sizeof(data));
+    } while (len == 0);
+
+    ck_assert_msg(len == -1, "accepted an oversized packet");
+
+    wipe_TCP_recv_buffer(&recv_buffer);
+    kill_sock(fds[0]);
+    kill_sock(fds[1]);
+}
+END_TEST
+
+START_TEST(test_send_queue)
+{
+    int fds[2];
+    ck_assert_msg(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0, "socketpair failed");
+    ck_assert_msg(set_socket_nonblock(fds[0]), "failed to make socket non-blocking");
+    ck_assert_msg(set_socket_nonblock(fds[1]), "failed to make socket non-blocking");
+
+    TCP_Send_Pool pool;
+    memset(&pool, 0, sizeof(pool));
+    TCP_Send_Queue queue;
+    memset(&queue, 0, sizeof(queue));
+    queue.pool = &pool;
+    queue.limit = 16 * MAX_PACKET_SIZE;
+
+    /* Queue more than the socket takes, in odd sized pieces that span chunks. */
+    uint8_t data[1000];
+    uint32_t queued = 0;
+
+    while (!tcp_send_queue_full(&queue, 0)) {
+        for (uint32_t i = 0; i < sizeof(data); ++i) {
+            data[i] = (queued + i) % 251;
+        }
+
+        ck_assert_msg(tcp_send_queue_add(&queue, data, sizeof(data)) == 0, "failed to queue data");
+        queued += sizeof(data);
+    }
+
+    ck_assert_msg(queue.size == queued, "queue size %u, expected %u", queue.size, queued);
+    ck_assert_msg(!tcp_send_queue_full(&queue, 1), "priority packets should still fit");
+
+    uint32_t received = 0;
+
+    while (received < queued) {
+        tcp_send_queue_flush(&queue, fds[0]);
+
+        uint8_t buffer[4096];
+        int len;
+
+        while ((len = recv(fds[1], (char *)buffer, sizeof(buffer), 0)) > 0) {
+            for (int i = 0; i < len; ++i) {
+                ck_assert_msg(buffer[i] == (received + i) % 251, "wrong byte at %u", received + i);
+            }
+
+            received += len;
+        }
+    }
+
+    ck_assert_msg(queue.size == 0 && queue.first == NULL, "queue not empty after sending everything");
+    ck_assert_msg(tcp_send_queue_flush(&queue, fds[0]) == 0, "flushing an empty queue failed");
+    ck_assert_msg(pool.num_free != 0, "sent chunks were not returned to the pool");
+
+    tcp_send_queue_add(&queue, data, sizeof(data));
+    tcp_send_queue_clear(&queue);
+    ck_assert_msg(queue.size == 0 && queue.first == NULL, "clear left data in the queue");
+
+    tcp_send_pool_free(&pool);
+    kill_sock(fds[0]);
+    kill_sock(fds[1]);
+}
+END_TEST
+#endif
+
 static Suite *TCP_suite(void)
 {
     Suite *s = suite_create("TCP");
 
     DEFTESTCASE_SLOW(basic, 5);
     DEFTESTCASE_SLOW(some, 10);
+#ifndef _WIN32
+    DEFTESTCASE(recv_buffer);
+    DEFTESTCASE(send_queue);
+#endif
     DEFTESTCASE_SLOW(client, 10);
     DEFTESTCASE_SLOW(client_invalid, 15);
     DEFTESTCASE_SLOW(tcp_connection, 20);
     DEFTESTCASE_SLOW(tcp_connection2, 20);
+#ifdef TCP_SERVER_USE_EPOLL
+    DEFTESTCASE_SLOW(threads, 10);
+#endif
     return s;
 }
 
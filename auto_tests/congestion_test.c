@@ -0,0 +1,199 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "check_compat.h"
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "../toxcore/congestion.h"
+
+#include "helpers.h"
+
+#define START_TIME 1000000
+
+/* A link that carries LINK_RATE packets per second, with a round trip time
+ * of LINK_RTT ms when its queue is empty. */
+#define LINK_RATE 2000.0
+#define LINK_RTT 40
+
+typedef struct {
+    Congestion_Control cc;
+    uint64_t time;
+    double queue; /* Packets waiting in the link. */
+    double last_delay; /* Queuing delay of the previous step, what acknowledgements show now. */
+    double carry; /* Fraction of a packet the send rate allowed but wasn't sent. */
+} Link_State;
+
+/* Send for one update interval, as fast as the send rate allows if saturate,
+ * and update the send rate.
+ *
+ * return the queuing delay of the link in ms.
+ */
+static double link_step(Link_State *link, bool saturate, uint32_t resent)
+{
+    uint32_t sent = 0;
+
+    if (saturate) {
+        const double packets = link->cc.send_rate * CONGESTION_UPDATE_INTERVAL / 1000.0 + link->carry;
+        sent = (uint32_t)packets;
+        link->carry = packets - sent;
+    }
+
+    link->queue += sent - LINK_RATE * CONGESTION_UPDATE_INTERVAL / 1000.0;
+
+    if (link->queue < 0) {
+        link->queue = 0;
+    }
+
+    const double queuing_delay = link->queue / LINK_RATE * 1000.0;
+    link->time += CONGESTION_UPDATE_INTERVAL;
+
+    if (sent != 0) {
+        congestion_rtt_sample(&link->cc, LINK_RTT + (uint64_t)link->last_delay, link->time);
+    }
+
+    link->last_delay = queuing_delay;
+
+    Congestion_Update update = {0};
+    update.time = link->time;
+    update.interval = CONGESTION_UPDATE_INTERVAL;
+    update.packets_sent = sent;
+    update.packets_resent = resent;
+    update.send_queue_size = (uint32_t)link->queue;
+    update.direct = 1;
+    congestion_update(&link->cc, &update);
+
+    return queuing_delay;
+}
+
+START_TEST(test_rtt)
+{
+    Congestion_Control cc;
+    ck_assert(congestion_init(&cc, CONGESTION_NUM_ALGORITHMS, START_TIME) == -1);
+    ck_assert(congestion_init(&cc, CONGESTION_ALGORITHM_QUEUE, START_TIME) == 0);
+    ck_assert_msg(congestion_rtt(&cc, 1234) == 1234, "round trip time without samples should be the default");
+    ck_assert_msg(congestion_min_rtt(&cc, 1234) == 1234, "lowest round trip time without samples should be the default");
+
+    uint32_t i;
+
+    for (i = 0; i < 100; ++i) {
+        congestion_rtt_sample(&cc, 100 + (i % 2) * 20, START_TIME + i);
+    }
+
+    const uint64_t rtt = congestion_rtt(&cc, 1234);
+    ck_assert_msg(rtt >= 100 && rtt <= 120, "smoothed round trip time %llu out of range", (unsigned long long)rtt);
+    ck_assert_msg(congestion_min_rtt(&cc, 1234) == 100, "lowest round trip time should be the lowest sample");
+    ck_assert_msg(congestion_min_rtt(&cc, 50) == 50, "lowest round trip time should not go over the default");
+}
+END_TEST
+
+START_TEST(test_ledbat_fills_link)
+{
+    Link_State link = {{0}};
+    link.time = START_TIME;
+    ck_assert(congestion_init(&link.cc, CONGESTION_ALGORITHM_LEDBAT, link.time) == 0);
+
+    uint32_t i;
+
+    /* 20 seconds to get up to speed. */
+    for (i = 0; i < 20000 / CONGESTION_UPDATE_INTERVAL; ++i) {
+        link_step(&link, 1, 0);
+    }
+
+    double max_delay = 0, total_rate = 0;
+    const uint32_t steps = 10000 / CONGESTION_UPDATE_INTERVAL;
+
+    for (i = 0; i < steps; ++i) {
+        const double delay = link_step(&link, 1, 0);
+
+        if (delay > max_delay) {
+            max_delay = delay;
+        }
+
+        total_rate += link.cc.send_rate;
+    }
+
+    ck_assert_msg(total_rate / steps > LINK_RATE * 0.8 && total_rate / steps < LINK_RATE * 1.2,
+                  "average send rate %f not close to link rate %f", total_rate / steps, LINK_RATE);
+    ck_assert_msg(max_delay < 100, "queuing delay went up to %f ms", max_delay);
+}
+END_TEST
+
+START_TEST(test_ledbat_loss)
+{
+    Link_State link = {{0}};
+    link.time = START_TIME;
+    ck_assert(congestion_init(&link.cc, CONGESTION_ALGORITHM_LEDBAT, link.time) == 0);
+
+    uint32_t i;
+
+    for (i = 0; i < 20000 / CONGESTION_UPDATE_INTERVAL; ++i) {
+        link_step(&link, 1, 0);
+    }
+
+    /* Lost packets halve the rate, once per round trip. */
+    const double rate = link.cc.send_rate;
+    link_step(&link, 1, 1);
+    ck_assert_msg(link.cc.send_rate < rate * 0.6, "rate %f not halved from %f after a loss", link.cc.send_rate, rate);
+
+    const double halved = link.cc.send_rate;
+    link_step(&link, 1, 1);
+    ck_assert_msg(link.cc.send_rate > halved * 0.9, "rate %f halved again within a round trip", link.cc.send_rate);
+
+    /* A connection that doesn't use its rate doesn't get more. */
+    const double idle_rate = link.cc.send_rate;
+
+    for (i = 0; i < 5000 / CONGESTION_UPDATE_INTERVAL; ++i) {
+        link_step(&link, 0, 0);
+    }
+
+    ck_assert_msg(link.cc.send_rate <= idle_rate, "rate of idle connection went from %f to %f", idle_rate,
+                  link.cc.send_rate);
+}
+END_TEST
+
+START_TEST(test_queue_minimum_rate)
+{
+    Link_State link = {{0}};
+    link.time = START_TIME;
+    ck_assert(congestion_init(&link.cc, CONGESTION_ALGORITHM_QUEUE, link.time) == 0);
+
+    uint32_t i;
+
+    for (i = 0; i < 100; ++i) {
+        link_step(&link, 0, 0);
+        ck_assert(link.cc.send_rate >= CRYPTO_PACKET_MIN_RATE);
+        ck_assert(link.cc.send_rate_requested >= link.cc.send_rate);
+    }
+}
+END_TEST
+
+static Suite *congestion_suite(void)
+{
+    Suite *s = suite_create("congestion");
+
+    DEFTESTCASE(rtt);
+    DEFTESTCASE(ledbat_fills_link);
+    DEFTESTCASE(ledbat_loss);
+    DEFTESTCASE(queue_minimum_rate);
+
+    return s;
+}
+
+int main(int argc, char *argv[])
+{
+    srand((unsigned int) time(NULL));
+
+    Suite *congestion = congestion_suite();
+    SRunner *test_runner = srunner_create(congestion);
+
+    int number_failed = 0;
+    srunner_run_all(test_runner, CK_NORMAL);
+    number_failed = srunner_ntests_failed(test_runner);
+
+    srunner_free(test_runner);
+
+    return number_failed;
+}
@@ -273,6 +273,95 @@ START_TEST(test_large_data_symmetric)
 }
 END_TEST
 
+START_TEST(test_symmetric_detached)
+{
+    unsigned char k[CRYPTO_SYMMETRIC_KEY_SIZE];
+    unsigned char n[CRYPTO_NONCE_SIZE];
+
+    unsigned char m1[1024];
+    unsigned char c1[sizeof(m1) + CRYPTO_MAC_SIZE];
+    unsigned char packet[sizeof(m1) + CRYPTO_MAC_SIZE];
+
+    rand_bytes(m1, sizeof(m1));
+    rand_bytes(n, CRYPTO_NONCE_SIZE);
+    new_symmetric_key(k);
+
+    /* In place encryption with the MAC in front gives the same packet. */
+    memcpy(packet + CRYPTO_MAC_SIZE, m1, sizeof(m1));
+    ck_assert_msg(encrypt_data_symmetric_detached(k, n, packet + CRYPTO_MAC_SIZE, sizeof(m1), packet) == sizeof(m1),
+                  "could not encrypt data");
+    ck_assert_msg(encrypt_data_symmetric(k, n, m1, sizeof(m1), c1) == sizeof(c1), "could not encrypt data");
+    ck_assert_msg(memcmp(packet, c1, sizeof(c1)) == 0, "encrypted packets differ");
+
+    ck_assert_msg(decrypt_data_symmetric_detached(k, n, packet + CRYPTO_MAC_SIZE, sizeof(m1), packet) == sizeof(m1),
+                  "could not decrypt data");
+    ck_assert_msg(memcmp(packet + CRYPTO_MAC_SIZE, m1, sizeof(m1)) == 0, "decrypted texts differ");
+
+    /* A modified packet is rejected and left alone. */
+    memcpy(packet, c1, sizeof(c1));
+    packet[sizeof(packet) - 1] ^= 1;
+    ck_assert_msg(decrypt_data_symmetric_detached(k, n, packet + CRYPTO_MAC_SIZE, sizeof(m1), packet) == -1,
+                  "modified packet was decrypted");
+    packet[sizeof(packet) - 1] ^= 1;
+    ck_assert_msg(memcmp(packet, c1, sizeof(c1)) == 0, "rejected packet was changed");
+
+    /* decrypt_data_symmetric may also work in place. */
+    ck_assert_msg(decrypt_data_symmetric(k, n, packet, sizeof(packet), packet) == sizeof(m1), "could not decrypt data");
+    ck_assert_msg(memcmp(packet, m1, sizeof(m1)) == 0, "decrypted texts differ");
+}
+END_TEST
+
+START_TEST(test_symmetric_batch)
+{
+    unsigned char k[2][CRYPTO_SYMMETRIC_KEY_SIZE];
+    unsigned char n[8][CRYPTO_NONCE_SIZE];
+    unsigned char m[8][200];
+    unsigned char c[8][sizeof(m[0]) + CRYPTO_MAC_SIZE];
+    unsigned char p[8][sizeof(m[0])];
+    Crypto_Batch_Entry entries[8];
+    size_t i;
+
+    new_symmetric_key(k[0]);
+    new_symmetric_key(k[1]);
+    rand_bytes(n[0], CRYPTO_NONCE_SIZE);
+
+    for (i = 0; i < 8; ++i) {
+        /* Runs of consecutive nonces with one key, then a switch. */
+        if (i > 0) {
+            memcpy(n[i], n[i - 1], CRYPTO_NONCE_SIZE);
+            increment_nonce(n[i]);
+        }
+
+        const size_t length = 1 + i * 28;
+        rand_bytes(m[i], length);
+        ck_assert_msg(encrypt_data_symmetric(k[i / 3 % 2], n[i], m[i], length, c[i]) == length + CRYPTO_MAC_SIZE,
+                      "could not encrypt data");
+
+        entries[i].shared_key = k[i / 3 % 2];
+        entries[i].nonce = n[i];
+        entries[i].encrypted = c[i];
+        entries[i].length = length + CRYPTO_MAC_SIZE;
+        entries[i].plain = p[i];
+    }
+
+    /* One corrupt packet, one decrypted in place. */
+    c[4][CRYPTO_MAC_SIZE] ^= 1;
+    entries[6].plain = c[6];
+
+    ck_assert_msg(decrypt_data_symmetric_batch(entries, 8) == 7, "wrong number of packets decrypted");
+
+    for (i = 0; i < 8; ++i) {
+        if (i == 4) {
+            ck_assert_msg(entries[i].plain_length == -1, "corrupt packet was decrypted");
+            continue;
+        }
+
+        ck_assert_msg(entries[i].plain_length == 1 + i * 28, "decrypted text lengths differ");
+        ck_assert_msg(memcmp(entries[i].plain, m[i], entries[i].plain_length) == 0, "decrypted texts differ");
+    }
+}
+END_TEST
+
 static void increment_nonce_number_cmp(uint8_t *nonce, uint32_t num)
 {
     uint32_t num1, num2;
@@ -421,6 +510,8 @@ static Suite *crypto_suite(void)
     DEFTESTCASE_SLOW(endtoend, 15); /* waiting up to 15 seconds */
     DEFTESTCASE(large_data);
     DEFTESTCASE(large_data_symmetric);
+    DEFTESTCASE(symmetric_detached);
+    DEFTESTCASE(symmetric_batch);
     DEFTESTCASE_SLOW(increment_nonce, 20);
     DEFTESTCASE(memzero);
     DEFTESTCASE(memcmp);
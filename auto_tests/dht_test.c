@@ -671,6 +671,99 @@ START_TEST(test_dht_create_packet)
 }
 END_TEST
 
+START_TEST(test_shared_keys_lru)
+{
+    Shared_Keys shared_keys;
+    memset(&shared_keys, 0, sizeof(shared_keys));
+    ck_assert_msg(shared_keys_set_capacity(&shared_keys, 3) == 0, "Failed to set capacity.");
+    ck_assert_msg(shared_keys.capacity == 4, "Capacity should be rounded up to 4, got %u", shared_keys.capacity);
+
+    uint8_t self_pk[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t self_sk[CRYPTO_SECRET_KEY_SIZE];
+    crypto_new_keypair(self_pk, self_sk);
+
+    uint8_t pks[5][CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t sk[CRYPTO_SECRET_KEY_SIZE];
+    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
+    uint8_t expected[CRYPTO_SHARED_KEY_SIZE];
+
+    for (uint32_t i = 0; i < 5; ++i) {
+        crypto_new_keypair(pks[i], sk);
+    }
+
+    for (uint32_t i = 0; i < 4; ++i) {
+        get_shared_key(&shared_keys, shared_key, self_sk, pks[i]);
+        encrypt_precompute(pks[i], self_sk, expected);
+        ck_assert_msg(memcmp(shared_key, expected, sizeof(expected)) == 0, "Wrong shared key.");
+    }
+
+    ck_assert_msg(shared_keys.misses == 4 && shared_keys.hits == 0, "Expected 4 misses.");
+
+    /* Touch key 0 so that key 1 is the least recently used one. */
+    get_shared_key(&shared_keys, shared_key, self_sk, pks[0]);
+    encrypt_precompute(pks[0], self_sk, expected);
+    ck_assert_msg(memcmp(shared_key, expected, sizeof(expected)) == 0, "Wrong cached shared key.");
+    ck_assert_msg(shared_keys.hits == 1, "Expected a hit.");
+
+    get_shared_key(&shared_keys, shared_key, self_sk, pks[4]);
+    ck_assert_msg(shared_keys.misses == 5, "Expected a miss.");
+
+    get_shared_key(&shared_keys, shared_key, self_sk, pks[0]);
+    ck_assert_msg(shared_keys.hits == 2, "Key 0 should not have been evicted.");
+
+    get_shared_key(&shared_keys, shared_key, self_sk, pks[1]);
+    ck_assert_msg(shared_keys.misses == 6, "Key 1 should have been evicted.");
+
+    shared_keys_free(&shared_keys);
+    ck_assert_msg(shared_keys.keys == NULL && shared_keys.num_keys == 0, "Shared keys not freed.");
+}
+END_TEST
+
+START_TEST(test_sort_client_list)
+{
+    unix_time_update();
+
+    uint8_t comp_pk[CRYPTO_PUBLIC_KEY_SIZE];
+    random_bytes(comp_pk, sizeof(comp_pk));
+
+    for (uint32_t length = 2; length <= 64; length *= 2) {
+        VLA(Client_data, list, length);
+        memset(list, 0, sizeof(Client_data) * length);
+
+        for (uint32_t i = 0; i < length; ++i) {
+            random_bytes(list[i].public_key, CRYPTO_PUBLIC_KEY_SIZE);
+            /* Every third entry is timed out. */
+            list[i].assoc4.timestamp = i % 3 == 0 ? 0 : unix_time();
+            list[i].assoc4.ip_port.port = i;
+        }
+
+        sort_client_list(list, length, comp_pk);
+
+        uint32_t timed_out = 0;
+        uint64_t ports = 0;
+
+        for (uint32_t i = 0; i < length; ++i) {
+            const Client_data *client = &list[i];
+            ports |= 1ULL << client->assoc4.ip_port.port;
+
+            if (client->assoc4.timestamp == 0) {
+                ck_assert_msg(i == timed_out, "Timed out entries should come first.");
+                ++timed_out;
+                continue;
+            }
+
+            if (i > timed_out) {
+                ck_assert_msg(id_closest(comp_pk, client->public_key, list[i - 1].public_key) == 1,
+                              "Entries should go from furthest to closest.");
+            }
+        }
+
+        ck_assert_msg(timed_out == (length + 2) / 3, "Wrong number of timed out entries: %u", timed_out);
+        ck_assert_msg(ports == (length == 64 ? UINT64_MAX : (1ULL << length) - 1), "Entries were lost while sorting.");
+    }
+}
+END_TEST
+
 #define MAX_COUNT 3
 
 static void dht_pack_unpack(const Node_format *nodes, size_t size, uint8_t *data, size_t length)
@@ -768,6 +861,8 @@ static Suite *dht_suite(void)
     Suite *s = suite_create("DHT");
     DEFTESTCASE(dht_create_packet);
     DEFTESTCASE(dht_node_packing);
+    DEFTESTCASE(shared_keys_lru);
+    DEFTESTCASE(sort_client_list);
 
     DEFTESTCASE_SLOW(list, 20);
     DEFTESTCASE_SLOW(DHT_test, 50);
@@ -4,6 +4,11 @@
 #define _DARWIN_C_SOURCE
 #define _XOPEN_SOURCE 600
 
+#if defined(__linux__)
+/* Needed for recvmmsg and sendmmsg in network.c. */
+#define _GNU_SOURCE
+#endif
+
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
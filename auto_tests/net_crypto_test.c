@@ -0,0 +1,513 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "check_compat.h"
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "helpers.h"
+
+#include "../toxcore/net_crypto.c"
+
+#define NUM_ROUND_TRIPS 200
+
+START_TEST(test_varint)
+{
+    static const uint32_t values[] = {0, 239, 240, 2287, 2288, 67823, 67824, UINT32_MAX};
+    static const uint16_t lengths[] = {1, 1, 2, 2, 3, 3, 5, 5};
+    uint32_t i;
+
+    for (i = 0; i < sizeof(values) / sizeof(values[0]); ++i) {
+        uint8_t data[5];
+        const uint16_t len = write_varint(data, values[i]);
+        ck_assert_msg(len == lengths[i], "%u written in %u bytes instead of %u", values[i], len, lengths[i]);
+
+        uint32_t value = 0;
+        ck_assert_msg(read_varint(data, len, &value) == len, "%u not read back", values[i]);
+        ck_assert_msg(value == values[i], "%u read back as %u", values[i], value);
+
+        ck_assert_msg(read_varint(data, len - 1, &value) == -1, "%u read from %u bytes", values[i], len - 1);
+    }
+
+    for (i = 250; i < 256; ++i) {
+        uint8_t data[5] = {(uint8_t)i};
+        uint32_t value;
+        ck_assert_msg(read_varint(data, sizeof(data), &value) == -1, "varint starting with %u read", i);
+    }
+}
+END_TEST
+
+/* Fill recv_array with a random window starting at start, with runs of
+ * received and missing packets, and send_array with every packet of that
+ * window and a few more the peer didn't get to yet, all sent in bundles.
+ */
+static void fill_window(Packet_Pool *pool, Packets_Array *send_array, Packets_Array *recv_array, uint32_t start,
+                        uint32_t window)
+{
+    Packet_Data dt;
+    memset(&dt, 0, sizeof(dt));
+    dt.sent_time = 1;
+    dt.length = 1;
+    dt.bundled = 1;
+
+    send_array->buffer_start = send_array->buffer_end = start;
+    recv_array->buffer_start = recv_array->buffer_end = start;
+
+    uint32_t i;
+
+    for (i = 0; i < window + 10; ++i) {
+        ck_assert(add_data_end_of_buffer(pool, send_array, &dt) == start + i);
+    }
+
+    i = 0;
+
+    while (i < window) {
+        uint32_t run = 1 + rand() % (rand() % 2 ? 3 : 300);
+        const bool received = rand() % 2;
+
+        for (; run != 0 && i < window; --run, ++i) {
+            if (received) {
+                ck_assert(add_data_to_buffer(pool, recv_array, start + i, &dt) == 0);
+            }
+        }
+    }
+
+    /* The window may end with missing packets too. */
+    ck_assert(set_buffer_end(recv_array, start + window) == 0);
+}
+
+/* Check that send_array holds exactly the packets from start up to end
+ * that recv_array doesn't and that those were marked to be sent again.
+ *
+ * return the number of packets the peer misses.
+ */
+static uint32_t check_requested(const Packets_Array *send_array, const Packets_Array *recv_array, uint32_t start,
+                                uint32_t end)
+{
+    uint32_t i, missing = 0;
+
+    for (i = start; i != end; ++i) {
+        const Packet_Data *packet = get_packet(send_array, i);
+
+        if (get_packet(recv_array, i) != NULL) {
+            ck_assert_msg(packet == NULL, "packet %u was received but not acknowledged", i - start);
+        } else {
+            ck_assert_msg(packet != NULL, "packet %u was not received but acknowledged", i - start);
+            ck_assert_msg(packet->sent_time == 0 && packet->resent, "packet %u was not requested", i - start);
+            ++missing;
+        }
+    }
+
+    return missing;
+}
+
+START_TEST(test_request_ranges_round_trip)
+{
+    Packet_Pool pool;
+    ck_assert(packet_pool_init(&pool) == 0);
+
+    uint32_t i, j;
+
+    for (i = 0; i < NUM_ROUND_TRIPS; ++i) {
+        Packets_Array send_array = {{0}}, recv_array = {{0}};
+        /* Some windows wrap around the packet numbers. */
+        const uint32_t start = i % 4 == 0 ? UINT32_MAX - rand() % 1000 : (uint32_t)rand();
+        const uint32_t window = 1 + rand() % 10000;
+        fill_window(&pool, &send_array, &recv_array, start, window);
+
+        uint8_t data[MAX_CRYPTO_DATA_SIZE];
+        const int len = generate_request_ranges_packet(data, sizeof(data), &recv_array);
+        ck_assert(len >= 1 && data[0] == PACKET_ID_REQUEST_RANGES);
+
+        uint64_t latest_send_time = 0;
+        uint32_t bundled_lost = 5;
+        const int requested = handle_request_ranges_packet(&pool, &send_array, data, len, &latest_send_time, 0,
+                              &bundled_lost);
+
+        /* A run takes at most 11 bytes, so all of them fit if there is room for one more. */
+        if (len < (int)sizeof(data) - 11) {
+            const uint32_t missing = check_requested(&send_array, &recv_array, start, start + window);
+            ck_assert_msg(requested == (int)missing, "%d packets requested instead of %u", requested, missing);
+
+            const bool received = find_packet(&recv_array, start, start + window, 1) != start + window;
+            ck_assert_msg(latest_send_time == (received ? 1 : 0), "round trip time sampled wrong");
+
+            /* Only the packets missing after the last one received count. */
+            uint32_t lost = 5;
+
+            for (j = start; j != start + window; ++j) {
+                lost = get_packet(&recv_array, j) != NULL ? 0 : lost + 1;
+            }
+
+            ck_assert_msg(bundled_lost == lost, "%u bundled packets lost instead of %u", bundled_lost, lost);
+        } else {
+            ck_assert(requested >= 0);
+        }
+
+        /* The packets the peer didn't get to yet are left alone. */
+        for (j = start + window; j != start + window + 10; ++j) {
+            const Packet_Data *packet = get_packet(&send_array, j);
+            ck_assert(packet != NULL && packet->sent_time == 1 && !packet->resent);
+        }
+
+        clear_buffer(&pool, &send_array);
+        clear_buffer(&pool, &recv_array);
+    }
+
+    packet_pool_kill(&pool);
+}
+END_TEST
+
+START_TEST(test_request_ranges_truncated)
+{
+    Packet_Pool pool;
+    ck_assert(packet_pool_init(&pool) == 0);
+
+    uint32_t i;
+
+    for (i = 0; i < NUM_ROUND_TRIPS; ++i) {
+        Packets_Array send_array = {{0}}, recv_array = {{0}};
+        const uint32_t start = (uint32_t)rand();
+        const uint32_t window = 1 + rand() % 10000;
+        fill_window(&pool, &send_array, &recv_array, start, window);
+
+        /* Only the first runs fit, the packets after them must stay. */
+        uint8_t data[1 + 11];
+        const int len = generate_request_ranges_packet(data, 1 + rand() % 11, &recv_array);
+        ck_assert(len >= 1);
+
+        uint64_t latest_send_time = 0;
+        uint32_t bundled_lost = 0;
+        const int requested = handle_request_ranges_packet(&pool, &send_array, data, len, &latest_send_time, 0,
+                              &bundled_lost);
+
+        /* The runs in the packet end at the first packet that was left alone. */
+        uint32_t end = start;
+
+        while (end != send_array.buffer_end
+                && (get_packet(&send_array, end) == NULL || get_packet(&send_array, end)->sent_time == 0)) {
+            ++end;
+        }
+
+        const uint32_t missing = check_requested(&send_array, &recv_array, start, end);
+        ck_assert_msg(requested == (int)missing, "%d packets requested instead of %u", requested, missing);
+
+        for (; end != send_array.buffer_end; ++end) {
+            const Packet_Data *packet = get_packet(&send_array, end);
+            ck_assert_msg(packet != NULL && packet->sent_time == 1 && !packet->resent,
+                          "packet %u after the runs in the packet was changed", end - start);
+        }
+
+        clear_buffer(&pool, &send_array);
+        clear_buffer(&pool, &recv_array);
+    }
+
+    packet_pool_kill(&pool);
+}
+END_TEST
+
+START_TEST(test_request_ranges_invalid)
+{
+    Packet_Pool pool;
+    ck_assert(packet_pool_init(&pool) == 0);
+
+    Packet_Data dt;
+    memset(&dt, 0, sizeof(dt));
+    dt.sent_time = 1;
+
+    Packets_Array send_array = {{0}};
+    uint32_t i;
+
+    for (i = 0; i < 10; ++i) {
+        ck_assert(add_data_end_of_buffer(&pool, &send_array, &dt) == i);
+    }
+
+    static const struct {
+        uint8_t data[8];
+        uint16_t length;
+        const char *what;
+    } invalid[] = {
+        {{PACKET_ID_REQUEST}, 1, "wrong packet id"},
+        {{PACKET_ID_REQUEST_RANGES}, 0, "empty packet"},
+        {{PACKET_ID_REQUEST_RANGES, 12}, 2, "missing packet past the end"},
+        {{PACKET_ID_REQUEST_RANGES, 0, 5, 6}, 4, "run of missing packets past the end"},
+        {{PACKET_ID_REQUEST_RANGES, 0, 11, 0}, 4, "received packets past the end"},
+        {{PACKET_ID_REQUEST_RANGES, 5, 6}, 3, "second run past the end"},
+        {{PACKET_ID_REQUEST_RANGES, 0, 5}, 3, "run without the number of missing packets"},
+        {{PACKET_ID_REQUEST_RANGES, 0}, 2, "run without its numbers"},
+        {{PACKET_ID_REQUEST_RANGES, 241}, 2, "truncated 2 byte number"},
+        {{PACKET_ID_REQUEST_RANGES, 248, 0}, 3, "truncated 3 byte number"},
+        {{PACKET_ID_REQUEST_RANGES, 249, 0, 0, 0}, 5, "truncated 5 byte number"},
+        {{PACKET_ID_REQUEST_RANGES, 249, 255, 255, 255, 255}, 6, "huge number"},
+        {{PACKET_ID_REQUEST_RANGES, 255}, 2, "unknown number format"},
+    };
+
+    uint64_t latest_send_time = 0;
+    uint32_t bundled_lost = 0;
+
+    for (i = 0; i < sizeof(invalid) / sizeof(invalid[0]); ++i) {
+        ck_assert_msg(handle_request_ranges_packet(&pool, &send_array, invalid[i].data, invalid[i].length,
+                      &latest_send_time, 0, &bundled_lost) == -1, "packet with %s accepted", invalid[i].what);
+    }
+
+    /* Exactly up to buffer_end is fine. */
+    const uint8_t all[] = {PACKET_ID_REQUEST_RANGES, 0, 9, 1};
+    ck_assert(handle_request_ranges_packet(&pool, &send_array, all, sizeof(all), &latest_send_time, 0,
+                                           &bundled_lost) == 1);
+    ck_assert(get_packet(&send_array, 8) == NULL && get_packet(&send_array, 9) != NULL);
+
+    clear_buffer(&pool, &send_array);
+    packet_pool_kill(&pool);
+}
+END_TEST
+
+#define NUM_STREAM_PACKETS 600
+#define NOT_ON_STREAM 0xff
+
+typedef struct {
+    uint8_t stream[NUM_STREAM_PACKETS + 8];
+    uint16_t number[NUM_STREAM_PACKETS + 8];
+    uint32_t count;
+} Delivered;
+
+static int record_delivery(void *object, int id, const uint8_t *data, uint16_t length, void *userdata)
+{
+    Delivered *delivered = (Delivered *)object;
+    ck_assert_msg(length == 4 && data[0] == CRYPTO_RESERVED_PACKETS, "delivered packet still has a stream header");
+    ck_assert(delivered->count < NUM_STREAM_PACKETS + 8);
+
+    uint16_t number;
+    memcpy(&number, data + 2, sizeof(uint16_t));
+    delivered->stream[delivered->count] = data[1];
+    delivered->number[delivered->count] = net_ntohs(number);
+    ++delivered->count;
+    return 0;
+}
+
+/* Set up a Net_Crypto with just an established connection 0 that records the
+ * packets delivered to it in delivered.
+ */
+static Net_Crypto *new_stream_net_crypto(Delivered *delivered)
+{
+    Net_Crypto *c = (Net_Crypto *)calloc(1, sizeof(Net_Crypto));
+    ck_assert(c != NULL);
+    ck_assert(packet_pool_init(&c->packet_pool) == 0);
+
+    c->crypto_connections = (Crypto_Connection *)calloc(1, sizeof(Crypto_Connection));
+    ck_assert(c->crypto_connections != NULL);
+    c->crypto_connections_length = 1;
+
+    Crypto_Connection *conn = &c->crypto_connections[0];
+    ck_assert(pthread_mutex_init(&conn->mutex, NULL) == 0);
+    conn->status = CRYPTO_CONN_ESTABLISHED;
+    conn->connection_data_callback = &record_delivery;
+    conn->connection_data_callback_object = delivered;
+    return c;
+}
+
+static void kill_stream_net_crypto(Net_Crypto *c)
+{
+    Crypto_Connection *conn = &c->crypto_connections[0];
+    uint32_t i;
+
+    for (i = 0; i < CRYPTO_MAX_STREAMS; ++i) {
+        free(conn->stream[i].reorder);
+    }
+
+    clear_buffer(&c->packet_pool, &conn->recv_array);
+    pthread_mutex_destroy(&conn->mutex);
+    free(c->crypto_connections);
+    packet_pool_kill(&c->packet_pool);
+    free(c);
+}
+
+/* Receive lossless packet number of the connection, with stream packet number
+ * stream_number on stream, or without a stream if stream is NOT_ON_STREAM.
+ */
+static void receive_stream_packet(Net_Crypto *c, uint32_t number, uint8_t stream, uint16_t stream_number)
+{
+    Packet_Data dt;
+    memset(&dt, 0, sizeof(dt));
+
+    uint8_t *payload = dt.data;
+    const uint16_t net_number = net_htons(stream_number);
+
+    if (stream != NOT_ON_STREAM) {
+        dt.data[0] = PACKET_ID_STREAM;
+        dt.data[1] = stream;
+        memcpy(dt.data + 2, &net_number, sizeof(uint16_t));
+        payload += CRYPTO_STREAM_HEADER_SIZE;
+        dt.length = CRYPTO_STREAM_HEADER_SIZE;
+    }
+
+    payload[0] = CRYPTO_RESERVED_PACKETS;
+    payload[1] = stream;
+    memcpy(payload + 2, &net_number, sizeof(uint16_t));
+    dt.length += 4;
+
+    Crypto_Connection *conn = &c->crypto_connections[0];
+    ck_assert(add_data_to_buffer(&c->packet_pool, &conn->recv_array, number, &dt) == 0);
+    ck_assert(deliver_lossless_packets(c, 0, number, NULL) == 0);
+}
+
+static void check_delivered(const Delivered *delivered, uint32_t index, uint8_t stream, uint16_t stream_number)
+{
+    ck_assert_msg(index < delivered->count, "only %u packets delivered", delivered->count);
+    ck_assert_msg(delivered->stream[index] == stream && delivered->number[index] == stream_number,
+                  "packet %u delivered was %u on stream %u instead of %u on stream %u", index, delivered->number[index],
+                  delivered->stream[index], stream_number, stream);
+}
+
+START_TEST(test_stream_out_of_order)
+{
+    Delivered delivered = {{0}};
+    Net_Crypto *c = new_stream_net_crypto(&delivered);
+
+    receive_stream_packet(c, 0, 1, 0);
+    receive_stream_packet(c, 1, 2, 0);
+    ck_assert(delivered.count == 2);
+
+    /* Packet 2, the second on stream 1, is late: stream 2 goes on without it. */
+    receive_stream_packet(c, 3, 2, 1);
+    receive_stream_packet(c, 4, 1, 2);
+    receive_stream_packet(c, 5, 2, 2);
+    ck_assert_msg(delivered.count == 4, "%u packets delivered before the late one", delivered.count);
+    check_delivered(&delivered, 2, 2, 1);
+    check_delivered(&delivered, 3, 2, 2);
+
+    receive_stream_packet(c, 2, 1, 1);
+    ck_assert(delivered.count == 6);
+    check_delivered(&delivered, 4, 1, 1);
+    check_delivered(&delivered, 5, 1, 2);
+
+    const Crypto_Connection *conn = &c->crypto_connections[0];
+    ck_assert_msg(conn->recv_array.buffer_start == 6, "delivered packets were not cleared");
+    ck_assert(conn->stream[1].recv_number == 3 && conn->stream[2].recv_number == 3);
+
+    kill_stream_net_crypto(c);
+}
+END_TEST
+
+START_TEST(test_stream_first_packet_waits)
+{
+    Delivered delivered = {{0}};
+    Net_Crypto *c = new_stream_net_crypto(&delivered);
+
+    /* Until a packet of a stream was delivered in the connection, its packets
+     * wait for the ones before them on every stream. */
+    receive_stream_packet(c, 1, 1, 0);
+    receive_stream_packet(c, 2, 1, 1);
+    receive_stream_packet(c, 3, NOT_ON_STREAM, 0);
+    ck_assert_msg(delivered.count == 0, "%u packets delivered before the first one", delivered.count);
+
+    receive_stream_packet(c, 0, NOT_ON_STREAM, 1);
+    ck_assert(delivered.count == 4);
+    check_delivered(&delivered, 0, NOT_ON_STREAM, 1);
+    check_delivered(&delivered, 1, 1, 0);
+    check_delivered(&delivered, 2, 1, 1);
+    check_delivered(&delivered, 3, NOT_ON_STREAM, 0);
+
+    /* Stream 2 starts after a gap, so its first packet waits again. */
+    receive_stream_packet(c, 6, 2, 0);
+    receive_stream_packet(c, 5, 1, 3);
+    ck_assert(delivered.count == 4);
+
+    receive_stream_packet(c, 4, 1, 2);
+    ck_assert(delivered.count == 7);
+    check_delivered(&delivered, 4, 1, 2);
+    check_delivered(&delivered, 5, 1, 3);
+    check_delivered(&delivered, 6, 2, 0);
+
+    kill_stream_net_crypto(c);
+}
+END_TEST
+
+START_TEST(test_stream_reorder_growth)
+{
+    Delivered delivered = {{0}};
+    Net_Crypto *c = new_stream_net_crypto(&delivered);
+    Crypto_Connection *conn = &c->crypto_connections[0];
+
+    receive_stream_packet(c, 0, 1, 0);
+    receive_stream_packet(c, 1, 2, 0);
+    ck_assert(delivered.count == 2);
+
+    /* Packets 2 and 3 come last, the others in random order, so the reorder
+     * arrays of both streams grow while they hold packets. */
+    uint32_t order[NUM_STREAM_PACKETS];
+    uint32_t i;
+
+    for (i = 0; i < NUM_STREAM_PACKETS; ++i) {
+        order[i] = i + 4;
+    }
+
+    for (i = NUM_STREAM_PACKETS - 1; i > 0; --i) {
+        const uint32_t j = rand() % (i + 1);
+        const uint32_t tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+
+    for (i = 0; i < NUM_STREAM_PACKETS; ++i) {
+        receive_stream_packet(c, order[i], 1 + order[i] % 2, order[i] / 2);
+    }
+
+    ck_assert_msg(delivered.count == 2, "%u packets delivered before the late ones", delivered.count);
+    ck_assert_msg(conn->stream[1].reorder_size >= NUM_STREAM_PACKETS / 2, "reorder array did not grow");
+    ck_assert_msg(conn->stream[2].reorder_size >= NUM_STREAM_PACKETS / 2, "reorder array did not grow");
+
+    receive_stream_packet(c, 3, 2, 1);
+    ck_assert(delivered.count == 2 + 1 + NUM_STREAM_PACKETS / 2);
+    receive_stream_packet(c, 2, 1, 1);
+    ck_assert(delivered.count == 2 + 2 + NUM_STREAM_PACKETS);
+
+    uint16_t next[CRYPTO_MAX_STREAMS] = {0};
+
+    for (i = 0; i < delivered.count; ++i) {
+        ck_assert_msg(delivered.number[i] == next[delivered.stream[i]], "stream %u delivered %u instead of %u",
+                      delivered.stream[i], delivered.number[i], next[delivered.stream[i]]);
+        ++next[delivered.stream[i]];
+    }
+
+    ck_assert(conn->recv_array.buffer_start == NUM_STREAM_PACKETS + 4);
+
+    /* Packets too far ahead of the stream can't wait for it. */
+    ck_assert(add_stream_reorder(&conn->recv_array, &conn->stream[1], 1,
+                                 conn->stream[1].recv_number + CRYPTO_PACKET_BUFFER_SIZE, 0) == -1);
+
+    kill_stream_net_crypto(c);
+}
+END_TEST
+
+static Suite *net_crypto_suite(void)
+{
+    Suite *s = suite_create("net_crypto");
+
+    DEFTESTCASE(varint);
+    DEFTESTCASE(request_ranges_round_trip);
+    DEFTESTCASE(request_ranges_truncated);
+    DEFTESTCASE(request_ranges_invalid);
+    DEFTESTCASE(stream_out_of_order);
+    DEFTESTCASE(stream_first_packet_waits);
+    DEFTESTCASE(stream_reorder_growth);
+
+    return s;
+}
+
+int main(int argc, char *argv[])
+{
+    srand((unsigned int) time(NULL));
+
+    Suite *net_crypto = net_crypto_suite();
+    SRunner *test_runner = srunner_create(net_crypto);
+
+    int number_failed = 0;
+    srunner_run_all(test_runner, CK_NORMAL);
+    number_failed = srunner_ntests_failed(test_runner);
+
+    srunner_free(test_runner);
+
+    return number_failed;
+}
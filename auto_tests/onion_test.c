@@ -139,7 +139,8 @@ static int handle_test_4(void *object, IP_Port source, const uint8_t *packet, ui
     return 0;
 }
 
-START_TEST(test_basic)
+/* If crypto_worker_threads is not 0, onion1 and onion2 decrypt on worker threads. */
+static void test_basic_onion(uint32_t crypto_worker_threads)
 {
     IP ip;
     ip_init(&ip, 1);
@@ -147,6 +148,13 @@ START_TEST(test_basic)
     Onion *onion1 = new_onion(new_DHT(NULL, new_networking(NULL, ip, 34567), true));
     Onion *onion2 = new_onion(new_DHT(NULL, new_networking(NULL, ip, 34568), true));
     ck_assert_msg((onion1 != NULL) && (onion2 != NULL), "Onion failed initializing.");
+
+    if (crypto_worker_threads != 0) {
+        ck_assert_msg(networking_set_crypto_workers(onion1->net, crypto_worker_threads) == 0 &&
+                      networking_set_crypto_workers(onion2->net, crypto_worker_threads) == 0,
+                      "Failed to start crypto workers.");
+    }
+
     networking_registerhandler(onion2->net, 'I', &handle_test_1, onion2);
 
     IP_Port on1 = {ip, onion1->net->port};
@@ -271,6 +279,17 @@ START_TEST(test_basic)
         kill_networking(net);
     }
 }
+
+START_TEST(test_basic)
+{
+    test_basic_onion(0);
+}
+END_TEST
+
+START_TEST(test_basic_crypto_workers)
+{
+    test_basic_onion(2);
+}
 END_TEST
 
 typedef struct {
@@ -466,6 +485,7 @@ static Suite *onion_suite(void)
     Suite *s = suite_create("Onion");
 
     DEFTESTCASE_SLOW(basic, 5);
+    DEFTESTCASE_SLOW(basic_crypto_workers, 5);
     DEFTESTCASE_SLOW(announce, 70);
     return s;
 }
@@ -0,0 +1,167 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "check_compat.h"
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "../toxcore/timer_wheel.h"
+
+#include "helpers.h"
+
+#define NUM_TIMERS 1000
+#define START_TIME 1500000000ULL
+
+typedef struct {
+    Timer_Wheel *wheel;
+    uint64_t now;
+    uint64_t expires[NUM_TIMERS];
+    uint32_t fired[NUM_TIMERS];
+    uint32_t repeat;
+} Wheel_State;
+
+static void check_expired(void *object, uint32_t number, void *userdata)
+{
+    Wheel_State *state = (Wheel_State *)object;
+
+    ck_assert_msg(number < NUM_TIMERS, "unknown timer %u fired", number);
+    ck_assert_msg(state->expires[number] != 0, "timer %u fired but was not set", number);
+    ck_assert_msg(state->expires[number] <= state->now, "timer %u fired at %llu before it expired at %llu", number,
+                  (unsigned long long)state->now, (unsigned long long)state->expires[number]);
+
+    ++state->fired[number];
+    state->expires[number] = 0;
+
+    if (state->repeat != 0) {
+        --state->repeat;
+        state->expires[number] = state->now + 1 + rand() % 5000;
+        ck_assert(timer_set(state->wheel, number, state->expires[number]) == 0);
+    }
+}
+
+/* Advance the wheel to time, checking that every timer that expired fired. */
+static void run_until(Wheel_State *state, uint64_t time)
+{
+    state->now = time;
+    do_timer_wheel(state->wheel, time, NULL);
+
+    uint32_t i;
+
+    for (i = 0; i < NUM_TIMERS; ++i) {
+        ck_assert_msg(state->expires[i] == 0 || state->expires[i] > time,
+                      "timer %u expiring at %llu did not fire at %llu", i, (unsigned long long)state->expires[i],
+                      (unsigned long long)time);
+    }
+}
+
+START_TEST(test_expiry)
+{
+    Wheel_State state = {0};
+    state.wheel = new_timer_wheel(&check_expired, &state, START_TIME);
+    ck_assert(state.wheel != NULL);
+
+    uint32_t i;
+
+    /* Spread the timers over all levels of the wheel and past its end. */
+    for (i = 0; i < NUM_TIMERS; ++i) {
+        const uint64_t ranges[] = {64, 4096, 262144, 16777216, 100000000};
+        state.expires[i] = START_TIME + rand() % ranges[i % 5];
+
+        if (state.expires[i] == START_TIME) {
+            ++state.expires[i];
+        }
+
+        ck_assert(timer_set(state.wheel, i, state.expires[i]) == 0);
+    }
+
+    /* Stopped timers never fire. */
+    for (i = 0; i < NUM_TIMERS; i += 7) {
+        timer_stop(state.wheel, i);
+        state.expires[i] = 0;
+    }
+
+    uint64_t time = START_TIME;
+
+    while (time < START_TIME + 110000000) {
+        /* Steps like those of an iterating instance, and long sleeps. */
+        time += (rand() % 4 == 0) ? rand() % 1000000 : rand() % 3;
+        run_until(&state, time);
+    }
+
+    for (i = 0; i < NUM_TIMERS; ++i) {
+        ck_assert_msg(state.fired[i] == (i % 7 != 0), "timer %u fired %u times", i, state.fired[i]);
+    }
+
+    kill_timer_wheel(state.wheel);
+}
+END_TEST
+
+START_TEST(test_set_from_callback)
+{
+    Wheel_State state = {0};
+    state.wheel = new_timer_wheel(&check_expired, &state, START_TIME);
+    ck_assert(state.wheel != NULL);
+
+    uint32_t i;
+
+    for (i = 0; i < NUM_TIMERS; ++i) {
+        state.expires[i] = START_TIME + 1 + rand() % 100;
+        ck_assert(timer_set(state.wheel, i, state.expires[i]) == 0);
+    }
+
+    state.repeat = NUM_TIMERS * 10;
+    uint64_t time = START_TIME;
+
+    while (state.repeat != 0 || time < START_TIME + 100000) {
+        time += 1 + rand() % 100;
+        run_until(&state, time);
+    }
+
+    uint32_t total = 0;
+
+    for (i = 0; i < NUM_TIMERS; ++i) {
+        total += state.fired[i];
+    }
+
+    ck_assert_msg(total == NUM_TIMERS * 11, "%u timers fired, expected %u", total, NUM_TIMERS * 11);
+
+    /* A timer set to a time that has passed fires once at the next run, not in the same one. */
+    state.expires[0] = time - 10;
+    ck_assert(timer_set(state.wheel, 0, state.expires[0]) == 0);
+    state.fired[0] = 0;
+    run_until(&state, time);
+    ck_assert(state.fired[0] == 1);
+    run_until(&state, time);
+    ck_assert(state.fired[0] == 1);
+
+    kill_timer_wheel(state.wheel);
+}
+END_TEST
+
+static Suite *timer_wheel_suite(void)
+{
+    Suite *s = suite_create("timer_wheel");
+
+    DEFTESTCASE_SLOW(expiry, 60);
+    DEFTESTCASE(set_from_callback);
+
+    return s;
+}
+
+int main(int argc, char *argv[])
+{
+    srand((unsigned int) time(NULL));
+
+    Suite *timer_wheel = timer_wheel_suite();
+    SRunner *test_runner = srunner_create(timer_wheel);
+
+    int number_failed = 0;
+    srunner_run_all(test_runner, CK_NORMAL);
+    number_failed = srunner_ntests_failed(test_runner);
+
+    srunner_free(test_runner);
+
+    return number_failed;
+}
@@ -41,13 +41,20 @@ START_TEST(test_many_clients)
     uint32_t i, j;
     uint32_t to_comp = 974536;
 
+    /* Half of the instances decrypt packets on a worker thread. */
+    struct Tox_Options *options = tox_options_new(NULL);
+    ck_assert_msg(options != NULL, "Failed to allocate options");
+
     for (i = 0; i < NUM_TOXES; ++i) {
         index[i] = i + 1;
-        toxes[i] = tox_new_log(0, 0, &index[i]);
+        tox_options_set_crypto_worker_threads(options, i % 2);
+        toxes[i] = tox_new_log(options, 0, &index[i]);
         ck_assert_msg(toxes[i] != 0, "Failed to create tox instances %u", i);
         tox_callback_friend_request(toxes[i], accept_friend_request);
     }
 
+    tox_options_free(options);
+
     {
         TOX_ERR_GET_PORT error;
         ck_assert_msg(tox_self_get_udp_port(toxes[0], &error) == 33445, "First Tox instance did not bind to udp port 33445.\n");
@@ -10,12 +10,22 @@
 #include <stdlib.h>
 #include <time.h>
 
+#ifdef __linux__
+#include <poll.h>
+#endif
+
 #include "../toxcore/ccompat.h"
 #include "../toxcore/tox.h"
 #include "../toxcore/util.h"
 
 #include "helpers.h"
 
+#ifdef FORCE_TESTS_IPV6
+#define TOX_LOCALHOST "::1"
+#else
+#define TOX_LOCALHOST "127.0.0.1"
+#endif
+
 static void set_random_name_and_status_message(Tox *tox, uint8_t *name, uint8_t *status_message)
 {
     int i;
@@ -137,12 +147,69 @@ START_TEST(test_one)
 }
 END_TEST
 
+START_TEST(test_event_fd)
+{
+    uint32_t index[] = { 3, 4 };
+    Tox *tox1 = tox_new_log(0, 0, &index[0]);
+    Tox *tox2 = tox_new_log(0, 0, &index[1]);
+
+    ck_assert_msg(tox1 && tox2, "failed to create 2 tox instances");
+
+    const int32_t fd1 = tox_event_fd(tox1);
+    const int32_t fd2 = tox_event_fd(tox2);
+
+#ifdef __linux__
+    ck_assert_msg(fd1 >= 0 && fd2 >= 0, "tox_event_fd failed: %d %d", fd1, fd2);
+#endif
+
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+    tox_self_get_public_key(tox1, public_key);
+    tox_friend_add_norequest(tox2, public_key, 0);
+    tox_self_get_public_key(tox2, public_key);
+    tox_friend_add_norequest(tox1, public_key, 0);
+
+    uint8_t dht_key[TOX_PUBLIC_KEY_SIZE];
+    tox_self_get_dht_id(tox1, dht_key);
+    const uint16_t port = tox_self_get_udp_port(tox1, 0);
+    ck_assert_msg(tox_bootstrap(tox2, TOX_LOCALHOST, port, dht_key, 0), "bootstrap failed");
+
+    const uint64_t start = time(NULL);
+
+    while (tox_friend_get_connection_status(tox1, 0, 0) != TOX_CONNECTION_UDP ||
+            tox_friend_get_connection_status(tox2, 0, 0) != TOX_CONNECTION_UDP) {
+        ck_assert_msg(time(NULL) - start < 60, "friends did not connect while waiting on the event fds");
+
+        uint32_t timeout = tox_event_timeout(tox1);
+
+        if (tox_event_timeout(tox2) < timeout) {
+            timeout = tox_event_timeout(tox2);
+        }
+
+#ifdef __linux__
+        struct pollfd fds[2] = { { fd1, POLLIN, 0 }, { fd2, POLLIN, 0 } };
+        ck_assert_msg(poll(fds, 2, timeout) >= 0, "poll failed");
+#else
+        c_sleep(timeout);
+#endif
+
+        tox_iterate(tox1, 0);
+        tox_iterate(tox2, 0);
+    }
+
+    printf("event_fd: friends connected after %llu seconds\n", (unsigned long long)(time(NULL) - start));
+
+    tox_kill(tox1);
+    tox_kill(tox2);
+}
+END_TEST
+
 
 static Suite *tox_suite(void)
 {
     Suite *s = suite_create("Tox one");
 
     DEFTESTCASE(one);
+    DEFTESTCASE(event_fd);
 
     return s;
 }
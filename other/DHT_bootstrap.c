@@ -184,6 +184,8 @@ int main(int argc, char *argv[])
             is_waiting_for_dht_connection = 0;
         }
 
+        networking_send_queue_begin(dht->net);
+
         do_DHT(dht);
 
         if (is_timeout(last_LANdiscovery, is_waiting_for_dht_connection ? 5 : LAN_DISCOVERY_INTERVAL)) {
@@ -195,6 +197,7 @@ int main(int argc, char *argv[])
         do_TCP_server(tcp_s);
 #endif
         networking_poll(dht->net, NULL);
+        networking_send_queue_flush(dht->net);
 
         c_sleep(1);
     }
@@ -33,13 +33,16 @@
  * Important: You are responsible for freeing `pid_file_path` and `keys_file_path`
  *            also, iff `tcp_relay_ports_count` > 0, then you are responsible for freeing `tcp_relay_ports`
  *            and also `motd` iff `enable_motd` is set.
+ *            `crypto_worker_threads` is 0 if packets should be decrypted on the main thread.
+ *            `tcp_relay_threads` is 0 if the TCP relay should run on the main thread.
  *
  * @return 1 on success,
  *         0 on failure, doesn't modify any data pointed by arguments.
  */
 int get_general_config(const char *cfg_file_path, char **pid_file_path, char **keys_file_path, int *port,
                        int *enable_ipv6, int *enable_ipv4_fallback, int *enable_lan_discovery, int *enable_tcp_relay,
-                       uint16_t **tcp_relay_ports, int *tcp_relay_port_count, int *enable_motd, char **motd);
+                       uint16_t **tcp_relay_ports, int *tcp_relay_port_count, int *enable_motd, char **motd,
+                       int *crypto_worker_threads, int *tcp_relay_threads);
 
 /**
  * Bootstraps off nodes listed in the config file.
@@ -38,5 +38,7 @@
 #define DEFAULT_TCP_RELAY_PORTS_COUNT 3
 #define DEFAULT_ENABLE_MOTD           1 // 1 - true, 0 - false
 #define DEFAULT_MOTD                  DAEMON_NAME
+#define DEFAULT_CRYPTO_WORKER_THREADS 0 // 0 - decrypt packets on the main thread
+#define DEFAULT_TCP_RELAY_THREADS     0 // 0 - run the TCP relay on the main thread
 
 #endif // CONFIG_DEFAULTS_H
@@ -31,4 +31,8 @@
 #define MIN_ALLOWED_PORT 1
 #define MAX_ALLOWED_PORT 65535
 
+// Number of shared keys cached for each kind of incoming request; bootstrap nodes hear from far more peers than
+// clients do
+#define SHARED_KEYS_CAPACITY 32768
+
 #endif // GLOBAL_H
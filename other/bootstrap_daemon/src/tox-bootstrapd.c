@@ -202,9 +202,12 @@ int main(int argc, char *argv[])
     int tcp_relay_port_count;
     int enable_motd;
     char *motd;
+    int crypto_worker_threads;
+    int tcp_relay_threads;
 
     if (get_general_config(cfg_file_path, &pid_file_path, &keys_file_path, &port, &enable_ipv6, &enable_ipv4_fallback,
-                           &enable_lan_discovery, &enable_tcp_relay, &tcp_relay_ports, &tcp_relay_port_count, &enable_motd, &motd)) {
+                           &enable_lan_discovery, &enable_tcp_relay, &tcp_relay_ports, &tcp_relay_port_count, &enable_motd, &motd,
+                           &crypto_worker_threads, &tcp_relay_threads)) {
         log_write(LOG_LEVEL_INFO, "General config read successfully\n");
     } else {
         log_write(LOG_LEVEL_ERROR, "Couldn't read config file: %s. Exiting.\n", cfg_file_path);
@@ -245,6 +248,15 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (crypto_worker_threads > 0) {
+        if (networking_set_crypto_workers(net, crypto_worker_threads) == 0) {
+            log_write(LOG_LEVEL_INFO, "Started %d crypto worker threads.\n", crypto_worker_threads);
+        } else {
+            log_write(LOG_LEVEL_WARNING, "Couldn't start %d crypto worker threads, decrypting on the main thread.\n",
+                      crypto_worker_threads);
+        }
+    }
+
     DHT *dht = new_DHT(NULL, net, true);
 
     if (dht == NULL) {
@@ -260,6 +272,14 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    if (shared_keys_set_capacity(&dht->shared_keys_recv, SHARED_KEYS_CAPACITY) != 0 ||
+            shared_keys_set_capacity(&onion->shared_keys_1, SHARED_KEYS_CAPACITY) != 0 ||
+            shared_keys_set_capacity(&onion->shared_keys_2, SHARED_KEYS_CAPACITY) != 0 ||
+            shared_keys_set_capacity(&onion->shared_keys_3, SHARED_KEYS_CAPACITY) != 0 ||
+            shared_keys_set_capacity(&onion_a->shared_keys_recv, SHARED_KEYS_CAPACITY) != 0) {
+        log_write(LOG_LEVEL_WARNING, "Couldn't enlarge the shared key caches, using the default size.\n");
+    }
+
     if (enable_motd) {
         if (bootstrap_set_callbacks(dht->net, DAEMON_VERSION_NUMBER, (uint8_t *)motd, strlen(motd) + 1) == 0) {
             log_write(LOG_LEVEL_INFO, "Set MOTD successfully.\n");
@@ -299,6 +319,15 @@ int main(int argc, char *argv[])
             log_write(LOG_LEVEL_ERROR, "Couldn't initialize Tox TCP server. Exiting.\n");
             return 1;
         }
+
+        if (tcp_relay_threads > 0) {
+            if (tcp_server_set_threads(tcp_server, tcp_relay_threads) == 0) {
+                log_write(LOG_LEVEL_INFO, "Started %d TCP relay threads.\n", tcp_relay_threads);
+            } else {
+                log_write(LOG_LEVEL_WARNING, "Couldn't start %d TCP relay threads, relaying on the main thread.\n",
+                          tcp_relay_threads);
+            }
+        }
     }
 
     if (bootstrap_from_config(cfg_file_path, dht, enable_ipv6)) {
@@ -321,6 +350,8 @@ int main(int argc, char *argv[])
     }
 
     while (1) {
+        networking_send_queue_begin(dht->net);
+
         do_DHT(dht);
 
         if (enable_lan_discovery && is_timeout(last_LANdiscovery, LAN_DISCOVERY_INTERVAL)) {
@@ -333,6 +364,7 @@ int main(int argc, char *argv[])
         }
 
         networking_poll(dht->net, NULL);
+        networking_send_queue_flush(dht->net);
 
         if (waiting_for_dht_connection && DHT_isconnected(dht)) {
             log_write(LOG_LEVEL_INFO, "Connected to another bootstrap node successfully.\n");
@@ -1,7 +1,9 @@
 #include "../toxcore/tox.c"
 
+#include "../toxcore/congestion.c"
 #include "../toxcore/crypto_core.c"
 #include "../toxcore/crypto_core_mem.c"
+#include "../toxcore/crypto_workers.c"
 #include "../toxcore/DHT.c"
 #include "../toxcore/friend_connection.c"
 #include "../toxcore/friend_requests.c"
@@ -19,7 +21,10 @@
 #include "../toxcore/ping.c"
 #include "../toxcore/TCP_client.c"
 #include "../toxcore/TCP_connection.c"
+#include "../toxcore/TCP_send_queue.c"
 #include "../toxcore/TCP_server.c"
+#include "../toxcore/TCP_uring.c"
+#include "../toxcore/timer_wheel.c"
 #include "../toxcore/tox_api.c"
 #include "../toxcore/util.c"
 
@@ -0,0 +1,271 @@
+/* Symmetric encryption benchmark
+ * Compares the packet encryption and decryption of crypto_core with the
+ * padded crypto_box interface it used to go through, which needs the plain
+ * text copied into a buffer with crypto_box_ZEROBYTES of zeros in front and
+ * the result copied out again, and with the detached functions that work in
+ * place. It also compares decrypting a burst of packets received on one
+ * connection one by one with decrypt_data_symmetric_batch.
+ *
+ * Usage: ./crypto_bench [packet count]
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "../toxcore/ccompat.h"
+#include "../toxcore/crypto_core.h"
+#include "../toxcore/network.h"
+
+#ifdef VANILLA_NACL
+#include <crypto_box.h>
+#else
+#include <sodium.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_BENCH_PACKET_SIZE 1400
+
+/* The implementation of encrypt_data_symmetric before the detached functions. */
+static int32_t padded_encrypt(const uint8_t *shared_key, const uint8_t *nonce, const uint8_t *plain, size_t length,
+                              uint8_t *encrypted)
+{
+    VLA(uint8_t, temp_plain, length + crypto_box_ZEROBYTES);
+    VLA(uint8_t, temp_encrypted, length + CRYPTO_MAC_SIZE + crypto_box_BOXZEROBYTES);
+
+    memset(temp_plain, 0, crypto_box_ZEROBYTES);
+    memcpy(temp_plain + crypto_box_ZEROBYTES, plain, length);
+
+    if (crypto_box_afternm(temp_encrypted, temp_plain, length + crypto_box_ZEROBYTES, nonce, shared_key) != 0) {
+        return -1;
+    }
+
+    memcpy(encrypted, temp_encrypted + crypto_box_BOXZEROBYTES, length + CRYPTO_MAC_SIZE);
+    return length + CRYPTO_MAC_SIZE;
+}
+
+/* The implementation of decrypt_data_symmetric before the detached functions. */
+static int32_t padded_decrypt(const uint8_t *shared_key, const uint8_t *nonce, const uint8_t *encrypted, size_t length,
+                              uint8_t *plain)
+{
+    VLA(uint8_t, temp_plain, length + crypto_box_ZEROBYTES);
+    VLA(uint8_t, temp_encrypted, length + crypto_box_BOXZEROBYTES);
+
+    memset(temp_encrypted, 0, crypto_box_BOXZEROBYTES);
+    memcpy(temp_encrypted + crypto_box_BOXZEROBYTES, encrypted, length);
+
+    if (crypto_box_open_afternm(temp_plain, temp_encrypted, length + crypto_box_BOXZEROBYTES, nonce, shared_key) != 0) {
+        return -1;
+    }
+
+    memcpy(plain, temp_plain + crypto_box_ZEROBYTES, length - CRYPTO_MAC_SIZE);
+    return length - CRYPTO_MAC_SIZE;
+}
+
+typedef enum {
+    BENCH_PADDED,
+    BENCH_SYMMETRIC,
+    BENCH_DETACHED,
+} Bench_Mode;
+
+static const char *const bench_names[] = {"padded", "symmetric", "detached"};
+
+/* Encrypt and then decrypt count packets of size bytes.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int run(Bench_Mode mode, uint32_t count, uint16_t size, uint64_t *encrypt_ms, uint64_t *decrypt_ms)
+{
+    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
+    uint8_t nonce[CRYPTO_NONCE_SIZE];
+    new_symmetric_key(shared_key);
+    random_nonce(nonce);
+
+    uint8_t plain[MAX_BENCH_PACKET_SIZE];
+    uint8_t packet[MAX_BENCH_PACKET_SIZE + CRYPTO_MAC_SIZE];
+    random_bytes(plain, size);
+
+    uint64_t start = current_time_monotonic();
+
+    for (uint32_t i = 0; i < count; ++i) {
+        int32_t len;
+
+        switch (mode) {
+            case BENCH_PADDED:
+                len = padded_encrypt(shared_key, nonce, plain, size, packet) - CRYPTO_MAC_SIZE;
+                break;
+
+            case BENCH_SYMMETRIC:
+                len = encrypt_data_symmetric(shared_key, nonce, plain, size, packet) - CRYPTO_MAC_SIZE;
+                break;
+
+            default:
+                /* A sender builds the plain text right behind the room for the MAC. */
+                memcpy(packet + CRYPTO_MAC_SIZE, plain, size);
+                len = encrypt_data_symmetric_detached(shared_key, nonce, packet + CRYPTO_MAC_SIZE, size, packet);
+                break;
+        }
+
+        if (len != size) {
+            return -1;
+        }
+    }
+
+    *encrypt_ms = current_time_monotonic() - start;
+
+    uint8_t encrypted[MAX_BENCH_PACKET_SIZE + CRYPTO_MAC_SIZE];
+    memcpy(encrypted, packet, size + CRYPTO_MAC_SIZE);
+
+    start = current_time_monotonic();
+
+    for (uint32_t i = 0; i < count; ++i) {
+        int32_t len;
+
+        switch (mode) {
+            case BENCH_PADDED:
+                len = padded_decrypt(shared_key, nonce, encrypted, size + CRYPTO_MAC_SIZE, plain);
+                break;
+
+            case BENCH_SYMMETRIC:
+                len = decrypt_data_symmetric(shared_key, nonce, encrypted, size + CRYPTO_MAC_SIZE, plain);
+                break;
+
+            default:
+                /* A receiver decrypts the packet where it was received. */
+                memcpy(packet, encrypted, size + CRYPTO_MAC_SIZE);
+                len = decrypt_data_symmetric_detached(shared_key, nonce, packet + CRYPTO_MAC_SIZE, size, packet);
+                break;
+        }
+
+        if (len != size) {
+            return -1;
+        }
+    }
+
+    *decrypt_ms = current_time_monotonic() - start;
+    return 0;
+}
+
+/* Packets received on one connection in a burst. */
+#define BURST_SIZE 16
+
+/* Decrypt count packets of size bytes, in bursts of consecutive nonces.
+ *
+ * return time taken in milliseconds.
+ * return UINT64_MAX on failure.
+ */
+static uint64_t run_burst(bool batch, uint32_t count, uint16_t size)
+{
+    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
+    uint8_t nonces[BURST_SIZE][CRYPTO_NONCE_SIZE];
+    new_symmetric_key(shared_key);
+    random_nonce(nonces[0]);
+
+    uint8_t plain[MAX_BENCH_PACKET_SIZE];
+    uint8_t encrypted[BURST_SIZE][MAX_BENCH_PACKET_SIZE + CRYPTO_MAC_SIZE];
+    uint8_t decrypted[BURST_SIZE][MAX_BENCH_PACKET_SIZE];
+    Crypto_Batch_Entry entries[BURST_SIZE];
+    random_bytes(plain, size);
+
+    for (uint32_t i = 0; i < BURST_SIZE; ++i) {
+        if (i > 0) {
+            memcpy(nonces[i], nonces[i - 1], CRYPTO_NONCE_SIZE);
+            increment_nonce(nonces[i]);
+        }
+
+        encrypt_data_symmetric(shared_key, nonces[i], plain, size, encrypted[i]);
+        entries[i].shared_key = shared_key;
+        entries[i].nonce = nonces[i];
+        entries[i].encrypted = encrypted[i];
+        entries[i].length = size + CRYPTO_MAC_SIZE;
+        entries[i].plain = decrypted[i];
+    }
+
+    const uint64_t start = current_time_monotonic();
+
+    for (uint32_t done = 0; done < count; done += BURST_SIZE) {
+        if (batch) {
+            if (decrypt_data_symmetric_batch(entries, BURST_SIZE) != BURST_SIZE) {
+                return UINT64_MAX;
+            }
+
+            continue;
+        }
+
+        for (uint32_t i = 0; i < BURST_SIZE; ++i) {
+            if (decrypt_data_symmetric(shared_key, nonces[i], encrypted[i], size + CRYPTO_MAC_SIZE, decrypted[i]) != size) {
+                return UINT64_MAX;
+            }
+        }
+    }
+
+    return current_time_monotonic() - start;
+}
+
+int main(int argc, char *argv[])
+{
+    const uint32_t count = argc > 1 ? (uint32_t)atoi(argv[1]) : 1000000;
+
+    if (count == 0) {
+        fprintf(stderr, "usage: %s [packet count]\n", argv[0]);
+        return 1;
+    }
+
+    static const uint16_t sizes[] = {64, 256, 1024, MAX_BENCH_PACKET_SIZE - CRYPTO_MAC_SIZE};
+
+    printf("%u packets per run, times in ns per packet\n", count);
+    printf("%5s %-10s %8s %8s\n", "size", "mode", "encrypt", "decrypt");
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        for (Bench_Mode mode = BENCH_PADDED; mode <= BENCH_DETACHED; ++mode) {
+            uint64_t encrypt_ms, decrypt_ms;
+
+            if (run(mode, count, sizes[i], &encrypt_ms, &decrypt_ms) == -1) {
+                fprintf(stderr, "%s: encryption failed\n", bench_names[mode]);
+                return 1;
+            }
+
+            printf("%5u %-10s %8.1f %8.1f\n", sizes[i], bench_names[mode], encrypt_ms * 1000000.0 / count,
+                   decrypt_ms * 1000000.0 / count);
+        }
+    }
+
+    printf("\nbursts of %u packets from one connection, decrypt times in ns per packet\n", BURST_SIZE);
+    printf("%5s %8s %8s\n", "size", "single", "batch");
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        const uint64_t single_ms = run_burst(false, count, sizes[i]);
+        const uint64_t batch_ms = run_burst(true, count, sizes[i]);
+
+        if (single_ms == UINT64_MAX || batch_ms == UINT64_MAX) {
+            fprintf(stderr, "decryption failed\n");
+            return 1;
+        }
+
+        printf("%5u %8.1f %8.1f\n", sizes[i], single_ms * 1000000.0 / count, batch_ms * 1000000.0 / count);
+    }
+
+    return 0;
+}
@@ -0,0 +1,191 @@
+/* DHT get nodes benchmark
+ * Fills the close list of a DHT and measures how many closest node lookups
+ * get_close_nodes can do per second and how many get nodes requests per
+ * second the get nodes packet handler can answer.
+ *
+ * Usage: ./dht_getnodes_bench [request count] [sender count]
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "../toxcore/DHT.h"
+#include "../toxcore/util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define GET_NODES_PACKET_SIZE (1 + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE + \
+                               sizeof(uint64_t) + CRYPTO_MAC_SIZE)
+
+/* Put a random key sharing exactly bits leading bits with base in public_key. */
+static void random_pk_in_bucket(uint8_t *public_key, const uint8_t *base, unsigned int bits)
+{
+    random_bytes(public_key, CRYPTO_PUBLIC_KEY_SIZE);
+
+    const unsigned int byte = bits / 8;
+    const uint8_t mask = 0x80 >> (bits % 8);
+    const uint8_t high = (uint8_t)~(0xff >> (bits % 8));
+
+    memcpy(public_key, base, byte);
+    public_key[byte] = (base[byte] & high) | (~base[byte] & mask) | (public_key[byte] & (mask - 1));
+}
+
+/* Fill every k-bucket of the close list with fresh nodes.
+ *
+ * return the number of nodes in the close list.
+ */
+static uint32_t fill_close_list(DHT *dht)
+{
+    for (unsigned int bucket = 0; bucket < LCLIENT_LENGTH; ++bucket) {
+        for (unsigned int i = 0; i < LCLIENT_NODES; ++i) {
+            uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+            random_pk_in_bucket(public_key, dht->self_public_key, bucket);
+
+            IP_Port ip_port;
+            ip_init(&ip_port.ip, 0);
+            ip_port.ip.ip4.uint32 = net_htonl(0x0A000000 | (bucket << 8) | i);
+            ip_port.port = net_htons(33445);
+
+            addto_lists(dht, ip_port, public_key);
+        }
+    }
+
+    uint32_t num_nodes = 0;
+
+    for (uint32_t i = 0; i < LCLIENT_LIST; ++i) {
+        if (!is_timeout(dht->close_clientlist[i].assoc4.timestamp, BAD_NODE_TIMEOUT)) {
+            ++num_nodes;
+        }
+    }
+
+    return num_nodes;
+}
+
+static void create_getnodes_packet(uint8_t *packet, const uint8_t *self_public_key, const uint8_t *self_secret_key,
+                                   const uint8_t *dht_public_key)
+{
+    uint8_t plain[CRYPTO_PUBLIC_KEY_SIZE + sizeof(uint64_t)];
+    random_bytes(plain, sizeof(plain));
+
+    uint8_t nonce[CRYPTO_NONCE_SIZE];
+    random_nonce(nonce);
+
+    packet[0] = NET_PACKET_GET_NODES;
+    memcpy(packet + 1, self_public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    memcpy(packet + 1 + CRYPTO_PUBLIC_KEY_SIZE, nonce, CRYPTO_NONCE_SIZE);
+    encrypt_data(dht_public_key, self_secret_key, nonce, plain, sizeof(plain),
+                 packet + 1 + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE);
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t count = argc > 1 ? (uint32_t)atoi(argv[1]) : 200000;
+    uint32_t num_senders = argc > 2 ? (uint32_t)atoi(argv[2]) : 256;
+
+    if (count == 0 || num_senders == 0) {
+        fprintf(stderr, "request and sender counts must be positive\n");
+        return 1;
+    }
+
+    IP ip;
+    ip_init(&ip, 0);
+    ip.ip4.uint32 = net_htonl(0x7F000001);
+
+    Logger *log = logger_new();
+    Networking_Core *net = new_networking(log, ip, 33445);
+    DHT *dht = net ? new_DHT(log, net, true) : NULL;
+
+    if (dht == NULL) {
+        fprintf(stderr, "failed to create DHT\n");
+        return 1;
+    }
+
+    unix_time_update();
+    printf("close list: %u nodes\n", fill_close_list(dht));
+
+    uint8_t *targets = (uint8_t *)malloc(num_senders * CRYPTO_PUBLIC_KEY_SIZE);
+    uint8_t *packets = (uint8_t *)malloc(num_senders * GET_NODES_PACKET_SIZE);
+
+    if (targets == NULL || packets == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    for (uint32_t i = 0; i < num_senders; ++i) {
+        uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+        uint8_t secret_key[CRYPTO_SECRET_KEY_SIZE];
+        crypto_new_keypair(public_key, secret_key);
+        memcpy(targets + i * CRYPTO_PUBLIC_KEY_SIZE, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+        create_getnodes_packet(packets + i * GET_NODES_PACKET_SIZE, public_key, secret_key, dht->self_public_key);
+    }
+
+    Node_format nodes_list[MAX_SENT_NODES];
+    uint32_t found = 0;
+    uint64_t start = current_time_monotonic();
+
+    for (uint32_t i = 0; i < count; ++i) {
+        found += get_close_nodes(dht, targets + (i % num_senders) * CRYPTO_PUBLIC_KEY_SIZE, nodes_list, 0, 1, 0);
+    }
+
+    uint64_t ms = current_time_monotonic() - start;
+
+    if (ms == 0) {
+        ms = 1;
+    }
+
+    printf("get_close_nodes  %u lookups (%u nodes) in %llu ms: %llu lookups/s\n", count, found,
+           (unsigned long long)ms, (unsigned long long)count * 1000 / ms);
+
+    /* Responses go to a port nobody listens on. */
+    IP_Port source;
+    source.ip = ip;
+    source.port = net_htons(9);
+
+    const Packet_Handles *handler = &dht->net->packethandlers[NET_PACKET_GET_NODES];
+    uint32_t handled = 0;
+    start = current_time_monotonic();
+
+    for (uint32_t i = 0; i < count; ++i) {
+        if (handler->function(handler->object, source, packets + (i % num_senders) * GET_NODES_PACKET_SIZE,
+                              GET_NODES_PACKET_SIZE, NULL) == 0) {
+            ++handled;
+        }
+    }
+
+    ms = current_time_monotonic() - start;
+
+    if (ms == 0) {
+        ms = 1;
+    }
+
+    printf("handle_getnodes  %u/%u requests in %llu ms: %llu requests/s\n", handled, count,
+           (unsigned long long)ms, (unsigned long long)count * 1000 / ms);
+
+    free(packets);
+    free(targets);
+    kill_DHT(dht);
+    kill_networking(net);
+    logger_kill(log);
+    return 0;
+}
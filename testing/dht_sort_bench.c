@@ -0,0 +1,202 @@
+/* DHT client list sort benchmark
+ * Measures sort_client_list on lists of 8 to 1024 entries against the
+ * previous implementation, which copied every entry into a temporary array
+ * and called qsort with a comparison function that re-derived the timeout,
+ * hardening and distance of both entries on every call.
+ *
+ * Usage: ./dht_sort_bench [total entries sorted per list size]
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "../toxcore/DHT.h"
+#include "../toxcore/util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_LIST_LENGTH 1024
+
+typedef struct {
+    const uint8_t *base_public_key;
+    Client_data entry;
+} Reference_Cmp_data;
+
+static int reference_cmp(const void *a, const void *b)
+{
+    Reference_Cmp_data cmp1, cmp2;
+    memcpy(&cmp1, a, sizeof(Reference_Cmp_data));
+    memcpy(&cmp2, b, sizeof(Reference_Cmp_data));
+    Client_data entry1 = cmp1.entry;
+    Client_data entry2 = cmp2.entry;
+
+#define TIMED_OUT(entry) (is_timeout((entry).assoc4.timestamp, BAD_NODE_TIMEOUT) && \
+                          is_timeout((entry).assoc6.timestamp, BAD_NODE_TIMEOUT))
+#define HARDENING_OK(assoc) ((assoc).hardening.routes_requests_ok + ((assoc).hardening.send_nodes_ok << 1) + \
+                             ((assoc).hardening.testing_requests << 2) == 2)
+#define BAD_HARDENING(entry) (!HARDENING_OK((entry).assoc4) && !HARDENING_OK((entry).assoc6))
+
+    bool t1 = TIMED_OUT(entry1);
+    bool t2 = TIMED_OUT(entry2);
+
+    if (t1 || t2) {
+        return t1 == t2 ? 0 : (t1 ? -1 : 1);
+    }
+
+    t1 = BAD_HARDENING(entry1);
+    t2 = BAD_HARDENING(entry2);
+
+    if (t1 != t2) {
+        return t1 ? -1 : 1;
+    }
+
+    int close = id_closest(cmp1.base_public_key, entry1.public_key, entry2.public_key);
+
+    return close == 1 ? 1 : (close == 2 ? -1 : 0);
+}
+
+/* The sort as it was before sort_client_list stopped copying entries. */
+static void reference_sort(Client_data *list, unsigned int length, const uint8_t *comp_public_key)
+{
+    VLA(Reference_Cmp_data, cmp_list, length);
+
+    for (uint32_t i = 0; i < length; i++) {
+        cmp_list[i].base_public_key = comp_public_key;
+        cmp_list[i].entry = list[i];
+    }
+
+    qsort(cmp_list, length, sizeof(Reference_Cmp_data), reference_cmp);
+
+    for (uint32_t i = 0; i < length; i++) {
+        list[i] = cmp_list[i].entry;
+    }
+}
+
+/* A mix of fresh, timed out and hardened entries, like a real client list. */
+static void fill_list(Client_data *list, unsigned int length)
+{
+    memset(list, 0, length * sizeof(Client_data));
+
+    for (uint32_t i = 0; i < length; ++i) {
+        Client_data *client = &list[i];
+        random_bytes(client->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+
+        const int kind = rand() % 4;
+
+        if (kind != 0) {
+            client->assoc4.timestamp = unix_time();
+        }
+
+        if (kind == 3) {
+            client->assoc4.hardening.send_nodes_ok = 1;
+        }
+    }
+}
+
+/* return time spent in milliseconds. Both sorts pay for the same copy of the
+ * unsorted list every round.
+ */
+static uint64_t run_sort(void (*sort)(Client_data *, unsigned int, const uint8_t *), const Client_data *list,
+                         Client_data *work, unsigned int length, uint32_t rounds, const uint8_t *comp_public_key)
+{
+    uint64_t start = current_time_monotonic();
+
+    for (uint32_t i = 0; i < rounds; ++i) {
+        memcpy(work, list, length * sizeof(Client_data));
+        sort(work, length, comp_public_key);
+    }
+
+    return current_time_monotonic() - start;
+}
+
+/* return 1 if both lists are in the same order. Equal entries may be
+ * swapped, so only compare the sort keys.
+ */
+static int same_order(const Client_data *list1, const Client_data *list2, unsigned int length,
+                      const uint8_t *comp_public_key)
+{
+    for (uint32_t i = 0; i < length; ++i) {
+        Reference_Cmp_data cmp1 = { comp_public_key, list1[i] };
+        Reference_Cmp_data cmp2 = { comp_public_key, list2[i] };
+
+        if (reference_cmp(&cmp1, &cmp2) != 0) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t total = argc > 1 ? (uint32_t)atoi(argv[1]) : 1000000;
+
+    Client_data *list = (Client_data *)malloc(MAX_LIST_LENGTH * sizeof(Client_data));
+    Client_data *work = (Client_data *)malloc(MAX_LIST_LENGTH * sizeof(Client_data));
+    Client_data *check = (Client_data *)malloc(MAX_LIST_LENGTH * sizeof(Client_data));
+
+    if (list == NULL || work == NULL || check == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    unix_time_update();
+
+    uint8_t comp_public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    random_bytes(comp_public_key, sizeof(comp_public_key));
+
+    for (unsigned int length = 8; length <= MAX_LIST_LENGTH; length *= 2) {
+        const uint32_t rounds = total / length ? total / length : 1;
+        fill_list(list, length);
+
+        memcpy(work, list, length * sizeof(Client_data));
+        memcpy(check, list, length * sizeof(Client_data));
+        sort_client_list(work, length, comp_public_key);
+        reference_sort(check, length, comp_public_key);
+
+        if (!same_order(work, check, length, comp_public_key)) {
+            fprintf(stderr, "sort_client_list and the reference sort disagree for %u entries\n", length);
+            return 1;
+        }
+
+        uint64_t reference_ms = run_sort(reference_sort, list, work, length, rounds, comp_public_key);
+        uint64_t sort_ms = run_sort(sort_client_list, list, work, length, rounds, comp_public_key);
+
+        if (reference_ms == 0) {
+            reference_ms = 1;
+        }
+
+        if (sort_ms == 0) {
+            sort_ms = 1;
+        }
+
+        printf("%4u entries x %6u: copying qsort %6llu ms, sort_client_list %6llu ms (%.2fx)\n", length, rounds,
+               (unsigned long long)reference_ms, (unsigned long long)sort_ms, (double)reference_ms / sort_ms);
+    }
+
+    free(check);
+    free(work);
+    free(list);
+    return 0;
+}
@@ -0,0 +1,145 @@
+/* Friend list benchmark
+ * Adds a large number of friends to a Tox instance, saves it and measures how
+ * long it takes to load the profile again, to look all friends up by their
+ * public key and to run tox_iterate while none of them are online.
+ *
+ * Usage: ./friend_load_bench [friend count]
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "../toxcore/crypto_core.h"
+#include "../toxcore/network.h"
+#include "../toxcore/tox.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static Tox *new_bench_tox(const uint8_t *savedata, size_t length)
+{
+    struct Tox_Options *options = tox_options_new(NULL);
+
+    if (options == NULL) {
+        return NULL;
+    }
+
+    tox_options_set_udp_enabled(options, false);
+    tox_options_set_local_discovery_enabled(options, false);
+
+    if (savedata != NULL) {
+        tox_options_set_savedata_type(options, TOX_SAVEDATA_TYPE_TOX_SAVE);
+        tox_options_set_savedata_data(options, savedata, length);
+    }
+
+    Tox *tox = tox_new(options, NULL);
+    tox_options_free(options);
+    return tox;
+}
+
+int main(int argc, char *argv[])
+{
+    const uint32_t num_friends = argc > 1 ? (uint32_t)atoi(argv[1]) : 20000;
+
+    if (num_friends == 0) {
+        fprintf(stderr, "usage: %s [friend count]\n", argv[0]);
+        return 1;
+    }
+
+    uint8_t *keys = (uint8_t *)malloc((size_t)num_friends * TOX_PUBLIC_KEY_SIZE);
+    Tox *tox = new_bench_tox(NULL, 0);
+
+    if (keys == NULL || tox == NULL) {
+        fprintf(stderr, "failed to create Tox instance\n");
+        return 1;
+    }
+
+    uint64_t start = current_time_monotonic();
+
+    for (uint32_t i = 0; i < num_friends; ++i) {
+        uint8_t secret_key[CRYPTO_SECRET_KEY_SIZE];
+        crypto_new_keypair(keys + (size_t)i * TOX_PUBLIC_KEY_SIZE, secret_key);
+
+        if (tox_friend_add_norequest(tox, keys + (size_t)i * TOX_PUBLIC_KEY_SIZE, NULL) != i) {
+            fprintf(stderr, "failed to add friend %u\n", i);
+            return 1;
+        }
+    }
+
+    const uint64_t add_ms = current_time_monotonic() - start;
+
+    const size_t length = tox_get_savedata_size(tox);
+    uint8_t *savedata = (uint8_t *)malloc(length);
+
+    if (savedata == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    tox_get_savedata(tox, savedata);
+    tox_kill(tox);
+
+    start = current_time_monotonic();
+    tox = new_bench_tox(savedata, length);
+    const uint64_t load_ms = current_time_monotonic() - start;
+
+    if (tox == NULL || tox_self_get_friend_list_size(tox) != num_friends) {
+        fprintf(stderr, "failed to load the profile\n");
+        return 1;
+    }
+
+    start = current_time_monotonic();
+
+    for (uint32_t i = 0; i < num_friends; ++i) {
+        if (tox_friend_by_public_key(tox, keys + (size_t)i * TOX_PUBLIC_KEY_SIZE, NULL) != i) {
+            fprintf(stderr, "failed to find friend %u\n", i);
+            return 1;
+        }
+    }
+
+    const uint64_t lookup_ms = current_time_monotonic() - start;
+
+    /* The first iterations start looking for every friend. */
+    for (uint32_t i = 0; i < 10; ++i) {
+        tox_iterate(tox, NULL);
+    }
+
+    const uint32_t num_iterations = 1000;
+    start = current_time_monotonic();
+
+    for (uint32_t i = 0; i < num_iterations; ++i) {
+        tox_iterate(tox, NULL);
+    }
+
+    const uint64_t iterate_ms = current_time_monotonic() - start;
+
+    printf("%u friends, %u KiB profile\n", num_friends, (unsigned int)(length / 1024));
+    printf("add: %llu ms, load: %llu ms, look up all: %llu ms\n", (unsigned long long)add_ms,
+           (unsigned long long)load_ms, (unsigned long long)lookup_ms);
+    printf("idle tox_iterate: %.3f ms\n", (double)iterate_ms / num_iterations);
+
+    tox_kill(tox);
+    free(savedata);
+    free(keys);
+    return 0;
+}
@@ -0,0 +1,116 @@
+/* BS_LIST benchmark
+ * Fills a list with public keys, like the accepted connections of a busy TCP
+ * relay, then replaces keys one at a time as connections come and go and
+ * looks every key up.
+ *
+ * Usage: ./list_bench [key count] [churn operations]
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "../toxcore/crypto_core.h"
+#include "../toxcore/list.h"
+#include "../toxcore/network.h"
+
+#include <stdio.h>
+#include <string.h>
+
+int main(int argc, char *argv[])
+{
+    const uint32_t num_keys = argc > 1 ? (uint32_t)atoi(argv[1]) : 100000;
+    const uint32_t num_churn = argc > 2 ? (uint32_t)atoi(argv[2]) : 1000000;
+
+    if (num_keys == 0) {
+        fprintf(stderr, "usage: %s [key count] [churn operations]\n", argv[0]);
+        return 1;
+    }
+
+    uint8_t *keys = (uint8_t *)malloc((size_t)num_keys * CRYPTO_PUBLIC_KEY_SIZE);
+    BS_LIST list;
+
+    if (keys == NULL || !bs_list_init(&list, CRYPTO_PUBLIC_KEY_SIZE, 8)) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    random_bytes(keys, (size_t)num_keys * CRYPTO_PUBLIC_KEY_SIZE);
+
+    uint64_t start = current_time_monotonic();
+
+    for (uint32_t i = 0; i < num_keys; ++i) {
+        if (!bs_list_add(&list, keys + (size_t)i * CRYPTO_PUBLIC_KEY_SIZE, i)) {
+            fprintf(stderr, "failed to add key %u\n", i);
+            return 1;
+        }
+    }
+
+    const uint64_t add_ms = current_time_monotonic() - start;
+
+    /* Pick the keys to replace with xorshift so that the random number
+     * generator doesn't dominate the time taken. */
+    uint32_t state = random_int() | 1;
+    start = current_time_monotonic();
+
+    for (uint32_t i = 0; i < num_churn; ++i) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+
+        const uint32_t id = state % num_keys;
+        uint8_t *key = keys + (size_t)id * CRYPTO_PUBLIC_KEY_SIZE;
+
+        if (!bs_list_remove(&list, key, id)) {
+            fprintf(stderr, "failed to remove key %u\n", id);
+            return 1;
+        }
+
+        /* The rest of the key is random, so this makes a new key. */
+        memcpy(key, &i, sizeof(i));
+
+        if (!bs_list_add(&list, key, id)) {
+            fprintf(stderr, "failed to add key %u\n", id);
+            return 1;
+        }
+    }
+
+    const uint64_t churn_ms = current_time_monotonic() - start;
+
+    start = current_time_monotonic();
+
+    for (uint32_t i = 0; i < num_keys; ++i) {
+        if (bs_list_find(&list, keys + (size_t)i * CRYPTO_PUBLIC_KEY_SIZE) != (int)i) {
+            fprintf(stderr, "failed to find key %u\n", i);
+            return 1;
+        }
+    }
+
+    const uint64_t find_ms = current_time_monotonic() - start;
+
+    printf("%u keys, %u keys replaced\n", num_keys, num_churn);
+    printf("add: %.1f ns, replace: %.1f ns, find: %.1f ns per key\n", add_ms * 1000000.0 / num_keys,
+           num_churn ? churn_ms * 1000000.0 / num_churn : 0.0, find_ms * 1000000.0 / num_keys);
+
+    bs_list_free(&list);
+    free(keys);
+    return 0;
+}
@@ -0,0 +1,187 @@
+/* Bulk transfer benchmark
+ * Floods the largest lossless packets between two Tox instances over
+ * loopback and measures the throughput, the number of UDP data packets it
+ * took and the CPU time spent per MB.
+ *
+ * Usage: ./mtu_bench [seconds]
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _XOPEN_SOURCE 600
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define TOX_DEFINED
+typedef struct Messenger Tox;
+
+#include "../toxcore/Messenger.h"
+#include "../toxcore/tox.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_PACKET_ID 160
+
+/* Counts the data packets on their way to the receiver. */
+typedef struct {
+    uint64_t packets;
+    uint64_t bytes;
+    uint16_t largest;
+
+    packet_handler_callback function;
+    void *object;
+} Bench_Link;
+
+static uint64_t time_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t cpu_time_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int handle_link_packet(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
+{
+    Bench_Link *link = (Bench_Link *)object;
+
+    ++link->packets;
+    link->bytes += length;
+
+    if (length > link->largest) {
+        link->largest = length;
+    }
+
+    return link->function(link->object, source, packet, length, userdata);
+}
+
+static uint64_t bytes_received;
+
+static void handle_bench_packet(Tox *tox, uint32_t friend_number, const uint8_t *data, size_t length,
+                                void *user_data)
+{
+    if (data[0] == BENCH_PACKET_ID) {
+        bytes_received += length;
+    }
+}
+
+static void iterate_both(Tox *sender, Tox *receiver)
+{
+    tox_iterate(sender, NULL);
+    tox_iterate(receiver, NULL);
+}
+
+int main(int argc, char *argv[])
+{
+    const uint32_t seconds = argc > 1 ? (uint32_t)atoi(argv[1]) : 10;
+
+    if (seconds == 0) {
+        fprintf(stderr, "usage: %s [seconds]\n", argv[0]);
+        return 1;
+    }
+
+    Tox *sender = tox_new(NULL, NULL);
+    Tox *receiver = tox_new(NULL, NULL);
+
+    if (sender == NULL || receiver == NULL) {
+        fprintf(stderr, "failed to create Tox instances\n");
+        return 1;
+    }
+
+    uint8_t address[TOX_PUBLIC_KEY_SIZE];
+    tox_self_get_public_key(receiver, address);
+    const uint32_t friend_number = tox_friend_add_norequest(sender, address, NULL);
+    tox_self_get_public_key(sender, address);
+    tox_friend_add_norequest(receiver, address, NULL);
+
+    uint8_t dht_key[TOX_PUBLIC_KEY_SIZE];
+    tox_self_get_dht_id(receiver, dht_key);
+    tox_bootstrap(sender, "127.0.0.1", tox_self_get_udp_port(receiver, NULL), dht_key, NULL);
+
+    tox_callback_friend_lossless_packet(receiver, &handle_bench_packet);
+
+    while (tox_friend_get_connection_status(sender, friend_number, NULL) != TOX_CONNECTION_UDP
+            || tox_friend_get_connection_status(receiver, 0, NULL) != TOX_CONNECTION_UDP) {
+        iterate_both(sender, receiver);
+        usleep(10000);
+    }
+
+    /* Give the connection time to find out what the path takes. */
+    const uint64_t settle = time_us();
+
+    while (time_us() - settle < 2000000) {
+        iterate_both(sender, receiver);
+        usleep(10000);
+    }
+
+    Bench_Link link;
+    memset(&link, 0, sizeof(link));
+    Networking_Core *net = receiver->net;
+    link.function = net->packethandlers[NET_PACKET_CRYPTO_DATA].function;
+    link.object = net->packethandlers[NET_PACKET_CRYPTO_DATA].object;
+    networking_registerhandler(net, NET_PACKET_CRYPTO_DATA, &handle_link_packet, &link);
+
+    uint8_t packet[TOX_MAX_CUSTOM_PACKET_SIZE];
+    memset(packet, 0, sizeof(packet));
+    packet[0] = BENCH_PACKET_ID;
+
+    const uint64_t start = time_us();
+    const uint64_t cpu_start = cpu_time_us();
+
+    while (time_us() - start < (uint64_t)seconds * 1000000) {
+        while (tox_friend_send_lossless_packet(sender, friend_number, packet, sizeof(packet), NULL)) {
+            continue;
+        }
+
+        iterate_both(sender, receiver);
+
+        uint32_t interval = tox_iteration_interval(sender);
+
+        if (interval > tox_iteration_interval(receiver)) {
+            interval = tox_iteration_interval(receiver);
+        }
+
+        usleep(interval * 1000);
+    }
+
+    const double cpu_seconds = (cpu_time_us() - cpu_start) / 1000000.0;
+    const double mbytes = bytes_received / 1000000.0;
+
+    printf("received: %.2f MB/s, %.1f packets per UDP data packet\n", mbytes / seconds,
+           link.packets ? (double)bytes_received / sizeof(packet) / link.packets : 0.0);
+    printf("UDP data packets: %llu, largest %u bytes, %.1f bytes on average\n", (unsigned long long)link.packets,
+           link.largest, link.packets ? (double)link.bytes / link.packets : 0.0);
+    printf("CPU time: %.3f s, %.1f ms per MB\n", cpu_seconds, mbytes > 0 ? cpu_seconds * 1000.0 / mbytes : 0.0);
+
+    networking_registerhandler(net, NET_PACKET_CRYPTO_DATA, link.function, link.object);
+    tox_kill(sender);
+    tox_kill(receiver);
+    return 0;
+}
@@ -0,0 +1,200 @@
+/* Packet pacing benchmark
+ * Floods lossless packets between two Tox instances over loopback, through an
+ * emulated bottleneck link with a shallow queue in front of the receiver, and
+ * measures how many packets get through, how many the link drops, and the
+ * largest burst that reached the link within a millisecond.
+ *
+ * Usage: ./pacing_bench [link packets per second] [link queue length] [seconds]
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _XOPEN_SOURCE 600
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define TOX_DEFINED
+typedef struct Messenger Tox;
+
+#include "../toxcore/Messenger.h"
+#include "../toxcore/tox.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_PACKET_ID 160
+#define BENCH_PACKET_SIZE 1300
+
+/* A link that forwards rate packets per second and holds up to depth
+ * packets, dropping what doesn't fit. */
+typedef struct {
+    double rate;
+    double depth;
+    double queue;
+    uint64_t last_time;
+
+    uint32_t forwarded;
+    uint32_t dropped;
+
+    uint64_t burst_time;
+    uint32_t burst;
+    uint32_t max_burst;
+
+    packet_handler_callback function;
+    void *object;
+} Bench_Link;
+
+static uint64_t time_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int handle_link_packet(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
+{
+    Bench_Link *link = (Bench_Link *)object;
+    const uint64_t now = time_us();
+
+    if (now / 1000 != link->burst_time) {
+        link->burst_time = now / 1000;
+        link->burst = 0;
+    }
+
+    if (++link->burst > link->max_burst) {
+        link->max_burst = link->burst;
+    }
+
+    link->queue -= link->rate * (double)(now - link->last_time) / 1000000.0;
+    link->last_time = now;
+
+    if (link->queue < 0) {
+        link->queue = 0;
+    }
+
+    if (link->queue + 1 > link->depth) {
+        ++link->dropped;
+        return 1;
+    }
+
+    link->queue += 1;
+    ++link->forwarded;
+    return link->function(link->object, source, packet, length, userdata);
+}
+
+static uint32_t packets_received;
+
+static void handle_bench_packet(Tox *tox, uint32_t friend_number, const uint8_t *data, size_t length,
+                                void *user_data)
+{
+    if (length == BENCH_PACKET_SIZE && data[0] == BENCH_PACKET_ID) {
+        ++packets_received;
+    }
+}
+
+static void iterate_both(Tox *sender, Tox *receiver)
+{
+    tox_iterate(sender, NULL);
+    tox_iterate(receiver, NULL);
+}
+
+int main(int argc, char *argv[])
+{
+    Bench_Link link;
+    memset(&link, 0, sizeof(link));
+    link.rate = argc > 1 ? atof(argv[1]) : 1000.0;
+    link.depth = argc > 2 ? atof(argv[2]) : 16.0;
+    const uint32_t seconds = argc > 3 ? (uint32_t)atoi(argv[3]) : 10;
+
+    if (link.rate <= 0 || link.depth < 1 || seconds == 0) {
+        fprintf(stderr, "usage: %s [link packets per second] [link queue length] [seconds]\n", argv[0]);
+        return 1;
+    }
+
+    Tox *sender = tox_new(NULL, NULL);
+    Tox *receiver = tox_new(NULL, NULL);
+
+    if (sender == NULL || receiver == NULL) {
+        fprintf(stderr, "failed to create Tox instances\n");
+        return 1;
+    }
+
+    uint8_t address[TOX_PUBLIC_KEY_SIZE];
+    tox_self_get_public_key(receiver, address);
+    const uint32_t friend_number = tox_friend_add_norequest(sender, address, NULL);
+    tox_self_get_public_key(sender, address);
+    tox_friend_add_norequest(receiver, address, NULL);
+
+    uint8_t dht_key[TOX_PUBLIC_KEY_SIZE];
+    tox_self_get_dht_id(receiver, dht_key);
+    tox_bootstrap(sender, "127.0.0.1", tox_self_get_udp_port(receiver, NULL), dht_key, NULL);
+
+    tox_callback_friend_lossless_packet(receiver, &handle_bench_packet);
+
+    while (tox_friend_get_connection_status(sender, friend_number, NULL) != TOX_CONNECTION_UDP) {
+        iterate_both(sender, receiver);
+        usleep(10000);
+    }
+
+    Networking_Core *net = receiver->net;
+    link.function = net->packethandlers[NET_PACKET_CRYPTO_DATA].function;
+    link.object = net->packethandlers[NET_PACKET_CRYPTO_DATA].object;
+    link.last_time = time_us();
+    networking_registerhandler(net, NET_PACKET_CRYPTO_DATA, &handle_link_packet, &link);
+
+    uint8_t packet[BENCH_PACKET_SIZE];
+    memset(packet, 0, sizeof(packet));
+    packet[0] = BENCH_PACKET_ID;
+
+    const uint64_t start = time_us();
+    uint64_t iterations = 0;
+
+    while (time_us() - start < (uint64_t)seconds * 1000000) {
+        while (tox_friend_send_lossless_packet(sender, friend_number, packet, sizeof(packet), NULL)) {
+            continue;
+        }
+
+        iterate_both(sender, receiver);
+        ++iterations;
+
+        uint32_t interval = tox_iteration_interval(sender);
+
+        if (interval > tox_iteration_interval(receiver)) {
+            interval = tox_iteration_interval(receiver);
+        }
+
+        usleep(interval * 1000);
+    }
+
+    printf("link: %.0f packets/s, queue of %.0f packets\n", link.rate, link.depth);
+    printf("received: %.1f packets/s, dropped by link: %u of %u (%.2f%%)\n", (double)packets_received / seconds,
+           link.dropped, link.dropped + link.forwarded,
+           100.0 * link.dropped / (link.dropped + link.forwarded ? link.dropped + link.forwarded : 1));
+    printf("largest burst in 1 ms: %u packets, %.1f iterations/s\n", link.max_burst, (double)iterations / seconds);
+
+    networking_registerhandler(net, NET_PACKET_CRYPTO_DATA, link.function, link.object);
+    tox_kill(sender);
+    tox_kill(receiver);
+    return 0;
+}
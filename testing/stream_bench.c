@@ -0,0 +1,251 @@
+/* Stream head of line blocking benchmark
+ * Floods lossless packets between two Tox instances over loopback while
+ * sending a message every few milliseconds, drops a share of the data packets
+ * on their way to the receiver, and measures how long the messages take to be
+ * delivered.
+ *
+ * Usage: ./stream_bench [loss percent] [seconds]
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _XOPEN_SOURCE 600
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define TOX_DEFINED
+typedef struct Messenger Tox;
+
+#include "../toxcore/Messenger.h"
+#include "../toxcore/tox.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_PACKET_ID 160
+#define BENCH_PACKET_SIZE 1300
+
+/* Interval in ms between messages. */
+#define MESSAGE_INTERVAL 20
+#define MAX_MESSAGES 65536
+
+/* Messages that take longer than this many ms were held back. */
+#define DELAYED_LATENCY 10
+
+/* A link that drops packets at random, a share loss of them. */
+typedef struct {
+    double loss;
+
+    uint32_t forwarded;
+    uint32_t dropped;
+
+    packet_handler_callback function;
+    void *object;
+} Bench_Link;
+
+static uint64_t time_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int handle_link_packet(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
+{
+    Bench_Link *link = (Bench_Link *)object;
+
+    if (rand() < link->loss * RAND_MAX) {
+        ++link->dropped;
+        return 1;
+    }
+
+    ++link->forwarded;
+    return link->function(link->object, source, packet, length, userdata);
+}
+
+static uint32_t packets_received;
+static uint32_t packets_out_of_order;
+static uint32_t messages_received;
+static uint64_t latencies[MAX_MESSAGES];
+
+static void handle_bench_packet(Tox *tox, uint32_t friend_number, const uint8_t *data, size_t length,
+                                void *user_data)
+{
+    uint32_t number;
+
+    if (length == BENCH_PACKET_SIZE && data[0] == BENCH_PACKET_ID) {
+        memcpy(&number, data + 1, sizeof(number));
+
+        if (number != packets_received) {
+            ++packets_out_of_order;
+        }
+
+        ++packets_received;
+    }
+}
+
+static void handle_bench_message(Tox *tox, uint32_t friend_number, TOX_MESSAGE_TYPE type, const uint8_t *message,
+                                 size_t length, void *user_data)
+{
+    uint64_t sent_time;
+
+    if (length != sizeof(sent_time) || messages_received == MAX_MESSAGES) {
+        return;
+    }
+
+    memcpy(&sent_time, message, sizeof(sent_time));
+    latencies[messages_received] = time_us() - sent_time;
+    ++messages_received;
+}
+
+static int cmp_latency(const void *a, const void *b)
+{
+    const uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void iterate_both(Tox *sender, Tox *receiver)
+{
+    tox_iterate(sender, NULL);
+    tox_iterate(receiver, NULL);
+}
+
+int main(int argc, char *argv[])
+{
+    Bench_Link link;
+    memset(&link, 0, sizeof(link));
+    link.loss = (argc > 1 ? atof(argv[1]) : 1.0) / 100.0;
+    const uint32_t seconds = argc > 2 ? (uint32_t)atoi(argv[2]) : 10;
+
+    if (link.loss < 0 || link.loss >= 1 || seconds == 0) {
+        fprintf(stderr, "usage: %s [loss percent] [seconds]\n", argv[0]);
+        return 1;
+    }
+
+    srand((unsigned int)time(NULL));
+
+    Tox *sender = tox_new(NULL, NULL);
+    Tox *receiver = tox_new(NULL, NULL);
+
+    if (sender == NULL || receiver == NULL) {
+        fprintf(stderr, "failed to create Tox instances\n");
+        return 1;
+    }
+
+    uint8_t address[TOX_PUBLIC_KEY_SIZE];
+    tox_self_get_public_key(receiver, address);
+    const uint32_t friend_number = tox_friend_add_norequest(sender, address, NULL);
+    tox_self_get_public_key(sender, address);
+    tox_friend_add_norequest(receiver, address, NULL);
+
+    uint8_t dht_key[TOX_PUBLIC_KEY_SIZE];
+    tox_self_get_dht_id(receiver, dht_key);
+    tox_bootstrap(sender, "127.0.0.1", tox_self_get_udp_port(receiver, NULL), dht_key, NULL);
+
+    tox_callback_friend_lossless_packet(receiver, &handle_bench_packet);
+    tox_callback_friend_message(receiver, &handle_bench_message);
+
+    while (tox_friend_get_connection_status(sender, friend_number, NULL) != TOX_CONNECTION_UDP
+            || tox_friend_get_connection_status(receiver, 0, NULL) != TOX_CONNECTION_UDP) {
+        iterate_both(sender, receiver);
+        usleep(10000);
+    }
+
+    Networking_Core *net = receiver->net;
+    link.function = net->packethandlers[NET_PACKET_CRYPTO_DATA].function;
+    link.object = net->packethandlers[NET_PACKET_CRYPTO_DATA].object;
+    networking_registerhandler(net, NET_PACKET_CRYPTO_DATA, &handle_link_packet, &link);
+
+    uint8_t packet[BENCH_PACKET_SIZE];
+    memset(packet, 0, sizeof(packet));
+    packet[0] = BENCH_PACKET_ID;
+
+    const uint64_t start = time_us();
+    uint64_t last_message = start;
+    uint32_t messages_sent = 0, packets_sent = 0;
+
+    while (time_us() - start < (uint64_t)seconds * 1000000) {
+        while (1) {
+            memcpy(packet + 1, &packets_sent, sizeof(packets_sent));
+
+            if (!tox_friend_send_lossless_packet(sender, friend_number, packet, sizeof(packet), NULL)) {
+                break;
+            }
+
+            ++packets_sent;
+        }
+
+        const uint64_t now = time_us();
+
+        if (now - last_message >= MESSAGE_INTERVAL * 1000 && messages_sent < MAX_MESSAGES) {
+            last_message = now;
+
+            if (tox_friend_send_message(sender, friend_number, TOX_MESSAGE_TYPE_NORMAL, (const uint8_t *)&now,
+                                        sizeof(now), NULL) != 0) {
+                ++messages_sent;
+            }
+        }
+
+        iterate_both(sender, receiver);
+
+        uint32_t interval = tox_iteration_interval(sender);
+
+        if (interval > tox_iteration_interval(receiver)) {
+            interval = tox_iteration_interval(receiver);
+        }
+
+        if (interval > MESSAGE_INTERVAL) {
+            interval = MESSAGE_INTERVAL;
+        }
+
+        usleep(interval * 1000);
+    }
+
+    qsort(latencies, messages_received, sizeof(uint64_t), &cmp_latency);
+
+    printf("loss: %.2f%% (%u of %u packets dropped)\n", link.loss * 100, link.dropped, link.dropped + link.forwarded);
+    printf("bulk received: %.1f packets/s, %u out of order\n", (double)packets_received / seconds,
+           packets_out_of_order);
+
+    if (messages_received != 0) {
+        uint32_t i, delayed = 0;
+
+        for (i = 0; i < messages_received; ++i) {
+            if (latencies[i] > DELAYED_LATENCY * 1000) {
+                ++delayed;
+            }
+        }
+
+        printf("messages: %u of %u received, %u took over %u ms\n", messages_received, messages_sent, delayed,
+               DELAYED_LATENCY);
+        printf("latency: median %.1f ms, 90th percentile %.1f ms, 99th percentile %.1f ms, max %.1f ms\n",
+               latencies[messages_received / 2] / 1000.0, latencies[messages_received * 9 / 10] / 1000.0,
+               latencies[messages_received * 99 / 100] / 1000.0, latencies[messages_received - 1] / 1000.0);
+    }
+
+    networking_registerhandler(net, NET_PACKET_CRYPTO_DATA, link.function, link.object);
+    tox_kill(sender);
+    tox_kill(receiver);
+    return 0;
+}
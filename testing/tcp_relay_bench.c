@@ -0,0 +1,253 @@
+/* TCP relay server throughput benchmark
+ * Connects pairs of clients that route data to each other through a TCP relay
+ * server, like the one tox-bootstrapd runs, and measures how much data the
+ * server relays with each of its socket backends: epoll and, if it was built
+ * with TCP_SERVER_USE_IO_URING and the kernel supports it, io_uring.
+ *
+ * Clients and server run in the same thread, so the system time reported
+ * includes the clients' system calls, which are the same for both backends.
+ *
+ * Usage: ./tcp_relay_bench [pairs] [seconds] [packet size]
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "../toxcore/TCP_client.h"
+#include "../toxcore/util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#define BENCH_PORT 33600
+
+/* Packets each client tries to send per round. */
+#define BURST 16
+
+typedef struct {
+    TCP_Client_Connection *con;
+    uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t secret_key[CRYPTO_SECRET_KEY_SIZE];
+    uint8_t connection_id;
+    bool online;
+    uint64_t received;
+} Bench_Client;
+
+static int response_callback(void *object, uint8_t connection_id, const uint8_t *public_key)
+{
+    Bench_Client *client = (Bench_Client *)object;
+    client->connection_id = connection_id;
+    return 0;
+}
+
+static int status_callback(void *object, uint32_t number, uint8_t connection_id, uint8_t status)
+{
+    Bench_Client *client = (Bench_Client *)object;
+    client->online = status == 2;
+    return 0;
+}
+
+static int data_callback(void *object, uint32_t number, uint8_t connection_id, const uint8_t *data, uint16_t length,
+                         void *userdata)
+{
+    Bench_Client *client = (Bench_Client *)object;
+    client->received += length;
+    return 0;
+}
+
+static double cpu_seconds(const struct timeval *tv)
+{
+    return tv->tv_sec + tv->tv_usec / 1000000.0;
+}
+
+static void run_clients(TCP_Server *tcp_s, Bench_Client *clients, uint32_t num_clients)
+{
+    unix_time_update();
+    do_TCP_server(tcp_s);
+
+    for (uint32_t i = 0; i < num_clients; ++i) {
+        do_TCP_connection(clients[i].con, NULL);
+    }
+}
+
+/* Wait until every client is connected to its partner.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int connect_clients(TCP_Server *tcp_s, Bench_Client *clients, uint32_t num_clients, uint16_t port)
+{
+    IP_Port ip_port;
+    ip_init(&ip_port.ip, 0);
+    ip_port.ip.ip4.uint32 = net_htonl(0x7F000001);
+    ip_port.port = net_htons(port);
+
+    unix_time_update();
+
+    for (uint32_t i = 0; i < num_clients; ++i) {
+        crypto_new_keypair(clients[i].public_key, clients[i].secret_key);
+        clients[i].con = new_TCP_connection(ip_port, tcp_server_public_key(tcp_s), clients[i].public_key,
+                                            clients[i].secret_key, NULL);
+
+        if (clients[i].con == NULL) {
+            return -1;
+        }
+
+        routing_response_handler(clients[i].con, &response_callback, &clients[i]);
+        routing_status_handler(clients[i].con, &status_callback, &clients[i]);
+        routing_data_handler(clients[i].con, &data_callback, &clients[i]);
+    }
+
+    const uint64_t start = unix_time();
+    uint32_t confirmed = 0;
+
+    while (confirmed != num_clients) {
+        if (is_timeout(start, 10)) {
+            return -1;
+        }
+
+        run_clients(tcp_s, clients, num_clients);
+        confirmed = 0;
+
+        for (uint32_t i = 0; i < num_clients; ++i) {
+            confirmed += clients[i].con->status == TCP_CLIENT_CONFIRMED;
+        }
+    }
+
+    for (uint32_t i = 0; i < num_clients; ++i) {
+        send_routing_request(clients[i].con, clients[i ^ 1].public_key);
+    }
+
+    uint32_t online = 0;
+
+    while (online != num_clients) {
+        if (is_timeout(start, 10)) {
+            return -1;
+        }
+
+        run_clients(tcp_s, clients, num_clients);
+        online = 0;
+
+        for (uint32_t i = 0; i < num_clients; ++i) {
+            online += clients[i].online;
+        }
+    }
+
+    return 0;
+}
+
+/* return 0 on success.
+ * return -1 on failure.
+ */
+static int bench(const char *name, bool io_uring, uint32_t num_pairs, uint32_t seconds, uint16_t packet_size)
+{
+    uint8_t self_public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t self_secret_key[CRYPTO_SECRET_KEY_SIZE];
+    crypto_new_keypair(self_public_key, self_secret_key);
+
+    const uint16_t port = BENCH_PORT + io_uring;
+    TCP_Server *tcp_s = new_TCP_server(0, 1, &port, self_secret_key, NULL);
+
+    if (tcp_s == NULL) {
+        fprintf(stderr, "failed to create TCP server\n");
+        return -1;
+    }
+
+    if (tcp_server_set_io_uring(tcp_s, io_uring) == -1) {
+        printf("%-8s not available\n", name);
+        kill_TCP_server(tcp_s);
+        return 0;
+    }
+
+    const uint32_t num_clients = 2 * num_pairs;
+    Bench_Client *clients = (Bench_Client *)calloc(num_clients, sizeof(Bench_Client));
+    uint8_t *data = (uint8_t *)calloc(1, packet_size);
+
+    if (clients == NULL || data == NULL || connect_clients(tcp_s, clients, num_clients, port) == -1) {
+        fprintf(stderr, "%s: failed to connect the clients\n", name);
+        free(data);
+        free(clients);
+        kill_TCP_server(tcp_s);
+        return -1;
+    }
+
+    struct rusage usage_start, usage_end;
+    getrusage(RUSAGE_SELF, &usage_start);
+    const uint64_t start = current_time_monotonic();
+
+    while (current_time_monotonic() - start < seconds * 1000ULL) {
+        for (uint32_t i = 0; i < num_clients; ++i) {
+            for (uint32_t j = 0; j < BURST; ++j) {
+                if (send_data(clients[i].con, clients[i].connection_id, data, packet_size) != 1) {
+                    break;
+                }
+            }
+        }
+
+        run_clients(tcp_s, clients, num_clients);
+    }
+
+    const uint64_t ms = current_time_monotonic() - start;
+    getrusage(RUSAGE_SELF, &usage_end);
+
+    uint64_t received = 0;
+
+    for (uint32_t i = 0; i < num_clients; ++i) {
+        received += clients[i].received;
+        kill_TCP_connection(clients[i].con);
+    }
+
+    const double user = cpu_seconds(&usage_end.ru_utime) - cpu_seconds(&usage_start.ru_utime);
+    const double sys = cpu_seconds(&usage_end.ru_stime) - cpu_seconds(&usage_start.ru_stime);
+
+    printf("%-8s %8.1f MiB/s %9.0f packets/s, cpu user %.2f s sys %.2f s\n", name,
+           received / 1048576.0 / (ms / 1000.0), received / packet_size / (ms / 1000.0), user, sys);
+
+    free(data);
+    free(clients);
+    kill_TCP_server(tcp_s);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const uint32_t num_pairs = argc > 1 ? (uint32_t)atoi(argv[1]) : 32;
+    const uint32_t seconds = argc > 2 ? (uint32_t)atoi(argv[2]) : 5;
+    const uint16_t packet_size = argc > 3 ? (uint16_t)atoi(argv[3]) : 1024;
+
+    if (num_pairs == 0 || seconds == 0 || packet_size == 0
+            || packet_size > MAX_PACKET_SIZE - CRYPTO_MAC_SIZE - 1) {
+        fprintf(stderr, "usage: %s [pairs] [seconds] [packet size]\n", argv[0]);
+        return 1;
+    }
+
+    printf("%u client pairs, %u byte packets\n", num_pairs, packet_size);
+
+    if (bench("epoll", false, num_pairs, seconds, packet_size) == -1
+            || bench("io_uring", true, num_pairs, seconds, packet_size) == -1) {
+        return 1;
+    }
+
+    return 0;
+}
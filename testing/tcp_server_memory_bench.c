@@ -0,0 +1,286 @@
+/* TCP relay server memory benchmark
+ * Connects a large number of idle clients to a TCP relay server, like the one
+ * tox-bootstrapd runs, and reports how much memory the server needs for them.
+ * Every client completes the handshake and one ping so that the server has
+ * confirmed it, then stays silent.
+ *
+ * The number of clients is limited by the open file limit: every client needs
+ * a socket on both ends.
+ *
+ * Usage: ./tcp_server_memory_bench [client count]
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "../toxcore/TCP_server.h"
+#include "../toxcore/util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+/* Clients that do their handshake at the same time, well below the size of
+ * the server's handshake queues.
+ */
+#define BATCH_SIZE 128
+
+/* Connections per listening port, below the number of local ports. */
+#define CLIENTS_PER_PORT 20000
+
+#define FIRST_PORT 33500
+#define MAX_PORTS 16
+
+#define PING_PACKET_SIZE (sizeof(uint16_t) + 1 + sizeof(uint64_t) + CRYPTO_MAC_SIZE)
+
+typedef struct {
+    Socket sock;
+    uint8_t secret_key[CRYPTO_SECRET_KEY_SIZE];
+    uint8_t temp_secret_key[CRYPTO_SECRET_KEY_SIZE];
+    uint8_t sent_nonce[CRYPTO_NONCE_SIZE];
+    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
+    uint8_t state; /* 0 waiting for the handshake, 1 waiting for the pong, 2 done. */
+} Bench_Client;
+
+/* return the resident set size of the process in bytes. */
+static uint64_t resident_memory(void)
+{
+    FILE *file = fopen("/proc/self/statm", "r");
+
+    if (file == NULL) {
+        return 0;
+    }
+
+    unsigned long size = 0, resident = 0;
+
+    if (fscanf(file, "%lu %lu", &size, &resident) != 2) {
+        resident = 0;
+    }
+
+    fclose(file);
+    return (uint64_t)resident * sysconf(_SC_PAGESIZE);
+}
+
+/* Connect client to the server and send the handshake.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int start_client(Bench_Client *client, const TCP_Server *tcp_s, uint16_t port)
+{
+    client->sock = net_socket(TOX_AF_INET, TOX_SOCK_STREAM, TOX_PROTO_TCP);
+
+    if (!sock_valid(client->sock)) {
+        return -1;
+    }
+
+    IP_Port ip_port;
+    ip_init(&ip_port.ip, 0);
+    ip_port.ip.ip4.uint32 = net_htonl(0x7F000001);
+    ip_port.port = net_htons(port);
+
+    if (net_connect(client->sock, ip_port) != 0) {
+        return -1;
+    }
+
+    uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    crypto_new_keypair(public_key, client->secret_key);
+    random_nonce(client->sent_nonce);
+
+    uint8_t plain[TCP_HANDSHAKE_PLAIN_SIZE];
+    crypto_new_keypair(plain, client->temp_secret_key);
+    memcpy(plain + CRYPTO_PUBLIC_KEY_SIZE, client->sent_nonce, CRYPTO_NONCE_SIZE);
+
+    uint8_t handshake[TCP_CLIENT_HANDSHAKE_SIZE];
+    memcpy(handshake, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    random_nonce(handshake + CRYPTO_PUBLIC_KEY_SIZE);
+    encrypt_data(tcp_server_public_key(tcp_s), client->secret_key, handshake + CRYPTO_PUBLIC_KEY_SIZE, plain,
+                 sizeof(plain), handshake + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE);
+
+    if (send(client->sock, (const char *)handshake, sizeof(handshake), 0) != sizeof(handshake)) {
+        return -1;
+    }
+
+    client->state = 0;
+    return 0;
+}
+
+/* Advance client if the server answered.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int run_client(Bench_Client *client, const TCP_Server *tcp_s)
+{
+    if (client->state == 0) {
+        uint8_t response[TCP_SERVER_HANDSHAKE_SIZE];
+
+        if (recv(client->sock, (char *)response, sizeof(response), MSG_DONTWAIT) != sizeof(response)) {
+            return 0;
+        }
+
+        uint8_t plain[TCP_HANDSHAKE_PLAIN_SIZE];
+
+        if (decrypt_data(tcp_server_public_key(tcp_s), client->secret_key, response, response + CRYPTO_NONCE_SIZE,
+                         sizeof(response) - CRYPTO_NONCE_SIZE, plain) != sizeof(plain)) {
+            return -1;
+        }
+
+        encrypt_precompute(plain, client->temp_secret_key, client->shared_key);
+
+        /* The server confirms a connection once the first packet arrives. */
+        uint8_t ping[1 + sizeof(uint64_t)];
+        ping[0] = TCP_PACKET_PING;
+        random_bytes(ping + 1, sizeof(uint64_t));
+
+        uint8_t packet[PING_PACKET_SIZE];
+        const uint16_t length = net_htons(sizeof(ping) + CRYPTO_MAC_SIZE);
+        memcpy(packet, &length, sizeof(uint16_t));
+        encrypt_data_symmetric(client->shared_key, client->sent_nonce, ping, sizeof(ping), packet + sizeof(uint16_t));
+
+        if (send(client->sock, (const char *)packet, sizeof(packet), 0) != sizeof(packet)) {
+            return -1;
+        }
+
+        client->state = 1;
+        return 0;
+    }
+
+    if (client->state == 1) {
+        uint8_t pong[PING_PACKET_SIZE];
+
+        if (recv(client->sock, (char *)pong, sizeof(pong), MSG_DONTWAIT) == sizeof(pong)) {
+            client->state = 2;
+        }
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t num_clients = argc > 1 ? (uint32_t)atoi(argv[1]) : 50000;
+
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+
+        const uint32_t max_clients = limit.rlim_cur > 64 ? (limit.rlim_cur - 64) / 2 : 0;
+
+        if (num_clients > max_clients) {
+            printf("open file limit %llu only allows %u clients\n", (unsigned long long)limit.rlim_cur, max_clients);
+            num_clients = max_clients;
+        }
+    }
+
+    if (num_clients == 0) {
+        fprintf(stderr, "client count must be positive\n");
+        return 1;
+    }
+
+    uint16_t ports[MAX_PORTS];
+    uint16_t num_ports = (num_clients + CLIENTS_PER_PORT - 1) / CLIENTS_PER_PORT;
+
+    if (num_ports > MAX_PORTS) {
+        num_ports = MAX_PORTS;
+    }
+
+    for (uint16_t i = 0; i < num_ports; ++i) {
+        ports[i] = FIRST_PORT + i;
+    }
+
+    Bench_Client *clients = (Bench_Client *)calloc(num_clients, sizeof(Bench_Client));
+
+    if (clients == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    uint8_t self_public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t self_secret_key[CRYPTO_SECRET_KEY_SIZE];
+    crypto_new_keypair(self_public_key, self_secret_key);
+
+    TCP_Server *tcp_s = new_TCP_server(0, num_ports, ports, self_secret_key, NULL);
+
+    if (tcp_s == NULL) {
+        fprintf(stderr, "failed to create TCP server\n");
+        return 1;
+    }
+
+    const uint64_t start_memory = resident_memory();
+    const uint64_t start = current_time_monotonic();
+    uint32_t connected = 0;
+
+    for (uint32_t first = 0; first < num_clients; first += BATCH_SIZE) {
+        const uint32_t end = first + BATCH_SIZE < num_clients ? first + BATCH_SIZE : num_clients;
+
+        for (uint32_t i = first; i < end; ++i) {
+            if (start_client(&clients[i], tcp_s, ports[i % num_ports]) == -1) {
+                clients[i].state = 3;
+            }
+        }
+
+        unix_time_update();
+        const uint64_t batch_start = unix_time();
+        uint32_t done;
+
+        do {
+            do_TCP_server(tcp_s);
+            done = 0;
+
+            for (uint32_t i = first; i < end; ++i) {
+                if (clients[i].state < 2 && run_client(&clients[i], tcp_s) == -1) {
+                    clients[i].state = 3;
+                }
+
+                done += clients[i].state >= 2;
+            }
+        } while (done != end - first && !is_timeout(batch_start, 10));
+
+        for (uint32_t i = first; i < end; ++i) {
+            connected += clients[i].state == 2;
+        }
+    }
+
+    const uint64_t ms = current_time_monotonic() - start;
+    const uint64_t used = resident_memory() - start_memory;
+
+    printf("%u/%u idle clients connected in %llu ms\n", connected, num_clients, (unsigned long long)ms);
+    printf("TCP_Secure_Connection: %u bytes\n", (unsigned int)sizeof(TCP_Secure_Connection));
+    printf("server memory: %llu KiB, %llu bytes per client\n", (unsigned long long)used / 1024,
+           connected ? (unsigned long long)used / connected : 0ULL);
+
+    kill_TCP_server(tcp_s);
+
+    for (uint32_t i = 0; i < num_clients; ++i) {
+        if (clients[i].sock) {
+            kill_sock(clients[i].sock);
+        }
+    }
+
+    free(clients);
+    return connected == num_clients ? 0 : 1;
+}
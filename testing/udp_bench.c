@@ -0,0 +1,187 @@
+/* UDP benchmark
+ * Measures how many packets per second networking_poll can receive and
+ * dispatch over loopback, with and without batched receiving, and how many
+ * packets per second sendpacket can send with and without the send queue.
+ *
+ * Usage: ./udp_bench [packet count] [packet size]
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "../toxcore/network.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Packets sent before the receiver drains the socket; must fit in SO_RCVBUF. */
+#define BURST_SIZE 512
+
+#define BENCH_PACKET_ID 0xfe
+
+static uint32_t packets_received;
+
+static int handle_bench_packet(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
+{
+    ++packets_received;
+    return 0;
+}
+
+/* return time spent in networking_poll in milliseconds. */
+static uint64_t run_recv(Networking_Core *sender, Networking_Core *receiver, IP_Port to, uint32_t count,
+                         uint16_t size)
+{
+    uint8_t packet[MAX_UDP_PACKET_SIZE];
+    memset(packet, 0, sizeof(packet));
+    packet[0] = BENCH_PACKET_ID;
+
+    uint64_t elapsed = 0;
+    uint32_t sent = 0;
+    packets_received = 0;
+
+    while (sent < count) {
+        uint32_t burst = count - sent < BURST_SIZE ? count - sent : BURST_SIZE;
+
+        for (uint32_t i = 0; i < burst; ++i) {
+            sendpacket(sender, to, packet, size);
+        }
+
+        sent += burst;
+
+        uint64_t start = current_time_monotonic();
+        uint32_t target = packets_received + burst;
+        uint32_t idle = 0;
+
+        /* Packets dropped by the kernel never arrive, so give up after a while. */
+        while (packets_received < target && idle < 100) {
+            uint32_t before = packets_received;
+            networking_poll(receiver, NULL);
+            idle = packets_received == before ? idle + 1 : 0;
+        }
+
+        elapsed += current_time_monotonic() - start;
+    }
+
+    return elapsed;
+}
+
+/* return time spent sending in milliseconds. */
+static uint64_t run_send(Networking_Core *sender, Networking_Core *receiver, IP_Port to, uint32_t count,
+                         uint16_t size)
+{
+    uint8_t packet[MAX_UDP_PACKET_SIZE];
+    memset(packet, 0, sizeof(packet));
+    packet[0] = BENCH_PACKET_ID;
+
+    uint64_t elapsed = 0;
+    uint32_t sent = 0;
+
+    while (sent < count) {
+        uint32_t burst = count - sent < BURST_SIZE ? count - sent : BURST_SIZE;
+        uint64_t start = current_time_monotonic();
+
+        networking_send_queue_begin(sender);
+
+        for (uint32_t i = 0; i < burst; ++i) {
+            sendpacket(sender, to, packet, size);
+        }
+
+        networking_send_queue_flush(sender);
+
+        elapsed += current_time_monotonic() - start;
+        sent += burst;
+
+        /* Drain the receiver so the kernel doesn't start dropping. */
+        networking_poll(receiver, NULL);
+    }
+
+    return elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t count = argc > 1 ? (uint32_t)atoi(argv[1]) : 1000000;
+    uint16_t size = argc > 2 ? (uint16_t)atoi(argv[2]) : 100;
+
+    if (size < 1 || size > MAX_UDP_PACKET_SIZE) {
+        fprintf(stderr, "packet size must be between 1 and %d\n", MAX_UDP_PACKET_SIZE);
+        return 1;
+    }
+
+    IP ip;
+    ip_init(&ip, 0);
+    ip.ip4.uint32 = net_htonl(0x7F000001);
+
+    Logger *log = logger_new();
+    Networking_Core *sender = new_networking(log, ip, 33445);
+    Networking_Core *receiver = new_networking(log, ip, 33445);
+
+    if (sender == NULL || receiver == NULL) {
+        fprintf(stderr, "failed to create sockets\n");
+        return 1;
+    }
+
+    networking_registerhandler(receiver, BENCH_PACKET_ID, &handle_bench_packet, NULL);
+
+    IP_Port to;
+    to.ip = ip;
+    to.port = receiver->port;
+
+    for (int batch = 0; batch <= 1; ++batch) {
+        if (networking_set_batch_receive(receiver, batch) != batch) {
+            printf("%-10s not supported on this platform\n", "recvmmsg");
+            continue;
+        }
+
+        uint64_t ms = run_recv(sender, receiver, to, count, size);
+
+        if (ms == 0) {
+            ms = 1;
+        }
+
+        printf("%-10s %u/%u packets of %u bytes in %llu ms: %llu packets/s\n", batch ? "recvmmsg" : "recvfrom",
+               packets_received, count, size, (unsigned long long)ms,
+               (unsigned long long)packets_received * 1000 / ms);
+    }
+
+    for (int queue = 0; queue <= 1; ++queue) {
+        if (networking_set_send_queue(sender, queue) != queue) {
+            printf("%-10s not supported on this platform\n", "sendmmsg");
+            continue;
+        }
+
+        uint64_t ms = run_send(sender, receiver, to, count, size);
+
+        if (ms == 0) {
+            ms = 1;
+        }
+
+        printf("%-10s %u packets of %u bytes in %llu ms: %llu packets/s\n", queue ? "sendmmsg" : "sendto",
+               count, size, (unsigned long long)ms, (unsigned long long)count * 1000 / ms);
+    }
+
+    kill_networking(sender);
+    kill_networking(receiver);
+    logger_kill(log);
+    return 0;
+}
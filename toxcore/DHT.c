@@ -107,56 +107,221 @@ static unsigned int bit_by_bit_cmp(const uint8_t *pk1, const uint8_t *pk2)
     return i * 8 + j;
 }
 
-/* Shared key generations are costly, it is therefor smart to store commonly used
- * ones so that they can re used later without being computed again.
- *
- * If shared key is already in shared_keys, copy it to shared_key.
- * else generate it into shared_key and copy it to shared_keys
+#define SHARED_KEYS_NONE UINT32_MAX
+
+void shared_keys_free(Shared_Keys *shared_keys)
+{
+    if (shared_keys->keys != NULL) {
+        crypto_memzero(shared_keys->keys, shared_keys->capacity * sizeof(Shared_Key));
+    }
+
+    free(shared_keys->keys);
+    free(shared_keys->buckets);
+    memset(shared_keys, 0, sizeof(Shared_Keys));
+}
+
+int shared_keys_set_capacity(Shared_Keys *shared_keys, uint32_t capacity)
+{
+    uint32_t size = 1;
+
+    while (size < capacity && size < (1U << 31)) {
+        size <<= 1;
+    }
+
+    Shared_Key *keys = (Shared_Key *)calloc(size, sizeof(Shared_Key));
+    uint32_t *buckets = (uint32_t *)malloc(size * sizeof(uint32_t));
+
+    if (keys == NULL || buckets == NULL) {
+        free(keys);
+        free(buckets);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < size; ++i) {
+        buckets[i] = SHARED_KEYS_NONE;
+    }
+
+    const uint64_t hits = shared_keys->hits;
+    const uint64_t misses = shared_keys->misses;
+    shared_keys_free(shared_keys);
+
+    shared_keys->keys = keys;
+    shared_keys->buckets = buckets;
+    shared_keys->capacity = size;
+    shared_keys->hash_seed = random_64b();
+    shared_keys->lru_first = SHARED_KEYS_NONE;
+    shared_keys->lru_last = SHARED_KEYS_NONE;
+    shared_keys->hits = hits;
+    shared_keys->misses = misses;
+    return 0;
+}
+
+/* Hash of the whole public key, seeded so that peers can't pick keys that
+ * all land in the same bucket.
  */
-void get_shared_key(Shared_Keys *shared_keys, uint8_t *shared_key, const uint8_t *secret_key, const uint8_t *public_key)
+static uint32_t shared_keys_bucket(const Shared_Keys *shared_keys, const uint8_t *public_key)
 {
-    uint32_t num = ~0;
-    uint32_t curr = 0;
+    uint64_t hash = shared_keys->hash_seed;
 
-    for (uint32_t i = 0; i < MAX_KEYS_PER_SLOT; ++i) {
-        int index = public_key[30] * MAX_KEYS_PER_SLOT + i;
-        Shared_Key *key = &shared_keys->keys[index];
+    for (uint32_t i = 0; i < CRYPTO_PUBLIC_KEY_SIZE; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, public_key + i, sizeof(word));
+        hash = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+        hash ^= hash >> 29;
+    }
 
-        if (key->stored) {
-            if (id_equal(public_key, key->public_key)) {
-                memcpy(shared_key, key->shared_key, CRYPTO_SHARED_KEY_SIZE);
-                ++key->times_requested;
-                key->time_last_requested = unix_time();
-                return;
-            }
+    return (uint32_t)(hash >> 32) & (shared_keys->capacity - 1);
+}
 
-            if (num != 0) {
-                if (is_timeout(key->time_last_requested, KEYS_TIMEOUT)) {
-                    num = 0;
-                    curr = index;
-                } else if (num > key->times_requested) {
-                    num = key->times_requested;
-                    curr = index;
-                }
-            }
-        } else if (num != 0) {
-            num = 0;
-            curr = index;
+static void shared_keys_lru_unlink(Shared_Keys *shared_keys, uint32_t index)
+{
+    Shared_Key *key = &shared_keys->keys[index];
+
+    if (key->lru_prev != SHARED_KEYS_NONE) {
+        shared_keys->keys[key->lru_prev].lru_next = key->lru_next;
+    } else {
+        shared_keys->lru_first = key->lru_next;
+    }
+
+    if (key->lru_next != SHARED_KEYS_NONE) {
+        shared_keys->keys[key->lru_next].lru_prev = key->lru_prev;
+    } else {
+        shared_keys->lru_last = key->lru_prev;
+    }
+}
+
+static void shared_keys_lru_push_first(Shared_Keys *shared_keys, uint32_t index)
+{
+    Shared_Key *key = &shared_keys->keys[index];
+    key->lru_prev = SHARED_KEYS_NONE;
+    key->lru_next = shared_keys->lru_first;
+
+    if (shared_keys->lru_first != SHARED_KEYS_NONE) {
+        shared_keys->keys[shared_keys->lru_first].lru_prev = index;
+    } else {
+        shared_keys->lru_last = index;
+    }
+
+    shared_keys->lru_first = index;
+}
+
+/* Remove the key at index from its hash bucket. */
+static void shared_keys_bucket_unlink(Shared_Keys *shared_keys, uint32_t index)
+{
+    uint32_t *next = &shared_keys->buckets[shared_keys_bucket(shared_keys, shared_keys->keys[index].public_key)];
+
+    while (*next != SHARED_KEYS_NONE) {
+        if (*next == index) {
+            *next = shared_keys->keys[index].hash_next;
+            return;
         }
+
+        next = &shared_keys->keys[*next].hash_next;
     }
+}
 
-    encrypt_precompute(public_key, secret_key, shared_key);
+/* return index of public_key in bucket, or SHARED_KEYS_NONE if it isn't there. */
+static uint32_t shared_keys_find(const Shared_Keys *shared_keys, uint32_t bucket, const uint8_t *public_key)
+{
+    uint32_t index = shared_keys->buckets[bucket];
+
+    while (index != SHARED_KEYS_NONE && !id_equal(public_key, shared_keys->keys[index].public_key)) {
+        index = shared_keys->keys[index].hash_next;
+    }
+
+    return index;
+}
+
+static void shared_keys_touch(Shared_Keys *shared_keys, uint32_t index)
+{
+    Shared_Key *key = &shared_keys->keys[index];
+    ++key->times_requested;
+    key->time_last_requested = unix_time();
 
-    if (num != (uint32_t)~0) {
-        Shared_Key *key = &shared_keys->keys[curr];
-        key->stored = 1;
-        key->times_requested = 1;
-        memcpy(key->public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
-        memcpy(key->shared_key, shared_key, CRYPTO_SHARED_KEY_SIZE);
-        key->time_last_requested = unix_time();
+    if (shared_keys->lru_first != index) {
+        shared_keys_lru_unlink(shared_keys, index);
+        shared_keys_lru_push_first(shared_keys, index);
     }
 }
 
+/* Copy the shared key for public_key from shared_keys into shared_key.
+ *
+ * return -1 if it is not in shared_keys.
+ * return 0 on success.
+ */
+int shared_keys_lookup(Shared_Keys *shared_keys, uint8_t *shared_key, const uint8_t *public_key)
+{
+    if (shared_keys->keys == NULL && shared_keys_set_capacity(shared_keys, SHARED_KEYS_DEFAULT_CAPACITY) == -1) {
+        ++shared_keys->misses;
+        return -1;
+    }
+
+    const uint32_t index = shared_keys_find(shared_keys, shared_keys_bucket(shared_keys, public_key), public_key);
+
+    if (index == SHARED_KEYS_NONE) {
+        ++shared_keys->misses;
+        return -1;
+    }
+
+    memcpy(shared_key, shared_keys->keys[index].shared_key, CRYPTO_SHARED_KEY_SIZE);
+    shared_keys_touch(shared_keys, index);
+    ++shared_keys->hits;
+    return 0;
+}
+
+/* Store shared_key for public_key in shared_keys, replacing the least recently
+ * requested key if shared_keys is full.
+ */
+void shared_keys_add(Shared_Keys *shared_keys, const uint8_t *public_key, const uint8_t *shared_key)
+{
+    if (shared_keys->keys == NULL) {
+        return;
+    }
+
+    const uint32_t bucket = shared_keys_bucket(shared_keys, public_key);
+    uint32_t index = shared_keys_find(shared_keys, bucket, public_key);
+
+    if (index != SHARED_KEYS_NONE) {
+        shared_keys_touch(shared_keys, index);
+        return;
+    }
+
+    if (shared_keys->num_keys < shared_keys->capacity) {
+        index = shared_keys->num_keys;
+        ++shared_keys->num_keys;
+    } else {
+        index = shared_keys->lru_last;
+        shared_keys_bucket_unlink(shared_keys, index);
+        shared_keys_lru_unlink(shared_keys, index);
+    }
+
+    Shared_Key *key = &shared_keys->keys[index];
+    key->times_requested = 1;
+    memcpy(key->public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    memcpy(key->shared_key, shared_key, CRYPTO_SHARED_KEY_SIZE);
+    key->time_last_requested = unix_time();
+    key->hash_next = shared_keys->buckets[bucket];
+    shared_keys->buckets[bucket] = index;
+    shared_keys_lru_push_first(shared_keys, index);
+}
+
+/* Shared key generations are costly, it is therefor smart to store commonly used
+ * ones so that they can re used later without being computed again.
+ *
+ * If shared key is already in shared_keys, copy it to shared_key.
+ * else generate it into shared_key and copy it to shared_keys, replacing the
+ * least recently requested key if shared_keys is full.
+ */
+void get_shared_key(Shared_Keys *shared_keys, uint8_t *shared_key, const uint8_t *secret_key, const uint8_t *public_key)
+{
+    if (shared_keys_lookup(shared_keys, shared_key, public_key) == 0) {
+        return;
+    }
+
+    encrypt_precompute(public_key, secret_key, shared_key);
+    shared_keys_add(shared_keys, public_key, shared_key);
+}
+
 /* Copy shared_key to encrypt/decrypt DHT packet from public_key into shared_key
  * for packets that we receive.
  */
@@ -544,6 +709,34 @@ static uint32_t index_of_node_pk(const Node_format *array, uint32_t size, const
     INDEX_OF_PK
 }
 
+/* return the index of the k-bucket of close_clientlist that public_key belongs in. */
+static unsigned int close_bucket_index(const DHT *dht, const uint8_t *public_key)
+{
+    const unsigned int index = bit_by_bit_cmp(public_key, dht->self_public_key);
+
+    if (index >= LCLIENT_LENGTH) {
+        return LCLIENT_LENGTH - 1;
+    }
+
+    return index;
+}
+
+/* Find index of public_key in close_clientlist, only looking in its k-bucket.
+ *
+ * return index or UINT32_MAX if not found.
+ */
+static uint32_t index_of_close_pk(const DHT *dht, const uint8_t *public_key)
+{
+    const uint32_t bucket_start = close_bucket_index(dht, public_key) * LCLIENT_NODES;
+    const uint32_t index = index_of_client_pk(dht->close_clientlist + bucket_start, LCLIENT_NODES, public_key);
+
+    if (index == UINT32_MAX) {
+        return UINT32_MAX;
+    }
+
+    return bucket_start + index;
+}
+
 /* Find index of Client_data with ip_port equal to param ip_port.
  *
  * return index or UINT32_MAX if not found.
@@ -647,6 +840,29 @@ static int client_or_ip_port_in_list(Logger *log, Client_data *list, uint16_t le
     return 1;
 }
 
+/* client_or_ip_port_in_list for the close list. A public key can only take
+ * over the entry of another one with the same ip_port if both belong in the
+ * same k-bucket. Otherwise the old entry is dropped and 0 is returned so that
+ * the new key gets added to its own bucket.
+ */
+static int client_or_ip_port_in_close_list(DHT *dht, const uint8_t *public_key, IP_Port ip_port)
+{
+    const uint32_t bucket_start = close_bucket_index(dht, public_key) * LCLIENT_NODES;
+
+    if (client_or_ip_port_in_list(dht->log, dht->close_clientlist + bucket_start, LCLIENT_NODES, public_key, ip_port)) {
+        return 1;
+    }
+
+    const uint32_t index = index_of_client_ip_port(dht->close_clientlist, LCLIENT_LIST, &ip_port);
+
+    if (index != UINT32_MAX) {
+        LOGGER_DEBUG(dht->log, "coipicl[%u]: dropping public_key of other k-bucket", index);
+        memset(&dht->close_clientlist[index], 0, sizeof(Client_data));
+    }
+
+    return 0;
+}
+
 /* Add node to the node list making sure only the nodes closest to cmp_pk are in the list.
  */
 bool add_to_list(Node_format *nodes_list, unsigned int length, const uint8_t *pk, IP_Port ip_port,
@@ -745,6 +961,34 @@ static void get_close_nodes_inner(const uint8_t *public_key, Node_format *nodes_
     *num_nodes_ptr = num_nodes;
 }
 
+/* Add the nodes of the close list closest to public_key to nodes_list.
+ *
+ * The k-buckets are visited in order of distance to public_key: the bucket
+ * public_key would be in first, then all buckets above it, whose nodes share
+ * exactly as many leading bits with public_key as we do, then the buckets
+ * below it, nearest first. Every node in a later group is further away than
+ * any node in an earlier one, so the search stops once nodes_list is full.
+ */
+static void get_close_nodes_close_list(const DHT *dht, const uint8_t *public_key, Node_format *nodes_list,
+                                       Family sa_family, uint32_t *num_nodes_ptr, uint8_t is_LAN)
+{
+    const unsigned int bucket = close_bucket_index(dht, public_key);
+    const Client_data *close_list = dht->close_clientlist;
+
+    get_close_nodes_inner(public_key, nodes_list, sa_family, close_list + bucket * LCLIENT_NODES, LCLIENT_NODES,
+                          num_nodes_ptr, is_LAN, 0);
+
+    if (*num_nodes_ptr < MAX_SENT_NODES) {
+        get_close_nodes_inner(public_key, nodes_list, sa_family, close_list + (bucket + 1) * LCLIENT_NODES,
+                              (LCLIENT_LENGTH - (bucket + 1)) * LCLIENT_NODES, num_nodes_ptr, is_LAN, 0);
+    }
+
+    for (unsigned int i = bucket; i > 0 && *num_nodes_ptr < MAX_SENT_NODES; --i) {
+        get_close_nodes_inner(public_key, nodes_list, sa_family, close_list + (i - 1) * LCLIENT_NODES, LCLIENT_NODES,
+                              num_nodes_ptr, is_LAN, 0);
+    }
+}
+
 /* Find MAX_SENT_NODES nodes closest to the public_key for the send nodes request:
  * put them in the nodes_list and return how many were found.
  *
@@ -757,8 +1001,7 @@ static int get_somewhat_close_nodes(const DHT *dht, const uint8_t *public_key, N
                                     Family sa_family, uint8_t is_LAN, uint8_t want_good)
 {
     uint32_t num_nodes = 0;
-    get_close_nodes_inner(public_key, nodes_list, sa_family,
-                          dht->close_clientlist, LCLIENT_LIST, &num_nodes, is_LAN, 0);
+    get_close_nodes_close_list(dht, public_key, nodes_list, sa_family, &num_nodes, is_LAN);
 
     /* TODO(irungentoo): uncomment this when hardening is added to close friend clients */
 #if 0
@@ -787,61 +1030,56 @@ int get_close_nodes(const DHT *dht, const uint8_t *public_key, Node_format *node
     return get_somewhat_close_nodes(dht, public_key, nodes_list, sa_family, is_LAN, want_good);
 }
 
-typedef struct {
-    const uint8_t *base_public_key;
-    Client_data entry;
-} DHT_Cmp_data;
+/* Sort key of a Client_data, computed once per entry by sort_client_list. */
+typedef struct DHT_Sort_Key {
+    /* 0 if both addresses timed out, 1 if neither passed the hardening tests, 2 otherwise. */
+    uint8_t rank;
+    /* public_key XOR the key we sort by, so a larger distance is further away. */
+    uint8_t distance[CRYPTO_PUBLIC_KEY_SIZE];
+    uint32_t index;
+} DHT_Sort_Key;
 
-static int cmp_dht_entry(const void *a, const void *b)
-{
-    DHT_Cmp_data cmp1, cmp2;
-    memcpy(&cmp1, a, sizeof(DHT_Cmp_data));
-    memcpy(&cmp2, b, sizeof(DHT_Cmp_data));
-    Client_data entry1 = cmp1.entry;
-    Client_data entry2 = cmp2.entry;
-    const uint8_t *cmp_public_key = cmp1.base_public_key;
+/* Lists up to this length are sorted with an insertion sort instead of qsort. */
+#define SORT_INSERTION_MAX 16
 
+static void dht_sort_key(DHT_Sort_Key *key, const Client_data *client, const uint8_t *comp_public_key,
+                         uint32_t index)
+{
 #define ASSOC_TIMEOUT(assoc) is_timeout((assoc).timestamp, BAD_NODE_TIMEOUT)
-
-    bool t1 = ASSOC_TIMEOUT(entry1.assoc4) && ASSOC_TIMEOUT(entry1.assoc6);
-    bool t2 = ASSOC_TIMEOUT(entry2.assoc4) && ASSOC_TIMEOUT(entry2.assoc6);
-
-    if (t1 && t2) {
-        return 0;
-    }
-
-    if (t1) {
-        return -1;
-    }
-
-    if (t2) {
-        return 1;
-    }
-
 #define INCORRECT_HARDENING(assoc) hardening_correct(&(assoc).hardening) != HARDENING_ALL_OK
 
-    t1 = INCORRECT_HARDENING(entry1.assoc4) && INCORRECT_HARDENING(entry1.assoc6);
-    t2 = INCORRECT_HARDENING(entry2.assoc4) && INCORRECT_HARDENING(entry2.assoc6);
-
-    if (t1 && !t2) {
-        return -1;
+    if (ASSOC_TIMEOUT(client->assoc4) && ASSOC_TIMEOUT(client->assoc6)) {
+        key->rank = 0;
+    } else if (INCORRECT_HARDENING(client->assoc4) && INCORRECT_HARDENING(client->assoc6)) {
+        key->rank = 1;
+    } else {
+        key->rank = 2;
     }
 
-    if (!t1 && t2) {
-        return 1;
+    for (size_t i = 0; i < CRYPTO_PUBLIC_KEY_SIZE; ++i) {
+        key->distance[i] = client->public_key[i] ^ comp_public_key[i];
     }
 
-    int close = id_closest(cmp_public_key, entry1.public_key, entry2.public_key);
+    key->index = index;
+}
 
-    if (close == 1) {
-        return 1;
+/* Order in which replace_all wants the list: timed out entries first, then
+ * the ones that failed hardening, each group from furthest to closest.
+ */
+static int cmp_dht_sort_key(const void *a, const void *b)
+{
+    const DHT_Sort_Key *key1 = (const DHT_Sort_Key *)a;
+    const DHT_Sort_Key *key2 = (const DHT_Sort_Key *)b;
+
+    if (key1->rank != key2->rank) {
+        return key1->rank < key2->rank ? -1 : 1;
     }
 
-    if (close == 2) {
-        return -1;
+    if (key1->rank == 0) {
+        return 0;
     }
 
-    return 0;
+    return -memcmp(key1->distance, key2->distance, CRYPTO_PUBLIC_KEY_SIZE);
 }
 
 /* Is it ok to store node with public_key in client.
@@ -856,21 +1094,57 @@ static unsigned int store_node_ok(const Client_data *client, const uint8_t *publ
            id_closest(comp_public_key, client->public_key, public_key) == 2;
 }
 
-static void sort_client_list(Client_data *list, unsigned int length, const uint8_t *comp_public_key)
+/* The sort keys are computed once per entry and the entries themselves are
+ * only moved once, in place.
+ */
+void sort_client_list(Client_data *list, unsigned int length, const uint8_t *comp_public_key)
 {
-    // Pass comp_public_key to qsort with each Client_data entry, so the
-    // comparison function can use it as the base of comparison.
-    VLA(DHT_Cmp_data, cmp_list, length);
+    if (length < 2) {
+        return;
+    }
+
+    VLA(DHT_Sort_Key, keys, length);
 
-    for (uint32_t i = 0; i < length; i++) {
-        cmp_list[i].base_public_key = comp_public_key;
-        cmp_list[i].entry = list[i];
+    for (uint32_t i = 0; i < length; ++i) {
+        dht_sort_key(&keys[i], &list[i], comp_public_key, i);
     }
 
-    qsort(cmp_list, length, sizeof(DHT_Cmp_data), cmp_dht_entry);
+    if (length <= SORT_INSERTION_MAX) {
+        for (uint32_t i = 1; i < length; ++i) {
+            const DHT_Sort_Key key = keys[i];
+            uint32_t j = i;
 
-    for (uint32_t i = 0; i < length; i++) {
-        list[i] = cmp_list[i].entry;
+            while (j > 0 && cmp_dht_sort_key(&keys[j - 1], &key) > 0) {
+                keys[j] = keys[j - 1];
+                --j;
+            }
+
+            keys[j] = key;
+        }
+    } else {
+        qsort(keys, length, sizeof(DHT_Sort_Key), cmp_dht_sort_key);
+    }
+
+    /* keys[i].index is now the entry that belongs at i. Follow each cycle of
+     * that permutation, marking moved slots by pointing them at themselves.
+     */
+    for (uint32_t i = 0; i < length; ++i) {
+        if (keys[i].index == i) {
+            continue;
+        }
+
+        const Client_data temp = list[i];
+        uint32_t j = i;
+
+        while (keys[j].index != i) {
+            const uint32_t from = keys[j].index;
+            list[j] = list[from];
+            keys[j].index = j;
+            j = from;
+        }
+
+        list[j] = temp;
+        keys[j].index = j;
     }
 }
 
@@ -944,15 +1218,9 @@ static int replace_all(Client_data    *list,
  */
 static int add_to_close(DHT *dht, const uint8_t *public_key, IP_Port ip_port, bool simulate)
 {
-    unsigned int index = bit_by_bit_cmp(public_key, dht->self_public_key);
-
-    if (index >= LCLIENT_LENGTH) {
-        index = LCLIENT_LENGTH - 1;
-    }
+    const unsigned int index = close_bucket_index(dht, public_key);
 
     for (uint32_t i = 0; i < LCLIENT_NODES; ++i) {
-        /* TODO(iphydf): write bounds checking test to catch the case that
-         * index is left as >= LCLIENT_LENGTH */
         Client_data *client = &dht->close_clientlist[(index * LCLIENT_NODES) + i];
 
         if (!is_timeout(client->assoc4.timestamp, BAD_NODE_TIMEOUT) ||
@@ -997,12 +1265,7 @@ static bool is_pk_in_client_list(Client_data *list, unsigned int client_list_len
 
 static bool is_pk_in_close_list(DHT *dht, const uint8_t *public_key, IP_Port ip_port)
 {
-    unsigned int index = bit_by_bit_cmp(public_key, dht->self_public_key);
-
-    if (index >= LCLIENT_LENGTH) {
-        index = LCLIENT_LENGTH - 1;
-    }
-
+    const unsigned int index = close_bucket_index(dht, public_key);
     return is_pk_in_client_list(dht->close_clientlist + index * LCLIENT_NODES, LCLIENT_NODES, public_key, ip_port);
 }
 
@@ -1087,8 +1350,7 @@ uint32_t addto_lists(DHT *dht, IP_Port ip_port, const uint8_t *public_key)
     /* NOTE: Current behavior if there are two clients with the same id is
      * to replace the first ip by the second.
      */
-    const bool in_close_list = client_or_ip_port_in_list(dht->log, dht->close_clientlist,
-                               LCLIENT_LIST, public_key, ip_port);
+    const bool in_close_list = client_or_ip_port_in_close_list(dht, public_key, ip_port);
 
     /* add_to_close should be called only if !in_list (don't extract to variable) */
     if (in_close_list || add_to_close(dht, public_key, ip_port, 0)) {
@@ -1165,7 +1427,8 @@ static void returnedip_ports(DHT *dht, IP_Port ip_port, const uint8_t *public_ke
     }
 
     if (id_equal(public_key, dht->self_public_key)) {
-        update_client_data(dht->close_clientlist, LCLIENT_LIST, ip_port, nodepublic_key);
+        const uint32_t bucket_start = close_bucket_index(dht, nodepublic_key) * LCLIENT_NODES;
+        update_client_data(dht->close_clientlist + bucket_start, LCLIENT_NODES, ip_port, nodepublic_key);
         return;
     }
 
@@ -1743,20 +2006,20 @@ int DHT_bootstrap_from_address(DHT *dht, const char *address, uint8_t ipv6enable
  */
 int route_packet(const DHT *dht, const uint8_t *public_key, const uint8_t *packet, uint16_t length)
 {
-    for (uint32_t i = 0; i < LCLIENT_LIST; ++i) {
-        if (id_equal(public_key, dht->close_clientlist[i].public_key)) {
-            const Client_data *client = &dht->close_clientlist[i];
-            const IPPTsPng *assocs[ASSOC_COUNT] = { &client->assoc6, &client->assoc4 };
+    const uint32_t index = index_of_close_pk(dht, public_key);
 
-            for (size_t j = 0; j < ASSOC_COUNT; j++) {
-                const IPPTsPng *assoc = assocs[j];
+    if (index == UINT32_MAX) {
+        return -1;
+    }
 
-                if (ip_isset(&assoc->ip_port.ip)) {
-                    return sendpacket(dht->net, assoc->ip_port, packet, length);
-                }
-            }
+    const Client_data *client = &dht->close_clientlist[index];
+    const IPPTsPng *assocs[ASSOC_COUNT] = { &client->assoc6, &client->assoc4 };
 
-            break;
+    for (size_t j = 0; j < ASSOC_COUNT; j++) {
+        const IPPTsPng *assoc = assocs[j];
+
+        if (ip_isset(&assoc->ip_port.ip)) {
+            return sendpacket(dht->net, assoc->ip_port, packet, length);
         }
     }
 
@@ -2229,21 +2492,20 @@ static int send_hardening_getnode_res(const DHT *dht, const Node_format *sendto,
     return sendpacket(dht->net, sendto->ip_port, packet, len);
 }
 
-/* TODO(irungentoo): improve */
 static IPPTsPng *get_closelist_IPPTsPng(DHT *dht, const uint8_t *public_key, Family sa_family)
 {
-    for (uint32_t i = 0; i < LCLIENT_LIST; ++i) {
-        if (!id_equal(dht->close_clientlist[i].public_key, public_key)) {
-            continue;
-        }
+    const uint32_t index = index_of_close_pk(dht, public_key);
 
-        if (sa_family == AF_INET) {
-            return &dht->close_clientlist[i].assoc4;
-        }
+    if (index == UINT32_MAX) {
+        return NULL;
+    }
 
-        if (sa_family == AF_INET6) {
-            return &dht->close_clientlist[i].assoc6;
-        }
+    if (sa_family == AF_INET) {
+        return &dht->close_clientlist[index].assoc4;
+    }
+
+    if (sa_family == AF_INET6) {
+        return &dht->close_clientlist[index].assoc6;
     }
 
     return NULL;
@@ -2593,8 +2855,8 @@ DHT *new_DHT(Logger *log, Networking_Core *net, bool holepunching_enabled)
     new_symmetric_key(dht->secret_symmetric_key);
     crypto_new_keypair(dht->self_public_key, dht->self_secret_key);
 
-    ping_array_init(&dht->dht_ping_array, DHT_PING_ARRAY_SIZE, PING_TIMEOUT);
-    ping_array_init(&dht->dht_harden_ping_array, DHT_PING_ARRAY_SIZE, PING_TIMEOUT);
+    ping_array_init(&dht->dht_ping_array, DHT_PING_ARRAY_SIZE, PING_TIMEOUT, sizeof(Node_format));
+    ping_array_init(&dht->dht_harden_ping_array, DHT_PING_ARRAY_SIZE, PING_TIMEOUT, sizeof(Node_format) * 2);
 
     for (uint32_t i = 0; i < DHT_FAKE_FRIEND_NUMBER; ++i) {
         uint8_t random_key_bytes[CRYPTO_PUBLIC_KEY_SIZE];
@@ -2640,6 +2902,8 @@ void kill_DHT(DHT *dht)
     ping_array_free_all(&dht->dht_ping_array);
     ping_array_free_all(&dht->dht_harden_ping_array);
     kill_ping(dht->ping);
+    shared_keys_free(&dht->shared_keys_recv);
+    shared_keys_free(&dht->shared_keys_sent);
     free(dht->friends_list);
     free(dht->loaded_nodes_list);
     free(dht);
@@ -34,6 +34,11 @@
 /* Maximum number of clients stored per friend. */
 #define MAX_FRIEND_CLIENTS 8
 
+/* The close list is a routing table of LCLIENT_LENGTH k-buckets of
+ * LCLIENT_NODES clients each. Bucket i holds clients whose public key has
+ * exactly i leading bits in common with ours (bucket LCLIENT_LENGTH - 1 holds
+ * those with at least that many).
+ */
 #define LCLIENT_NODES (MAX_FRIEND_CLIENTS)
 #define LCLIENT_LENGTH 128
 
@@ -212,21 +217,61 @@ int unpack_nodes(Node_format *nodes, uint16_t max_num_nodes, uint16_t *processed
 
 /*----------------------------------------------------------------------------------*/
 /* struct to store some shared keys so we don't have to regenerate them for each request. */
-#define MAX_KEYS_PER_SLOT 4
-#define KEYS_TIMEOUT 600
+
+/* Number of keys cached by a Shared_Keys unless set with shared_keys_set_capacity. */
+#define SHARED_KEYS_DEFAULT_CAPACITY 1024
 
 typedef struct {
     uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
     uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
     uint32_t times_requested;
-    uint8_t  stored; /* 0 if not, 1 if is */
     uint64_t time_last_requested;
+
+    uint32_t hash_next; /* Next key in the same hash bucket. */
+    uint32_t lru_prev; /* More recently requested key. */
+    uint32_t lru_next; /* Less recently requested key. */
 } Shared_Key;
 
+/* Hash table of shared keys with least recently used eviction.
+ * A zeroed Shared_Keys is valid and allocates its storage on first use.
+ */
 typedef struct {
-    Shared_Key keys[256 * MAX_KEYS_PER_SLOT];
+    Shared_Key *keys;
+    uint32_t *buckets;
+    uint32_t capacity; /* Always a power of 2. */
+    uint32_t num_keys;
+    uint64_t hash_seed;
+
+    uint32_t lru_first; /* Most recently requested key. */
+    uint32_t lru_last; /* Least recently requested key, evicted first. */
+
+    uint64_t hits;
+    uint64_t misses;
 } Shared_Keys;
 
+/* Set the maximum number of keys cached in shared_keys and clear it.
+ * capacity is rounded up to a power of 2.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+int shared_keys_set_capacity(Shared_Keys *shared_keys, uint32_t capacity);
+
+/* Free the memory used by shared_keys and clear it. */
+void shared_keys_free(Shared_Keys *shared_keys);
+
+/* Copy the shared key for public_key from shared_keys into shared_key.
+ *
+ * return -1 if it is not in shared_keys.
+ * return 0 on success.
+ */
+int shared_keys_lookup(Shared_Keys *shared_keys, uint8_t *shared_key, const uint8_t *public_key);
+
+/* Store shared_key for public_key in shared_keys, replacing the least recently
+ * requested key if shared_keys is full.
+ */
+void shared_keys_add(Shared_Keys *shared_keys, const uint8_t *public_key, const uint8_t *shared_key);
+
 /*----------------------------------------------------------------------------------*/
 
 typedef int (*cryptopacket_handler_callback)(void *object, IP_Port ip_port, const uint8_t *source_pubkey,
@@ -457,4 +502,10 @@ int DHT_non_lan_connected(const DHT *dht);
 
 uint32_t addto_lists(DHT *dht, IP_Port ip_port, const uint8_t *public_key);
 
+/* Sort list so that the entries most worth replacing come first: timed out
+ * ones, then those that failed the hardening tests, then the others, each
+ * group from furthest to closest to comp_public_key.
+ */
+void sort_client_list(Client_data *list, unsigned int length, const uint8_t *comp_public_key);
+
 #endif
@@ -35,8 +35,9 @@
 
 
 static void set_friend_status(Messenger *m, int32_t friendnumber, uint8_t status, void *userdata);
-static int write_cryptpacket_id(const Messenger *m, int32_t friendnumber, uint8_t packet_id, const uint8_t *data,
-                                uint32_t length, uint8_t congestion_control);
+static void do_friend_timer(void *object, uint32_t number, void *userdata);
+static int write_cryptpacket_id(const Messenger *m, int32_t friendnumber, uint8_t stream, uint8_t packet_id,
+                                const uint8_t *data, uint32_t length, uint8_t congestion_control);
 
 // friend_not_valid determines if the friendnumber passed is valid in the Messenger object
 static uint8_t friend_not_valid(const Messenger *m, int32_t friendnumber)
@@ -77,17 +78,7 @@ static int realloc_friendlist(Messenger *m, uint32_t num)
  */
 int32_t getfriend_id(const Messenger *m, const uint8_t *real_pk)
 {
-    uint32_t i;
-
-    for (i = 0; i < m->numfriends; ++i) {
-        if (m->friendlist[i].status > 0) {
-            if (id_equal(real_pk, m->friendlist[i].real_pk)) {
-                return i;
-            }
-        }
-    }
-
-    return -1;
+    return pk_index_get(&m->friend_index, real_pk);
 }
 
 /* Copies the public key associated to that friend id into real_pk buffer.
@@ -186,10 +177,23 @@ static int32_t init_new_friend(Messenger *m, const uint8_t *real_pk, uint8_t sta
         return FAERR_NOMEM;
     }
 
-    uint32_t i;
+    /* If no friend was deleted, the only free slot is the one at the end. */
+    uint32_t i = m->friend_index.size == m->numfriends ? m->numfriends : 0;
 
-    for (i = 0; i <= m->numfriends; ++i) {
+    for (; i <= m->numfriends; ++i) {
         if (m->friendlist[i].status == NOFRIEND) {
+            if (pk_index_set(&m->friend_index, real_pk, i) == -1) {
+                kill_friend_connection(m->fr_c, friendcon_id);
+                return FAERR_NOMEM;
+            }
+
+            /* Setting the timer here makes room for it, so waking the friend later can't fail. */
+            if (timer_set(m->friend_timers, i, 0) == -1) {
+                pk_index_remove(&m->friend_index, real_pk);
+                kill_friend_connection(m->fr_c, friendcon_id);
+                return FAERR_NOMEM;
+            }
+
             m->friendlist[i].status = status;
             m->friendlist[i].friendcon_id = friendcon_id;
             m->friendlist[i].friendrequest_lastsent = 0;
@@ -422,6 +426,8 @@ int m_delfriend(Messenger *m, int32_t friendnumber)
     }
 
     kill_friend_connection(m->fr_c, m->friendlist[friendnumber].friendcon_id);
+    pk_index_remove(&m->friend_index, m->friendlist[friendnumber].real_pk);
+    timer_stop(m->friend_timers, friendnumber);
     memset(&(m->friendlist[friendnumber]), 0, sizeof(Friend));
     uint32_t i;
 
@@ -510,8 +516,8 @@ int m_send_message_generic(Messenger *m, int32_t friendnumber, uint8_t type, con
         memcpy(packet + 1, message, length);
     }
 
-    int64_t packet_num = write_cryptpacket(m->net_crypto, friend_connection_crypt_connection_id(m->fr_c,
-                                           m->friendlist[friendnumber].friendcon_id), packet, length + 1, 0);
+    int64_t packet_num = write_cryptpacket_stream(m->net_crypto, friend_connection_crypt_connection_id(m->fr_c,
+                         m->friendlist[friendnumber].friendcon_id), MESSENGER_STREAM_MESSAGES, packet, length + 1, 0);
 
     if (packet_num == -1) {
         return -4;
@@ -537,7 +543,7 @@ static int m_sendname(const Messenger *m, int32_t friendnumber, const uint8_t *n
         return 0;
     }
 
-    return write_cryptpacket_id(m, friendnumber, PACKET_ID_NICKNAME, name, length, 0);
+    return write_cryptpacket_id(m, friendnumber, MESSENGER_STREAM_DEFAULT, PACKET_ID_NICKNAME, name, length, 0);
 }
 
 /* Set the name and name_length of a friend.
@@ -785,18 +791,20 @@ int m_get_istyping(const Messenger *m, int32_t friendnumber)
 
 static int send_statusmessage(const Messenger *m, int32_t friendnumber, const uint8_t *status, uint16_t length)
 {
-    return write_cryptpacket_id(m, friendnumber, PACKET_ID_STATUSMESSAGE, status, length, 0);
+    return write_cryptpacket_id(m, friendnumber, MESSENGER_STREAM_DEFAULT, PACKET_ID_STATUSMESSAGE, status, length, 0);
 }
 
 static int send_userstatus(const Messenger *m, int32_t friendnumber, uint8_t status)
 {
-    return write_cryptpacket_id(m, friendnumber, PACKET_ID_USERSTATUS, &status, sizeof(status), 0);
+    return write_cryptpacket_id(m, friendnumber, MESSENGER_STREAM_DEFAULT, PACKET_ID_USERSTATUS, &status,
+                                sizeof(status), 0);
 }
 
 static int send_user_istyping(const Messenger *m, int32_t friendnumber, uint8_t is_typing)
 {
     uint8_t typing = is_typing;
-    return write_cryptpacket_id(m, friendnumber, PACKET_ID_TYPING, &typing, sizeof(typing), 0);
+    return write_cryptpacket_id(m, friendnumber, MESSENGER_STREAM_DEFAULT, PACKET_ID_TYPING, &typing, sizeof(typing),
+                                0);
 }
 
 static int set_friend_statusmessage(const Messenger *m, int32_t friendnumber, const uint8_t *status, uint16_t length)
@@ -951,10 +959,11 @@ void set_friend_status(Messenger *m, int32_t friendnumber, uint8_t status, void
 {
     check_friend_connectionstatus(m, friendnumber, status, userdata);
     m->friendlist[friendnumber].status = status;
+    timer_set(m->friend_timers, friendnumber, 0);
 }
 
-static int write_cryptpacket_id(const Messenger *m, int32_t friendnumber, uint8_t packet_id, const uint8_t *data,
-                                uint32_t length, uint8_t congestion_control)
+static int write_cryptpacket_id(const Messenger *m, int32_t friendnumber, uint8_t stream, uint8_t packet_id,
+                                const uint8_t *data, uint32_t length, uint8_t congestion_control)
 {
     if (friend_not_valid(m, friendnumber)) {
         return 0;
@@ -971,8 +980,9 @@ static int write_cryptpacket_id(const Messenger *m, int32_t friendnumber, uint8_
         memcpy(packet + 1, data, length);
     }
 
-    return write_cryptpacket(m->net_crypto, friend_connection_crypt_connection_id(m->fr_c,
-                             m->friendlist[friendnumber].friendcon_id), packet, length + 1, congestion_control) != -1;
+    return write_cryptpacket_stream(m->net_crypto, friend_connection_crypt_connection_id(m->fr_c,
+                                    m->friendlist[friendnumber].friendcon_id), stream, packet, length + 1,
+                                    congestion_control) != -1;
 }
 
 /**********CONFERENCES************/
@@ -996,7 +1006,8 @@ void m_callback_conference_invite(Messenger *m, void (*function)(Messenger *m, u
  */
 int send_conference_invite_packet(const Messenger *m, int32_t friendnumber, const uint8_t *data, uint16_t length)
 {
-    return write_cryptpacket_id(m, friendnumber, PACKET_ID_INVITE_CONFERENCE, data, length, 0);
+    return write_cryptpacket_id(m, friendnumber, MESSENGER_STREAM_DEFAULT, PACKET_ID_INVITE_CONFERENCE, data, length,
+                                0);
 }
 
 /****************FILE SENDING*****************/
@@ -1122,7 +1133,8 @@ static int file_sendrequest(const Messenger *m, int32_t friendnumber, uint8_t fi
         memcpy(packet + 1 + sizeof(file_type) + sizeof(filesize) + FILE_ID_LENGTH, filename, filename_length);
     }
 
-    return write_cryptpacket_id(m, friendnumber, PACKET_ID_FILE_SENDREQUEST, packet, SIZEOF_VLA(packet), 0);
+    return write_cryptpacket_id(m, friendnumber, MESSENGER_STREAM_FILES, PACKET_ID_FILE_SENDREQUEST, packet,
+                                SIZEOF_VLA(packet), 0);
 }
 
 /* Send a file send request.
@@ -1199,7 +1211,8 @@ static int send_file_control_packet(const Messenger *m, int32_t friendnumber, ui
         memcpy(packet + 3, data, data_length);
     }
 
-    return write_cryptpacket_id(m, friendnumber, PACKET_ID_FILE_CONTROL, packet, SIZEOF_VLA(packet), 0);
+    return write_cryptpacket_id(m, friendnumber, MESSENGER_STREAM_FILES, PACKET_ID_FILE_CONTROL, packet,
+                                SIZEOF_VLA(packet), 0);
 }
 
 /* Send a file control request.
@@ -1385,8 +1398,9 @@ static int64_t send_file_data_packet(const Messenger *m, int32_t friendnumber, u
         memcpy(packet + 2, data, length);
     }
 
-    return write_cryptpacket(m->net_crypto, friend_connection_crypt_connection_id(m->fr_c,
-                             m->friendlist[friendnumber].friendcon_id), packet, SIZEOF_VLA(packet), 1);
+    return write_cryptpacket_stream(m->net_crypto, friend_connection_crypt_connection_id(m->fr_c,
+                                    m->friendlist[friendnumber].friendcon_id), MESSENGER_STREAM_FILES, packet,
+                                    SIZEOF_VLA(packet), 1);
 }
 
 #define MAX_FILE_DATA_SIZE (MAX_CRYPTO_DATA_SIZE - 2)
@@ -1754,7 +1768,7 @@ void m_callback_msi_packet(Messenger *m, void (*function)(Messenger *m, uint32_t
  */
 int m_msi_packet(const Messenger *m, int32_t friendnumber, const uint8_t *data, uint16_t length)
 {
-    return write_cryptpacket_id(m, friendnumber, PACKET_ID_MSI, data, length, 0);
+    return write_cryptpacket_id(m, friendnumber, MESSENGER_STREAM_DEFAULT, PACKET_ID_MSI, data, length, 0);
 }
 
 static int m_handle_custom_lossy_packet(void *object, int friend_num, const uint8_t *packet, uint16_t length,
@@ -1893,8 +1907,9 @@ int send_custom_lossless_packet(const Messenger *m, int32_t friendnumber, const
         return -4;
     }
 
-    if (write_cryptpacket(m->net_crypto, friend_connection_crypt_connection_id(m->fr_c,
-                          m->friendlist[friendnumber].friendcon_id), data, length, 1) == -1) {
+    if (write_cryptpacket_stream(m->net_crypto, friend_connection_crypt_connection_id(m->fr_c,
+                                 m->friendlist[friendnumber].friendcon_id), MESSENGER_STREAM_CUSTOM, data, length,
+                                 1) == -1) {
         return -5;
     }
 
@@ -1946,7 +1961,7 @@ Messenger *new_messenger(Messenger_Options *options, unsigned int *error)
 
     if (options->udp_disabled) {
         /* this is the easiest way to completely disable UDP without changing too much code. */
-        m->net = (Networking_Core *)calloc(1, sizeof(Networking_Core));
+        m->net = new_networking_no_udp(log);
     } else {
         IP ip;
         ip_init(&ip, options->ipv6enabled);
@@ -1963,6 +1978,11 @@ Messenger *new_messenger(Messenger_Options *options, unsigned int *error)
         return NULL;
     }
 
+    if (options->crypto_worker_threads != 0 && !options->udp_disabled
+            && networking_set_crypto_workers(m->net, options->crypto_worker_threads) == -1) {
+        LOGGER_WARNING(m->log, "failed to start %u crypto worker threads", options->crypto_worker_threads);
+    }
+
     m->dht = new_DHT(m->log, m->net, options->hole_punching_enabled);
 
     if (m->dht == NULL) {
@@ -1980,12 +2000,23 @@ Messenger *new_messenger(Messenger_Options *options, unsigned int *error)
         return NULL;
     }
 
+    net_crypto_set_congestion_algorithm(m->net_crypto, options->congestion_algorithm);
+
+    /* File transfers get what custom packets leave of the pacer, and both
+     * what messages and the rest leave. */
+    net_crypto_set_stream_weight(m->net_crypto, MESSENGER_STREAM_DEFAULT, 4);
+    net_crypto_set_stream_weight(m->net_crypto, MESSENGER_STREAM_MESSAGES, 4);
+    net_crypto_set_stream_weight(m->net_crypto, MESSENGER_STREAM_CUSTOM, 2);
+    net_crypto_set_stream_weight(m->net_crypto, MESSENGER_STREAM_FILES, 1);
+
     m->onion = new_onion(m->dht);
     m->onion_a = new_onion_announce(m->dht);
     m->onion_c =  new_onion_client(m->net_crypto);
     m->fr_c = new_friend_connections(m->onion_c, options->local_discovery_enabled);
+    m->friend_timers = new_timer_wheel(&do_friend_timer, m, unix_time());
 
-    if (!(m->onion && m->onion_a && m->onion_c)) {
+    if (!(m->onion && m->onion_a && m->onion_c && m->fr_c && m->friend_timers)) {
+        kill_timer_wheel(m->friend_timers);
         kill_friend_connections(m->fr_c);
         kill_onion(m->onion);
         kill_onion_announce(m->onion_a);
@@ -2001,6 +2032,7 @@ Messenger *new_messenger(Messenger_Options *options, unsigned int *error)
         m->tcp_server = new_TCP_server(options->ipv6enabled, 1, &options->tcp_server_port, m->dht->self_secret_key, m->onion);
 
         if (m->tcp_server == NULL) {
+            kill_timer_wheel(m->friend_timers);
             kill_friend_connections(m->fr_c);
             kill_onion(m->onion);
             kill_onion_announce(m->onion_a);
@@ -2058,6 +2090,8 @@ void kill_messenger(Messenger *m)
     }
 
     logger_kill(m->log);
+    pk_index_free(&m->friend_index);
+    kill_timer_wheel(m->friend_timers);
     free(m->friendlist);
     free(m);
 }
@@ -2396,67 +2430,98 @@ static int m_handle_packet(void *object, int i, const uint8_t *temp, uint16_t le
     return 0;
 }
 
-static void do_friends(Messenger *m, void *userdata)
+/* Periodic work of a friend, called when its timer expires. */
+static void do_friend_timer(void *object, uint32_t number, void *userdata)
 {
-    uint32_t i;
+    Messenger *m = (Messenger *)object;
+    const uint32_t i = number;
+
+    if (friend_not_valid(m, i)) {
+        return;
+    }
+
     uint64_t temp_time = unix_time();
 
-    for (i = 0; i < m->numfriends; ++i) {
-        if (m->friendlist[i].status == FRIEND_ADDED) {
-            int fr = send_friend_request_packet(m->fr_c, m->friendlist[i].friendcon_id, m->friendlist[i].friendrequest_nospam,
-                                                m->friendlist[i].info,
-                                                m->friendlist[i].info_size);
+    if (m->friendlist[i].status == FRIEND_ADDED) {
+        int fr = send_friend_request_packet(m->fr_c, m->friendlist[i].friendcon_id, m->friendlist[i].friendrequest_nospam,
+                                            m->friendlist[i].info,
+                                            m->friendlist[i].info_size);
 
-            if (fr >= 0) {
-                set_friend_status(m, i, FRIEND_REQUESTED, userdata);
-                m->friendlist[i].friendrequest_lastsent = temp_time;
-            }
+        if (fr >= 0) {
+            set_friend_status(m, i, FRIEND_REQUESTED, userdata);
+            m->friendlist[i].friendrequest_lastsent = temp_time;
         }
+    }
+
+    if (m->friendlist[i].status == FRIEND_REQUESTED) {
+        /* If we didn't connect to friend after successfully sending him a friend request the request is deemed
+         * unsuccessful so we set the status back to FRIEND_ADDED and try again.
+         */
+        check_friend_request_timed_out(m, i, temp_time, userdata);
+    }
 
-        if (m->friendlist[i].status == FRIEND_REQUESTED
-                || m->friendlist[i].status == FRIEND_CONFIRMED) { /* friend is not online. */
-            if (m->friendlist[i].status == FRIEND_REQUESTED) {
-                /* If we didn't connect to friend after successfully sending him a friend request the request is deemed
-                 * unsuccessful so we set the status back to FRIEND_ADDED and try again.
-                 */
-                check_friend_request_timed_out(m, i, temp_time, userdata);
+    if (m->friendlist[i].status == FRIEND_ONLINE) { /* friend is online. */
+        if (m->friendlist[i].name_sent == 0) {
+            if (m_sendname(m, i, m->name, m->name_length)) {
+                m->friendlist[i].name_sent = 1;
             }
         }
 
-        if (m->friendlist[i].status == FRIEND_ONLINE) { /* friend is online. */
-            if (m->friendlist[i].name_sent == 0) {
-                if (m_sendname(m, i, m->name, m->name_length)) {
-                    m->friendlist[i].name_sent = 1;
-                }
+        if (m->friendlist[i].statusmessage_sent == 0) {
+            if (send_statusmessage(m, i, m->statusmessage, m->statusmessage_length)) {
+                m->friendlist[i].statusmessage_sent = 1;
             }
+        }
 
-            if (m->friendlist[i].statusmessage_sent == 0) {
-                if (send_statusmessage(m, i, m->statusmessage, m->statusmessage_length)) {
-                    m->friendlist[i].statusmessage_sent = 1;
-                }
+        if (m->friendlist[i].userstatus_sent == 0) {
+            if (send_userstatus(m, i, m->userstatus)) {
+                m->friendlist[i].userstatus_sent = 1;
             }
+        }
 
-            if (m->friendlist[i].userstatus_sent == 0) {
-                if (send_userstatus(m, i, m->userstatus)) {
-                    m->friendlist[i].userstatus_sent = 1;
-                }
+        if (m->friendlist[i].user_istyping_sent == 0) {
+            if (send_user_istyping(m, i, m->friendlist[i].user_istyping)) {
+                m->friendlist[i].user_istyping_sent = 1;
             }
+        }
 
-            if (m->friendlist[i].user_istyping_sent == 0) {
-                if (send_user_istyping(m, i, m->friendlist[i].user_istyping)) {
-                    m->friendlist[i].user_istyping_sent = 1;
-                }
-            }
+        check_friend_tcp_udp(m, i, userdata);
+        do_receipts(m, i, userdata);
+        do_reqchunk_filecb(m, i, userdata);
 
-            check_friend_tcp_udp(m, i, userdata);
-            do_receipts(m, i, userdata);
-            do_reqchunk_filecb(m, i, userdata);
+        m->friendlist[i].last_seen_time = (uint64_t) time(NULL);
+    }
 
-            m->friendlist[i].last_seen_time = (uint64_t) time(NULL);
-        }
+    /* The callbacks above may have deleted the friend. */
+    if (friend_not_valid(m, i)) {
+        return;
+    }
+
+    /* Friends that are added or online are looked at every time, friends
+     * that were sent a request when it times out, and confirmed friends only
+     * when set_friend_status wakes them. */
+    switch (m->friendlist[i].status) {
+        case FRIEND_ADDED:
+        case FRIEND_ONLINE:
+            timer_set(m->friend_timers, i, 0);
+            break;
+
+        case FRIEND_REQUESTED:
+            timer_set(m->friend_timers, i,
+                      m->friendlist[i].friendrequest_lastsent + m->friendlist[i].friendrequest_timeout + 1);
+            break;
+
+        default:
+            timer_stop(m->friend_timers, i);
+            break;
     }
 }
 
+static void do_friends(Messenger *m, void *userdata)
+{
+    do_timer_wheel(m->friend_timers, unix_time(), userdata);
+}
+
 static void connection_status_cb(Messenger *m, void *userdata)
 {
     unsigned int conn_status = onion_connection_status(m->onion_c);
@@ -2510,6 +2575,50 @@ uint32_t messenger_run_interval(const Messenger *m)
     return crypto_interval;
 }
 
+int messenger_poll_fd(Messenger *m)
+{
+    const int poll_fd = networking_poll_fd(m->net);
+
+    if (poll_fd == -1) {
+        return -1;
+    }
+
+    tcp_connections_set_poll_fd(m->net_crypto->tcp_c, poll_fd);
+
+    if (m->tcp_server && tcp_server_poll_fd(m->tcp_server) != -1) {
+        net_poll_fd_add(poll_fd, tcp_server_poll_fd(m->tcp_server), 0);
+    }
+
+    return poll_fd;
+}
+
+uint32_t messenger_poll_timeout(const Messenger *m)
+{
+    if (!m->has_added_relays) {
+        return 0;
+    }
+
+    const uint32_t crypto_interval = crypto_run_interval(m->net_crypto);
+
+    if (crypto_interval <= MIN_RUN_INTERVAL) {
+        return crypto_interval;
+    }
+
+    /* Without epoll the TCP server has to be polled like before. */
+    if (!m->net->has_poll_fd || (m->tcp_server && tcp_server_poll_fd(m->tcp_server) == -1)) {
+        return MIN_RUN_INTERVAL;
+    }
+
+    /* Sending files is driven by do_messenger() asking for chunks. */
+    for (uint32_t i = 0; i < m->numfriends; ++i) {
+        if (m->friendlist[i].status == FRIEND_ONLINE && m->friendlist[i].num_sending_files) {
+            return MIN_RUN_INTERVAL;
+        }
+    }
+
+    return crypto_interval;
+}
+
 /* The main loop that needs to be run at least 20 times per second. */
 void do_messenger(Messenger *m, void *userdata)
 {
@@ -2536,6 +2645,11 @@ void do_messenger(Messenger *m, void *userdata)
 
     unix_time_update();
 
+    networking_poll_fd_clear(m->net);
+
+    /* Collect the UDP packets sent during this iteration and send them all at once at the end. */
+    networking_send_queue_begin(m->net);
+
     if (!m->options.udp_disabled) {
         networking_poll(m->net, userdata);
         do_DHT(m->dht);
@@ -2551,6 +2665,8 @@ void do_messenger(Messenger *m, void *userdata)
     do_friends(m, userdata);
     connection_status_cb(m, userdata);
 
+    networking_send_queue_flush(m->net);
+
     if (unix_time() > m->lastdump + DUMPING_CLIENTS_FRIENDS_EVERY_N_SECONDS) {
         m->lastdump = unix_time();
         uint32_t client, last_pinged;
@@ -69,6 +69,13 @@ enum {
 #define PACKET_ID_LOSSLESS_RANGE_SIZE 32
 #define PACKET_LOSSY_AV_RESERVED 8 /* Number of lossy packet types at start of range reserved for A/V. */
 
+/* The net_crypto streams that lossless packets are sent on, so that a lost
+ * file data packet doesn't hold back the messages sent after it. */
+#define MESSENGER_STREAM_DEFAULT CRYPTO_STREAM_DEFAULT
+#define MESSENGER_STREAM_MESSAGES 1
+#define MESSENGER_STREAM_FILES 2
+#define MESSENGER_STREAM_CUSTOM 3
+
 typedef struct {
     uint8_t ipv6enabled;
     uint8_t udp_disabled;
@@ -78,6 +85,8 @@ typedef struct {
 
     uint8_t hole_punching_enabled;
     bool local_discovery_enabled;
+    uint32_t crypto_worker_threads;
+    Congestion_Algorithm congestion_algorithm;
 
     logger_cb *log_callback;
     void *log_user_data;
@@ -239,6 +248,8 @@ struct Messenger {
 
     Friend *friendlist;
     uint32_t numfriends;
+    PK_Index friend_index; /* Friend numbers by real_pk. */
+    Timer_Wheel *friend_timers; /* When each friend next needs do_friend. */
 
     time_t lastdump;
 
@@ -751,6 +762,18 @@ void do_messenger(Messenger *m, void *userdata);
  */
 uint32_t messenger_run_interval(const Messenger *m);
 
+/* Get a file descriptor that becomes readable when there is network traffic
+ * for do_messenger() to handle, see networking_poll_fd().
+ *
+ * return -1 on failure or if not supported on this platform.
+ */
+int messenger_poll_fd(Messenger *m);
+
+/* Return the time in milliseconds until do_messenger() has work to do that
+ * doesn't start with traffic announced by messenger_poll_fd().
+ */
+uint32_t messenger_poll_timeout(const Messenger *m);
+
 /* SAVING AND LOADING FUNCTIONS: */
 
 /* return size of the messenger data (for saving). */
@@ -33,6 +33,19 @@
 #include <sys/ioctl.h>
 #endif
 
+#if defined(__linux__)
+#define TCP_CLIENT_USE_EPOLL
+#endif
+
+#ifdef TCP_CLIENT_USE_EPOLL
+#include <pthread.h>
+#include <sys/epoll.h>
+
+#ifndef EPOLLRDHUP
+#define EPOLLRDHUP 0x2000
+#endif
+#endif
+
 /* return 1 on success
  * return 0 on failure
  */
@@ -62,16 +75,17 @@ static int proxy_http_generate_connection_request(TCP_Client_Connection *TCP_con
         return 0;
     }
 
+    char request[MAX_PACKET_SIZE];
     const uint16_t port = net_ntohs(TCP_conn->ip_port.port);
-    const int written = snprintf((char *)TCP_conn->last_packet, MAX_PACKET_SIZE, "%s%s:%hu%s%s:%hu%s", one, ip, port, two,
-                                 ip, port, three);
+    const int written = snprintf(request, sizeof(request), "%s%s:%hu%s%s:%hu%s", one, ip, port, two, ip, port, three);
 
     if (written < 0 || MAX_PACKET_SIZE < written) {
         return 0;
     }
 
-    TCP_conn->last_packet_length = written;
-    TCP_conn->last_packet_sent = 0;
+    if (tcp_send_queue_add(&TCP_conn->send_queue, (const uint8_t *)request, written) == -1) {
+        return 0;
+    }
 
     return 1;
 }
@@ -110,12 +124,12 @@ static int proxy_http_read_connection_response(TCP_Client_Connection *TCP_conn)
 
 static void proxy_socks5_generate_handshake(TCP_Client_Connection *TCP_conn)
 {
-    TCP_conn->last_packet[0] = 5; /* SOCKSv5 */
-    TCP_conn->last_packet[1] = 1; /* number of authentication methods supported */
-    TCP_conn->last_packet[2] = 0; /* No authentication */
+    uint8_t packet[3];
+    packet[0] = 5; /* SOCKSv5 */
+    packet[1] = 1; /* number of authentication methods supported */
+    packet[2] = 0; /* No authentication */
 
-    TCP_conn->last_packet_length = 3;
-    TCP_conn->last_packet_sent = 0;
+    tcp_send_queue_add(&TCP_conn->send_queue, packet, sizeof(packet));
 }
 
 /* return 1 on success.
@@ -140,28 +154,28 @@ static int socks5_read_handshake_response(TCP_Client_Connection *TCP_conn)
 
 static void proxy_socks5_generate_connection_request(TCP_Client_Connection *TCP_conn)
 {
-    TCP_conn->last_packet[0] = 5; /* SOCKSv5 */
-    TCP_conn->last_packet[1] = 1; /* command code: establish a TCP/IP stream connection */
-    TCP_conn->last_packet[2] = 0; /* reserved, must be 0 */
+    uint8_t packet[4 + sizeof(IP6) + sizeof(uint16_t)];
+    packet[0] = 5; /* SOCKSv5 */
+    packet[1] = 1; /* command code: establish a TCP/IP stream connection */
+    packet[2] = 0; /* reserved, must be 0 */
     uint16_t length = 3;
 
     if (TCP_conn->ip_port.ip.family == AF_INET) {
-        TCP_conn->last_packet[3] = 1; /* IPv4 address */
+        packet[3] = 1; /* IPv4 address */
         ++length;
-        memcpy(TCP_conn->last_packet + length, TCP_conn->ip_port.ip.ip4.uint8, sizeof(IP4));
+        memcpy(packet + length, TCP_conn->ip_port.ip.ip4.uint8, sizeof(IP4));
         length += sizeof(IP4);
     } else {
-        TCP_conn->last_packet[3] = 4; /* IPv6 address */
+        packet[3] = 4; /* IPv6 address */
         ++length;
-        memcpy(TCP_conn->last_packet + length, TCP_conn->ip_port.ip.ip6.uint8, sizeof(IP6));
+        memcpy(packet + length, TCP_conn->ip_port.ip.ip6.uint8, sizeof(IP6));
         length += sizeof(IP6);
     }
 
-    memcpy(TCP_conn->last_packet + length, &TCP_conn->ip_port.port, sizeof(uint16_t));
+    memcpy(packet + length, &TCP_conn->ip_port.port, sizeof(uint16_t));
     length += sizeof(uint16_t);
 
-    TCP_conn->last_packet_length = length;
-    TCP_conn->last_packet_sent = 0;
+    tcp_send_queue_add(&TCP_conn->send_queue, packet, length);
 }
 
 /* return 1 on success.
@@ -206,18 +220,17 @@ static int generate_handshake(TCP_Client_Connection *TCP_conn)
     crypto_new_keypair(plain, TCP_conn->temp_secret_key);
     random_nonce(TCP_conn->sent_nonce);
     memcpy(plain + CRYPTO_PUBLIC_KEY_SIZE, TCP_conn->sent_nonce, CRYPTO_NONCE_SIZE);
-    memcpy(TCP_conn->last_packet, TCP_conn->self_public_key, CRYPTO_PUBLIC_KEY_SIZE);
-    random_nonce(TCP_conn->last_packet + CRYPTO_PUBLIC_KEY_SIZE);
-    int len = encrypt_data_symmetric(TCP_conn->shared_key, TCP_conn->last_packet + CRYPTO_PUBLIC_KEY_SIZE, plain,
-                                     sizeof(plain), TCP_conn->last_packet + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE);
+    uint8_t packet[TCP_CLIENT_HANDSHAKE_SIZE];
+    memcpy(packet, TCP_conn->self_public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    random_nonce(packet + CRYPTO_PUBLIC_KEY_SIZE);
+    int len = encrypt_data_symmetric(TCP_conn->shared_key, packet + CRYPTO_PUBLIC_KEY_SIZE, plain,
+                                     sizeof(plain), packet + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE);
 
     if (len != sizeof(plain) + CRYPTO_MAC_SIZE) {
         return -1;
     }
 
-    TCP_conn->last_packet_length = CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE + sizeof(plain) + CRYPTO_MAC_SIZE;
-    TCP_conn->last_packet_sent = 0;
-    return 0;
+    return tcp_send_queue_add(&TCP_conn->send_queue, packet, sizeof(packet));
 }
 
 /* data must be of length TCP_SERVER_HANDSHAKE_SIZE
@@ -241,107 +254,12 @@ static int handle_handshake(TCP_Client_Connection *TCP_conn, const uint8_t *data
     return 0;
 }
 
-/* return 0 if pending data was sent completely
- * return -1 if it wasn't
- */
-static int client_send_pending_data_nonpriority(TCP_Client_Connection *con)
-{
-    if (con->last_packet_length == 0) {
-        return 0;
-    }
-
-    uint16_t left = con->last_packet_length - con->last_packet_sent;
-    int len = send(con->sock, (const char *)(con->last_packet + con->last_packet_sent), left, MSG_NOSIGNAL);
-
-    if (len <= 0) {
-        return -1;
-    }
-
-    if (len == left) {
-        con->last_packet_length = 0;
-        con->last_packet_sent = 0;
-        return 0;
-    }
-
-    con->last_packet_sent += len;
-    return -1;
-}
-
 /* return 0 if pending data was sent completely
  * return -1 if it wasn't
  */
 static int client_send_pending_data(TCP_Client_Connection *con)
 {
-    /* finish sending current non-priority packet */
-    if (client_send_pending_data_nonpriority(con) == -1) {
-        return -1;
-    }
-
-    TCP_Priority_List *p = con->priority_queue_start;
-
-    while (p) {
-        uint16_t left = p->size - p->sent;
-        int len = send(con->sock, (const char *)(p->data + p->sent), left, MSG_NOSIGNAL);
-
-        if (len != left) {
-            if (len > 0) {
-                p->sent += len;
-            }
-
-            break;
-        }
-
-        TCP_Priority_List *pp = p;
-        p = p->next;
-        free(pp);
-    }
-
-    con->priority_queue_start = p;
-
-    if (!p) {
-        con->priority_queue_end = NULL;
-        return 0;
-    }
-
-    return -1;
-}
-
-/* return 0 on failure (only if malloc fails)
- * return 1 on success
- */
-static bool client_add_priority(TCP_Client_Connection *con, const uint8_t *packet, uint16_t size, uint16_t sent)
-{
-    TCP_Priority_List *p = con->priority_queue_end;
-    TCP_Priority_List *new_list = (TCP_Priority_List *)malloc(sizeof(TCP_Priority_List) + size);
-
-    if (!new_list) {
-        return 0;
-    }
-
-    new_list->next = NULL;
-    new_list->size = size;
-    new_list->sent = sent;
-    memcpy(new_list->data, packet, size);
-
-    if (p) {
-        p->next = new_list;
-    } else {
-        con->priority_queue_start = new_list;
-    }
-
-    con->priority_queue_end = new_list;
-    return 1;
-}
-
-static void wipe_priority_list(TCP_Client_Connection *con)
-{
-    TCP_Priority_List *p = con->priority_queue_start;
-
-    while (p) {
-        TCP_Priority_List *pp = p;
-        p = p->next;
-        free(pp);
-    }
+    return tcp_send_queue_flush(&con->send_queue, con->sock);
 }
 
 /* return 1 on success.
@@ -355,14 +273,10 @@ static int write_packet_TCP_client_secure_connection(TCP_Client_Connection *con,
         return -1;
     }
 
-    bool sendpriority = 1;
+    client_send_pending_data(con);
 
-    if (client_send_pending_data(con) == -1) {
-        if (priority) {
-            sendpriority = 0;
-        } else {
-            return 0;
-        }
+    if (tcp_send_queue_full(&con->send_queue, priority)) {
+        return 0;
     }
 
     VLA(uint8_t, packet, sizeof(uint16_t) + length + CRYPTO_MAC_SIZE);
@@ -375,37 +289,27 @@ static int write_packet_TCP_client_secure_connection(TCP_Client_Connection *con,
         return -1;
     }
 
-    if (priority) {
-        len = sendpriority ? send(con->sock, (const char *)packet, SIZEOF_VLA(packet), MSG_NOSIGNAL) : 0;
-
-        if (len <= 0) {
-            len = 0;
-        }
+    len = 0;
 
-        increment_nonce(con->sent_nonce);
+    if (con->send_queue.size == 0) {
+        len = send(con->sock, (const char *)packet, SIZEOF_VLA(packet), MSG_NOSIGNAL);
 
         if ((unsigned int)len == SIZEOF_VLA(packet)) {
+            increment_nonce(con->sent_nonce);
             return 1;
         }
 
-        return client_add_priority(con, packet, SIZEOF_VLA(packet), len);
+        if (len < 0) {
+            len = 0;
+        }
     }
 
-    len = send(con->sock, (const char *)packet, SIZEOF_VLA(packet), MSG_NOSIGNAL);
-
-    if (len <= 0) {
-        return 0;
+    if (tcp_send_queue_add(&con->send_queue, packet + len, SIZEOF_VLA(packet) - len) == -1) {
+        /* Nothing was sent yet, so the packet can still be dropped. */
+        return len == 0 ? 0 : -1;
     }
 
     increment_nonce(con->sent_nonce);
-
-    if ((unsigned int)len == SIZEOF_VLA(packet)) {
-        return 1;
-    }
-
-    memcpy(con->last_packet, packet, SIZEOF_VLA(packet));
-    con->last_packet_length = SIZEOF_VLA(packet);
-    con->last_packet_sent = len;
     return 1;
 }
 
@@ -605,6 +509,252 @@ void onion_response_handler(TCP_Client_Connection *con, int (*onion_callback)(vo
     con->onion_callback_object = object;
 }
 
+#define TCP_POLL_NO_SLOT UINT32_MAX
+
+#ifdef TCP_CLIENT_USE_EPOLL
+
+/* One epoll set holds the sockets of every TCP client connection in the
+ * process, whichever instance they belong to. Whoever calls epoll_wait marks
+ * the connections it gets events for as ready and each instance then runs
+ * its own ready connections.
+ *
+ * Connections are referred to by slot and generation rather than by pointer
+ * so that an event for a connection that another thread just killed is
+ * harmless.
+ *
+ * The set and the slots are kept until the process exits once created: a
+ * thread may still be in epoll_wait on the set after the last connection is
+ * removed, and closing it would let that thread drain the events of whatever
+ * epoll set reuses the descriptor.
+ */
+typedef struct TCP_Poll_Slot {
+    uint32_t generation;
+    uint32_t next_free;
+    bool used;
+    bool ready;
+} TCP_Poll_Slot;
+
+static struct {
+    pthread_mutex_t mutex;
+    int efd;
+
+    TCP_Poll_Slot *slots;
+    uint32_t slots_length;
+    uint32_t first_free;
+} tcp_poll = { PTHREAD_MUTEX_INITIALIZER, -1, NULL, 0, TCP_POLL_NO_SLOT };
+
+#define TCP_POLL_MAX_EVENTS 64
+
+static uint64_t tcp_poll_data(uint32_t slot, uint32_t generation)
+{
+    return ((uint64_t)generation << 32) | slot;
+}
+
+/* Add the socket of TCP_connection to the shared epoll set.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int tcp_poll_add(TCP_Client_Connection *TCP_connection)
+{
+    pthread_mutex_lock(&tcp_poll.mutex);
+
+    if (tcp_poll.efd == -1) {
+        tcp_poll.efd = epoll_create(8);
+
+        if (tcp_poll.efd == -1) {
+            pthread_mutex_unlock(&tcp_poll.mutex);
+            return -1;
+        }
+    }
+
+    if (tcp_poll.first_free == TCP_POLL_NO_SLOT) {
+        uint32_t new_length = tcp_poll.slots_length ? tcp_poll.slots_length * 2 : 64;
+        TCP_Poll_Slot *new_slots = (TCP_Poll_Slot *)realloc(tcp_poll.slots, new_length * sizeof(TCP_Poll_Slot));
+
+        if (new_slots == NULL) {
+            pthread_mutex_unlock(&tcp_poll.mutex);
+            return -1;
+        }
+
+        for (uint32_t i = tcp_poll.slots_length; i < new_length; ++i) {
+            new_slots[i].generation = 0;
+            new_slots[i].used = 0;
+            new_slots[i].ready = 0;
+            new_slots[i].next_free = i + 1 < new_length ? i + 1 : TCP_POLL_NO_SLOT;
+        }
+
+        tcp_poll.slots = new_slots;
+        tcp_poll.first_free = tcp_poll.slots_length;
+        tcp_poll.slots_length = new_length;
+    }
+
+    const uint32_t slot = tcp_poll.first_free;
+    TCP_Poll_Slot *poll_slot = &tcp_poll.slots[slot];
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
+    ev.data.u64 = tcp_poll_data(slot, poll_slot->generation);
+
+    if (epoll_ctl(tcp_poll.efd, EPOLL_CTL_ADD, TCP_connection->sock, &ev) == -1) {
+        pthread_mutex_unlock(&tcp_poll.mutex);
+        return -1;
+    }
+
+    tcp_poll.first_free = poll_slot->next_free;
+    poll_slot->used = 1;
+    poll_slot->ready = 0;
+
+    TCP_connection->poll_slot = slot;
+    TCP_connection->poll_generation = poll_slot->generation;
+    TCP_connection->poll_writable = 0;
+
+    pthread_mutex_unlock(&tcp_poll.mutex);
+    return 0;
+}
+
+static void tcp_poll_remove(TCP_Client_Connection *TCP_connection)
+{
+    if (TCP_connection->poll_slot == TCP_POLL_NO_SLOT) {
+        return;
+    }
+
+    pthread_mutex_lock(&tcp_poll.mutex);
+
+    epoll_ctl(tcp_poll.efd, EPOLL_CTL_DEL, TCP_connection->sock, NULL);
+
+    TCP_Poll_Slot *poll_slot = &tcp_poll.slots[TCP_connection->poll_slot];
+    ++poll_slot->generation;
+    poll_slot->used = 0;
+    poll_slot->next_free = tcp_poll.first_free;
+    tcp_poll.first_free = TCP_connection->poll_slot;
+
+    pthread_mutex_unlock(&tcp_poll.mutex);
+    TCP_connection->poll_slot = TCP_POLL_NO_SLOT;
+}
+
+/* Only wait for the socket to become writable while there is data it didn't
+ * take yet: the kernel reports it writable again after every ACK.
+ */
+static void tcp_poll_update(TCP_Client_Connection *TCP_connection)
+{
+    if (TCP_connection->poll_slot == TCP_POLL_NO_SLOT) {
+        return;
+    }
+
+    const bool writable = TCP_connection->send_queue.size != 0;
+
+    if (writable == TCP_connection->poll_writable) {
+        return;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET | EPOLLRDHUP | (writable ? EPOLLOUT : 0);
+    ev.data.u64 = tcp_poll_data(TCP_connection->poll_slot, TCP_connection->poll_generation);
+
+    pthread_mutex_lock(&tcp_poll.mutex);
+
+    if (epoll_ctl(tcp_poll.efd, EPOLL_CTL_MOD, TCP_connection->sock, &ev) == 0) {
+        TCP_connection->poll_writable = writable;
+    }
+
+    pthread_mutex_unlock(&tcp_poll.mutex);
+}
+
+/* return the ready flag of TCP_connection and clear it. */
+static bool tcp_poll_take_ready(TCP_Client_Connection *TCP_connection)
+{
+    if (TCP_connection->poll_slot == TCP_POLL_NO_SLOT) {
+        return 1;
+    }
+
+    pthread_mutex_lock(&tcp_poll.mutex);
+    TCP_Poll_Slot *poll_slot = &tcp_poll.slots[TCP_connection->poll_slot];
+    const bool ready = poll_slot->ready;
+    poll_slot->ready = 0;
+    pthread_mutex_unlock(&tcp_poll.mutex);
+    return ready;
+}
+
+static bool tcp_poll_is_ready(const TCP_Client_Connection *TCP_connection)
+{
+    if (TCP_connection->poll_slot == TCP_POLL_NO_SLOT) {
+        return 1;
+    }
+
+    pthread_mutex_lock(&tcp_poll.mutex);
+    const bool ready = tcp_poll.slots[TCP_connection->poll_slot].ready;
+    pthread_mutex_unlock(&tcp_poll.mutex);
+    return ready;
+}
+
+void poll_TCP_connections(void)
+{
+    pthread_mutex_lock(&tcp_poll.mutex);
+    const int efd = tcp_poll.efd;
+    pthread_mutex_unlock(&tcp_poll.mutex);
+
+    if (efd == -1) {
+        return;
+    }
+
+    struct epoll_event events[TCP_POLL_MAX_EVENTS];
+    int nfds;
+
+    do {
+        nfds = epoll_wait(efd, events, TCP_POLL_MAX_EVENTS, 0);
+
+        if (nfds <= 0) {
+            break;
+        }
+
+        pthread_mutex_lock(&tcp_poll.mutex);
+
+        for (int i = 0; i < nfds; ++i) {
+            const uint32_t slot = (uint32_t)events[i].data.u64;
+            const uint32_t generation = (uint32_t)(events[i].data.u64 >> 32);
+
+            if (slot < tcp_poll.slots_length && tcp_poll.slots[slot].used
+                    && tcp_poll.slots[slot].generation == generation) {
+                tcp_poll.slots[slot].ready = 1;
+            }
+        }
+
+        pthread_mutex_unlock(&tcp_poll.mutex);
+    } while (nfds == TCP_POLL_MAX_EVENTS);
+}
+
+#else
+
+static int tcp_poll_add(TCP_Client_Connection *TCP_connection)
+{
+    return -1;
+}
+
+static void tcp_poll_remove(TCP_Client_Connection *TCP_connection)
+{
+}
+
+static void tcp_poll_update(TCP_Client_Connection *TCP_connection)
+{
+}
+
+static bool tcp_poll_take_ready(TCP_Client_Connection *TCP_connection)
+{
+    return 1;
+}
+
+static bool tcp_poll_is_ready(const TCP_Client_Connection *TCP_connection)
+{
+    return 1;
+}
+
+void poll_TCP_connections(void)
+{
+}
+
+#endif
+
 /* Create new TCP connection to ip_port/public_key
  */
 TCP_Client_Connection *new_TCP_connection(IP_Port ip_port, const uint8_t *public_key, const uint8_t *self_public_key,
@@ -655,6 +805,8 @@ TCP_Client_Connection *new_TCP_connection(IP_Port ip_port, const uint8_t *public
     }
 
     temp->sock = sock;
+    temp->poll_slot = TCP_POLL_NO_SLOT;
+    temp->send_queue.limit = TCP_SEND_QUEUE_LIMIT;
     memcpy(temp->public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
     memcpy(temp->self_public_key, self_public_key, CRYPTO_PUBLIC_KEY_SIZE);
     encrypt_precompute(temp->public_key, self_secret_key, temp->shared_key);
@@ -686,6 +838,9 @@ TCP_Client_Connection *new_TCP_connection(IP_Port ip_port, const uint8_t *public
 
     temp->kill_at = unix_time() + TCP_CONNECTION_TIMEOUT;
 
+    /* Without the shared epoll set the connection is simply run every time. */
+    tcp_poll_add(temp);
+
     return temp;
 }
 
@@ -871,7 +1026,7 @@ static int do_confirmed_TCP(TCP_Client_Connection *conn, void *userdata)
         return 0;
     }
 
-    while ((len = read_packet_TCP_secure_connection(conn->sock, &conn->next_packet_length, conn->shared_key,
+    while ((len = read_packet_TCP_secure_connection(conn->sock, &conn->recv_buffer, conn->shared_key,
                   conn->recv_nonce, packet, sizeof(packet)))) {
         if (len == -1) {
             conn->status = TCP_CLIENT_DISCONNECTED;
@@ -893,6 +1048,9 @@ void do_TCP_connection(TCP_Client_Connection *TCP_connection, void *userdata)
 {
     unix_time_update();
 
+    /* Cleared before reading so that anything arriving from now on sets it again. */
+    tcp_poll_take_ready(TCP_connection);
+
     if (TCP_connection->status == TCP_CLIENT_DISCONNECTED) {
         return;
     }
@@ -973,6 +1131,47 @@ void do_TCP_connection(TCP_Client_Connection *TCP_connection, void *userdata)
     if (TCP_connection->kill_at <= unix_time()) {
         TCP_connection->status = TCP_CLIENT_DISCONNECTED;
     }
+
+    tcp_poll_update(TCP_connection);
+}
+
+/* return 1 if do_TCP_connection has anything to do for TCP_connection. */
+static bool TCP_connection_wants_run(const TCP_Client_Connection *TCP_connection)
+{
+    if (TCP_connection->status != TCP_CLIENT_CONFIRMED) {
+        return 1;
+    }
+
+    if (TCP_connection->kill_at <= unix_time()) {
+        return 1;
+    }
+
+    if (is_timeout(TCP_connection->last_pinged, TCP_PING_FREQUENCY)) {
+        return 1;
+    }
+
+    if (TCP_connection->ping_id && is_timeout(TCP_connection->last_pinged, TCP_PING_TIMEOUT)) {
+        return 1;
+    }
+
+    /* Data queued since the last run: try sending it and start polling for
+     * writability if that doesn't work out.
+     */
+    if (TCP_connection->send_queue.size != 0 && !TCP_connection->poll_writable) {
+        return 1;
+    }
+
+    return tcp_poll_is_ready(TCP_connection);
+}
+
+int do_TCP_connection_if_ready(TCP_Client_Connection *TCP_connection, void *userdata)
+{
+    if (!TCP_connection_wants_run(TCP_connection)) {
+        return 0;
+    }
+
+    do_TCP_connection(TCP_connection, userdata);
+    return 1;
 }
 
 /* Kill the TCP connection
@@ -983,7 +1182,9 @@ void kill_TCP_connection(TCP_Client_Connection *TCP_connection)
         return;
     }
 
-    wipe_priority_list(TCP_connection);
+    tcp_poll_remove(TCP_connection);
+    tcp_send_queue_clear(&TCP_connection->send_queue);
+    wipe_TCP_recv_buffer(&TCP_connection->recv_buffer);
     kill_sock(TCP_connection->sock);
     crypto_memzero(TCP_connection, sizeof(TCP_Client_Connection));
     free(TCP_connection);
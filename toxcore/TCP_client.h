@@ -53,6 +53,10 @@ enum {
 typedef struct  {
     uint8_t status;
     Socket sock;
+    /* Slot of sock in the set of sockets polled by poll_TCP_connections. */
+    uint32_t poll_slot;
+    uint32_t poll_generation;
+    bool poll_writable; /* Whether we are waiting for sock to become writable. */
     uint8_t self_public_key[CRYPTO_PUBLIC_KEY_SIZE]; /* our public key */
     uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE]; /* public key of the server */
     IP_Port ip_port; /* The ip and port of the server */
@@ -60,15 +64,12 @@ typedef struct  {
     uint8_t recv_nonce[CRYPTO_NONCE_SIZE]; /* Nonce of received packets. */
     uint8_t sent_nonce[CRYPTO_NONCE_SIZE]; /* Nonce of sent packets. */
     uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
-    uint16_t next_packet_length;
+    TCP_Recv_Buffer recv_buffer;
 
     uint8_t temp_secret_key[CRYPTO_SECRET_KEY_SIZE];
 
-    uint8_t last_packet[2 + MAX_PACKET_SIZE];
-    uint16_t last_packet_length;
-    uint16_t last_packet_sent;
-
-    TCP_Priority_List *priority_queue_start, *priority_queue_end;
+    /* Also holds the proxy and handshake packets while connecting. */
+    TCP_Send_Queue send_queue;
 
     uint64_t kill_at;
 
@@ -110,6 +111,20 @@ TCP_Client_Connection *new_TCP_connection(IP_Port ip_port, const uint8_t *public
  */
 void do_TCP_connection(TCP_Client_Connection *TCP_connection, void *userdata);
 
+/* Check which TCP connections in this process, of any instance, have sockets
+ * that became readable or writable since they were last run.
+ */
+void poll_TCP_connections(void);
+
+/* Run the TCP connection only if its socket became ready according to
+ * poll_TCP_connections, if it is not confirmed yet or if one of its timers
+ * expired. Where sockets can't be polled the connection is always run.
+ *
+ * return 1 if the connection was run.
+ * return 0 if there was nothing to do.
+ */
+int do_TCP_connection_if_ready(TCP_Client_Connection *TCP_connection, void *userdata);
+
 /* Kill the TCP connection
  */
 void kill_TCP_connection(TCP_Client_Connection *TCP_connection);
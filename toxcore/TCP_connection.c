@@ -40,6 +40,7 @@ struct TCP_Connections {
 
     TCP_Connection_to *connections;
     uint32_t connections_length; /* Length of connections array. */
+    PK_Index connection_index; /* connections_number of each connection by public_key. */
 
     TCP_con *tcp_connections;
     uint32_t tcp_connections_length; /* Length of tcp_connections array. */
@@ -58,6 +59,10 @@ struct TCP_Connections {
 
     bool onion_status;
     uint16_t onion_num_conns;
+
+    /* See tcp_connections_set_poll_fd. */
+    bool has_poll_fd;
+    int poll_fd;
 };
 
 
@@ -130,9 +135,12 @@ static int create_connection(TCP_Connections *tcp_c)
 {
     uint32_t i;
 
-    for (i = 0; i < tcp_c->connections_length; ++i) {
-        if (tcp_c->connections[i].status == TCP_CONN_NONE) {
-            return i;
+    /* If every connection is in the index there are no free slots to reuse. */
+    if (tcp_c->connection_index.size != tcp_c->connections_length) {
+        for (i = 0; i < tcp_c->connections_length; ++i) {
+            if (tcp_c->connections[i].status == TCP_CONN_NONE) {
+                return i;
+            }
         }
     }
 
@@ -190,6 +198,7 @@ static int wipe_connection(TCP_Connections *tcp_c, int connections_number)
     }
 
     uint32_t i;
+    pk_index_remove(&tcp_c->connection_index, tcp_c->connections[connections_number].public_key);
     memset(&(tcp_c->connections[connections_number]), 0 , sizeof(TCP_Connection_to));
 
     for (i = tcp_c->connections_length; i != 0; --i) {
@@ -444,19 +453,7 @@ void set_onion_packet_tcp_connection_callback(TCP_Connections *tcp_c, int (*tcp_
  */
 static int find_tcp_connection_to(TCP_Connections *tcp_c, const uint8_t *public_key)
 {
-    unsigned int i;
-
-    for (i = 0; i < tcp_c->connections_length; ++i) {
-        TCP_Connection_to *con_to = get_connection(tcp_c, i);
-
-        if (con_to) {
-            if (public_key_cmp(con_to->public_key, public_key) == 0) {
-                return i;
-            }
-        }
-    }
-
-    return -1;
+    return pk_index_get(&tcp_c->connection_index, public_key);
 }
 
 /* Find the TCP connection to a relay with relay_pk.
@@ -504,7 +501,8 @@ int new_tcp_connection_to(TCP_Connections *tcp_c, const uint8_t *public_key, int
 
     int connections_number = create_connection(tcp_c);
 
-    if (connections_number == -1) {
+    if (connections_number == -1
+            || pk_index_set(&tcp_c->connection_index, public_key, connections_number) == -1) {
         return -1;
     }
 
@@ -756,6 +754,24 @@ static int kill_tcp_relay_connection(TCP_Connections *tcp_c, int tcp_connections
     return wipe_tcp_connection(tcp_c, tcp_connections_number);
 }
 
+/* Create a new connection to a TCP relay and add its socket to the poll
+ * descriptor, if any.
+ *
+ * return NULL on failure.
+ */
+static TCP_Client_Connection *new_tcp_client_connection(TCP_Connections *tcp_c, IP_Port ip_port,
+        const uint8_t *relay_pk)
+{
+    TCP_Client_Connection *connection = new_TCP_connection(ip_port, relay_pk, tcp_c->self_public_key,
+                                        tcp_c->self_secret_key, &tcp_c->proxy_info);
+
+    if (connection != NULL && tcp_c->has_poll_fd) {
+        net_poll_fd_add(tcp_c->poll_fd, connection->sock, 1);
+    }
+
+    return connection;
+}
+
 static int reconnect_tcp_relay_connection(TCP_Connections *tcp_c, int tcp_connections_number)
 {
     TCP_con *tcp_con = get_tcp_connection(tcp_c, tcp_connections_number);
@@ -772,8 +788,7 @@ static int reconnect_tcp_relay_connection(TCP_Connections *tcp_c, int tcp_connec
     uint8_t relay_pk[CRYPTO_PUBLIC_KEY_SIZE];
     memcpy(relay_pk, tcp_con->connection->public_key, CRYPTO_PUBLIC_KEY_SIZE);
     kill_TCP_connection(tcp_con->connection);
-    tcp_con->connection = new_TCP_connection(ip_port, relay_pk, tcp_c->self_public_key, tcp_c->self_secret_key,
-                          &tcp_c->proxy_info);
+    tcp_con->connection = new_tcp_client_connection(tcp_c, ip_port, relay_pk);
 
     if (!tcp_con->connection) {
         kill_tcp_relay_connection(tcp_c, tcp_connections_number);
@@ -862,8 +877,7 @@ static int unsleep_tcp_relay_connection(TCP_Connections *tcp_c, int tcp_connecti
         return -1;
     }
 
-    tcp_con->connection = new_TCP_connection(tcp_con->ip_port, tcp_con->relay_pk, tcp_c->self_public_key,
-                          tcp_c->self_secret_key, &tcp_c->proxy_info);
+    tcp_con->connection = new_tcp_client_connection(tcp_c, tcp_con->ip_port, tcp_con->relay_pk);
 
     if (!tcp_con->connection) {
         kill_tcp_relay_connection(tcp_c, tcp_connections_number);
@@ -1133,8 +1147,7 @@ static int add_tcp_relay_instance(TCP_Connections *tcp_c, IP_Port ip_port, const
 
     TCP_con *tcp_con = &tcp_c->tcp_connections[tcp_connections_number];
 
-    tcp_con->connection = new_TCP_connection(ip_port, relay_pk, tcp_c->self_public_key, tcp_c->self_secret_key,
-                          &tcp_c->proxy_info);
+    tcp_con->connection = new_tcp_client_connection(tcp_c, ip_port, relay_pk);
 
     if (!tcp_con->connection) {
         return -1;
@@ -1385,22 +1398,38 @@ TCP_Connections *new_tcp_connections(const uint8_t *secret_key, TCP_Proxy_Info *
     return temp;
 }
 
+void tcp_connections_set_poll_fd(TCP_Connections *tcp_c, int poll_fd)
+{
+    tcp_c->poll_fd = poll_fd;
+    tcp_c->has_poll_fd = 1;
+
+    for (uint32_t i = 0; i < tcp_c->tcp_connections_length; ++i) {
+        const TCP_con *tcp_con = get_tcp_connection(tcp_c, i);
+
+        if (tcp_con && tcp_con->connection) {
+            net_poll_fd_add(poll_fd, tcp_con->connection->sock, 1);
+        }
+    }
+}
+
 static void do_tcp_conns(TCP_Connections *tcp_c, void *userdata)
 {
     unsigned int i;
 
+    poll_TCP_connections();
+
     for (i = 0; i < tcp_c->tcp_connections_length; ++i) {
         TCP_con *tcp_con = get_tcp_connection(tcp_c, i);
 
         if (tcp_con) {
             if (tcp_con->status != TCP_CONN_SLEEPING) {
-                do_TCP_connection(tcp_con->connection, userdata);
+                if (do_TCP_connection_if_ready(tcp_con->connection, userdata)) {
+                    /* callbacks can change TCP connection address. */
+                    tcp_con = get_tcp_connection(tcp_c, i);
 
-                /* callbacks can change TCP connection address. */
-                tcp_con = get_tcp_connection(tcp_c, i);
-
-                // Make sure the TCP connection wasn't dropped in any of the callbacks.
-                assert(tcp_con != NULL);
+                    // Make sure the TCP connection wasn't dropped in any of the callbacks.
+                    assert(tcp_con != NULL);
+                }
 
                 if (tcp_con->connection->status == TCP_CLIENT_DISCONNECTED) {
                     if (tcp_con->status == TCP_CONN_CONNECTED) {
@@ -1487,5 +1516,6 @@ void kill_tcp_connections(TCP_Connections *tcp_c)
 
     free(tcp_c->tcp_connections);
     free(tcp_c->connections);
+    pk_index_free(&tcp_c->connection_index);
     free(tcp_c);
 }
@@ -216,6 +216,11 @@ unsigned int tcp_copy_connected_relays(TCP_Connections *tcp_c, Node_format *tcp_
  */
 TCP_Connections *new_tcp_connections(const uint8_t *secret_key, TCP_Proxy_Info *proxy_info);
 
+/* Add the sockets of all current and future relay connections to poll_fd,
+ * a descriptor returned by networking_poll_fd.
+ */
+void tcp_connections_set_poll_fd(TCP_Connections *tcp_c, int poll_fd);
+
 void do_tcp_connections(TCP_Connections *tcp_c, void *userdata);
 void kill_tcp_connections(TCP_Connections *tcp_c);
 
@@ -0,0 +1,258 @@
+/*
+ * Queue of encrypted TCP stream data that could not be sent yet.
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "TCP_send_queue.h"
+
+struct TCP_Send_Chunk {
+    TCP_Send_Chunk *next;
+    uint8_t data[TCP_SEND_CHUNK_SIZE];
+};
+
+static TCP_Send_Chunk *new_chunk(TCP_Send_Pool *pool)
+{
+    TCP_Send_Chunk *chunk;
+
+    if (pool != NULL && pool->free_chunks != NULL) {
+        chunk = pool->free_chunks;
+        pool->free_chunks = chunk->next;
+        --pool->num_free;
+    } else {
+        chunk = (TCP_Send_Chunk *)malloc(sizeof(TCP_Send_Chunk));
+
+        if (chunk == NULL) {
+            return NULL;
+        }
+    }
+
+    chunk->next = NULL;
+    return chunk;
+}
+
+static void free_chunk(TCP_Send_Pool *pool, TCP_Send_Chunk *chunk)
+{
+    if (pool == NULL || pool->num_free >= TCP_SEND_POOL_MAX_FREE) {
+        free(chunk);
+        return;
+    }
+
+    chunk->next = pool->free_chunks;
+    pool->free_chunks = chunk;
+    ++pool->num_free;
+}
+
+/* Free the unused chunks of the pool. All queues using it must be cleared
+ * first.
+ */
+void tcp_send_pool_free(TCP_Send_Pool *pool)
+{
+    while (pool->free_chunks != NULL) {
+        TCP_Send_Chunk *chunk = pool->free_chunks;
+        pool->free_chunks = chunk->next;
+        free(chunk);
+    }
+
+    pool->num_free = 0;
+}
+
+/* Append length bytes of data to the queue.
+ *
+ * return -1 on failure (memory allocation failed).
+ * return 0 on success.
+ */
+int tcp_send_queue_add(TCP_Send_Queue *queue, const uint8_t *data, uint16_t length)
+{
+    /* Get all new chunks first so that a failed allocation leaves the queue
+     * as it was.
+     */
+    const uint16_t room = queue->last == NULL ? 0 : TCP_SEND_CHUNK_SIZE - queue->end;
+    TCP_Send_Chunk *chunks = NULL;
+
+    for (uint32_t needed = length > room ? length - room : 0, got = 0; got < needed; got += TCP_SEND_CHUNK_SIZE) {
+        TCP_Send_Chunk *chunk = new_chunk(queue->pool);
+
+        if (chunk == NULL) {
+            while (chunks != NULL) {
+                TCP_Send_Chunk *next = chunks->next;
+                free_chunk(queue->pool, chunks);
+                chunks = next;
+            }
+
+            return -1;
+        }
+
+        chunk->next = chunks;
+        chunks = chunk;
+    }
+
+    while (length != 0) {
+        if (queue->last == NULL || queue->end == TCP_SEND_CHUNK_SIZE) {
+            TCP_Send_Chunk *chunk = chunks;
+            chunks = chunk->next;
+            chunk->next = NULL;
+
+            if (queue->last == NULL) {
+                queue->first = chunk;
+                queue->start = 0;
+            } else {
+                queue->last->next = chunk;
+            }
+
+            queue->last = chunk;
+            queue->end = 0;
+        }
+
+        uint16_t copy = TCP_SEND_CHUNK_SIZE - queue->end;
+
+        if (copy > length) {
+            copy = length;
+        }
+
+        memcpy(queue->last->data + queue->end, data, copy);
+        queue->end += copy;
+        queue->size += copy;
+        data += copy;
+        length -= copy;
+    }
+
+    return 0;
+}
+
+/* Remove the first sent bytes from the queue. */
+static void consume_queue(TCP_Send_Queue *queue, uint32_t sent)
+{
+    queue->size -= sent;
+
+    while (sent != 0) {
+        const uint16_t in_chunk = (queue->first == queue->last ? queue->end : TCP_SEND_CHUNK_SIZE) - queue->start;
+
+        if (sent < in_chunk) {
+            queue->start += sent;
+            return;
+        }
+
+        sent -= in_chunk;
+        TCP_Send_Chunk *chunk = queue->first;
+        queue->first = chunk->next;
+        queue->start = 0;
+        free_chunk(queue->pool, chunk);
+    }
+
+    if (queue->first == NULL) {
+        queue->last = NULL;
+        queue->end = 0;
+    }
+}
+
+/* Send as much of the queue as the socket takes with a single system call.
+ *
+ * return 0 if the queue is empty afterwards.
+ * return -1 if it isn't.
+ */
+int tcp_send_queue_flush(TCP_Send_Queue *queue, Socket sock)
+{
+    if (queue->size == 0) {
+        return 0;
+    }
+
+#if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
+
+    while (queue->size != 0) {
+        const uint16_t left = (queue->first == queue->last ? queue->end : TCP_SEND_CHUNK_SIZE) - queue->start;
+        const int len = send(sock, (const char *)(queue->first->data + queue->start), left, MSG_NOSIGNAL);
+
+        if (len <= 0) {
+            return -1;
+        }
+
+        consume_queue(queue, len);
+
+        if (len != left) {
+            return -1;
+        }
+    }
+
+    return 0;
+#else
+    struct iovec iov[TCP_SEND_QUEUE_MAX_IOV];
+    const size_t num_iov = tcp_send_queue_iov(queue, iov, TCP_SEND_QUEUE_MAX_IOV);
+
+    /* sendmsg rather than writev, which has no way to pass MSG_NOSIGNAL. */
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = num_iov;
+
+    const ssize_t len = sendmsg(sock, &msg, MSG_NOSIGNAL);
+
+    if (len <= 0) {
+        return -1;
+    }
+
+    consume_queue(queue, len);
+    return queue->size == 0 ? 0 : -1;
+#endif
+}
+
+#if !defined(_WIN32) && !defined(__WIN32__) && !defined (WIN32)
+/* Point up to max_iov entries of iov at the queued data, in order.
+ *
+ * return the number of entries used.
+ */
+size_t tcp_send_queue_iov(const TCP_Send_Queue *queue, struct iovec *iov, size_t max_iov)
+{
+    size_t num_iov = 0;
+
+    for (TCP_Send_Chunk *chunk = queue->first; chunk != NULL && num_iov < max_iov; chunk = chunk->next) {
+        const uint16_t start = chunk == queue->first ? queue->start : 0;
+        const uint16_t end = chunk == queue->last ? queue->end : TCP_SEND_CHUNK_SIZE;
+        iov[num_iov].iov_base = chunk->data + start;
+        iov[num_iov].iov_len = end - start;
+        ++num_iov;
+    }
+
+    return num_iov;
+}
+#endif
+
+/* Remove the first sent bytes from the queue, for data that was sent without
+ * tcp_send_queue_flush.
+ */
+void tcp_send_queue_sent(TCP_Send_Queue *queue, uint32_t sent)
+{
+    consume_queue(queue, sent);
+}
+
+/* return true if no more packets of the given priority should be queued. */
+bool tcp_send_queue_full(const TCP_Send_Queue *queue, bool priority)
+{
+    return queue->size >= (priority ? 2 * (uint64_t)queue->limit : queue->limit);
+}
+
+/* Drop all queued data. */
+void tcp_send_queue_clear(TCP_Send_Queue *queue)
+{
+    consume_queue(queue, queue->size);
+}
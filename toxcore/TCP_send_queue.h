@@ -0,0 +1,108 @@
+/*
+ * Queue of encrypted TCP stream data that could not be sent yet.
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef TCP_SEND_QUEUE_H
+#define TCP_SEND_QUEUE_H
+
+#include "network.h"
+
+#if !defined(_WIN32) && !defined(__WIN32__) && !defined (WIN32)
+#include <sys/uio.h>
+#endif
+
+#if defined(_WIN32) || defined(__WIN32__) || defined(WIN32) || defined(__MACH__)
+#define MSG_NOSIGNAL 0
+#endif
+
+/* Queued data is stored in chunks of this many bytes. */
+#define TCP_SEND_CHUNK_SIZE 4096
+
+/* Maximum number of unused chunks a pool keeps around. */
+#define TCP_SEND_POOL_MAX_FREE 256
+
+/* Maximum number of chunks handed to the kernel in one call. */
+#define TCP_SEND_QUEUE_MAX_IOV 64
+
+typedef struct TCP_Send_Chunk TCP_Send_Chunk;
+
+/* Chunks that are not part of any queue, shared by all queues of a server. */
+typedef struct TCP_Send_Pool {
+    TCP_Send_Chunk *free_chunks;
+    uint32_t num_free;
+} TCP_Send_Pool;
+
+/* The queued bytes are a list of chunks, starting at offset start of the first
+ * chunk and ending at offset end of the last one.
+ */
+typedef struct TCP_Send_Queue {
+    TCP_Send_Pool *pool; /* NULL to allocate chunks with malloc. */
+    TCP_Send_Chunk *first, *last;
+    uint16_t start;
+    uint16_t end;
+    uint32_t size; /* Number of bytes queued. */
+
+    /* Number of bytes above which data packets are refused. Priority packets
+     * may use up to twice as much, so that control packets still get through
+     * to a connection that has fallen behind.
+     */
+    uint32_t limit;
+} TCP_Send_Queue;
+
+/* Free the unused chunks of the pool. All queues using it must be cleared
+ * first.
+ */
+void tcp_send_pool_free(TCP_Send_Pool *pool);
+
+/* Append length bytes of data to the queue.
+ *
+ * return -1 on failure (memory allocation failed).
+ * return 0 on success.
+ */
+int tcp_send_queue_add(TCP_Send_Queue *queue, const uint8_t *data, uint16_t length);
+
+/* Send as much of the queue as the socket takes with a single system call.
+ *
+ * return 0 if the queue is empty afterwards.
+ * return -1 if it isn't.
+ */
+int tcp_send_queue_flush(TCP_Send_Queue *queue, Socket sock);
+
+#if !defined(_WIN32) && !defined(__WIN32__) && !defined (WIN32)
+/* Point up to max_iov entries of iov at the queued data, in order.
+ *
+ * return the number of entries used.
+ */
+size_t tcp_send_queue_iov(const TCP_Send_Queue *queue, struct iovec *iov, size_t max_iov);
+#endif
+
+/* Remove the first sent bytes from the queue, for data that was sent without
+ * tcp_send_queue_flush.
+ */
+void tcp_send_queue_sent(TCP_Send_Queue *queue, uint32_t sent);
+
+/* return true if no more packets of the given priority should be queued. */
+bool tcp_send_queue_full(const TCP_Send_Queue *queue, bool priority);
+
+/* Drop all queued data. */
+void tcp_send_queue_clear(TCP_Send_Queue *queue);
+
+#endif
@@ -27,19 +27,146 @@
 
 #include "TCP_server.h"
 
+#include "TCP_uring.h"
 #include "util.h"
 
 #if !defined(_WIN32) && !defined(__WIN32__) && !defined (WIN32)
 #include <sys/ioctl.h>
 #endif
 
+#ifdef TCP_SERVER_USE_EPOLL
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/eventfd.h>
+
+/* Longest time in milliseconds a worker thread waits for events. */
+#define TCP_SHARD_WAIT 50
+
+/* Most packet data in bytes waiting in the mailbox of a shard. Like a full
+ * send queue, a full mailbox drops the packets that would go over it.
+ */
+#define TCP_SHARD_MAILBOX_LIMIT (256 * MAX_PACKET_SIZE)
+
+/* Handled messages each mailbox keeps to reuse for the next ones. */
+#define TCP_SHARD_MAX_FREE_MESSAGES 64
+
+/* Messages passed between the shards of a server, and from the shards to the
+ * thread calling do_TCP_server. Connections on other shards are addressed by
+ * public key since their index can change at any time.
+ */
+enum {
+    TCP_SHARD_ACCEPT,         /* Take over sock, a freshly accepted socket. */
+    TCP_SHARD_KILL,           /* target_pk connected again on another shard. */
+    TCP_SHARD_LINK,           /* sender_pk wants to link its slot sender_id with target_pk. */
+    TCP_SHARD_LINKED,         /* Slot target_id of target_pk was linked with sender_id. */
+    TCP_SHARD_UNLINK,         /* The link between sender_id and target_id is gone. */
+    TCP_SHARD_DATA,           /* Data packet from the link sender_id to target_id. */
+    TCP_SHARD_OOB,            /* OOB data from sender_pk to target_pk. */
+    TCP_SHARD_ONION_REQUEST,  /* Onion request to send from the main thread. */
+    TCP_SHARD_ONION_RESPONSE, /* Onion response for connection index with identifier. */
+};
+
+typedef struct TCP_Shard_Message TCP_Shard_Message;
+
+struct TCP_Shard_Message {
+    TCP_Shard_Message *next;
+
+    uint8_t type;
+    uint32_t shard; /* Shard that sent the message. */
+    uint8_t sender_pk[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t sender_id;
+    uint8_t target_pk[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t target_id;
+
+    Socket sock;
+    IP_Port source;
+    uint32_t index;
+    uint64_t identifier;
+
+    uint16_t length;
+    uint8_t data[MAX_PACKET_SIZE];
+};
+#endif
+
+#ifdef TCP_SERVER_USE_IO_URING
+#include <errno.h>
+
+/* Submission queue entries of each ring. */
+#define TCP_URING_QUEUE_SIZE 256
+
+/* Operations in flight for a socket, also tagged onto their user_data. */
+#define TCP_URING_RECV 1 /* recv, or accept for a listening socket. */
+#define TCP_URING_SEND 2
+
+/* The operations the kernel runs for a socket refer to this rather than to the
+ * connection, which moves between the queues and the accepted array and may
+ * be killed while they are in flight. It is freed once they all completed.
+ */
+struct TCP_Uring_Socket {
+    TCP_Server *server;
+    Socket sock;
+    uint8_t type; /* TCP_SOCKET_* of the connection, as in the epoll data. */
+    uint32_t index;
+    uint8_t in_flight;
+    bool dead; /* The connection was killed. */
+
+    /* Sockets with data to send are listed until do_TCP_uring sends it. */
+    bool send_listed;
+    TCP_Uring_Socket *next_send;
+
+    /* Data of a killed connection that the kernel may still be reading. */
+    TCP_Send_Queue send_queue;
+};
+#endif
+
 struct TCP_Server {
     Onion *onion;
 
 #ifdef TCP_SERVER_USE_EPOLL
     int efd;
     uint64_t last_run_pinged;
+
+    /* If tcp_server_set_threads was called, each shard is a server of its own
+     * with a thread that runs it. The shards share the listening sockets and
+     * keys of their parent, which only passes on onion requests.
+     */
+    TCP_Server *parent;
+    TCP_Server **shards;
+    uint32_t num_shards;
+    uint32_t next_shard; /* Shard that gets the next accepted socket. */
+
+    pthread_t thread;
+    bool stop;
+
+    pthread_mutex_t mailbox_mutex;
+    TCP_Shard_Message *mailbox_start, *mailbox_end;
+    uint32_t mailbox_bytes; /* Packet data in the mailbox. */
+    TCP_Shard_Message *free_messages;
+    uint32_t num_free_messages;
+    int wake_fd;
+
+    /* unix_time() is only updated by the main thread, so the thread running
+     * a shard keeps the time of its connections here. */
+    uint64_t shard_time;
+
+    /* Shard each public key is connected to. Parent only. */
+    pthread_mutex_t key_shard_mutex;
+    BS_LIST key_shard_list;
+
+#ifdef TCP_SERVER_USE_IO_URING
+    /* If not NULL the sockets are run by do_TCP_uring, efd is unused. */
+    TCP_Uring *uring;
+    bool uring_started;
+    uint32_t uring_in_flight; /* Operations that did not complete yet. */
+    TCP_Uring_Socket *uring_listening;
+    uint32_t num_uring_listening;
+    TCP_Uring_Socket uring_wake;
+    uint64_t uring_wake_count;
+    TCP_Uring_Socket *uring_send_list;
 #endif
+#endif
+    uint32_t shard_number; /* 0 unless this is a shard of a threaded server. */
     Socket *socks_listening;
     unsigned int num_listening_socks;
 
@@ -57,6 +184,10 @@ struct TCP_Server {
     uint64_t counter;
 
     BS_LIST accepted_key_list;
+
+    /* Chunks for the send queues of the accepted connections. */
+    TCP_Send_Pool send_pool;
+    uint32_t send_queue_limit;
 };
 
 const uint8_t *tcp_server_public_key(const TCP_Server *tcp_server)
@@ -69,6 +200,22 @@ size_t tcp_server_listen_count(const TCP_Server *tcp_server)
     return tcp_server->num_listening_socks;
 }
 
+int tcp_server_poll_fd(const TCP_Server *tcp_server)
+{
+#ifdef TCP_SERVER_USE_IO_URING
+
+    if (tcp_server->uring != NULL) {
+        return tcp_uring_fd(tcp_server->uring);
+    }
+
+#endif
+#ifdef TCP_SERVER_USE_EPOLL
+    return tcp_server->efd;
+#else
+    return -1;
+#endif
+}
+
 /* This is needed to compile on Android below API 21
  */
 #ifndef EPOLLRDHUP
@@ -120,6 +267,300 @@ static int get_TCP_connection_index(const TCP_Server *TCP_server, const uint8_t
     return bs_list_find(&TCP_server->accepted_key_list, public_key);
 }
 
+/* return the time in seconds used for the timeouts of the connections of TCP_server. */
+static uint64_t tcp_server_time(const TCP_Server *TCP_server)
+{
+#ifdef TCP_SERVER_USE_EPOLL
+
+    if (TCP_server->parent != NULL) {
+        return TCP_server->shard_time;
+    }
+
+#endif
+    return unix_time();
+}
+
+static bool tcp_server_timeout(const TCP_Server *TCP_server, uint64_t timestamp, uint64_t timeout)
+{
+    return timestamp + timeout <= tcp_server_time(TCP_server);
+}
+
+#ifdef TCP_SERVER_USE_EPOLL
+/* Wake up the thread of shard, which waits on its wake_fd.
+ *
+ * return -1 if the eventfd could not be written.
+ * return 0 on success.
+ */
+static int shard_wake(TCP_Server *shard)
+{
+    const uint64_t one = 1;
+
+    while (write(shard->wake_fd, &one, sizeof(one)) != sizeof(one)) {
+        /* EAGAIN means the counter is about to overflow, so it is set anyway. */
+        if (errno == EAGAIN) {
+            return 0;
+        }
+
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* return a new message of type for the mailbox of to with room for length
+ * bytes of data, reusing one it handled before if it can.
+ * return NULL on failure.
+ */
+static TCP_Shard_Message *new_shard_message(TCP_Server *to, const TCP_Server *from, uint8_t type, uint16_t length)
+{
+    if (length > MAX_PACKET_SIZE) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&to->mailbox_mutex);
+    TCP_Shard_Message *msg = to->free_messages;
+
+    if (msg != NULL) {
+        to->free_messages = msg->next;
+        --to->num_free_messages;
+    }
+
+    pthread_mutex_unlock(&to->mailbox_mutex);
+
+    if (msg == NULL) {
+        msg = (TCP_Shard_Message *)malloc(sizeof(TCP_Shard_Message));
+
+        if (msg == NULL) {
+            return NULL;
+        }
+    }
+
+    memset(msg, 0, offsetof(TCP_Shard_Message, data));
+    msg->type = type;
+    msg->shard = from->shard_number;
+    msg->length = length;
+    return msg;
+}
+
+/* Keep msg for the next new_shard_message to owner, or free it if owner
+ * already keeps enough. owner->mailbox_mutex must be held.
+ */
+static void recycle_shard_message(TCP_Server *owner, TCP_Shard_Message *msg)
+{
+    if (owner->num_free_messages >= TCP_SHARD_MAX_FREE_MESSAGES) {
+        free(msg);
+        return;
+    }
+
+    msg->next = owner->free_messages;
+    owner->free_messages = msg;
+    ++owner->num_free_messages;
+}
+
+/* Queue msg for the thread running to, which keeps it for reuse once handled.
+ * Messages with packet data are dropped while the mailbox is full.
+ *
+ * return true if msg was queued.
+ */
+static bool shard_post(TCP_Server *to, TCP_Shard_Message *msg)
+{
+    pthread_mutex_lock(&to->mailbox_mutex);
+
+    if (msg->length != 0 && to->mailbox_bytes + msg->length > TCP_SHARD_MAILBOX_LIMIT) {
+        recycle_shard_message(to, msg);
+        pthread_mutex_unlock(&to->mailbox_mutex);
+        return false;
+    }
+
+    const bool was_empty = to->mailbox_start == NULL;
+
+    if (was_empty) {
+        to->mailbox_start = msg;
+    } else {
+        to->mailbox_end->next = msg;
+    }
+
+    to->mailbox_end = msg;
+    to->mailbox_bytes += msg->length;
+    pthread_mutex_unlock(&to->mailbox_mutex);
+
+    /* The reader empties the eventfd before it takes the messages, so it only
+     * has to be woken for the first one.
+     */
+    if (was_empty) {
+        shard_wake(to);
+    }
+
+    return true;
+}
+
+/* Send a message about slot con_number of con to the shard the slot is linked
+ * to, or would be linked to for TCP_SHARD_LINK.
+ *
+ * return true if the message was queued.
+ */
+static bool shard_post_link(TCP_Server *TCP_server, uint32_t shard, uint8_t type, const TCP_Secure_Connection *con,
+                            uint8_t con_number, const uint8_t *data, uint16_t length)
+{
+    TCP_Server *to = TCP_server->parent->shards[shard];
+    TCP_Shard_Message *msg = new_shard_message(to, TCP_server, type, length);
+
+    if (msg == NULL) {
+        return false;
+    }
+
+    memcpy(msg->sender_pk, con->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    msg->sender_id = con_number;
+    memcpy(msg->target_pk, con->connections[con_number].public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    msg->target_id = con->connections[con_number].other_id;
+
+    if (length) {
+        memcpy(msg->data, data, length);
+    }
+
+    return shard_post(to, msg);
+}
+
+/* return the shard the connection to public_key is on.
+ * return -1 if there is none.
+ */
+static int key_shard_find(TCP_Server *TCP_server, const uint8_t *public_key)
+{
+    TCP_Server *parent = TCP_server->parent;
+    pthread_mutex_lock(&parent->key_shard_mutex);
+    const int shard = bs_list_find(&parent->key_shard_list, public_key);
+    pthread_mutex_unlock(&parent->key_shard_mutex);
+    return shard;
+}
+
+/* Record that public_key is now connected to the shard TCP_server. An older
+ * connection with the same key on another shard is killed.
+ *
+ * return 0 on failure.
+ * return 1 on success.
+ */
+static int key_shard_add(TCP_Server *TCP_server, const uint8_t *public_key)
+{
+    TCP_Server *parent = TCP_server->parent;
+    pthread_mutex_lock(&parent->key_shard_mutex);
+
+    const int old_shard = bs_list_find(&parent->key_shard_list, public_key);
+
+    if (old_shard != -1) {
+        bs_list_remove(&parent->key_shard_list, public_key, old_shard);
+    }
+
+    const int ret = bs_list_add(&parent->key_shard_list, public_key, TCP_server->shard_number);
+    pthread_mutex_unlock(&parent->key_shard_mutex);
+
+    if (old_shard != -1 && (uint32_t)old_shard != TCP_server->shard_number) {
+        TCP_Shard_Message *msg = new_shard_message(parent->shards[old_shard], TCP_server, TCP_SHARD_KILL, 0);
+
+        if (msg != NULL) {
+            memcpy(msg->target_pk, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+            shard_post(parent->shards[old_shard], msg);
+        }
+    }
+
+    return ret;
+}
+
+/* Forget that public_key is connected to the shard TCP_server, unless it has
+ * connected to another shard since.
+ */
+static void key_shard_remove(TCP_Server *TCP_server, const uint8_t *public_key)
+{
+    TCP_Server *parent = TCP_server->parent;
+    pthread_mutex_lock(&parent->key_shard_mutex);
+    bs_list_remove(&parent->key_shard_list, public_key, TCP_server->shard_number);
+    pthread_mutex_unlock(&parent->key_shard_mutex);
+}
+#endif
+
+/* Add room for more slots to the connections array of con.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int grow_connections(TCP_Secure_Connection *con)
+{
+    if (con->num_connections == NUM_CLIENT_CONNECTIONS) {
+        return -1;
+    }
+
+    uint32_t num = con->num_connections ? con->num_connections * 2 : 4;
+
+    if (num > NUM_CLIENT_CONNECTIONS) {
+        num = NUM_CLIENT_CONNECTIONS;
+    }
+
+    TCP_Route *connections = (TCP_Route *)realloc(con->connections, num * sizeof(TCP_Route));
+
+    if (connections == NULL) {
+        return -1;
+    }
+
+    memset(connections + con->num_connections, 0, (num - con->num_connections) * sizeof(TCP_Route));
+    con->connections = connections;
+    con->num_connections = num;
+    return 0;
+}
+
+/* Free the connections array of con. */
+static void wipe_connections(TCP_Secure_Connection *con)
+{
+    free(con->connections);
+    con->connections = NULL;
+    con->num_connections = 0;
+}
+
+#ifdef TCP_SERVER_USE_IO_URING
+/* Free ts if it is no longer used. */
+static void uring_socket_release(TCP_Uring_Socket *ts)
+{
+    if (ts->dead && ts->in_flight == 0 && !ts->send_listed) {
+        tcp_send_queue_clear(&ts->send_queue);
+        free(ts);
+    }
+}
+
+/* Have the queued data of the connection of ts sent by do_TCP_uring. */
+static void uring_send_later(TCP_Uring_Socket *ts)
+{
+    if (ts->send_listed) {
+        return;
+    }
+
+    ts->send_listed = true;
+    ts->next_send = ts->server->uring_send_list;
+    ts->server->uring_send_list = ts;
+}
+
+/* Detach con, which is being killed, from the operations in flight for its
+ * socket. They still complete later, so ts is freed then.
+ */
+static void uring_detach(TCP_Secure_Connection *con)
+{
+    TCP_Uring_Socket *ts = con->uring;
+
+    if (ts == NULL) {
+        return;
+    }
+
+    con->uring = NULL;
+    ts->dead = true;
+
+    if (ts->in_flight & TCP_URING_SEND) {
+        ts->send_queue = con->send_queue;
+        memset(&con->send_queue, 0, sizeof(TCP_Send_Queue));
+    }
+
+    /* Closing the socket would not end the recv in flight. */
+    shutdown(con->sock, SHUT_RDWR);
+}
+#endif
 
 static int kill_accepted(TCP_Server *TCP_server, int index);
 
@@ -163,12 +604,23 @@ static int add_accepted(TCP_Server *TCP_server, const TCP_Secure_Connection *con
         return -1;
     }
 
+#ifdef TCP_SERVER_USE_EPOLL
+
+    if (TCP_server->parent != NULL && !key_shard_add(TCP_server, con->public_key)) {
+        bs_list_remove(&TCP_server->accepted_key_list, con->public_key, index);
+        return -1;
+    }
+
+#endif
+
     memcpy(&TCP_server->accepted_connection_array[index], con, sizeof(TCP_Secure_Connection));
     TCP_server->accepted_connection_array[index].status = TCP_STATUS_CONFIRMED;
     ++TCP_server->num_accepted_connections;
     TCP_server->accepted_connection_array[index].identifier = ++TCP_server->counter;
-    TCP_server->accepted_connection_array[index].last_pinged = unix_time();
+    TCP_server->accepted_connection_array[index].last_pinged = tcp_server_time(TCP_server);
     TCP_server->accepted_connection_array[index].ping_id = 0;
+    TCP_server->accepted_connection_array[index].send_queue.pool = &TCP_server->send_pool;
+    TCP_server->accepted_connection_array[index].send_queue.limit = TCP_server->send_queue_limit;
 
     return index;
 }
@@ -192,6 +644,20 @@ static int del_accepted(TCP_Server *TCP_server, int index)
         return -1;
     }
 
+#ifdef TCP_SERVER_USE_EPOLL
+
+    if (TCP_server->parent != NULL) {
+        key_shard_remove(TCP_server, TCP_server->accepted_connection_array[index].public_key);
+    }
+
+#endif
+#ifdef TCP_SERVER_USE_IO_URING
+    uring_detach(&TCP_server->accepted_connection_array[index]);
+#endif
+
+    tcp_send_queue_clear(&TCP_server->accepted_connection_array[index].send_queue);
+    wipe_TCP_recv_buffer(&TCP_server->accepted_connection_array[index].recv_buffer);
+    wipe_connections(&TCP_server->accepted_connection_array[index]);
     crypto_memzero(&TCP_server->accepted_connection_array[index], sizeof(TCP_Secure_Connection));
     --TCP_server->num_accepted_connections;
 
@@ -273,43 +739,82 @@ int read_TCP_packet(Socket sock, uint8_t *data, uint16_t length)
     return -1;
 }
 
-/* return length of received packet on success.
- * return 0 if could not read any packet.
- * return -1 on failure (connection must be killed).
+/* Receive as much stream data as fits into recv_buffer.
+ *
+ * return 1 if new data was received.
+ * return 0 if not.
+ * return -1 if received data had to be dropped.
  */
-int read_packet_TCP_secure_connection(Socket sock, uint16_t *next_packet_length, const uint8_t *shared_key,
-                                      uint8_t *recv_nonce, uint8_t *data, uint16_t max_len)
+static int recv_TCP_buffer(Socket sock, TCP_Recv_Buffer *recv_buffer)
 {
-    if (*next_packet_length == 0) {
-        uint16_t len = read_TCP_length(sock);
+    if (recv_buffer->drained) {
+        /* The socket was empty after the last recv(), so only try again once
+         * the caller was woken up for it.
+         */
+        recv_buffer->drained = false;
+        return 0;
+    }
 
-        if (len == (uint16_t)~0) {
-            return -1;
-        }
+    if (recv_buffer->data == NULL) {
+        /* Only allocate the buffer once there is something to put in it. */
+        uint8_t data[TCP_RECV_BUFFER_SIZE];
+        const int len = recv(sock, (char *)data, sizeof(data), MSG_NOSIGNAL);
 
-        if (len == 0) {
+        if (len <= 0) {
             return 0;
         }
 
-        *next_packet_length = len;
+        recv_buffer->data = (uint8_t *)malloc(TCP_RECV_BUFFER_SIZE);
+
+        if (recv_buffer->data == NULL) {
+            return -1;
+        }
+
+        memcpy(recv_buffer->data, data, len);
+        recv_buffer->start = 0;
+        recv_buffer->end = len;
+        recv_buffer->drained = len < (int)sizeof(data);
+        return 1;
     }
 
-    if (max_len + CRYPTO_MAC_SIZE < *next_packet_length) {
-        return -1;
+    if (recv_buffer->start != 0) {
+        memmove(recv_buffer->data, recv_buffer->data + recv_buffer->start, recv_buffer->end - recv_buffer->start);
+        recv_buffer->end -= recv_buffer->start;
+        recv_buffer->start = 0;
     }
 
-    VLA(uint8_t, data_encrypted, *next_packet_length);
-    int len_packet = read_TCP_packet(sock, data_encrypted, *next_packet_length);
+    const uint16_t space = TCP_RECV_BUFFER_SIZE - recv_buffer->end;
+    const int len = recv(sock, (char *)(recv_buffer->data + recv_buffer->end), space, MSG_NOSIGNAL);
 
-    if (len_packet != *next_packet_length) {
+    if (len <= 0) {
         return 0;
     }
 
-    *next_packet_length = 0;
+    recv_buffer->end += len;
+    recv_buffer->drained = len < space;
+    return 1;
+}
+
+/* Free the memory of recv_buffer and drop any data in it. */
+void wipe_TCP_recv_buffer(TCP_Recv_Buffer *recv_buffer)
+{
+    free(recv_buffer->data);
+    recv_buffer->data = NULL;
+    recv_buffer->start = 0;
+    recv_buffer->end = 0;
+}
 
-    int len = decrypt_data_symmetric(shared_key, recv_nonce, data_encrypted, len_packet, data);
+/* Decrypt the packet of length bytes with the next nonce into data.
+ *
+ * return length of the plain packet on success.
+ * return -1 on failure.
+ */
+static int decrypt_TCP_packet(const uint8_t *shared_key, uint8_t *recv_nonce, const uint8_t *packet, uint16_t length,
+                              uint8_t *data)
+{
+    int len = decrypt_data_symmetric(shared_key, recv_nonce, packet, length, data);
 
-    if (len + CRYPTO_MAC_SIZE != len_packet) {
+    if (len + CRYPTO_MAC_SIZE != length) {
         return -1;
     }
 
@@ -318,96 +823,195 @@ int read_packet_TCP_secure_connection(Socket sock, uint16_t *next_packet_length,
     return len;
 }
 
-/* return 0 if pending data was sent completely
- * return -1 if it wasn't
+/* Packets of a connection that are decrypted together. */
+#define TCP_DECRYPT_BATCH 8
+
+/* Decrypt the complete packets at the start of the length bytes of stream
+ * data in place, up to TCP_DECRYPT_BATCH of them, with one
+ * decrypt_data_symmetric_batch call.
+ *
+ * return number of bytes of data used and set packets, lengths and count to
+ * the plain packets, which may be none.
+ * return -1 on failure (connection must be killed).
  */
-static int send_pending_data_nonpriority(TCP_Secure_Connection *con)
+static int decrypt_TCP_packets(const uint8_t *shared_key, uint8_t *recv_nonce, uint8_t *data, uint16_t length,
+                               uint8_t **packets, uint16_t *lengths, uint16_t *count)
 {
-    if (con->last_packet_length == 0) {
-        return 0;
+    Crypto_Batch_Entry entries[TCP_DECRYPT_BATCH];
+    uint8_t nonces[TCP_DECRYPT_BATCH][CRYPTO_NONCE_SIZE];
+    uint16_t used = 0;
+    uint16_t i;
+
+    for (i = 0; i < TCP_DECRYPT_BATCH && length - used >= sizeof(uint16_t); ++i) {
+        uint16_t packet_length;
+        memcpy(&packet_length, data + used, sizeof(uint16_t));
+        packet_length = net_ntohs(packet_length);
+
+        if (packet_length > MAX_PACKET_SIZE) {
+            return -1;
+        }
+
+        if (length - used < sizeof(uint16_t) + packet_length) {
+            break;
+        }
+
+        memcpy(nonces[i], recv_nonce, CRYPTO_NONCE_SIZE);
+        increment_nonce(recv_nonce);
+
+        /* The plain text ends up right behind the MAC. */
+        entries[i].shared_key = shared_key;
+        entries[i].nonce = nonces[i];
+        entries[i].encrypted = data + used + sizeof(uint16_t);
+        entries[i].length = packet_length;
+        entries[i].plain = data + used + sizeof(uint16_t) + CRYPTO_MAC_SIZE;
+        used += sizeof(uint16_t) + packet_length;
     }
 
-    uint16_t left = con->last_packet_length - con->last_packet_sent;
-    int len = send(con->sock, (const char *)(con->last_packet + con->last_packet_sent), left, MSG_NOSIGNAL);
+    *count = i;
 
-    if (len <= 0) {
+    if (decrypt_data_symmetric_batch(entries, *count) != *count) {
         return -1;
     }
 
-    if (len == left) {
-        con->last_packet_length = 0;
-        con->last_packet_sent = 0;
-        return 0;
+    for (i = 0; i < *count; ++i) {
+        packets[i] = entries[i].plain;
+        lengths[i] = entries[i].plain_length;
     }
 
-    con->last_packet_sent += len;
-    return -1;
+    return used;
 }
 
-/* return 0 if pending data was sent completely
- * return -1 if it wasn't
+/* Make sure recv_buffer holds a complete packet, receiving more stream data
+ * into it with a single recv() if it does not.
+ *
+ * return 1 if it holds a complete packet.
+ * return 0 if it does not.
+ * return -1 on failure (connection must be killed).
  */
-static int send_pending_data(TCP_Secure_Connection *con)
+static int fill_TCP_recv_buffer(Socket sock, TCP_Recv_Buffer *recv_buffer, uint16_t max_len)
 {
-    /* finish sending current non-priority packet */
-    if (send_pending_data_nonpriority(con) == -1) {
-        return -1;
-    }
+    for (;;) {
+        const uint16_t available = recv_buffer->end - recv_buffer->start;
 
-    TCP_Priority_List *p = con->priority_queue_start;
+        if (available >= sizeof(uint16_t)) {
+            uint16_t packet_length;
+            memcpy(&packet_length, recv_buffer->data + recv_buffer->start, sizeof(uint16_t));
+            packet_length = net_ntohs(packet_length);
 
-    while (p) {
-        uint16_t left = p->size - p->sent;
-        int len = send(con->sock, (const char *)(p->data + p->sent), left, MSG_NOSIGNAL);
-
-        if (len != left) {
-            if (len > 0) {
-                p->sent += len;
+            if (packet_length > MAX_PACKET_SIZE || max_len + CRYPTO_MAC_SIZE < packet_length) {
+                return -1;
             }
 
-            break;
+            if (available >= sizeof(uint16_t) + packet_length) {
+                return 1;
+            }
         }
 
-        TCP_Priority_List *pp = p;
-        p = p->next;
-        free(pp);
-    }
+        const int received = recv_TCP_buffer(sock, recv_buffer);
+
+        if (received == -1) {
+            return -1;
+        }
 
-    con->priority_queue_start = p;
+        if (received == 0) {
+            if (available == 0) {
+                /* Idle connections don't keep a buffer around. */
+                wipe_TCP_recv_buffer(recv_buffer);
+            }
 
-    if (!p) {
-        con->priority_queue_end = NULL;
-        return 0;
+            return 0;
+        }
     }
-
-    return -1;
 }
 
-/* return 0 on failure (only if malloc fails)
- * return 1 on success
+/* Read the next packet of the connection into data, receiving more stream
+ * data into recv_buffer with a single recv() if it does not hold a complete
+ * packet yet.
+ *
+ * return length of received packet on success.
+ * return 0 if could not read any packet.
+ * return -1 on failure (connection must be killed).
  */
-static bool add_priority(TCP_Secure_Connection *con, const uint8_t *packet, uint16_t size, uint16_t sent)
+int read_packet_TCP_secure_connection(Socket sock, TCP_Recv_Buffer *recv_buffer, const uint8_t *shared_key,
+                                      uint8_t *recv_nonce, uint8_t *data, uint16_t max_len)
 {
-    TCP_Priority_List *p = con->priority_queue_end;
-    TCP_Priority_List *new_list = (TCP_Priority_List *)malloc(sizeof(TCP_Priority_List) + size);
+    const int filled = fill_TCP_recv_buffer(sock, recv_buffer, max_len);
 
-    if (!new_list) {
-        return 0;
+    if (filled != 1) {
+        return filled;
     }
 
-    new_list->next = NULL;
-    new_list->size = size;
-    new_list->sent = sent;
-    memcpy(new_list->data, packet, size);
+    uint16_t packet_length;
+    memcpy(&packet_length, recv_buffer->data + recv_buffer->start, sizeof(uint16_t));
+    packet_length = net_ntohs(packet_length);
 
-    if (p) {
-        p->next = new_list;
-    } else {
-        con->priority_queue_start = new_list;
+    const uint8_t *packet = recv_buffer->data + recv_buffer->start + sizeof(uint16_t);
+    recv_buffer->start += sizeof(uint16_t) + packet_length;
+
+    if (recv_buffer->start == recv_buffer->end) {
+        recv_buffer->start = 0;
+        recv_buffer->end = 0;
     }
 
-    con->priority_queue_end = new_list;
-    return 1;
+    return decrypt_TCP_packet(shared_key, recv_nonce, packet, packet_length, data);
+}
+
+/* Like read_packet_TCP_secure_connection, but decrypt all complete packets in
+ * recv_buffer, up to TCP_DECRYPT_BATCH of them, together and in place.
+ *
+ * return number of packets read and set packets and lengths to them. They stay
+ * valid until the next read.
+ * return -1 on failure (connection must be killed).
+ */
+static int read_packets_TCP_secure_connection(Socket sock, TCP_Recv_Buffer *recv_buffer, const uint8_t *shared_key,
+        uint8_t *recv_nonce, uint8_t **packets, uint16_t *lengths)
+{
+    const int filled = fill_TCP_recv_buffer(sock, recv_buffer, MAX_PACKET_SIZE);
+
+    if (filled != 1) {
+        return filled;
+    }
+
+    uint16_t count;
+    const int used = decrypt_TCP_packets(shared_key, recv_nonce, recv_buffer->data + recv_buffer->start,
+                                         recv_buffer->end - recv_buffer->start, packets, lengths, &count);
+
+    if (used == -1) {
+        return -1;
+    }
+
+    recv_buffer->start += used;
+
+    if (recv_buffer->start == recv_buffer->end) {
+        /* The data stays where it is until more is received. */
+        recv_buffer->start = 0;
+        recv_buffer->end = 0;
+    }
+
+    return count;
+}
+
+/* return 0 if pending data was sent completely
+ * return -1 if it wasn't
+ */
+static int send_pending_data(TCP_Secure_Connection *con)
+{
+#ifdef TCP_SERVER_USE_IO_URING
+
+    if (con->uring != NULL) {
+        if (con->send_queue.size == 0) {
+            return 0;
+        }
+
+        if (!(con->uring->in_flight & TCP_URING_SEND)) {
+            uring_send_later(con->uring);
+        }
+
+        return -1;
+    }
+
+#endif
+    return tcp_send_queue_flush(&con->send_queue, con->sock);
 }
 
 /* return 1 on success.
@@ -421,14 +1025,10 @@ static int write_packet_TCP_secure_connection(TCP_Secure_Connection *con, const
         return -1;
     }
 
-    bool sendpriority = 1;
+    send_pending_data(con);
 
-    if (send_pending_data(con) == -1) {
-        if (priority) {
-            sendpriority = 0;
-        } else {
-            return 0;
-        }
+    if (tcp_send_queue_full(&con->send_queue, priority)) {
+        return 0;
     }
 
     VLA(uint8_t, packet, sizeof(uint16_t) + length + CRYPTO_MAC_SIZE);
@@ -441,37 +1041,41 @@ static int write_packet_TCP_secure_connection(TCP_Secure_Connection *con, const
         return -1;
     }
 
-    if (priority) {
-        len = sendpriority ? send(con->sock, (const char *)packet, SIZEOF_VLA(packet), MSG_NOSIGNAL) : 0;
+#ifdef TCP_SERVER_USE_IO_URING
 
-        if (len <= 0) {
-            len = 0;
+    if (con->uring != NULL) {
+        /* Everything is sent in one go by do_TCP_uring. */
+        if (tcp_send_queue_add(&con->send_queue, packet, SIZEOF_VLA(packet)) == -1) {
+            return 0;
         }
 
         increment_nonce(con->sent_nonce);
+        uring_send_later(con->uring);
+        return 1;
+    }
+
+#endif
+    len = 0;
+
+    if (con->send_queue.size == 0) {
+        len = send(con->sock, (const char *)packet, SIZEOF_VLA(packet), MSG_NOSIGNAL);
 
         if ((unsigned int)len == SIZEOF_VLA(packet)) {
+            increment_nonce(con->sent_nonce);
             return 1;
         }
 
-        return add_priority(con, packet, SIZEOF_VLA(packet), len);
+        if (len < 0) {
+            len = 0;
+        }
     }
 
-    len = send(con->sock, (const char *)packet, SIZEOF_VLA(packet), MSG_NOSIGNAL);
-
-    if (len <= 0) {
-        return 0;
+    if (tcp_send_queue_add(&con->send_queue, packet + len, SIZEOF_VLA(packet) - len) == -1) {
+        /* Nothing was sent yet, so the packet can still be dropped. */
+        return len == 0 ? 0 : -1;
     }
 
     increment_nonce(con->sent_nonce);
-
-    if ((unsigned int)len == SIZEOF_VLA(packet)) {
-        return 1;
-    }
-
-    memcpy(con->last_packet, packet, SIZEOF_VLA(packet));
-    con->last_packet_length = SIZEOF_VLA(packet);
-    con->last_packet_sent = len;
     return 1;
 }
 
@@ -479,6 +1083,12 @@ static int write_packet_TCP_secure_connection(TCP_Secure_Connection *con, const
  */
 static void kill_TCP_secure_connection(TCP_Secure_Connection *con)
 {
+#ifdef TCP_SERVER_USE_IO_URING
+    uring_detach(con);
+#endif
+    tcp_send_queue_clear(&con->send_queue);
+    wipe_TCP_recv_buffer(&con->recv_buffer);
+    wipe_connections(con);
     kill_sock(con->sock);
     crypto_memzero(con, sizeof(TCP_Secure_Connection));
 }
@@ -498,7 +1108,7 @@ static int kill_accepted(TCP_Server *TCP_server, int index)
 
     uint32_t i;
 
-    for (i = 0; i < NUM_CLIENT_CONNECTIONS; ++i) {
+    for (i = 0; i < TCP_server->accepted_connection_array[index].num_connections; ++i) {
         rm_connection_index(TCP_server, &TCP_server->accepted_connection_array[index], i);
     }
 
@@ -631,7 +1241,7 @@ static int handle_TCP_routing_req(TCP_Server *TCP_server, uint32_t con_id, const
         return 0;
     }
 
-    for (i = 0; i < NUM_CLIENT_CONNECTIONS; ++i) {
+    for (i = 0; i < con->num_connections; ++i) {
         if (con->connections[i].status != 0) {
             if (public_key_cmp(public_key, con->connections[i].public_key) == 0) {
                 if (send_routing_response(con, i + NUM_RESERVED_PORTS, public_key) == -1) {
@@ -645,6 +1255,10 @@ static int handle_TCP_routing_req(TCP_Server *TCP_server, uint32_t con_id, const
         }
     }
 
+    if (index == (uint32_t)~0 && grow_connections(con) == 0) {
+        index = i;
+    }
+
     if (index == (uint32_t)~0) {
         if (send_routing_response(con, 0, public_key) == -1) {
             return -1;
@@ -671,7 +1285,7 @@ static int handle_TCP_routing_req(TCP_Server *TCP_server, uint32_t con_id, const
         uint32_t other_id = ~0;
         TCP_Secure_Connection *other_conn = &TCP_server->accepted_connection_array[other_index];
 
-        for (i = 0; i < NUM_CLIENT_CONNECTIONS; ++i) {
+        for (i = 0; i < other_conn->num_connections; ++i) {
             if (other_conn->connections[i].status == 1
                     && public_key_cmp(other_conn->connections[i].public_key, con->public_key) == 0) {
                 other_id = i;
@@ -683,18 +1297,46 @@ static int handle_TCP_routing_req(TCP_Server *TCP_server, uint32_t con_id, const
             con->connections[index].status = 2;
             con->connections[index].index = other_index;
             con->connections[index].other_id = other_id;
+            con->connections[index].shard = TCP_server->shard_number;
             other_conn->connections[other_id].status = 2;
             other_conn->connections[other_id].index = con_id;
             other_conn->connections[other_id].other_id = index;
+            other_conn->connections[other_id].shard = TCP_server->shard_number;
             // TODO(irungentoo): return values?
             send_connect_notification(con, index);
             send_connect_notification(other_conn, other_id);
         }
     }
 
+#ifdef TCP_SERVER_USE_EPOLL
+
+    /* The other shard links both ends if the other side asked for us too. */
+    if (other_index == -1 && TCP_server->parent != NULL) {
+        const int shard = key_shard_find(TCP_server, public_key);
+
+        if (shard != -1 && (uint32_t)shard != TCP_server->shard_number) {
+            shard_post_link(TCP_server, shard, TCP_SHARD_LINK, con, index, NULL, 0);
+        }
+    }
+
+#endif
     return 0;
 }
 
+/* return 1 on success.
+ * return 0 if could not send packet.
+ * return -1 on failure (connection must be killed).
+ */
+static int send_oob_recv(TCP_Secure_Connection *con, const uint8_t *sender_public_key, const uint8_t *data,
+                         uint16_t length)
+{
+    VLA(uint8_t, resp_packet, 1 + CRYPTO_PUBLIC_KEY_SIZE + length);
+    resp_packet[0] = TCP_PACKET_OOB_RECV;
+    memcpy(resp_packet + 1, sender_public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    memcpy(resp_packet + 1 + CRYPTO_PUBLIC_KEY_SIZE, data, length);
+    return write_packet_TCP_secure_connection(con, resp_packet, SIZEOF_VLA(resp_packet), 0);
+}
+
 /* return 0 on success.
  * return -1 on failure (connection must be killed).
  */
@@ -710,14 +1352,30 @@ static int handle_TCP_oob_send(TCP_Server *TCP_server, uint32_t con_id, const ui
     int other_index = get_TCP_connection_index(TCP_server, public_key);
 
     if (other_index != -1) {
-        VLA(uint8_t, resp_packet, 1 + CRYPTO_PUBLIC_KEY_SIZE + length);
-        resp_packet[0] = TCP_PACKET_OOB_RECV;
-        memcpy(resp_packet + 1, con->public_key, CRYPTO_PUBLIC_KEY_SIZE);
-        memcpy(resp_packet + 1 + CRYPTO_PUBLIC_KEY_SIZE, data, length);
-        write_packet_TCP_secure_connection(&TCP_server->accepted_connection_array[other_index], resp_packet,
-                                           SIZEOF_VLA(resp_packet), 0);
+        send_oob_recv(&TCP_server->accepted_connection_array[other_index], con->public_key, data, length);
+        return 0;
+    }
+
+#ifdef TCP_SERVER_USE_EPOLL
+
+    if (TCP_server->parent != NULL) {
+        const int shard = key_shard_find(TCP_server, public_key);
+
+        if (shard == -1 || (uint32_t)shard == TCP_server->shard_number) {
+            return 0;
+        }
+
+        TCP_Shard_Message *msg = new_shard_message(TCP_server->parent->shards[shard], TCP_server, TCP_SHARD_OOB, length);
+
+        if (msg != NULL) {
+            memcpy(msg->sender_pk, con->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+            memcpy(msg->target_pk, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+            memcpy(msg->data, data, length);
+            shard_post(TCP_server->parent->shards[shard], msg);
+        }
     }
 
+#endif
     return 0;
 }
 
@@ -728,7 +1386,7 @@ static int handle_TCP_oob_send(TCP_Server *TCP_server, uint32_t con_id, const ui
  */
 static int rm_connection_index(TCP_Server *TCP_server, TCP_Secure_Connection *con, uint8_t con_number)
 {
-    if (con_number >= NUM_CLIENT_CONNECTIONS) {
+    if (con_number >= con->num_connections) {
         return -1;
     }
 
@@ -736,7 +1394,11 @@ static int rm_connection_index(TCP_Server *TCP_server, TCP_Secure_Connection *co
         uint32_t index = con->connections[con_number].index;
         uint8_t other_id = con->connections[con_number].other_id;
 
-        if (con->connections[con_number].status == 2) {
+        if (con->connections[con_number].status == 2 && con->connections[con_number].shard != TCP_server->shard_number) {
+#ifdef TCP_SERVER_USE_EPOLL
+            shard_post_link(TCP_server, con->connections[con_number].shard, TCP_SHARD_UNLINK, con, con_number, NULL, 0);
+#endif
+        } else if (con->connections[con_number].status == 2) {
 
             if (index >= TCP_server->size_accepted_connections) {
                 return -1;
@@ -752,24 +1414,87 @@ static int rm_connection_index(TCP_Server *TCP_server, TCP_Secure_Connection *co
         con->connections[con_number].index = 0;
         con->connections[con_number].other_id = 0;
         con->connections[con_number].status = 0;
+
+        /* Give the slots back once the last one is unused, slot numbers
+         * the client still knows about are all gone by then.
+         */
+        uint32_t i;
+
+        for (i = 0; i < con->num_connections; ++i) {
+            if (con->connections[i].status != 0) {
+                return 0;
+            }
+        }
+
+        wipe_connections(con);
         return 0;
     }
 
     return -1;
 }
 
+/* return the onion the onion requests of the connections of TCP_server go to.
+ */
+static Onion *tcp_server_onion(const TCP_Server *TCP_server)
+{
+#ifdef TCP_SERVER_USE_EPOLL
+
+    if (TCP_server->parent != NULL) {
+        return TCP_server->parent->onion;
+    }
+
+#endif
+    return TCP_server->onion;
+}
+
+static int send_tcp_onion_response(TCP_Server *TCP_server, uint32_t index, uint64_t identifier, const uint8_t *data,
+                                   uint16_t length);
+
 static int handle_onion_recv_1(void *object, IP_Port dest, const uint8_t *data, uint16_t length)
 {
     TCP_Server *TCP_server = (TCP_Server *)object;
     uint32_t index = dest.ip.ip6.uint32[0];
 
+#ifdef TCP_SERVER_USE_EPOLL
+
+    if (TCP_server->num_shards != 0) {
+        const uint32_t shard = dest.ip.ip6.uint32[1];
+
+        if (shard >= TCP_server->num_shards) {
+            return 1;
+        }
+
+        TCP_Shard_Message *msg = new_shard_message(TCP_server->shards[shard], TCP_server, TCP_SHARD_ONION_RESPONSE, length);
+
+        if (msg == NULL) {
+            return 1;
+        }
+
+        msg->index = index;
+        msg->identifier = dest.ip.ip6.uint64[1];
+        memcpy(msg->data, data, length);
+        shard_post(TCP_server->shards[shard], msg);
+        return 0;
+    }
+
+#endif
+
+    return send_tcp_onion_response(TCP_server, index, dest.ip.ip6.uint64[1], data, length);
+}
+
+/* return 0 on success.
+ * return 1 on failure.
+ */
+static int send_tcp_onion_response(TCP_Server *TCP_server, uint32_t index, uint64_t identifier, const uint8_t *data,
+                                   uint16_t length)
+{
     if (index >= TCP_server->size_accepted_connections) {
         return 1;
     }
 
     TCP_Secure_Connection *con = &TCP_server->accepted_connection_array[index];
 
-    if (con->identifier != dest.ip.ip6.uint64[1]) {
+    if (con->identifier != identifier) {
         return 1;
     }
 
@@ -861,7 +1586,7 @@ static int handle_TCP_packet(TCP_Server *TCP_server, uint32_t con_id, const uint
         }
 
         case TCP_PACKET_ONION_REQUEST: {
-            if (TCP_server->onion) {
+            if (tcp_server_onion(TCP_server)) {
                 if (length <= 1 + CRYPTO_NONCE_SIZE + ONION_SEND_BASE * 2) {
                     return -1;
                 }
@@ -870,8 +1595,26 @@ static int handle_TCP_packet(TCP_Server *TCP_server, uint32_t con_id, const uint
                 source.port = 0;  // dummy initialise
                 source.ip.family = TCP_ONION_FAMILY;
                 source.ip.ip6.uint32[0] = con_id;
-                source.ip.ip6.uint32[1] = 0;
+                source.ip.ip6.uint32[1] = TCP_server->shard_number;
                 source.ip.ip6.uint64[1] = con->identifier;
+
+#ifdef TCP_SERVER_USE_EPOLL
+
+                /* The onion isn't thread safe, so the main thread sends it. */
+                if (TCP_server->parent != NULL) {
+                    TCP_Shard_Message *msg = new_shard_message(TCP_server->parent, TCP_server, TCP_SHARD_ONION_REQUEST,
+                                             length - 1);
+
+                    if (msg != NULL) {
+                        msg->source = source;
+                        memcpy(msg->data, data + 1, length - 1);
+                        shard_post(TCP_server->parent, msg);
+                    }
+
+                    return 0;
+                }
+
+#endif
                 onion_send_1(TCP_server->onion, data + 1 + CRYPTO_NONCE_SIZE, length - (1 + CRYPTO_NONCE_SIZE), source,
                              data + 1);
             }
@@ -890,7 +1633,7 @@ static int handle_TCP_packet(TCP_Server *TCP_server, uint32_t con_id, const uint
 
             uint8_t c_id = data[0] - NUM_RESERVED_PORTS;
 
-            if (c_id >= NUM_CLIENT_CONNECTIONS) {
+            if (c_id >= con->num_connections) {
                 return -1;
             }
 
@@ -907,6 +1650,17 @@ static int handle_TCP_packet(TCP_Server *TCP_server, uint32_t con_id, const uint
             VLA(uint8_t, new_data, length);
             memcpy(new_data, data, length);
             new_data[0] = other_c_id;
+
+#ifdef TCP_SERVER_USE_EPOLL
+
+            /* Dropped if the other shard has too much queued, like when the
+             * send queue of a connection on this shard is full. */
+            if (con->connections[c_id].shard != TCP_server->shard_number) {
+                shard_post_link(TCP_server, con->connections[c_id].shard, TCP_SHARD_DATA, con, c_id, new_data, length);
+                return 0;
+            }
+
+#endif
             int ret = write_packet_TCP_secure_connection(&TCP_server->accepted_connection_array[index], new_data, length, 0);
 
             if (ret == -1) {
@@ -970,7 +1724,9 @@ static int accept_connection(TCP_Server *TCP_server, Socket sock)
 
     conn->status = TCP_STATUS_CONNECTED;
     conn->sock = sock;
-    conn->next_packet_length = 0;
+    conn->recv_buffer.start = 0;
+    conn->recv_buffer.end = 0;
+    conn->recv_buffer.drained = false;
 
     ++TCP_server->incoming_connection_queue_index;
     return index;
@@ -1028,6 +1784,8 @@ TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uin
         return NULL;
     }
 
+    temp->send_queue_limit = TCP_SEND_QUEUE_LIMIT;
+
 #ifdef TCP_SERVER_USE_EPOLL
     temp->efd = epoll_create(8);
 
@@ -1037,6 +1795,10 @@ TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uin
         return NULL;
     }
 
+#endif
+#ifdef TCP_SERVER_USE_IO_URING
+    /* Falls back to epoll if the kernel doesn't support it. */
+    temp->uring = new_tcp_uring(TCP_URING_QUEUE_SIZE);
 #endif
 
     uint8_t family;
@@ -1072,6 +1834,16 @@ TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uin
     }
 
     if (temp->num_listening_socks == 0) {
+#ifdef TCP_SERVER_USE_IO_URING
+
+        if (temp->uring != NULL) {
+            kill_tcp_uring(temp->uring);
+        }
+
+#endif
+#ifdef TCP_SERVER_USE_EPOLL
+        close(temp->efd);
+#endif
         free(temp->socks_listening);
         free(temp);
         return NULL;
@@ -1090,6 +1862,7 @@ TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uin
     return temp;
 }
 
+#ifndef TCP_SERVER_USE_EPOLL
 static void do_TCP_accept_new(TCP_Server *TCP_server)
 {
     uint32_t i;
@@ -1104,6 +1877,29 @@ static void do_TCP_accept_new(TCP_Server *TCP_server)
         } while (accept_connection(TCP_server, sock) != -1);
     }
 }
+#endif
+
+/* Move incoming connection i, which sent its handshake, to the unconfirmed
+ * queue.
+ *
+ * return its index there.
+ */
+static int queue_unconfirmed(TCP_Server *TCP_server, uint32_t i)
+{
+    int index_new = TCP_server->unconfirmed_connection_queue_index % MAX_INCOMING_CONNECTIONS;
+    TCP_Secure_Connection *conn_old = &TCP_server->incoming_connection_queue[i];
+    TCP_Secure_Connection *conn_new = &TCP_server->unconfirmed_connection_queue[index_new];
+
+    if (conn_new->status != TCP_STATUS_NO_STATUS) {
+        kill_TCP_secure_connection(conn_new);
+    }
+
+    memcpy(conn_new, conn_old, sizeof(TCP_Secure_Connection));
+    crypto_memzero(conn_old, sizeof(TCP_Secure_Connection));
+    ++TCP_server->unconfirmed_connection_queue_index;
+
+    return index_new;
+}
 
 static int do_incoming(TCP_Server *TCP_server, uint32_t i)
 {
@@ -1116,19 +1912,7 @@ static int do_incoming(TCP_Server *TCP_server, uint32_t i)
     if (ret == -1) {
         kill_TCP_secure_connection(&TCP_server->incoming_connection_queue[i]);
     } else if (ret == 1) {
-        int index_new = TCP_server->unconfirmed_connection_queue_index % MAX_INCOMING_CONNECTIONS;
-        TCP_Secure_Connection *conn_old = &TCP_server->incoming_connection_queue[i];
-        TCP_Secure_Connection *conn_new = &TCP_server->unconfirmed_connection_queue[index_new];
-
-        if (conn_new->status != TCP_STATUS_NO_STATUS) {
-            kill_TCP_secure_connection(conn_new);
-        }
-
-        memcpy(conn_new, conn_old, sizeof(TCP_Secure_Connection));
-        crypto_memzero(conn_old, sizeof(TCP_Secure_Connection));
-        ++TCP_server->unconfirmed_connection_queue_index;
-
-        return index_new;
+        return queue_unconfirmed(TCP_server, i);
     }
 
     return -1;
@@ -1143,7 +1927,7 @@ static int do_unconfirmed(TCP_Server *TCP_server, uint32_t i)
     }
 
     uint8_t packet[MAX_PACKET_SIZE];
-    int len = read_packet_TCP_secure_connection(conn->sock, &conn->next_packet_length, conn->shared_key, conn->recv_nonce,
+    int len = read_packet_TCP_secure_connection(conn->sock, &conn->recv_buffer, conn->shared_key, conn->recv_nonce,
               packet, sizeof(packet));
 
     if (len == 0) {
@@ -1162,23 +1946,27 @@ static void do_confirmed_recv(TCP_Server *TCP_server, uint32_t i)
 {
     TCP_Secure_Connection *conn = &TCP_server->accepted_connection_array[i];
 
-    uint8_t packet[MAX_PACKET_SIZE];
-    int len;
+    uint8_t *packets[TCP_DECRYPT_BATCH];
+    uint16_t lengths[TCP_DECRYPT_BATCH];
+    int count, j;
 
-    while ((len = read_packet_TCP_secure_connection(conn->sock, &conn->next_packet_length, conn->shared_key,
-                  conn->recv_nonce, packet, sizeof(packet)))) {
-        if (len == -1) {
+    while ((count = read_packets_TCP_secure_connection(conn->sock, &conn->recv_buffer, conn->shared_key,
+                    conn->recv_nonce, packets, lengths))) {
+        if (count == -1) {
             kill_accepted(TCP_server, i);
-            break;
+            return;
         }
 
-        if (handle_TCP_packet(TCP_server, i, packet, len) == -1) {
-            kill_accepted(TCP_server, i);
-            break;
+        for (j = 0; j < count; ++j) {
+            if (handle_TCP_packet(TCP_server, i, packets[j], lengths[j]) == -1) {
+                kill_accepted(TCP_server, i);
+                return;
+            }
         }
     }
 }
 
+#ifndef TCP_SERVER_USE_EPOLL
 static void do_TCP_incoming(TCP_Server *TCP_server)
 {
     uint32_t i;
@@ -1196,16 +1984,17 @@ static void do_TCP_unconfirmed(TCP_Server *TCP_server)
         do_unconfirmed(TCP_server, i);
     }
 }
+#endif
 
 static void do_TCP_confirmed(TCP_Server *TCP_server)
 {
 #ifdef TCP_SERVER_USE_EPOLL
 
-    if (TCP_server->last_run_pinged == unix_time()) {
+    if (TCP_server->last_run_pinged == tcp_server_time(TCP_server)) {
         return;
     }
 
-    TCP_server->last_run_pinged = unix_time();
+    TCP_server->last_run_pinged = tcp_server_time(TCP_server);
 #endif
     uint32_t i;
 
@@ -1216,7 +2005,7 @@ static void do_TCP_confirmed(TCP_Server *TCP_server)
             continue;
         }
 
-        if (is_timeout(conn->last_pinged, TCP_PING_FREQUENCY)) {
+        if (tcp_server_timeout(TCP_server, conn->last_pinged, TCP_PING_FREQUENCY)) {
             uint8_t ping[1 + sizeof(uint64_t)];
             ping[0] = TCP_PACKET_PING;
             uint64_t ping_id = random_64b();
@@ -1229,17 +2018,17 @@ static void do_TCP_confirmed(TCP_Server *TCP_server)
             int ret = write_packet_TCP_secure_connection(conn, ping, sizeof(ping), 1);
 
             if (ret == 1) {
-                conn->last_pinged = unix_time();
+                conn->last_pinged = tcp_server_time(TCP_server);
                 conn->ping_id = ping_id;
             } else {
-                if (is_timeout(conn->last_pinged, TCP_PING_FREQUENCY + TCP_PING_TIMEOUT)) {
+                if (tcp_server_timeout(TCP_server, conn->last_pinged, TCP_PING_FREQUENCY + TCP_PING_TIMEOUT)) {
                     kill_accepted(TCP_server, i);
                     continue;
                 }
             }
         }
 
-        if (conn->ping_id && is_timeout(conn->last_pinged, TCP_PING_TIMEOUT)) {
+        if (conn->ping_id && tcp_server_timeout(TCP_server, conn->last_pinged, TCP_PING_TIMEOUT)) {
             kill_accepted(TCP_server, i);
             continue;
         }
@@ -1254,135 +2043,1231 @@ static void do_TCP_confirmed(TCP_Server *TCP_server)
     }
 }
 
-#ifdef TCP_SERVER_USE_EPOLL
-static void do_TCP_epoll(TCP_Server *TCP_server)
+#ifdef TCP_SERVER_USE_IO_URING
+/* return 0 if a recv on the socket of ts was queued.
+ * return -1 on failure.
+ */
+static int uring_start_recv(TCP_Server *TCP_server, TCP_Uring_Socket *ts)
 {
-#define MAX_EVENTS 16
-    struct epoll_event events[MAX_EVENTS];
-    int nfds;
+    if (tcp_uring_recv(TCP_server->uring, ts->sock, (uintptr_t)ts | TCP_URING_RECV) == -1) {
+        return -1;
+    }
 
-    while ((nfds = epoll_wait(TCP_server->efd, events, MAX_EVENTS, 0)) > 0) {
-        int n;
+    ts->in_flight |= TCP_URING_RECV;
+    ++TCP_server->uring_in_flight;
+    return 0;
+}
 
-        for (n = 0; n < nfds; ++n) {
-            Socket sock = events[n].data.u64 & 0xFFFFFFFF;
-            int status = (events[n].data.u64 >> 32) & 0xFF, index = (events[n].data.u64 >> 40);
+/* Start receiving on incoming connection index. */
+static void uring_accept(TCP_Server *TCP_server, int index)
+{
+    TCP_Secure_Connection *con = &TCP_server->incoming_connection_queue[index];
+    TCP_Uring_Socket *ts = (TCP_Uring_Socket *)calloc(1, sizeof(TCP_Uring_Socket));
 
-            if ((events[n].events & EPOLLERR) || (events[n].events & EPOLLHUP) || (events[n].events & EPOLLRDHUP)) {
-                switch (status) {
-                    case TCP_SOCKET_LISTENING: {
-                        //should never happen
-                        break;
-                    }
+    if (ts == NULL) {
+        kill_TCP_secure_connection(con);
+        return;
+    }
 
-                    case TCP_SOCKET_INCOMING: {
-                        kill_TCP_secure_connection(&TCP_server->incoming_connection_queue[index]);
-                        break;
-                    }
+    ts->server = TCP_server;
+    ts->sock = con->sock;
+    ts->type = TCP_SOCKET_INCOMING;
+    ts->index = index;
+    con->uring = ts;
 
-                    case TCP_SOCKET_UNCONFIRMED: {
-                        kill_TCP_secure_connection(&TCP_server->unconfirmed_connection_queue[index]);
-                        break;
-                    }
+    if (uring_start_recv(TCP_server, ts) == -1) {
+        kill_TCP_secure_connection(con);
+        uring_socket_release(ts);
+    }
+}
+#endif
 
-                    case TCP_SOCKET_CONFIRMED: {
-                        kill_accepted(TCP_server, index);
-                        break;
-                    }
-                }
+#ifdef TCP_SERVER_USE_EPOLL
+/* Start the handshake on a freshly accepted socket. */
+static void epoll_accept(TCP_Server *TCP_server, Socket sock_new)
+{
+    int index_new = accept_connection(TCP_server, sock_new);
 
-                continue;
-            }
+    if (index_new == -1) {
+        return;
+    }
 
+#ifdef TCP_SERVER_USE_IO_URING
 
-            if (!(events[n].events & EPOLLIN)) {
-                continue;
-            }
+    if (TCP_server->uring != NULL) {
+        uring_accept(TCP_server, index_new);
+        return;
+    }
 
-            switch (status) {
-                case TCP_SOCKET_LISTENING: {
-                    //socket is from socks_listening, accept connection
-                    struct sockaddr_storage addr;
-                    socklen_t addrlen = sizeof(addr);
+#endif
 
-                    while (1) {
-                        Socket sock_new = accept(sock, (struct sockaddr *)&addr, &addrlen);
+    struct epoll_event ev = {
+        .events = EPOLLIN | EPOLLET | EPOLLRDHUP,
+        .data.u64 = sock_new | ((uint64_t)TCP_SOCKET_INCOMING << 32) | ((uint64_t)index_new << 40)
+    };
 
-                        if (!sock_valid(sock_new)) {
-                            break;
-                        }
+    if (epoll_ctl(TCP_server->efd, EPOLL_CTL_ADD, sock_new, &ev) == -1) {
+        kill_TCP_secure_connection(&TCP_server->incoming_connection_queue[index_new]);
+    }
+}
 
-                        int index_new = accept_connection(TCP_server, sock_new);
+/* Hand out accepted sockets to the shards round robin. */
+static void shard_accept(TCP_Server *TCP_server, Socket sock_new)
+{
+    TCP_Server *parent = TCP_server->parent;
+    TCP_Server *shard = parent->shards[TCP_server->next_shard];
+    TCP_server->next_shard = (TCP_server->next_shard + 1) % parent->num_shards;
 
-                        if (index_new == -1) {
-                            continue;
-                        }
+    if (shard == TCP_server) {
+        epoll_accept(TCP_server, sock_new);
+        return;
+    }
 
-                        struct epoll_event ev = {
-                            .events = EPOLLIN | EPOLLET | EPOLLRDHUP,
-                            .data.u64 = sock_new | ((uint64_t)TCP_SOCKET_INCOMING << 32) | ((uint64_t)index_new << 40)
-                        };
+    TCP_Shard_Message *msg = new_shard_message(shard, TCP_server, TCP_SHARD_ACCEPT, 0);
 
-                        if (epoll_ctl(TCP_server->efd, EPOLL_CTL_ADD, sock_new, &ev) == -1) {
-                            kill_TCP_secure_connection(&TCP_server->incoming_connection_queue[index_new]);
-                            continue;
-                        }
-                    }
+    if (msg == NULL) {
+        kill_sock(sock_new);
+        return;
+    }
 
-                    break;
-                }
+    msg->sock = sock_new;
+    shard_post(shard, msg);
+}
 
-                case TCP_SOCKET_INCOMING: {
-                    int index_new;
+#ifdef TCP_SERVER_USE_IO_URING
+static TCP_Secure_Connection *uring_connection(TCP_Server *TCP_server, const TCP_Uring_Socket *ts)
+{
+    switch (ts->type) {
+        case TCP_SOCKET_INCOMING:
+            return &TCP_server->incoming_connection_queue[ts->index];
+
+        case TCP_SOCKET_UNCONFIRMED:
+            return &TCP_server->unconfirmed_connection_queue[ts->index];
+
+        default:
+            return &TCP_server->accepted_connection_array[ts->index];
+    }
+}
+
+static void uring_kill(TCP_Server *TCP_server, const TCP_Uring_Socket *ts)
+{
+    if (ts->type == TCP_SOCKET_CONFIRMED) {
+        kill_accepted(TCP_server, ts->index);
+    } else {
+        kill_TCP_secure_connection(uring_connection(TCP_server, ts));
+    }
+}
+
+/* Take the first wanted bytes of stream data, of which recv_buffer holds the
+ * beginning and data the rest. If they are all in data they are used in place,
+ * otherwise they are collected in recv_buffer.
+ *
+ * return number of bytes of data used and set out to the wanted bytes, or to
+ * NULL if they are not complete yet.
+ * return -1 on failure.
+ */
+static int take_TCP_data(TCP_Recv_Buffer *recv_buffer, const uint8_t *data, uint16_t length, uint16_t wanted,
+                         const uint8_t **out)
+{
+    *out = NULL;
+
+    if (recv_buffer->end == 0 && length >= wanted) {
+        *out = data;
+        return wanted;
+    }
+
+    if (recv_buffer->data == NULL) {
+        recv_buffer->data = (uint8_t *)malloc(TCP_RECV_BUFFER_SIZE);
+
+        if (recv_buffer->data == NULL) {
+            return -1;
+        }
+    }
+
+    uint16_t take = wanted - recv_buffer->end;
+
+    if (take > length) {
+        take = length;
+    }
+
+    memcpy(recv_buffer->data + recv_buffer->end, data, take);
+    recv_buffer->end += take;
+
+    if (recv_buffer->end == wanted) {
+        /* Stays valid until more data is collected. */
+        *out = recv_buffer->data;
+        recv_buffer->end = 0;
+    }
+
+    return take;
+}
+
+/* Like take_TCP_data, for the next length prefixed packet.
+ *
+ * return number of bytes of data used and set packet and packet_length to the
+ * packet without its length, or packet to NULL if it is not complete yet.
+ * return -1 on failure.
+ */
+static int next_TCP_packet(TCP_Recv_Buffer *recv_buffer, const uint8_t *data, uint16_t length,
+                           const uint8_t **packet, uint16_t *packet_length)
+{
+    uint16_t wanted = sizeof(uint16_t);
+    *packet_length = 0;
+
+    if (recv_buffer->end + length >= sizeof(uint16_t)) {
+        uint8_t prefix[sizeof(uint16_t)];
+        uint16_t i;
+
+        for (i = 0; i < sizeof(uint16_t); ++i) {
+            prefix[i] = i < recv_buffer->end ? recv_buffer->data[i] : data[i - recv_buffer->end];
+        }
+
+        memcpy(packet_length, prefix, sizeof(uint16_t));
+        *packet_length = net_ntohs(*packet_length);
+
+        if (*packet_length > MAX_PACKET_SIZE) {
+            return -1;
+        }
+
+        wanted += *packet_length;
+    }
+
+    const int used = take_TCP_data(recv_buffer, data, length, wanted, packet);
+
+    if (used != -1 && *packet != NULL) {
+        *packet += sizeof(uint16_t);
+    }
+
+    return used;
+}
+
+/* Handle a handshake or packet that arrived on the socket of ts. */
+static void uring_packet(TCP_Server *TCP_server, TCP_Uring_Socket *ts, const uint8_t *packet, uint16_t length)
+{
+    TCP_Secure_Connection *con = uring_connection(TCP_server, ts);
+
+    if (ts->type == TCP_SOCKET_INCOMING) {
+        if (handle_TCP_handshake(con, packet, length, TCP_server->secret_key) != 1) {
+            kill_TCP_secure_connection(con);
+            return;
+        }
+
+        ts->index = queue_unconfirmed(TCP_server, ts->index);
+        ts->type = TCP_SOCKET_UNCONFIRMED;
+        return;
+    }
+
+    uint8_t data[MAX_PACKET_SIZE];
+    const int len = decrypt_TCP_packet(con->shared_key, con->recv_nonce, packet, length, data);
+
+    if (len == -1) {
+        uring_kill(TCP_server, ts);
+        return;
+    }
+
+    if (ts->type == TCP_SOCKET_UNCONFIRMED) {
+        const int index = confirm_TCP_connection(TCP_server, con, data, len);
+
+        if (index != -1) {
+            ts->type = TCP_SOCKET_CONFIRMED;
+            ts->index = index;
+        }
+
+        return;
+    }
+
+    if (handle_TCP_packet(TCP_server, ts->index, data, len) == -1) {
+        kill_accepted(TCP_server, ts->index);
+    }
+}
+
+/* Handle the complete packets at the start of the length bytes of data
+ * received on the confirmed connection of ts, decrypted together in place.
+ *
+ * return number of bytes of data used.
+ * return -1 if the connection was killed.
+ */
+static int uring_confirmed_packets(TCP_Server *TCP_server, TCP_Uring_Socket *ts, uint8_t *data, uint16_t length)
+{
+    TCP_Secure_Connection *con = uring_connection(TCP_server, ts);
+    uint8_t *packets[TCP_DECRYPT_BATCH];
+    uint16_t lengths[TCP_DECRYPT_BATCH];
+    uint16_t count, i;
+
+    const int used = decrypt_TCP_packets(con->shared_key, con->recv_nonce, data, length, packets, lengths, &count);
+
+    if (used == -1) {
+        uring_kill(TCP_server, ts);
+        return -1;
+    }
+
+    for (i = 0; i < count; ++i) {
+        if (handle_TCP_packet(TCP_server, ts->index, packets[i], lengths[i]) == -1) {
+            kill_accepted(TCP_server, ts->index);
+            return -1;
+        }
+    }
+
+    return used;
+}
+
+/* Handle length bytes of stream data received on the socket of ts. Complete
+ * packets are decrypted right in the kernel's buffer, only packets that are
+ * cut off are copied into the receive buffer of the connection.
+ */
+static void uring_received(TCP_Server *TCP_server, TCP_Uring_Socket *ts, uint8_t *data, uint16_t length)
+{
+    while (length != 0 && !ts->dead) {
+        TCP_Secure_Connection *con = uring_connection(TCP_server, ts);
+        const uint8_t *packet;
+        uint16_t packet_length = TCP_CLIENT_HANDSHAKE_SIZE;
+        int used;
+
+        if (ts->type == TCP_SOCKET_CONFIRMED && con->recv_buffer.end == 0) {
+            used = uring_confirmed_packets(TCP_server, ts, data, length);
+
+            if (used == -1) {
+                return;
+            }
+
+            if (used != 0) {
+                data += used;
+                length -= used;
+                continue;
+            }
+        }
+
+        if (ts->type == TCP_SOCKET_INCOMING) {
+            used = take_TCP_data(&con->recv_buffer, data, length, packet_length, &packet);
+        } else {
+            used = next_TCP_packet(&con->recv_buffer, data, length, &packet, &packet_length);
+        }
+
+        if (used == -1) {
+            uring_kill(TCP_server, ts);
+            return;
+        }
+
+        data += used;
+        length -= used;
+
+        if (packet != NULL) {
+            uring_packet(TCP_server, ts, packet, packet_length);
+        }
+    }
+
+    if (!ts->dead && uring_connection(TCP_server, ts)->recv_buffer.end == 0) {
+        /* Idle connections don't keep a buffer around. */
+        wipe_TCP_recv_buffer(&uring_connection(TCP_server, ts)->recv_buffer);
+    }
+}
+
+/* Handle a completed accept on a listening socket. */
+static void uring_accepted(TCP_Server *TCP_server, TCP_Uring_Socket *ts, int32_t res)
+{
+    ts->in_flight = 0;
+
+    if (res < 0) {
+        /* Tried again by the next do_TCP_uring. */
+        return;
+    }
+
+    if (ts->dead) {
+        kill_sock(res);
+        return;
+    }
+
+    if (TCP_server->parent != NULL) {
+        shard_accept(TCP_server, res);
+    } else {
+        epoll_accept(TCP_server, res);
+    }
+
+    if (tcp_uring_accept(TCP_server->uring, ts->sock, (uintptr_t)ts | TCP_URING_RECV) == 0) {
+        ts->in_flight = TCP_URING_RECV;
+        ++TCP_server->uring_in_flight;
+    }
+}
+
+static void uring_event(TCP_Server *TCP_server, const TCP_Uring_Event *event)
+{
+    TCP_Uring_Socket *ts = (TCP_Uring_Socket *)(uintptr_t)(event->user_data & ~(uint64_t)3);
+    const uint8_t operation = event->user_data & 3;
+
+    if (ts == NULL) {
+        /* Result of tcp_uring_cancel_all. */
+        return;
+    }
+
+    --TCP_server->uring_in_flight;
+
+    if (ts->type == TCP_SOCKET_LISTENING) {
+        uring_accepted(TCP_server, ts, event->res);
+        return;
+    }
+
+    if (ts->type == TCP_SOCKET_WAKEUP) {
+        /* Messages are handled by do_shard_messages. */
+        ts->in_flight = 0;
+        return;
+    }
+
+    /* The operation stays in flight until it was handled, so that ts isn't
+     * freed if the connection is killed meanwhile.
+     */
+    if (!ts->dead && operation == TCP_URING_RECV) {
+        if (event->res > 0) {
+            uring_received(TCP_server, ts, event->data, event->res);
+        } else if (event->res != -ENOBUFS && event->res != -EINTR && event->res != -EAGAIN) {
+            uring_kill(TCP_server, ts);
+        }
+    }
+
+    if (!ts->dead && operation == TCP_URING_SEND) {
+        TCP_Secure_Connection *con = uring_connection(TCP_server, ts);
+
+        if (event->res > 0) {
+            tcp_send_queue_sent(&con->send_queue, event->res);
+        } else {
+            uring_kill(TCP_server, ts);
+        }
+    }
+
+    ts->in_flight &= ~operation;
+
+    if (!ts->dead && operation == TCP_URING_RECV && uring_start_recv(TCP_server, ts) == -1) {
+        uring_kill(TCP_server, ts);
+    }
+
+    if (!ts->dead && operation == TCP_URING_SEND && uring_connection(TCP_server, ts)->send_queue.size != 0) {
+        uring_send_later(ts);
+    }
+
+    uring_socket_release(ts);
+}
+
+/* Queue a send of the data of every listed socket that has none in flight. */
+static void uring_flush(TCP_Server *TCP_server)
+{
+    TCP_Uring_Socket *ts = TCP_server->uring_send_list;
+    TCP_Uring_Socket *retry = NULL;
+    TCP_server->uring_send_list = NULL;
+
+    while (ts != NULL) {
+        TCP_Uring_Socket *next = ts->next_send;
+        ts->send_listed = false;
+
+        if (!ts->dead && !(ts->in_flight & TCP_URING_SEND)) {
+            struct iovec iov[TCP_URING_MAX_IOV];
+            const size_t num_iov = tcp_send_queue_iov(&uring_connection(TCP_server, ts)->send_queue, iov, TCP_URING_MAX_IOV);
+
+            if (num_iov != 0 && tcp_uring_send(TCP_server->uring, ts->sock, iov, num_iov, (uintptr_t)ts | TCP_URING_SEND) == 0) {
+                ts->in_flight |= TCP_URING_SEND;
+                ++TCP_server->uring_in_flight;
+            } else if (num_iov != 0) {
+                ts->send_listed = true;
+                ts->next_send = retry;
+                retry = ts;
+            }
+        }
+
+        uring_socket_release(ts);
+        ts = next;
+    }
+
+    TCP_server->uring_send_list = retry;
+}
+
+/* Wait for connections on the listening sockets and for messages from other
+ * shards, unless that is in flight already.
+ */
+static void uring_listen(TCP_Server *TCP_server)
+{
+    uint32_t i;
+
+    if (!TCP_server->uring_started) {
+        TCP_server->uring_started = true;
+
+        /* The first shard accepts the connections of a threaded server. */
+        if (TCP_server->parent != NULL ? TCP_server->shard_number == 0 : TCP_server->num_shards == 0) {
+            const TCP_Server *owner = TCP_server->parent != NULL ? TCP_server->parent : TCP_server;
+            TCP_server->uring_listening = (TCP_Uring_Socket *)calloc(owner->num_listening_socks, sizeof(TCP_Uring_Socket));
+
+            if (TCP_server->uring_listening != NULL) {
+                TCP_server->num_uring_listening = owner->num_listening_socks;
+            }
+
+            for (i = 0; i < TCP_server->num_uring_listening; ++i) {
+                TCP_server->uring_listening[i].server = TCP_server;
+                TCP_server->uring_listening[i].sock = owner->socks_listening[i];
+                TCP_server->uring_listening[i].type = TCP_SOCKET_LISTENING;
+            }
+        }
+
+        if (TCP_server->parent != NULL || TCP_server->num_shards != 0) {
+            TCP_server->uring_wake.server = TCP_server;
+            TCP_server->uring_wake.sock = TCP_server->wake_fd;
+            TCP_server->uring_wake.type = TCP_SOCKET_WAKEUP;
+        }
+    }
+
+    for (i = 0; i < TCP_server->num_uring_listening; ++i) {
+        TCP_Uring_Socket *ts = &TCP_server->uring_listening[i];
+
+        if (ts->in_flight == 0 && tcp_uring_accept(TCP_server->uring, ts->sock, (uintptr_t)ts | TCP_URING_RECV) == 0) {
+            ts->in_flight = TCP_URING_RECV;
+            ++TCP_server->uring_in_flight;
+        }
+    }
+
+    TCP_Uring_Socket *wake = &TCP_server->uring_wake;
+
+    if (wake->type == TCP_SOCKET_WAKEUP && wake->in_flight == 0
+            && tcp_uring_read(TCP_server->uring, wake->sock, &TCP_server->uring_wake_count, sizeof(uint64_t),
+                              (uintptr_t)wake | TCP_URING_RECV) == 0) {
+        wake->in_flight = TCP_URING_RECV;
+        ++TCP_server->uring_in_flight;
+    }
+}
+
+/* Like do_TCP_epoll, with the socket operations run by io_uring: everything
+ * queued is passed to the kernel with a single system call, which also waits
+ * up to timeout milliseconds for the results.
+ */
+static void do_TCP_uring(TCP_Server *TCP_server, int timeout)
+{
+    uring_listen(TCP_server);
+
+    for (;;) {
+        uring_flush(TCP_server);
+        tcp_uring_submit(TCP_server->uring, timeout);
+        timeout = 0;
+
+        TCP_Uring_Event event;
+        bool completed = false;
+
+        while (tcp_uring_next(TCP_server->uring, &event)) {
+            uring_event(TCP_server, &event);
+            tcp_uring_release(TCP_server->uring, &event);
+            completed = true;
+        }
+
+        if (!completed) {
+            break;
+        }
+    }
+}
+
+/* Cancel everything in flight and wait for it before the server is freed. */
+static void uring_stop(TCP_Server *TCP_server)
+{
+    uint32_t i;
+
+    for (i = 0; i < MAX_INCOMING_CONNECTIONS; ++i) {
+        uring_detach(&TCP_server->incoming_connection_queue[i]);
+        uring_detach(&TCP_server->unconfirmed_connection_queue[i]);
+    }
+
+    for (i = 0; i < TCP_server->size_accepted_connections; ++i) {
+        uring_detach(&TCP_server->accepted_connection_array[i]);
+    }
+
+    for (i = 0; i < TCP_server->num_uring_listening; ++i) {
+        TCP_server->uring_listening[i].dead = true;
+    }
+
+    tcp_uring_cancel_all(TCP_server->uring);
+
+    for (i = 0; TCP_server->uring_in_flight != 0 && i < 100; ++i) {
+        tcp_uring_submit(TCP_server->uring, 10);
+
+        TCP_Uring_Event event;
+
+        while (tcp_uring_next(TCP_server->uring, &event)) {
+            uring_event(TCP_server, &event);
+            tcp_uring_release(TCP_server->uring, &event);
+        }
+    }
+
+    uring_flush(TCP_server);
+    free(TCP_server->uring_listening);
+    kill_tcp_uring(TCP_server->uring);
+    TCP_server->uring = NULL;
+}
+#endif
+
+/* Wait up to timeout milliseconds for events and handle them all. */
+static void do_TCP_epoll(TCP_Server *TCP_server, int timeout)
+{
+#ifdef TCP_SERVER_USE_IO_URING
+
+    if (TCP_server->uring != NULL) {
+        do_TCP_uring(TCP_server, timeout);
+        return;
+    }
+
+#endif
+#define MAX_EVENTS 16
+    struct epoll_event events[MAX_EVENTS];
+    int nfds;
+
+    while ((nfds = epoll_wait(TCP_server->efd, events, MAX_EVENTS, timeout)) > 0) {
+        int n;
+        timeout = 0;
+
+        for (n = 0; n < nfds; ++n) {
+            Socket sock = events[n].data.u64 & 0xFFFFFFFF;
+            int status = (events[n].data.u64 >> 32) & 0xFF, index = (events[n].data.u64 >> 40);
+
+            if ((events[n].events & EPOLLERR) || (events[n].events & EPOLLHUP) || (events[n].events & EPOLLRDHUP)) {
+                switch (status) {
+                    case TCP_SOCKET_LISTENING: {
+                        //should never happen
+                        break;
+                    }
+
+                    case TCP_SOCKET_INCOMING: {
+                        kill_TCP_secure_connection(&TCP_server->incoming_connection_queue[index]);
+                        break;
+                    }
+
+                    case TCP_SOCKET_UNCONFIRMED: {
+                        kill_TCP_secure_connection(&TCP_server->unconfirmed_connection_queue[index]);
+                        break;
+                    }
+
+                    case TCP_SOCKET_CONFIRMED: {
+                        kill_accepted(TCP_server, index);
+                        break;
+                    }
+                }
+
+                continue;
+            }
+
+            if ((events[n].events & EPOLLOUT) && status == TCP_SOCKET_CONFIRMED) {
+                /* The socket takes data again, send what was queued. */
+                send_pending_data(&TCP_server->accepted_connection_array[index]);
+            }
+
+            if (!(events[n].events & EPOLLIN)) {
+                continue;
+            }
+
+            switch (status) {
+                case TCP_SOCKET_LISTENING: {
+                    //socket is from socks_listening, accept connection
+                    struct sockaddr_storage addr;
+                    socklen_t addrlen = sizeof(addr);
+
+                    while (1) {
+                        Socket sock_new = accept(sock, (struct sockaddr *)&addr, &addrlen);
+
+                        if (!sock_valid(sock_new)) {
+                            break;
+                        }
+
+                        if (TCP_server->parent != NULL) {
+                            shard_accept(TCP_server, sock_new);
+                        } else {
+                            epoll_accept(TCP_server, sock_new);
+                        }
+                    }
+
+                    break;
+                }
+
+                case TCP_SOCKET_INCOMING: {
+                    int index_new;
 
                     if ((index_new = do_incoming(TCP_server, index)) != -1) {
                         events[n].events = EPOLLIN | EPOLLET | EPOLLRDHUP;
                         events[n].data.u64 = sock | ((uint64_t)TCP_SOCKET_UNCONFIRMED << 32) | ((uint64_t)index_new << 40);
 
-                        if (epoll_ctl(TCP_server->efd, EPOLL_CTL_MOD, sock, &events[n]) == -1) {
-                            kill_TCP_secure_connection(&TCP_server->unconfirmed_connection_queue[index_new]);
-                            break;
-                        }
-                    }
+                        if (epoll_ctl(TCP_server->efd, EPOLL_CTL_MOD, sock, &events[n]) == -1) {
+                            kill_TCP_secure_connection(&TCP_server->unconfirmed_connection_queue[index_new]);
+                            break;
+                        }
+                    }
+
+                    break;
+                }
+
+                case TCP_SOCKET_UNCONFIRMED: {
+                    int index_new;
+
+                    if ((index_new = do_unconfirmed(TCP_server, index)) != -1) {
+                        events[n].events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP;
+                        events[n].data.u64 = sock | ((uint64_t)TCP_SOCKET_CONFIRMED << 32) | ((uint64_t)index_new << 40);
+
+                        if (epoll_ctl(TCP_server->efd, EPOLL_CTL_MOD, sock, &events[n]) == -1) {
+                            //remove from confirmed connections
+                            kill_accepted(TCP_server, index_new);
+                            break;
+                        }
+
+                        /* Packets that arrived together with the first one are
+                         * already in the receive buffer and won't raise an event.
+                         */
+                        do_confirmed_recv(TCP_server, index_new);
+                    }
+
+                    break;
+                }
+
+                case TCP_SOCKET_CONFIRMED: {
+                    do_confirmed_recv(TCP_server, index);
+                    break;
+                }
+
+                case TCP_SOCKET_WAKEUP: {
+                    /* Messages are handled by do_shard_messages. */
+                    break;
+                }
+            }
+        }
+    }
+
+#undef MAX_EVENTS
+}
+
+/* return the connection slot target_id of target_pk belongs to if the slot is
+ * linked with slot sender_id of sender_pk on the shard that sent msg.
+ * return NULL if it isn't.
+ */
+static TCP_Secure_Connection *shard_message_link(TCP_Server *TCP_server, const TCP_Shard_Message *msg)
+{
+    const int index = get_TCP_connection_index(TCP_server, msg->target_pk);
+
+    if (index == -1) {
+        return NULL;
+    }
+
+    TCP_Secure_Connection *con = &TCP_server->accepted_connection_array[index];
+
+    if (msg->target_id >= con->num_connections
+            || con->connections[msg->target_id].status != 2
+            || con->connections[msg->target_id].shard != msg->shard
+            || con->connections[msg->target_id].other_id != msg->sender_id
+            || public_key_cmp(con->connections[msg->target_id].public_key, msg->sender_pk) != 0) {
+        return NULL;
+    }
+
+    return con;
+}
+
+/* Link slot con_number of con with slot other_id of a connection on shard.
+ *
+ * return -1 if con must be killed.
+ * return 0 on success.
+ */
+static int shard_link(TCP_Secure_Connection *con, uint8_t con_number, uint32_t shard, uint8_t other_id)
+{
+    con->connections[con_number].status = 2;
+    con->connections[con_number].index = 0;
+    con->connections[con_number].other_id = other_id;
+    con->connections[con_number].shard = shard;
+
+    if (send_connect_notification(con, con_number) == -1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static void handle_shard_link(TCP_Server *TCP_server, const TCP_Shard_Message *msg)
+{
+    const int index = get_TCP_connection_index(TCP_server, msg->target_pk);
+
+    if (index == -1) {
+        return;
+    }
+
+    TCP_Secure_Connection *con = &TCP_server->accepted_connection_array[index];
+    uint32_t i;
+
+    for (i = 0; i < con->num_connections; ++i) {
+        if (con->connections[i].status == 1 && public_key_cmp(con->connections[i].public_key, msg->sender_pk) == 0) {
+            if (shard_link(con, i, msg->shard, msg->sender_id) == -1) {
+                /* The other end isn't linked yet, so it stays waiting for us. */
+                kill_accepted(TCP_server, index);
+                return;
+            }
+
+            shard_post_link(TCP_server, msg->shard, TCP_SHARD_LINKED, con, i, NULL, 0);
+            return;
+        }
+    }
+}
+
+static void handle_shard_linked(TCP_Server *TCP_server, const TCP_Shard_Message *msg)
+{
+    /* Both sides asked for each other at the same time and we already linked
+     * our end when the other side's request came in.
+     */
+    if (shard_message_link(TCP_server, msg) != NULL) {
+        return;
+    }
+
+    const int index = get_TCP_connection_index(TCP_server, msg->target_pk);
+
+    if (index != -1) {
+        TCP_Secure_Connection *con = &TCP_server->accepted_connection_array[index];
 
-                    break;
-                }
+        if (msg->target_id < con->num_connections
+                && con->connections[msg->target_id].status == 1
+                && public_key_cmp(con->connections[msg->target_id].public_key, msg->sender_pk) == 0) {
+            if (shard_link(con, msg->target_id, msg->shard, msg->sender_id) == -1) {
+                /* Also unlinks the other end. */
+                kill_accepted(TCP_server, index);
+            }
 
-                case TCP_SOCKET_UNCONFIRMED: {
-                    int index_new;
+            return;
+        }
+    }
 
-                    if ((index_new = do_unconfirmed(TCP_server, index)) != -1) {
-                        events[n].events = EPOLLIN | EPOLLET | EPOLLRDHUP;
-                        events[n].data.u64 = sock | ((uint64_t)TCP_SOCKET_CONFIRMED << 32) | ((uint64_t)index_new << 40);
+    /* Our slot went away in the meantime, so undo the other end. */
+    TCP_Shard_Message *reply = new_shard_message(TCP_server->parent->shards[msg->shard], TCP_server, TCP_SHARD_UNLINK,
+                               0);
 
-                        if (epoll_ctl(TCP_server->efd, EPOLL_CTL_MOD, sock, &events[n]) == -1) {
-                            //remove from confirmed connections
-                            kill_accepted(TCP_server, index_new);
-                            break;
-                        }
-                    }
+    if (reply == NULL) {
+        return;
+    }
 
-                    break;
-                }
+    memcpy(reply->sender_pk, msg->target_pk, CRYPTO_PUBLIC_KEY_SIZE);
+    reply->sender_id = msg->target_id;
+    memcpy(reply->target_pk, msg->sender_pk, CRYPTO_PUBLIC_KEY_SIZE);
+    reply->target_id = msg->sender_id;
+    shard_post(TCP_server->parent->shards[msg->shard], reply);
+}
 
-                case TCP_SOCKET_CONFIRMED: {
-                    do_confirmed_recv(TCP_server, index);
-                    break;
-                }
+static void handle_shard_unlink(TCP_Server *TCP_server, const TCP_Shard_Message *msg)
+{
+    TCP_Secure_Connection *con = shard_message_link(TCP_server, msg);
+
+    if (con == NULL) {
+        return;
+    }
+
+    con->connections[msg->target_id].other_id = 0;
+    con->connections[msg->target_id].index = 0;
+    con->connections[msg->target_id].status = 1;
+
+    if (send_disconnect_notification(con, msg->target_id) == -1) {
+        kill_accepted(TCP_server, con - TCP_server->accepted_connection_array);
+    }
+}
+
+static void handle_shard_message(TCP_Server *TCP_server, const TCP_Shard_Message *msg)
+{
+    switch (msg->type) {
+        case TCP_SHARD_ACCEPT: {
+            epoll_accept(TCP_server, msg->sock);
+            break;
+        }
+
+        case TCP_SHARD_KILL: {
+            /* Nothing to do if it connected to this shard again since. */
+            if (key_shard_find(TCP_server, msg->target_pk) == (int)TCP_server->shard_number) {
+                break;
+            }
+
+            const int index = get_TCP_connection_index(TCP_server, msg->target_pk);
+
+            if (index != -1) {
+                kill_accepted(TCP_server, index);
+            }
+
+            break;
+        }
+
+        case TCP_SHARD_LINK: {
+            handle_shard_link(TCP_server, msg);
+            break;
+        }
+
+        case TCP_SHARD_LINKED: {
+            handle_shard_linked(TCP_server, msg);
+            break;
+        }
+
+        case TCP_SHARD_UNLINK: {
+            handle_shard_unlink(TCP_server, msg);
+            break;
+        }
+
+        case TCP_SHARD_DATA: {
+            TCP_Secure_Connection *con = shard_message_link(TCP_server, msg);
+
+            if (con != NULL) {
+                write_packet_TCP_secure_connection(con, msg->data, msg->length, 0);
+            }
+
+            break;
+        }
+
+        case TCP_SHARD_OOB: {
+            const int index = get_TCP_connection_index(TCP_server, msg->target_pk);
+
+            if (index != -1) {
+                send_oob_recv(&TCP_server->accepted_connection_array[index], msg->sender_pk, msg->data, msg->length);
             }
+
+            break;
+        }
+
+        case TCP_SHARD_ONION_REQUEST: {
+            onion_send_1(TCP_server->onion, msg->data + CRYPTO_NONCE_SIZE, msg->length - CRYPTO_NONCE_SIZE, msg->source,
+                         msg->data);
+            break;
+        }
+
+        case TCP_SHARD_ONION_RESPONSE: {
+            send_tcp_onion_response(TCP_server, msg->index, msg->identifier, msg->data, msg->length);
+            break;
         }
     }
+}
 
-#undef MAX_EVENTS
+static void free_shard_messages(TCP_Shard_Message *msg)
+{
+    while (msg != NULL) {
+        TCP_Shard_Message *next = msg->next;
+
+        if (msg->type == TCP_SHARD_ACCEPT) {
+            kill_sock(msg->sock);
+        }
+
+        free(msg);
+        msg = next;
+    }
+}
+
+/* Handle the messages queued for TCP_server.
+ *
+ * return false if the thread running it must stop.
+ */
+static bool do_shard_messages(TCP_Server *TCP_server)
+{
+    uint64_t count;
+
+    /* Fails with EAGAIN if nothing was queued since the last call. */
+    if (read(TCP_server->wake_fd, &count, sizeof(count)) == -1) {
+        count = 0;
+    }
+
+    pthread_mutex_lock(&TCP_server->mailbox_mutex);
+    TCP_Shard_Message *msg = TCP_server->mailbox_start;
+    TCP_server->mailbox_start = NULL;
+    TCP_server->mailbox_end = NULL;
+    TCP_server->mailbox_bytes = 0;
+    const bool stop = TCP_server->stop;
+    pthread_mutex_unlock(&TCP_server->mailbox_mutex);
+
+    if (stop) {
+        free_shard_messages(msg);
+        return false;
+    }
+
+    TCP_Shard_Message *handled = msg;
+
+    while (msg != NULL) {
+        handle_shard_message(TCP_server, msg);
+        msg = msg->next;
+    }
+
+    pthread_mutex_lock(&TCP_server->mailbox_mutex);
+
+    while (handled != NULL) {
+        TCP_Shard_Message *next = handled->next;
+        recycle_shard_message(TCP_server, handled);
+        handled = next;
+    }
+
+    pthread_mutex_unlock(&TCP_server->mailbox_mutex);
+
+    return true;
+}
+
+static void *shard_thread(void *arg)
+{
+    TCP_Server *TCP_server = (TCP_Server *)arg;
+
+    while (do_shard_messages(TCP_server)) {
+        TCP_server->shard_time = current_time_monotonic() / 1000;
+        do_TCP_confirmed(TCP_server);
+        do_TCP_epoll(TCP_server, TCP_SHARD_WAIT);
+    }
+
+    return NULL;
+}
+
+/* return 0 on failure.
+ * return 1 on success.
+ */
+static int shard_mailbox_init(TCP_Server *TCP_server)
+{
+    TCP_server->wake_fd = eventfd(0, EFD_NONBLOCK);
+
+    if (TCP_server->wake_fd == -1) {
+        return 0;
+    }
+
+    struct epoll_event ev = {
+        .events = EPOLLIN | EPOLLET,
+        .data.u64 = TCP_server->wake_fd | ((uint64_t)TCP_SOCKET_WAKEUP << 32)
+    };
+
+    if (epoll_ctl(TCP_server->efd, EPOLL_CTL_ADD, TCP_server->wake_fd, &ev) == -1
+            || pthread_mutex_init(&TCP_server->mailbox_mutex, NULL) != 0) {
+        close(TCP_server->wake_fd);
+        return 0;
+    }
+
+    return 1;
+}
+
+static void shard_mailbox_free(TCP_Server *TCP_server)
+{
+    free_shard_messages(TCP_server->mailbox_start);
+
+    while (TCP_server->free_messages != NULL) {
+        TCP_Shard_Message *next = TCP_server->free_messages->next;
+        free(TCP_server->free_messages);
+        TCP_server->free_messages = next;
+    }
+
+    pthread_mutex_destroy(&TCP_server->mailbox_mutex);
+    close(TCP_server->wake_fd);
+}
+
+static TCP_Server *new_TCP_shard(TCP_Server *parent, uint32_t shard_number)
+{
+    TCP_Server *shard = (TCP_Server *)calloc(1, sizeof(TCP_Server));
+
+    if (shard == NULL) {
+        return NULL;
+    }
+
+    shard->efd = epoll_create(8);
+
+    if (shard->efd == -1) {
+        free(shard);
+        return NULL;
+    }
+
+    if (!shard_mailbox_init(shard)) {
+        close(shard->efd);
+        free(shard);
+        return NULL;
+    }
+
+#ifdef TCP_SERVER_USE_IO_URING
+
+    if (parent->uring != NULL) {
+        shard->uring = new_tcp_uring(TCP_URING_QUEUE_SIZE);
+
+        if (shard->uring == NULL) {
+            shard_mailbox_free(shard);
+            close(shard->efd);
+            free(shard);
+            return NULL;
+        }
+    }
+
+#endif
+
+    shard->parent = parent;
+    shard->shard_number = shard_number;
+    shard->shard_time = current_time_monotonic() / 1000;
+    shard->send_queue_limit = parent->send_queue_limit;
+    memcpy(shard->public_key, parent->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    memcpy(shard->secret_key, parent->secret_key, CRYPTO_SECRET_KEY_SIZE);
+    bs_list_init(&shard->accepted_key_list, CRYPTO_PUBLIC_KEY_SIZE, 8);
+
+    return shard;
+}
+
+/* Stop the threads of the first num_running shards, then free all shards.
+ */
+static void kill_TCP_shards(TCP_Server *TCP_server, uint32_t num_running)
+{
+    uint32_t i;
+
+    for (i = 0; i < num_running; ++i) {
+        TCP_Server *shard = TCP_server->shards[i];
+        pthread_mutex_lock(&shard->mailbox_mutex);
+        shard->stop = true;
+        pthread_mutex_unlock(&shard->mailbox_mutex);
+
+        /* A shard that isn't woken still sees stop after at most TCP_SHARD_WAIT ms. */
+        shard_wake(shard);
+    }
+
+    for (i = 0; i < num_running; ++i) {
+        pthread_join(TCP_server->shards[i]->thread, NULL);
+    }
+
+    for (i = 0; i < TCP_server->num_shards; ++i) {
+        shard_mailbox_free(TCP_server->shards[i]);
+        kill_TCP_server(TCP_server->shards[i]);
+    }
+
+    free(TCP_server->shards);
+    TCP_server->shards = NULL;
+    TCP_server->num_shards = 0;
+
+    shard_mailbox_free(TCP_server);
+    pthread_mutex_destroy(&TCP_server->key_shard_mutex);
+    bs_list_free(&TCP_server->key_shard_list);
+}
+#endif
+
+int tcp_server_set_threads(TCP_Server *tcp_server, uint32_t num_threads)
+{
+#ifdef TCP_SERVER_USE_EPOLL
+
+    if (num_threads == 0 || num_threads > TCP_SERVER_MAX_THREADS) {
+        return -1;
+    }
+
+    if (tcp_server->parent != NULL || tcp_server->num_shards != 0 || tcp_server->incoming_connection_queue_index != 0) {
+        return -1;
+    }
+
+#ifdef TCP_SERVER_USE_IO_URING
+
+    /* The accepts in flight can't be moved to the first shard. */
+    if (tcp_server->uring_started) {
+        return -1;
+    }
+
+#endif
+
+    tcp_server->shards = (TCP_Server **)calloc(num_threads, sizeof(TCP_Server *));
+
+    if (tcp_server->shards == NULL) {
+        return -1;
+    }
+
+    if (!shard_mailbox_init(tcp_server)) {
+        free(tcp_server->shards);
+        tcp_server->shards = NULL;
+        return -1;
+    }
+
+    if (pthread_mutex_init(&tcp_server->key_shard_mutex, NULL) != 0) {
+        shard_mailbox_free(tcp_server);
+        free(tcp_server->shards);
+        tcp_server->shards = NULL;
+        return -1;
+    }
+
+    bs_list_init(&tcp_server->key_shard_list, CRYPTO_PUBLIC_KEY_SIZE, 8);
+
+    uint32_t i;
+
+    for (i = 0; i < num_threads; ++i) {
+        tcp_server->shards[i] = new_TCP_shard(tcp_server, i);
+
+        if (tcp_server->shards[i] == NULL) {
+            kill_TCP_shards(tcp_server, 0);
+            return -1;
+        }
+
+        ++tcp_server->num_shards;
+    }
+
+    /* The first shard accepts all connections and hands them out. */
+    for (i = 0; i < tcp_server->num_listening_socks; ++i) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.u64 = tcp_server->socks_listening[i] | ((uint64_t)TCP_SOCKET_LISTENING << 32);
+
+        if (epoll_ctl(tcp_server->shards[0]->efd, EPOLL_CTL_ADD, tcp_server->socks_listening[i], &ev) == -1) {
+            kill_TCP_shards(tcp_server, 0);
+            return -1;
+        }
+    }
+
+    for (i = 0; i < num_threads; ++i) {
+        if (pthread_create(&tcp_server->shards[i]->thread, NULL, &shard_thread, tcp_server->shards[i]) != 0) {
+            kill_TCP_shards(tcp_server, i);
+            return -1;
+        }
+    }
+
+    for (i = 0; i < tcp_server->num_listening_socks; ++i) {
+        epoll_ctl(tcp_server->efd, EPOLL_CTL_DEL, tcp_server->socks_listening[i], NULL);
+    }
+
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/* Set the number of bytes each connection may have queued for sending before
+ * data packets to it are refused. Defaults to TCP_SEND_QUEUE_LIMIT. Applies to
+ * connections that are confirmed afterwards.
+ *
+ * Must be called before tcp_server_set_threads.
+ */
+void tcp_server_set_send_queue_limit(TCP_Server *tcp_server, uint32_t limit)
+{
+    tcp_server->send_queue_limit = limit;
 }
+
+/* Enable or disable running the sockets of the server with io_uring instead of
+ * epoll. Servers use io_uring by default if it was enabled at build time with
+ * TCP_SERVER_USE_IO_URING and the kernel supports it (Linux 5.19 or newer).
+ *
+ * Must be called before tcp_server_set_threads and before do_TCP_server is
+ * first called.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+int tcp_server_set_io_uring(TCP_Server *tcp_server, bool enabled)
+{
+#ifdef TCP_SERVER_USE_IO_URING
+
+    if (tcp_server->parent != NULL || tcp_server->num_shards != 0 || tcp_server->uring_started) {
+        return -1;
+    }
+
+    if (!enabled) {
+        if (tcp_server->uring != NULL) {
+            kill_tcp_uring(tcp_server->uring);
+            tcp_server->uring = NULL;
+        }
+
+        return 0;
+    }
+
+    if (tcp_server->uring == NULL) {
+        tcp_server->uring = new_tcp_uring(TCP_URING_QUEUE_SIZE);
+    }
+
+    return tcp_server->uring == NULL ? -1 : 0;
+#else
+    return enabled ? -1 : 0;
 #endif
+}
 
 void do_TCP_server(TCP_Server *TCP_server)
 {
     unix_time_update();
 
 #ifdef TCP_SERVER_USE_EPOLL
-    do_TCP_epoll(TCP_server);
+
+    if (TCP_server->num_shards != 0) {
+        do_TCP_epoll(TCP_server, 0);
+        do_shard_messages(TCP_server);
+        return;
+    }
+
+    do_TCP_epoll(TCP_server, 0);
 
 #else
     do_TCP_accept_new(TCP_server);
@@ -1395,6 +3280,20 @@ void do_TCP_server(TCP_Server *TCP_server)
 
 void kill_TCP_server(TCP_Server *TCP_server)
 {
+#ifdef TCP_SERVER_USE_EPOLL
+
+    if (TCP_server->num_shards != 0) {
+        kill_TCP_shards(TCP_server, TCP_server->num_shards);
+    }
+
+#endif
+#ifdef TCP_SERVER_USE_IO_URING
+
+    if (TCP_server->uring != NULL) {
+        uring_stop(TCP_server);
+    }
+
+#endif
     uint32_t i;
 
     for (i = 0; i < TCP_server->num_listening_socks; ++i) {
@@ -1407,6 +3306,14 @@ void kill_TCP_server(TCP_Server *TCP_server)
 
     bs_list_free(&TCP_server->accepted_key_list);
 
+    for (i = 0; i < TCP_server->size_accepted_connections; ++i) {
+        tcp_send_queue_clear(&TCP_server->accepted_connection_array[i].send_queue);
+        wipe_TCP_recv_buffer(&TCP_server->accepted_connection_array[i].recv_buffer);
+        wipe_connections(&TCP_server->accepted_connection_array[i]);
+    }
+
+    tcp_send_pool_free(&TCP_server->send_pool);
+
 #ifdef TCP_SERVER_USE_EPOLL
     close(TCP_server->efd);
 #endif
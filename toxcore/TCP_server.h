@@ -25,6 +25,7 @@
 #define TCP_SERVER_H
 
 #include "crypto_core.h"
+#include "TCP_send_queue.h"
 #include "list.h"
 #include "onion.h"
 
@@ -32,16 +33,17 @@
 #include <sys/epoll.h>
 #endif
 
-#if defined(_WIN32) || defined(__WIN32__) || defined(WIN32) || defined(__MACH__)
-#define MSG_NOSIGNAL 0
-#endif
-
 #define MAX_INCOMING_CONNECTIONS 256
 
 #define TCP_MAX_BACKLOG MAX_INCOMING_CONNECTIONS
 
 #define MAX_PACKET_SIZE 2048
 
+/* Default number of bytes a connection may have queued for sending before
+ * data packets are refused. Control packets may queue up to twice as much.
+ */
+#define TCP_SEND_QUEUE_LIMIT (32 * MAX_PACKET_SIZE)
+
 #define TCP_HANDSHAKE_PLAIN_SIZE (CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE)
 #define TCP_SERVER_HANDSHAKE_SIZE (CRYPTO_NONCE_SIZE + TCP_HANDSHAKE_PLAIN_SIZE + CRYPTO_MAC_SIZE)
 #define TCP_CLIENT_HANDSHAKE_SIZE (CRYPTO_PUBLIC_KEY_SIZE + TCP_SERVER_HANDSHAKE_SIZE)
@@ -72,8 +74,12 @@
 #define TCP_SOCKET_INCOMING 1
 #define TCP_SOCKET_UNCONFIRMED 2
 #define TCP_SOCKET_CONFIRMED 3
+#define TCP_SOCKET_WAKEUP 4
 #endif
 
+/* Maximum number of worker threads for tcp_server_set_threads. */
+#define TCP_SERVER_MAX_THREADS 64
+
 enum {
     TCP_STATUS_NO_STATUS,
     TCP_STATUS_CONNECTED,
@@ -81,13 +87,31 @@ enum {
     TCP_STATUS_CONFIRMED,
 };
 
-typedef struct TCP_Priority_List TCP_Priority_List;
+/* Received stream data that has not been handled yet. Large enough for two
+ * full size packets, so that one recv() usually returns every packet that is
+ * waiting on the socket. Only allocated while data is coming in.
+ */
+#define TCP_RECV_BUFFER_SIZE (2 * (2 + MAX_PACKET_SIZE))
 
-struct TCP_Priority_List {
-    TCP_Priority_List *next;
-    uint16_t size, sent;
-    uint8_t data[];
-};
+typedef struct TCP_Recv_Buffer {
+    uint8_t *data; /* TCP_RECV_BUFFER_SIZE bytes or NULL. */
+    uint16_t start; /* First byte not handled yet. */
+    uint16_t end; /* One past the last byte received. */
+    bool drained; /* Whether the last recv() emptied the socket. */
+} TCP_Recv_Buffer;
+
+#ifdef TCP_SERVER_USE_IO_URING
+typedef struct TCP_Uring_Socket TCP_Uring_Socket;
+#endif
+
+/* Connection to another client that a client routes packets through. */
+typedef struct TCP_Route {
+    uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint32_t index;
+    uint8_t status; /* 0 if not used, 1 if other is offline, 2 if other is online. */
+    uint8_t other_id;
+    uint8_t shard; /* Shard the other connection is on, see tcp_server_set_threads. */
+} TCP_Route;
 
 typedef struct TCP_Secure_Connection {
     Socket sock;
@@ -95,19 +119,18 @@ typedef struct TCP_Secure_Connection {
     uint8_t recv_nonce[CRYPTO_NONCE_SIZE]; /* Nonce of received packets. */
     uint8_t sent_nonce[CRYPTO_NONCE_SIZE]; /* Nonce of sent packets. */
     uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
-    uint16_t next_packet_length;
-    struct {
-        uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
-        uint32_t index;
-        uint8_t status; /* 0 if not used, 1 if other is offline, 2 if other is online. */
-        uint8_t other_id;
-    } connections[NUM_CLIENT_CONNECTIONS];
-    uint8_t last_packet[2 + MAX_PACKET_SIZE];
+    TCP_Recv_Buffer recv_buffer;
+    /* Most clients only route to a few others, so slots are allocated as
+     * they are used, up to NUM_CLIENT_CONNECTIONS.
+     */
+    TCP_Route *connections;
+    uint8_t num_connections;
     uint8_t status;
-    uint16_t last_packet_length;
-    uint16_t last_packet_sent;
 
-    TCP_Priority_List *priority_queue_start, *priority_queue_end;
+    TCP_Send_Queue send_queue;
+#ifdef TCP_SERVER_USE_IO_URING
+    TCP_Uring_Socket *uring; /* NULL unless the server runs its sockets with io_uring. */
+#endif
 
     uint64_t identifier;
 
@@ -121,11 +144,50 @@ typedef struct TCP_Server TCP_Server;
 const uint8_t *tcp_server_public_key(const TCP_Server *tcp_server);
 size_t tcp_server_listen_count(const TCP_Server *tcp_server);
 
+/* return the epoll descriptor of the server, -1 if it doesn't use epoll. */
+int tcp_server_poll_fd(const TCP_Server *tcp_server);
+
 /* Create new TCP server instance.
  */
 TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uint16_t *ports, const uint8_t *secret_key,
                            Onion *onion);
 
+/* Run the connections of the server on num_threads worker threads instead of
+ * in do_TCP_server. Each thread has its own epoll set and runs a share of the
+ * connections, which are handed out round robin as they are accepted. Packets
+ * between connections on different threads are passed on through queues.
+ *
+ * do_TCP_server must still be called regularly; it sends the onion requests
+ * of all connections and keeps unix_time() up to date for the threads.
+ *
+ * Must be called before the server accepts its first connection. Only
+ * available if the server is built with TCP_SERVER_USE_EPOLL.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+int tcp_server_set_threads(TCP_Server *tcp_server, uint32_t num_threads);
+
+/* Set the number of bytes each connection may have queued for sending before
+ * data packets to it are refused. Defaults to TCP_SEND_QUEUE_LIMIT. Applies to
+ * connections that are confirmed afterwards.
+ *
+ * Must be called before tcp_server_set_threads.
+ */
+void tcp_server_set_send_queue_limit(TCP_Server *tcp_server, uint32_t limit);
+
+/* Enable or disable running the sockets of the server with io_uring instead of
+ * epoll. Servers use io_uring by default if it was enabled at build time with
+ * TCP_SERVER_USE_IO_URING and the kernel supports it (Linux 5.19 or newer).
+ *
+ * Must be called before tcp_server_set_threads and before do_TCP_server is
+ * first called.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+int tcp_server_set_io_uring(TCP_Server *tcp_server, bool enabled);
+
 /* Run the TCP_server
  */
 void do_TCP_server(TCP_Server *TCP_server);
@@ -155,11 +217,18 @@ uint16_t read_TCP_length(Socket sock);
  */
 int read_TCP_packet(Socket sock, uint8_t *data, uint16_t length);
 
-/* return length of received packet on success.
+/* Free the memory of recv_buffer and drop any data in it. */
+void wipe_TCP_recv_buffer(TCP_Recv_Buffer *recv_buffer);
+
+/* Read the next packet of the connection into data, receiving more stream
+ * data into recv_buffer with a single recv() if it does not hold a complete
+ * packet yet.
+ *
+ * return length of received packet on success.
  * return 0 if could not read any packet.
  * return -1 on failure (connection must be killed).
  */
-int read_packet_TCP_secure_connection(Socket sock, uint16_t *next_packet_length, const uint8_t *shared_key,
+int read_packet_TCP_secure_connection(Socket sock, TCP_Recv_Buffer *recv_buffer, const uint8_t *shared_key,
                                       uint8_t *recv_nonce, uint8_t *data, uint16_t max_len);
 
 
@@ -0,0 +1,419 @@
+/*
+ * Completion based socket I/O for the TCP relay server, using io_uring.
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#if defined(__linux__)
+/* Needed for MAP_ANONYMOUS. */
+#define _GNU_SOURCE
+#endif
+
+#include "TCP_uring.h"
+
+#ifdef TCP_SERVER_USE_IO_URING
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* There is no libc wrapper for the io_uring system calls and liburing would be
+ * one more dependency for the few operations needed here.
+ */
+static int uring_setup(uint32_t entries, struct io_uring_params *params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags, const void *arg,
+                       size_t arg_size)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static int uring_register(int fd, uint32_t opcode, const void *arg, uint32_t nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* msghdr of a queued send. */
+typedef struct TCP_Uring_Msg {
+    struct msghdr msg;
+    struct iovec iov[TCP_URING_MAX_IOV];
+} TCP_Uring_Msg;
+
+struct TCP_Uring {
+    int fd;
+
+    void *ring_memory;
+    size_t ring_size;
+
+    struct io_uring_sqe *sqes;
+    uint32_t *sq_head;
+    uint32_t *sq_tail;
+    uint32_t sq_mask;
+    uint32_t sq_entries;
+    uint32_t sq_queued; /* Tail including the entries not passed to the kernel yet. */
+
+    /* One per submission queue entry. The kernel copies them on submission. */
+    TCP_Uring_Msg *msgs;
+
+    struct io_uring_cqe *cqes;
+    uint32_t *cq_head;
+    uint32_t *cq_tail;
+    uint32_t cq_mask;
+
+    /* Ring of receive buffers handed to the kernel. Its tail overlays the
+     * reserved field of the first entry.
+     */
+    struct io_uring_buf *buf_ring;
+    uint16_t buf_tail;
+    uint8_t *buffers;
+};
+
+static uint32_t load_acquire(const uint32_t *value)
+{
+    return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+}
+
+static void add_buffer(TCP_Uring *ring, uint16_t id)
+{
+    struct io_uring_buf *buf = &ring->buf_ring[ring->buf_tail & (TCP_URING_BUFFER_COUNT - 1)];
+
+    /* Not a struct assignment: that would overwrite the tail in entry 0. */
+    buf->addr = (uint64_t)(uintptr_t)(ring->buffers + (size_t)id * TCP_URING_BUFFER_SIZE);
+    buf->len = TCP_URING_BUFFER_SIZE;
+    buf->bid = id;
+    ++ring->buf_tail;
+    __atomic_store_n(&ring->buf_ring[0].resv, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+/* Set up a ring with queue_size submission queue entries and register its
+ * receive buffers.
+ *
+ * return NULL if io_uring or one of the features needed is not available
+ * (Linux 5.19 or newer is required).
+ */
+TCP_Uring *new_tcp_uring(uint32_t queue_size)
+{
+    TCP_Uring *ring = (TCP_Uring *)calloc(1, sizeof(TCP_Uring));
+
+    if (ring == NULL) {
+        return NULL;
+    }
+
+    ring->ring_memory = MAP_FAILED;
+    ring->sqes = (struct io_uring_sqe *)MAP_FAILED;
+    ring->buf_ring = (struct io_uring_buf *)MAP_FAILED;
+    ring->buffers = (uint8_t *)MAP_FAILED;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    /* Every connection has a receive in flight, so a lot of them can complete
+     * between two calls.
+     */
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = 4 * queue_size;
+
+    ring->fd = uring_setup(queue_size, &params);
+
+    if (ring->fd == -1) {
+        free(ring);
+        return NULL;
+    }
+
+    const uint32_t features = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_SUBMIT_STABLE |
+                              IORING_FEAT_EXT_ARG;
+
+    if ((params.features & features) != features) {
+        kill_tcp_uring(ring);
+        return NULL;
+    }
+
+    const size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    const size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->ring_memory = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_SQ_RING);
+    ring->sqes = (struct io_uring_sqe *)mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                 PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_SQES);
+    ring->sq_entries = params.sq_entries;
+    ring->msgs = (TCP_Uring_Msg *)calloc(params.sq_entries, sizeof(TCP_Uring_Msg));
+
+    const size_t buf_ring_size = TCP_URING_BUFFER_COUNT * sizeof(struct io_uring_buf);
+    ring->buf_ring = (struct io_uring_buf *)mmap(NULL, buf_ring_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring->buffers = (uint8_t *)mmap(NULL, (size_t)TCP_URING_BUFFER_COUNT * TCP_URING_BUFFER_SIZE,
+                                    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (ring->ring_memory == MAP_FAILED || ring->sqes == MAP_FAILED || ring->msgs == NULL
+            || ring->buf_ring == MAP_FAILED || ring->buffers == MAP_FAILED) {
+        kill_tcp_uring(ring);
+        return NULL;
+    }
+
+    uint8_t *memory = (uint8_t *)ring->ring_memory;
+    ring->sq_head = (uint32_t *)(memory + params.sq_off.head);
+    ring->sq_tail = (uint32_t *)(memory + params.sq_off.tail);
+    ring->sq_mask = *(uint32_t *)(memory + params.sq_off.ring_mask);
+    ring->sq_queued = *ring->sq_tail;
+    ring->cq_head = (uint32_t *)(memory + params.cq_off.head);
+    ring->cq_tail = (uint32_t *)(memory + params.cq_off.tail);
+    ring->cq_mask = *(uint32_t *)(memory + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(memory + params.cq_off.cqes);
+
+    uint32_t *sq_array = (uint32_t *)(memory + params.sq_off.array);
+    uint32_t i;
+
+    for (i = 0; i < params.sq_entries; ++i) {
+        sq_array[i] = i;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+    reg.ring_entries = TCP_URING_BUFFER_COUNT;
+    reg.bgid = 0;
+
+    if (uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        kill_tcp_uring(ring);
+        return NULL;
+    }
+
+    for (i = 0; i < TCP_URING_BUFFER_COUNT; ++i) {
+        add_buffer(ring, i);
+    }
+
+    return ring;
+}
+
+void kill_tcp_uring(TCP_Uring *ring)
+{
+    /* Closing the ring cancels everything still in flight. */
+    close(ring->fd);
+
+    if (ring->ring_memory != MAP_FAILED) {
+        munmap(ring->ring_memory, ring->ring_size);
+    }
+
+    if (ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sq_entries * sizeof(struct io_uring_sqe));
+    }
+
+    if (ring->buf_ring != MAP_FAILED) {
+        munmap(ring->buf_ring, TCP_URING_BUFFER_COUNT * sizeof(struct io_uring_buf));
+    }
+
+    if (ring->buffers != MAP_FAILED) {
+        munmap(ring->buffers, (size_t)TCP_URING_BUFFER_COUNT * TCP_URING_BUFFER_SIZE);
+    }
+
+    free(ring->msgs);
+    free(ring);
+}
+
+int tcp_uring_fd(const TCP_Uring *ring)
+{
+    return ring->fd;
+}
+
+/* return a cleared submission queue entry.
+ * return NULL if the queue is full and the kernel did not take any entries.
+ */
+static struct io_uring_sqe *get_sqe(TCP_Uring *ring, uint32_t *slot)
+{
+    if (ring->sq_queued - load_acquire(ring->sq_head) == ring->sq_entries) {
+        tcp_uring_submit(ring, 0);
+
+        if (ring->sq_queued - load_acquire(ring->sq_head) == ring->sq_entries) {
+            return NULL;
+        }
+    }
+
+    *slot = ring->sq_queued & ring->sq_mask;
+    ++ring->sq_queued;
+
+    struct io_uring_sqe *sqe = &ring->sqes[*slot];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    return sqe;
+}
+
+int tcp_uring_accept(TCP_Uring *ring, Socket sock, uint64_t user_data)
+{
+    uint32_t slot;
+    struct io_uring_sqe *sqe = get_sqe(ring, &slot);
+
+    if (sqe == NULL) {
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = sock;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+int tcp_uring_recv(TCP_Uring *ring, Socket sock, uint64_t user_data)
+{
+    uint32_t slot;
+    struct io_uring_sqe *sqe = get_sqe(ring, &slot);
+
+    if (sqe == NULL) {
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = sock;
+    sqe->len = TCP_URING_BUFFER_SIZE;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+int tcp_uring_send(TCP_Uring *ring, Socket sock, const struct iovec *iov, size_t iovcnt, uint64_t user_data)
+{
+    if (iovcnt == 0 || iovcnt > TCP_URING_MAX_IOV) {
+        return -1;
+    }
+
+    uint32_t slot;
+    struct io_uring_sqe *sqe = get_sqe(ring, &slot);
+
+    if (sqe == NULL) {
+        return -1;
+    }
+
+    TCP_Uring_Msg *msg = &ring->msgs[slot];
+    memset(&msg->msg, 0, sizeof(msg->msg));
+    memcpy(msg->iov, iov, iovcnt * sizeof(struct iovec));
+    msg->msg.msg_iov = msg->iov;
+    msg->msg.msg_iovlen = iovcnt;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = sock;
+    sqe->addr = (uint64_t)(uintptr_t)&msg->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+int tcp_uring_read(TCP_Uring *ring, int fd, void *data, uint32_t length, uint64_t user_data)
+{
+    uint32_t slot;
+    struct io_uring_sqe *sqe = get_sqe(ring, &slot);
+
+    if (sqe == NULL) {
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)data;
+    sqe->len = length;
+    sqe->off = (uint64_t) -1;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+int tcp_uring_cancel_all(TCP_Uring *ring)
+{
+    uint32_t slot;
+    struct io_uring_sqe *sqe = get_sqe(ring, &slot);
+
+    if (sqe == NULL) {
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+    sqe->user_data = 0;
+    return 0;
+}
+
+int tcp_uring_submit(TCP_Uring *ring, int timeout)
+{
+    __atomic_store_n(ring->sq_tail, ring->sq_queued, __ATOMIC_RELEASE);
+
+    const uint32_t to_submit = ring->sq_queued - load_acquire(ring->sq_head);
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    uint32_t flags = 0;
+
+    if (timeout > 0) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    } else if (to_submit == 0) {
+        return 0;
+    }
+
+    if (uring_enter(ring->fd, to_submit, timeout > 0, flags, timeout > 0 ? &arg : NULL, sizeof(arg)) == -1) {
+        /* ETIME: nothing completed in time. EBUSY: too many completions are
+         * waiting, they have to be taken first.
+         */
+        if (errno != ETIME && errno != EINTR && errno != EBUSY && errno != EAGAIN) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+bool tcp_uring_next(TCP_Uring *ring, TCP_Uring_Event *event)
+{
+    const uint32_t head = *ring->cq_head;
+
+    if (head == load_acquire(ring->cq_tail)) {
+        return false;
+    }
+
+    const struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+    event->user_data = cqe->user_data;
+    event->res = cqe->res;
+    event->data = NULL;
+    event->buffer = -1;
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        event->buffer = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        event->data = ring->buffers + (size_t)event->buffer * TCP_URING_BUFFER_SIZE;
+    }
+
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+void tcp_uring_release(TCP_Uring *ring, const TCP_Uring_Event *event)
+{
+    if (event->buffer != -1) {
+        add_buffer(ring, event->buffer);
+    }
+}
+
+#endif
@@ -0,0 +1,117 @@
+/*
+ * Completion based socket I/O for the TCP relay server, using io_uring.
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef TCP_URING_H
+#define TCP_URING_H
+
+#include "network.h"
+
+#ifdef TCP_SERVER_USE_IO_URING
+
+#include <sys/uio.h>
+
+/* Buffers registered with the kernel, which picks one for each receive as
+ * data arrives. Sockets waiting for data don't hold on to any memory.
+ */
+#define TCP_URING_BUFFER_COUNT 256
+#define TCP_URING_BUFFER_SIZE 4096
+
+/* Maximum number of iovecs in one tcp_uring_send. */
+#define TCP_URING_MAX_IOV 16
+
+typedef struct TCP_Uring TCP_Uring;
+
+/* A completed operation. */
+typedef struct TCP_Uring_Event {
+    uint64_t user_data;
+    int32_t res; /* Result of the system call, -errno on failure. */
+
+    /* The res bytes received, if the operation was a receive that got data.
+     * They may be changed until the buffer is released.
+     */
+    uint8_t *data;
+    int32_t buffer; /* Registered buffer data is in, -1 if none. */
+} TCP_Uring_Event;
+
+/* Set up a ring with queue_size submission queue entries and register its
+ * receive buffers.
+ *
+ * return NULL if io_uring or one of the features needed is not available
+ * (Linux 5.19 or newer is required).
+ */
+TCP_Uring *new_tcp_uring(uint32_t queue_size);
+
+void kill_tcp_uring(TCP_Uring *ring);
+
+/* return the descriptor of the ring. It is readable while completed operations
+ * are waiting.
+ */
+int tcp_uring_fd(const TCP_Uring *ring);
+
+/* The following queue an operation that is passed to the kernel by the next
+ * tcp_uring_submit, or earlier if the submission queue is full. Its completion
+ * carries user_data, which must not be 0.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+
+/* Accept a connection on the listening socket sock. res is the new socket. */
+int tcp_uring_accept(TCP_Uring *ring, Socket sock, uint64_t user_data);
+
+/* Receive into one of the registered buffers. */
+int tcp_uring_recv(TCP_Uring *ring, Socket sock, uint64_t user_data);
+
+/* Send the data iov points to, which must stay in place until the operation
+ * completed. iov itself may be reused right away.
+ */
+int tcp_uring_send(TCP_Uring *ring, Socket sock, const struct iovec *iov, size_t iovcnt, uint64_t user_data);
+
+/* Read length bytes from fd into data, which must stay in place until the
+ * operation completed.
+ */
+int tcp_uring_read(TCP_Uring *ring, int fd, void *data, uint32_t length, uint64_t user_data);
+
+/* Cancel all operations in flight. They complete with res -ECANCELED. */
+int tcp_uring_cancel_all(TCP_Uring *ring);
+
+/* Pass the queued operations to the kernel, then wait up to timeout
+ * milliseconds until at least one operation has completed.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+int tcp_uring_submit(TCP_Uring *ring, int timeout);
+
+/* Take the next completed operation.
+ *
+ * return true if event was filled in.
+ * return false if no operation has completed.
+ */
+bool tcp_uring_next(TCP_Uring *ring, TCP_Uring_Event *event);
+
+/* Give the buffer of event back to the kernel once its data was handled. */
+void tcp_uring_release(TCP_Uring *ring, const TCP_Uring_Event *event);
+
+#endif
+
+#endif
@@ -0,0 +1,321 @@
+/*
+ * Congestion control for net_crypto connections: round trip time sampling
+ * and the algorithms that set the packet send rate of a connection.
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "congestion.h"
+
+#include <string.h>
+
+/* Length in ms of each minute of base delay history. */
+#define BASE_HISTORY_INTERVAL 60000
+
+/* If the send queue is SEND_QUEUE_RATIO times larger than the
+ * calculated link speed the packet send speed will be reduced
+ * by a value depending on this number.
+ */
+#define SEND_QUEUE_RATIO 2.0
+
+/* Queuing delay in ms that LEDBAT keeps the path at. */
+#define LEDBAT_TARGET 50
+
+/* Packets LEDBAT adds to its window per round trip when there is no queuing
+ * delay (RFC 6817 GAIN), and the smallest window it goes down to. */
+#define LEDBAT_GAIN 1.0
+#define LEDBAT_MIN_WINDOW 2.0
+
+typedef struct {
+    void (*init)(Congestion_Control *cc, uint64_t time);
+    void (*update)(Congestion_Control *cc, const Congestion_Update *update);
+} Congestion_Ops;
+
+static uint64_t rtt_lowest(const uint64_t *samples, uint32_t num)
+{
+    uint64_t lowest = UINT64_MAX;
+    uint32_t i;
+
+    for (i = 0; i < num; ++i) {
+        if (samples[i] < lowest) {
+            lowest = samples[i];
+        }
+    }
+
+    return lowest;
+}
+
+/* Forget the delays of the path, for when the connection moves to another one. */
+static void rtt_reset_delays(Congestion_Rtt *rtt, uint64_t time)
+{
+    uint32_t i;
+
+    for (i = 0; i < CONGESTION_CURRENT_FILTER; ++i) {
+        rtt->current[i] = UINT64_MAX;
+    }
+
+    for (i = 0; i < CONGESTION_BASE_HISTORY; ++i) {
+        rtt->base[i] = UINT64_MAX;
+    }
+
+    rtt->update_min = UINT64_MAX;
+    rtt->base_time = time;
+}
+
+static void queue_init(Congestion_Control *cc, uint64_t time)
+{
+}
+
+static void queue_update(Congestion_Control *cc, const Congestion_Update *update)
+{
+    unsigned int pos = cc->last_sendqueue_counter % CONGESTION_QUEUE_ARRAY_SIZE;
+    cc->last_sendqueue_size[pos] = update->send_queue_size;
+    ++cc->last_sendqueue_counter;
+
+    unsigned int j;
+    long signed int sum = 0;
+    sum = (long signed int)cc->last_sendqueue_size[(pos) % CONGESTION_QUEUE_ARRAY_SIZE] -
+          (long signed int)cc->last_sendqueue_size[(pos - (CONGESTION_QUEUE_ARRAY_SIZE - 1)) % CONGESTION_QUEUE_ARRAY_SIZE];
+
+    unsigned int n_p_pos = cc->last_sendqueue_counter % CONGESTION_LAST_SENT_ARRAY_SIZE;
+    cc->last_num_packets_sent[n_p_pos] = update->packets_sent;
+    cc->last_num_packets_resent[n_p_pos] = update->packets_resent;
+
+    if (update->hold) {
+        return;
+    }
+
+    long signed int total_sent = 0, total_resent = 0;
+
+    /* The send queue reflects the packets sent one round trip ago. */
+    unsigned int delay = (unsigned int)((congestion_min_rtt(cc, DEFAULT_PING_CONNECTION) / CONGESTION_UPDATE_INTERVAL) +
+                                        0.5);
+    unsigned int packets_set_rem_array = (CONGESTION_LAST_SENT_ARRAY_SIZE - CONGESTION_QUEUE_ARRAY_SIZE);
+
+    if (delay > packets_set_rem_array) {
+        delay = packets_set_rem_array;
+    }
+
+    for (j = 0; j < CONGESTION_QUEUE_ARRAY_SIZE; ++j) {
+        unsigned int ind = (j + (packets_set_rem_array  - delay) + n_p_pos) % CONGESTION_LAST_SENT_ARRAY_SIZE;
+        total_sent += cc->last_num_packets_sent[ind];
+        total_resent += cc->last_num_packets_resent[ind];
+    }
+
+    if (sum > 0) {
+        total_sent -= sum;
+    } else {
+        if (total_resent > -sum) {
+            total_resent = -sum;
+        }
+    }
+
+    /* if queue is too big only allow resending packets. */
+    uint32_t npackets = update->send_queue_size;
+    double min_speed = 1000.0 * (((double)(total_sent)) / ((double)(CONGESTION_QUEUE_ARRAY_SIZE) *
+                                 CONGESTION_UPDATE_INTERVAL));
+
+    double min_speed_request = 1000.0 * (((double)(total_sent + total_resent)) / ((double)(
+            CONGESTION_QUEUE_ARRAY_SIZE) * CONGESTION_UPDATE_INTERVAL));
+
+    if (min_speed < CRYPTO_PACKET_MIN_RATE) {
+        min_speed = CRYPTO_PACKET_MIN_RATE;
+    }
+
+    double send_array_ratio = (((double)npackets) / min_speed);
+
+    // TODO(irungentoo): Improve formula?
+    if (send_array_ratio > SEND_QUEUE_RATIO && CRYPTO_MIN_QUEUE_LENGTH < npackets) {
+        cc->send_rate = min_speed * (1.0 / (send_array_ratio / SEND_QUEUE_RATIO));
+    } else if (update->last_congestion_event + CONGESTION_EVENT_TIMEOUT < update->time) {
+        cc->send_rate = min_speed * 1.2;
+    } else {
+        cc->send_rate = min_speed * 0.9;
+    }
+
+    cc->send_rate_requested = min_speed_request * 1.2;
+
+    if (cc->send_rate < CRYPTO_PACKET_MIN_RATE) {
+        cc->send_rate = CRYPTO_PACKET_MIN_RATE;
+    }
+
+    if (cc->send_rate_requested < cc->send_rate) {
+        cc->send_rate_requested = cc->send_rate;
+    }
+}
+
+static void ledbat_init(Congestion_Control *cc, uint64_t time)
+{
+    cc->window = LEDBAT_MIN_WINDOW;
+    cc->last_decrease = 0;
+}
+
+/* LEDBAT (RFC 6817) adapted to the packet rate that net_crypto sends at: a
+ * window of packets in flight grows or shrinks by up to LEDBAT_GAIN packets
+ * per round trip depending on how far the queuing delay (current delay minus
+ * base delay) is from LEDBAT_TARGET, and is halved when packets are lost.
+ *
+ * The send rate is the window divided by the current delay, so a growing
+ * queue slows the connection down before the window reacts to it, like the
+ * acknowledgements of a window based sender would.
+ */
+static void ledbat_update(Congestion_Control *cc, const Congestion_Update *update)
+{
+    if (update->hold) {
+        return;
+    }
+
+    const uint64_t base_delay = rtt_lowest(cc->rtt.base, CONGESTION_BASE_HISTORY);
+    const uint64_t current_delay = rtt_lowest(cc->rtt.current, CONGESTION_CURRENT_FILTER);
+    const uint64_t rtt = current_delay != UINT64_MAX ? current_delay : congestion_rtt(cc, DEFAULT_PING_CONNECTION);
+
+    if (update->packets_resent != 0) {
+        if (cc->last_decrease + congestion_rtt(cc, DEFAULT_PING_CONNECTION) <= update->time) {
+            cc->window /= 2;
+            cc->last_decrease = update->time;
+        }
+    } else {
+        double off_target = 1.0;
+
+        if (base_delay != UINT64_MAX && current_delay != UINT64_MAX) {
+            const uint64_t queuing_delay = current_delay > base_delay ? current_delay - base_delay : 0;
+            off_target = ((double)LEDBAT_TARGET - (double)queuing_delay) / LEDBAT_TARGET;
+
+            if (off_target < -1.0) {
+                off_target = -1.0;
+            }
+        }
+
+        /* It only grows while the connection uses the rate it has. */
+        const double allowed = cc->send_rate * (double)update->interval / 1000.0;
+        const bool rate_used = (update->packets_sent + update->packets_resent) * 2 >= allowed;
+
+        if (off_target < 0 || rate_used) {
+            double step = (double)update->interval / (rtt + 1);
+
+            if (step > 1.0) {
+                step = 1.0;
+            }
+
+            cc->window += LEDBAT_GAIN * off_target * step;
+        }
+    }
+
+    if (cc->window < LEDBAT_MIN_WINDOW) {
+        cc->window = LEDBAT_MIN_WINDOW;
+    }
+
+    cc->send_rate = cc->window * 1000.0 / (rtt + 1);
+
+    if (cc->send_rate < CRYPTO_PACKET_MIN_RATE) {
+        cc->send_rate = CRYPTO_PACKET_MIN_RATE;
+    }
+
+    /* Requested packets are part of the rate, not on top of it. */
+    cc->send_rate_requested = cc->send_rate;
+}
+
+static const Congestion_Ops congestion_ops[CONGESTION_NUM_ALGORITHMS] = {
+    {queue_init, queue_update},
+    {ledbat_init, ledbat_update},
+};
+
+int congestion_init(Congestion_Control *cc, Congestion_Algorithm algorithm, uint64_t time)
+{
+    if ((unsigned int)algorithm >= CONGESTION_NUM_ALGORITHMS) {
+        return -1;
+    }
+
+    memset(cc, 0, sizeof(Congestion_Control));
+    cc->algorithm = algorithm;
+    cc->send_rate = CRYPTO_PACKET_MIN_RATE;
+    cc->send_rate_requested = CRYPTO_PACKET_MIN_RATE;
+    cc->rtt.lowest = UINT64_MAX;
+    rtt_reset_delays(&cc->rtt, time);
+    congestion_ops[algorithm].init(cc, time);
+    return 0;
+}
+
+void congestion_rtt_sample(Congestion_Control *cc, uint64_t rtt, uint64_t time)
+{
+    Congestion_Rtt *r = &cc->rtt;
+
+    if (!r->have_sample) {
+        r->have_sample = 1;
+        r->smoothed = rtt;
+        r->variation = rtt / 2;
+    } else {
+        const uint64_t error = r->smoothed > rtt ? r->smoothed - rtt : rtt - r->smoothed;
+        r->variation = (3 * r->variation + error) / 4;
+        r->smoothed = (7 * r->smoothed + rtt) / 8;
+    }
+
+    if (rtt < r->lowest) {
+        r->lowest = rtt;
+    }
+
+    if (rtt < r->update_min) {
+        r->update_min = rtt;
+    }
+
+    if (r->base_time + BASE_HISTORY_INTERVAL <= time) {
+        r->base_pos = (r->base_pos + 1) % CONGESTION_BASE_HISTORY;
+        r->base[r->base_pos] = UINT64_MAX;
+        r->base_time = time;
+    }
+
+    if (rtt < r->base[r->base_pos]) {
+        r->base[r->base_pos] = rtt;
+    }
+}
+
+uint64_t congestion_rtt(const Congestion_Control *cc, uint64_t default_rtt)
+{
+    if (!cc->rtt.have_sample) {
+        return default_rtt;
+    }
+
+    return cc->rtt.smoothed;
+}
+
+uint64_t congestion_min_rtt(const Congestion_Control *cc, uint64_t default_rtt)
+{
+    return cc->rtt.lowest < default_rtt ? cc->rtt.lowest : default_rtt;
+}
+
+void congestion_update(Congestion_Control *cc, const Congestion_Update *update)
+{
+    Congestion_Rtt *r = &cc->rtt;
+
+    if (update->direct != cc->direct) {
+        /* The delays of the old path say nothing about the new one. */
+        cc->direct = update->direct;
+        rtt_reset_delays(r, update->time);
+    } else if (r->update_min != UINT64_MAX) {
+        r->current[r->current_pos] = r->update_min;
+        r->current_pos = (r->current_pos + 1) % CONGESTION_CURRENT_FILTER;
+        r->update_min = UINT64_MAX;
+    }
+
+    congestion_ops[cc->algorithm].update(cc, update);
+}
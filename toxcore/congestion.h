@@ -0,0 +1,156 @@
+/*
+ * Congestion control for net_crypto connections: round trip time sampling
+ * and the algorithms that set the packet send rate of a connection.
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef CONGESTION_H
+#define CONGESTION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Minimum packet rate per second. */
+#define CRYPTO_PACKET_MIN_RATE 4.0
+
+/* Minimum packet queue max length. */
+#define CRYPTO_MIN_QUEUE_LENGTH 64
+
+/* Default connection ping in ms. */
+#define DEFAULT_PING_CONNECTION 1000
+
+/* Interval in ms at which congestion_update is called. */
+#define CONGESTION_UPDATE_INTERVAL 50
+
+/* Base current transfer speed on last CONGESTION_QUEUE_ARRAY_SIZE number of points taken
+   every CONGESTION_UPDATE_INTERVAL ms. */
+#define CONGESTION_QUEUE_ARRAY_SIZE 12
+#define CONGESTION_LAST_SENT_ARRAY_SIZE (CONGESTION_QUEUE_ARRAY_SIZE * 2)
+
+/* Timeout for increasing speed after congestion event (in ms). */
+#define CONGESTION_EVENT_TIMEOUT 1000
+
+/* The current delay is the lowest round trip time of this many updates. */
+#define CONGESTION_CURRENT_FILTER 4
+
+/* The base delay is the lowest round trip time of this many minutes. */
+#define CONGESTION_BASE_HISTORY 10
+
+typedef enum Congestion_Algorithm {
+    /* Estimate the link speed from how fast the send queue grows. */
+    CONGESTION_ALGORITHM_QUEUE,
+
+    /* LEDBAT: adjust the send rate to keep the delay added by queues on the
+     * path, measured from round trip times, at a target. */
+    CONGESTION_ALGORITHM_LEDBAT,
+
+    CONGESTION_NUM_ALGORITHMS
+} Congestion_Algorithm;
+
+typedef struct {
+    bool have_sample;
+
+    /* Smoothed round trip time and its variation, in ms (RFC 6298). */
+    uint64_t smoothed;
+    uint64_t variation;
+
+    /* Lowest sample of the connection, UINT64_MAX if none. */
+    uint64_t lowest;
+
+    /* Lowest sample since the last congestion_update, UINT64_MAX if none. */
+    uint64_t update_min;
+
+    /* Lowest samples of the last updates that had samples. */
+    uint64_t current[CONGESTION_CURRENT_FILTER];
+    uint32_t current_pos;
+
+    /* Lowest samples of the last minutes. */
+    uint64_t base[CONGESTION_BASE_HISTORY];
+    uint32_t base_pos;
+    uint64_t base_time;
+} Congestion_Rtt;
+
+/* What happened on a connection since the previous congestion_update. */
+typedef struct {
+    uint64_t time; /* Current time in ms. */
+    uint64_t interval; /* ms since the previous update. */
+
+    uint32_t packets_sent; /* New packets sent. */
+    uint32_t packets_resent; /* Packets sent again because the peer requested them. */
+    uint32_t send_queue_size; /* Packets sent but not yet acknowledged. */
+
+    /* Last time all the packets the send rate allowed were used up. */
+    uint64_t last_congestion_event;
+
+    /* Whether the connection currently goes over UDP instead of a TCP relay. */
+    bool direct;
+
+    /* Keep the send rate, the round trip times of the path are changing. */
+    bool hold;
+} Congestion_Update;
+
+typedef struct {
+    Congestion_Algorithm algorithm;
+
+    /* Packets per second allowed for new packets, and for new packets and
+     * packets requested again together. */
+    double send_rate;
+    double send_rate_requested;
+
+    Congestion_Rtt rtt;
+    bool direct; /* Congestion_Update.direct of the previous update. */
+
+    /* CONGESTION_ALGORITHM_QUEUE */
+    uint32_t last_sendqueue_size[CONGESTION_QUEUE_ARRAY_SIZE], last_sendqueue_counter;
+    long signed int last_num_packets_sent[CONGESTION_LAST_SENT_ARRAY_SIZE],
+         last_num_packets_resent[CONGESTION_LAST_SENT_ARRAY_SIZE];
+
+    /* CONGESTION_ALGORITHM_LEDBAT */
+    double window; /* Packets in flight per round trip. */
+    uint64_t last_decrease;
+} Congestion_Control;
+
+/* Set up congestion control for a new connection.
+ *
+ * return -1 if algorithm is not a valid algorithm.
+ * return 0 on success.
+ */
+int congestion_init(Congestion_Control *cc, Congestion_Algorithm algorithm, uint64_t time);
+
+/* Add a round trip time sample of rtt ms, taken at time.
+ *
+ * Samples must only be taken from packets that were sent once, as the
+ * acknowledgement of a packet that was sent again can't tell which of the
+ * sends it was for.
+ */
+void congestion_rtt_sample(Congestion_Control *cc, uint64_t rtt, uint64_t time);
+
+/* return the smoothed round trip time in ms, or default_rtt if no sample was taken. */
+uint64_t congestion_rtt(const Congestion_Control *cc, uint64_t default_rtt);
+
+/* return the lowest round trip time in ms of the connection, or default_rtt
+ * if no sample was lower.
+ */
+uint64_t congestion_min_rtt(const Congestion_Control *cc, uint64_t default_rtt);
+
+/* Update the send rates, called every CONGESTION_UPDATE_INTERVAL ms. */
+void congestion_update(Congestion_Control *cc, const Congestion_Update *update);
+
+#endif
@@ -126,6 +126,13 @@ int32_t encrypt_data_symmetric(const uint8_t *secret_key, const uint8_t *nonce,
         return -1;
     }
 
+#ifndef VANILLA_NACL
+
+    if (crypto_box_easy_afternm(encrypted, plain, length, nonce, secret_key) != 0) {
+        return -1;
+    }
+
+#else
     VLA(uint8_t, temp_plain, length + crypto_box_ZEROBYTES);
     VLA(uint8_t, temp_encrypted, length + crypto_box_MACBYTES + crypto_box_BOXZEROBYTES);
 
@@ -138,6 +145,7 @@ int32_t encrypt_data_symmetric(const uint8_t *secret_key, const uint8_t *nonce,
 
     /* Unpad the encrypted message. */
     memcpy(encrypted, temp_encrypted + crypto_box_BOXZEROBYTES, length + crypto_box_MACBYTES);
+#endif
     return length + crypto_box_MACBYTES;
 }
 
@@ -148,6 +156,13 @@ int32_t decrypt_data_symmetric(const uint8_t *secret_key, const uint8_t *nonce,
         return -1;
     }
 
+#ifndef VANILLA_NACL
+
+    if (crypto_box_open_easy_afternm(plain, encrypted, length, nonce, secret_key) != 0) {
+        return -1;
+    }
+
+#else
     VLA(uint8_t, temp_plain, length + crypto_box_ZEROBYTES);
     VLA(uint8_t, temp_encrypted, length + crypto_box_BOXZEROBYTES);
 
@@ -159,9 +174,164 @@ int32_t decrypt_data_symmetric(const uint8_t *secret_key, const uint8_t *nonce,
     }
 
     memcpy(plain, temp_plain + crypto_box_ZEROBYTES, length - crypto_box_MACBYTES);
+#endif
     return length - crypto_box_MACBYTES;
 }
 
+int32_t encrypt_data_symmetric_detached(const uint8_t *shared_key, const uint8_t *nonce, uint8_t *data, size_t length,
+                                        uint8_t *mac)
+{
+    if (length == 0 || !shared_key || !nonce || !data || !mac) {
+        return -1;
+    }
+
+#ifndef VANILLA_NACL
+
+    if (crypto_box_detached_afternm(data, mac, data, length, nonce, shared_key) != 0) {
+        return -1;
+    }
+
+#else
+    /* NaCl only has the padded interface. */
+    VLA(uint8_t, temp_plain, length + crypto_box_ZEROBYTES);
+    VLA(uint8_t, temp_encrypted, length + crypto_box_ZEROBYTES);
+
+    memset(temp_plain, 0, crypto_box_ZEROBYTES);
+    memcpy(temp_plain + crypto_box_ZEROBYTES, data, length);
+
+    if (crypto_box_afternm(temp_encrypted, temp_plain, length + crypto_box_ZEROBYTES, nonce, shared_key) != 0) {
+        return -1;
+    }
+
+    memcpy(mac, temp_encrypted + crypto_box_BOXZEROBYTES, crypto_box_MACBYTES);
+    memcpy(data, temp_encrypted + crypto_box_ZEROBYTES, length);
+#endif
+    return length;
+}
+
+int32_t decrypt_data_symmetric_detached(const uint8_t *shared_key, const uint8_t *nonce, uint8_t *data, size_t length,
+                                        const uint8_t *mac)
+{
+    if (length == 0 || !shared_key || !nonce || !data || !mac) {
+        return -1;
+    }
+
+#ifndef VANILLA_NACL
+
+    if (crypto_box_open_detached_afternm(data, data, mac, length, nonce, shared_key) != 0) {
+        return -1;
+    }
+
+#else
+    VLA(uint8_t, temp_plain, length + crypto_box_ZEROBYTES);
+    VLA(uint8_t, temp_encrypted, length + crypto_box_ZEROBYTES);
+
+    memset(temp_encrypted, 0, crypto_box_BOXZEROBYTES);
+    memcpy(temp_encrypted + crypto_box_BOXZEROBYTES, mac, crypto_box_MACBYTES);
+    memcpy(temp_encrypted + crypto_box_ZEROBYTES, data, length);
+
+    if (crypto_box_open_afternm(temp_plain, temp_encrypted, length + crypto_box_ZEROBYTES, nonce, shared_key) != 0) {
+        return -1;
+    }
+
+    memcpy(data, temp_plain + crypto_box_ZEROBYTES, length);
+#endif
+    return length;
+}
+
+#ifndef VANILLA_NACL
+/* The second half of crypto_box_open_afternm, with the HSalsa20 subkey derived
+ * from the shared key and the first 16 bytes of the nonce already computed.
+ */
+static int32_t decrypt_data_subkey(const uint8_t *subkey, const uint8_t *nonce, const uint8_t *encrypted,
+                                   size_t length, uint8_t *plain)
+{
+    const uint8_t *mac = encrypted;
+    const uint8_t *cipher = encrypted + crypto_box_MACBYTES;
+    const size_t cipher_length = length - crypto_box_MACBYTES;
+
+    /* The first 32 bytes of the key stream are the Poly1305 key, the rest of
+     * the first 64 byte block goes with the first 32 bytes of the message.
+     */
+    uint8_t block0[64];
+    crypto_stream_salsa20(block0, sizeof(block0), nonce + 16, subkey);
+
+    if (crypto_onetimeauth_poly1305_verify(mac, cipher, cipher_length, block0) != 0) {
+        crypto_memzero(block0, sizeof(block0));
+        return -1;
+    }
+
+    if (plain != cipher && plain < cipher + cipher_length && cipher < plain + cipher_length) {
+        memmove(plain, cipher, cipher_length);
+        cipher = plain;
+    }
+
+    const size_t first = cipher_length < 32 ? cipher_length : 32;
+
+    for (size_t i = 0; i < first; ++i) {
+        plain[i] = cipher[i] ^ block0[32 + i];
+    }
+
+    if (cipher_length > first) {
+        crypto_stream_salsa20_xor_ic(plain + first, cipher + first, cipher_length - first, nonce + 16, 1, subkey);
+    }
+
+    crypto_memzero(block0, sizeof(block0));
+    return cipher_length;
+}
+#endif
+
+uint32_t decrypt_data_symmetric_batch(Crypto_Batch_Entry *entries, uint32_t count)
+{
+    uint32_t decrypted = 0;
+
+#ifndef VANILLA_NACL
+    /* Packets of one connection share the key and, as their nonces are
+     * counters in the last bytes, nearly always the first 16 nonce bytes too.
+     * Those are all the HSalsa20 subkey depends on.
+     */
+    uint8_t subkey[crypto_core_hsalsa20_OUTPUTBYTES];
+    uint8_t subkey_input[crypto_box_BEFORENMBYTES + 16];
+    bool have_subkey = false;
+#endif
+
+    for (uint32_t i = 0; i < count; ++i) {
+        Crypto_Batch_Entry *entry = &entries[i];
+        entry->plain_length = -1;
+
+        if (entry->length <= crypto_box_BOXZEROBYTES || !entry->shared_key || !entry->nonce || !entry->encrypted
+                || !entry->plain) {
+            continue;
+        }
+
+#ifndef VANILLA_NACL
+
+        if (!have_subkey || crypto_memcmp(subkey_input, entry->shared_key, crypto_box_BEFORENMBYTES) != 0
+                || crypto_memcmp(subkey_input + crypto_box_BEFORENMBYTES, entry->nonce, 16) != 0) {
+            memcpy(subkey_input, entry->shared_key, crypto_box_BEFORENMBYTES);
+            memcpy(subkey_input + crypto_box_BEFORENMBYTES, entry->nonce, 16);
+            crypto_core_hsalsa20(subkey, entry->nonce, entry->shared_key, NULL);
+            have_subkey = true;
+        }
+
+        entry->plain_length = decrypt_data_subkey(subkey, entry->nonce, entry->encrypted, entry->length, entry->plain);
+#else
+        entry->plain_length = decrypt_data_symmetric(entry->shared_key, entry->nonce, entry->encrypted, entry->length,
+                              entry->plain);
+#endif
+
+        if (entry->plain_length != -1) {
+            ++decrypted;
+        }
+    }
+
+#ifndef VANILLA_NACL
+    crypto_memzero(subkey, sizeof(subkey));
+    crypto_memzero(subkey_input, sizeof(subkey_input));
+#endif
+    return decrypted;
+}
+
 int32_t encrypt_data(const uint8_t *public_key, const uint8_t *secret_key, const uint8_t *nonce,
                      const uint8_t *plain, size_t length, uint8_t *encrypted)
 {
@@ -204,6 +204,53 @@ int32_t encrypt_data_symmetric(const uint8_t *shared_key, const uint8_t *nonce,
 int32_t decrypt_data_symmetric(const uint8_t *shared_key, const uint8_t *nonce, const uint8_t *encrypted, size_t length,
                                uint8_t *plain);
 
+/**
+ * Encrypts the length bytes of data in place using a shared key
+ * CRYPTO_SYMMETRIC_KEY_SIZE big and a CRYPTO_NONCE_SIZE byte nonce, and puts
+ * the CRYPTO_MAC_SIZE byte MAC into mac. With mac = data - CRYPTO_MAC_SIZE the
+ * result is the same as that of encrypt_data_symmetric, so callers that leave
+ * room for the MAC in front of the plain text don't need a second buffer.
+ *
+ * @return -1 if there was a problem, length if everything was fine.
+ */
+int32_t encrypt_data_symmetric_detached(const uint8_t *shared_key, const uint8_t *nonce, uint8_t *data, size_t length,
+                                        uint8_t *mac);
+
+/**
+ * Decrypts the length bytes of data in place using a shared key
+ * CRYPTO_SHARED_KEY_SIZE big, a CRYPTO_NONCE_SIZE byte nonce and the
+ * CRYPTO_MAC_SIZE byte MAC mac. data is left unchanged if decryption fails.
+ *
+ * @return -1 if there was a problem (decryption failed), length if everything
+ * was fine.
+ */
+int32_t decrypt_data_symmetric_detached(const uint8_t *shared_key, const uint8_t *nonce, uint8_t *data, size_t length,
+                                        const uint8_t *mac);
+
+/**
+ * A packet for decrypt_data_symmetric_batch.
+ */
+typedef struct Crypto_Batch_Entry {
+    const uint8_t *shared_key;
+    const uint8_t *nonce;
+    const uint8_t *encrypted;
+    size_t length;
+    uint8_t *plain;
+
+    /* Set to what decrypt_data_symmetric would return for the packet. */
+    int32_t plain_length;
+} Crypto_Batch_Entry;
+
+/**
+ * Decrypts count packets like decrypt_data_symmetric. Consecutive packets with
+ * the same shared key and nonces that only differ in their last 8 bytes, like
+ * a burst received on one connection, share the part of the work that only
+ * depends on those.
+ *
+ * @return the number of packets that were decrypted.
+ */
+uint32_t decrypt_data_symmetric_batch(Crypto_Batch_Entry *entries, uint32_t count);
+
 /**
  * Increment the given nonce by 1 in big endian (rightmost byte incremented
  * first).
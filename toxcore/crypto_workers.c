@@ -0,0 +1,322 @@
+/*
+ * Pool of threads that authenticate and decrypt received packets so that
+ * the thread calling networking_poll only has to do the stateful part of
+ * packet handling.
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "crypto_workers.h"
+
+#include <pthread.h>
+
+struct Crypto_Workers {
+    pthread_mutex_t mutex;
+    pthread_cond_t work_cond; /* Signalled when a job is submitted or on shutdown. */
+    pthread_cond_t done_cond; /* Signalled when a worker finishes a job. */
+
+    pthread_t threads[CRYPTO_WORKERS_MAX_THREADS];
+    uint32_t num_threads;
+    bool stop;
+
+    /* jobs[head] is the oldest job not handed back yet, jobs[next] the oldest
+     * job no thread has picked up and jobs[tail] the next free slot.
+     * head <= next <= tail, all modulo CRYPTO_WORKERS_QUEUE_SIZE.
+     */
+    Crypto_Job jobs[CRYPTO_WORKERS_QUEUE_SIZE];
+    uint32_t head;
+    uint32_t next;
+    uint32_t tail;
+};
+
+/* Jobs a thread takes from the queue at once, so that bursts of packets from
+ * one connection are decrypted together by decrypt_data_symmetric_batch.
+ */
+#define CRYPTO_WORKERS_BATCH 16
+
+/* Run the count jobs from jobs[first] on. */
+static void run_jobs(Crypto_Workers *workers, uint32_t first, uint32_t count)
+{
+    Crypto_Batch_Entry entries[CRYPTO_WORKERS_BATCH];
+
+    for (uint32_t i = 0; i < count; ++i) {
+        Crypto_Job *job = &workers->jobs[(first + i) % CRYPTO_WORKERS_QUEUE_SIZE];
+
+        if (job->compute_shared_key) {
+            encrypt_precompute(job->public_key, job->secret_key, job->shared_key);
+            crypto_memzero(job->secret_key, CRYPTO_SECRET_KEY_SIZE);
+        }
+
+        entries[i].shared_key = job->shared_key;
+        entries[i].nonce = job->nonce;
+        entries[i].encrypted = job->packet + job->encrypted_start;
+        entries[i].length = job->encrypted_length;
+        entries[i].plain = job->plain;
+    }
+
+    decrypt_data_symmetric_batch(entries, count);
+
+    for (uint32_t i = 0; i < count; ++i) {
+        workers->jobs[(first + i) % CRYPTO_WORKERS_QUEUE_SIZE].plain_length = entries[i].plain_length;
+    }
+}
+
+/* Take the next jobs no thread has picked up yet, leaving some for the other
+ * threads if there are only a few. Must be called with the mutex held.
+ *
+ * return the number of jobs taken and set first to the first of them.
+ */
+static uint32_t take_jobs(Crypto_Workers *workers, uint32_t *first)
+{
+    const uint32_t pending = workers->tail - workers->next;
+    uint32_t count = (pending + workers->num_threads - 1) / workers->num_threads;
+
+    if (count > CRYPTO_WORKERS_BATCH) {
+        count = CRYPTO_WORKERS_BATCH;
+    }
+
+    *first = workers->next;
+    workers->next += count;
+    return count;
+}
+
+static void finish_jobs(Crypto_Workers *workers, uint32_t first, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; ++i) {
+        workers->jobs[(first + i) % CRYPTO_WORKERS_QUEUE_SIZE].done = true;
+    }
+}
+
+static void *worker_thread(void *arg)
+{
+    Crypto_Workers *workers = (Crypto_Workers *)arg;
+
+    pthread_mutex_lock(&workers->mutex);
+
+    while (!workers->stop) {
+        if (workers->next == workers->tail) {
+            pthread_cond_wait(&workers->work_cond, &workers->mutex);
+            continue;
+        }
+
+        uint32_t first;
+        const uint32_t count = take_jobs(workers, &first);
+        pthread_mutex_unlock(&workers->mutex);
+
+        run_jobs(workers, first, count);
+
+        pthread_mutex_lock(&workers->mutex);
+        finish_jobs(workers, first, count);
+        pthread_cond_signal(&workers->done_cond);
+    }
+
+    pthread_mutex_unlock(&workers->mutex);
+    return NULL;
+}
+
+/* Start a pool of num_threads worker threads.
+ *
+ * return NULL on failure.
+ * return the new pool on success.
+ */
+Crypto_Workers *new_crypto_workers(uint32_t num_threads)
+{
+    if (num_threads == 0 || num_threads > CRYPTO_WORKERS_MAX_THREADS) {
+        return NULL;
+    }
+
+    Crypto_Workers *workers = (Crypto_Workers *)calloc(1, sizeof(Crypto_Workers));
+
+    if (workers == NULL) {
+        return NULL;
+    }
+
+    if (pthread_mutex_init(&workers->mutex, NULL) != 0) {
+        free(workers);
+        return NULL;
+    }
+
+    if (pthread_cond_init(&workers->work_cond, NULL) != 0) {
+        pthread_mutex_destroy(&workers->mutex);
+        free(workers);
+        return NULL;
+    }
+
+    if (pthread_cond_init(&workers->done_cond, NULL) != 0) {
+        pthread_cond_destroy(&workers->work_cond);
+        pthread_mutex_destroy(&workers->mutex);
+        free(workers);
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < num_threads; ++i) {
+        if (pthread_create(&workers->threads[i], NULL, &worker_thread, workers) != 0) {
+            kill_crypto_workers(workers);
+            return NULL;
+        }
+
+        ++workers->num_threads;
+    }
+
+    return workers;
+}
+
+/* Stop the worker threads and free the pool.
+ * Jobs that were not handed back yet are dropped.
+ */
+void kill_crypto_workers(Crypto_Workers *workers)
+{
+    if (workers == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&workers->mutex);
+    workers->stop = true;
+    pthread_cond_broadcast(&workers->work_cond);
+    pthread_mutex_unlock(&workers->mutex);
+
+    for (uint32_t i = 0; i < workers->num_threads; ++i) {
+        pthread_join(workers->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&workers->done_cond);
+    pthread_cond_destroy(&workers->work_cond);
+    pthread_mutex_destroy(&workers->mutex);
+
+    for (uint32_t i = 0; i < CRYPTO_WORKERS_QUEUE_SIZE; ++i) {
+        Crypto_Job *job = &workers->jobs[i];
+
+        if (job->plain != NULL) {
+            crypto_memzero(job->plain, job->capacity);
+        }
+
+        free(job->plain);
+        free(job->packet);
+    }
+
+    crypto_memzero(workers->jobs, sizeof(workers->jobs));
+    free(workers);
+}
+
+/* Make packet and plain of job hold at least length bytes. No worker uses
+ * job while this is called.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int job_reserve(Crypto_Job *job, uint16_t length)
+{
+    if (job->capacity >= length) {
+        return 0;
+    }
+
+    /* Not realloc: the old plain buffer may hold decrypted data to wipe. */
+    if (job->plain != NULL) {
+        crypto_memzero(job->plain, job->capacity);
+    }
+
+    free(job->plain);
+    free(job->packet);
+    job->packet = (uint8_t *)malloc(length);
+    job->plain = (uint8_t *)malloc(length);
+
+    if (job->packet == NULL || job->plain == NULL) {
+        free(job->plain);
+        free(job->packet);
+        job->packet = NULL;
+        job->plain = NULL;
+        job->capacity = 0;
+        return -1;
+    }
+
+    job->capacity = length;
+    return 0;
+}
+
+/* Get an empty job for a packet of length bytes to fill in and then pass to
+ * crypto_workers_submit. If the queue is full, finished jobs are handed back
+ * first.
+ */
+Crypto_Job *crypto_workers_job(Crypto_Workers *workers, uint16_t length, void *userdata)
+{
+    /* Only this thread moves head and tail, so they can be read unlocked. */
+    if (workers->tail - workers->head == CRYPTO_WORKERS_QUEUE_SIZE) {
+        crypto_workers_drain(workers, userdata);
+    }
+
+    Crypto_Job *job = &workers->jobs[workers->tail % CRYPTO_WORKERS_QUEUE_SIZE];
+
+    if (job_reserve(job, length) == -1) {
+        return NULL;
+    }
+
+    job->compute_shared_key = false;
+    job->done = false;
+    return job;
+}
+
+/* Queue the job last returned by crypto_workers_job. */
+void crypto_workers_submit(Crypto_Workers *workers)
+{
+    pthread_mutex_lock(&workers->mutex);
+    ++workers->tail;
+    pthread_cond_signal(&workers->work_cond);
+    pthread_mutex_unlock(&workers->mutex);
+}
+
+/* Wait for all queued jobs to finish and hand them back in order. */
+void crypto_workers_drain(Crypto_Workers *workers, void *userdata)
+{
+    pthread_mutex_lock(&workers->mutex);
+
+    while (workers->head != workers->tail) {
+        Crypto_Job *job = &workers->jobs[workers->head % CRYPTO_WORKERS_QUEUE_SIZE];
+
+        if (!job->done) {
+            if (workers->next == workers->tail) {
+                pthread_cond_wait(&workers->done_cond, &workers->mutex);
+                continue;
+            }
+
+            /* Help out rather than sit idle. */
+            uint32_t first;
+            const uint32_t count = take_jobs(workers, &first);
+            pthread_mutex_unlock(&workers->mutex);
+
+            run_jobs(workers, first, count);
+
+            pthread_mutex_lock(&workers->mutex);
+            finish_jobs(workers, first, count);
+            continue;
+        }
+
+        pthread_mutex_unlock(&workers->mutex);
+
+        job->function(job->object, job, userdata);
+
+        pthread_mutex_lock(&workers->mutex);
+        ++workers->head;
+    }
+
+    pthread_mutex_unlock(&workers->mutex);
+}
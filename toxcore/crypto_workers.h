@@ -0,0 +1,113 @@
+/*
+ * Pool of threads that authenticate and decrypt received packets so that
+ * the thread calling networking_poll only has to do the stateful part of
+ * packet handling.
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef CRYPTO_WORKERS_H
+#define CRYPTO_WORKERS_H
+
+#include "crypto_core.h"
+#include "network.h"
+
+#include <stdbool.h>
+
+#define CRYPTO_WORKERS_MAX_THREADS 64
+
+/* Maximum number of jobs that can be queued before the oldest ones have to be
+ * handed back to the main thread.
+ */
+#define CRYPTO_WORKERS_QUEUE_SIZE 256
+
+typedef struct Crypto_Job Crypto_Job;
+
+/* Called on the thread that called crypto_workers_drain once job is done.
+ * Jobs are handed back in the order they were submitted.
+ */
+typedef void crypto_job_cb(void *object, Crypto_Job *job, void *userdata);
+
+struct Crypto_Job {
+    crypto_job_cb *function;
+    void *object;
+
+    /* Free for the caller to use, e.g. for a connection id. */
+    int32_t number;
+    IP_Port source;
+
+    /* If set, the worker computes shared_key from public_key and secret_key
+     * before decrypting. The secret key is wiped once it has been used.
+     */
+    bool compute_shared_key;
+    uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t secret_key[CRYPTO_SECRET_KEY_SIZE];
+    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
+
+    uint8_t nonce[CRYPTO_NONCE_SIZE];
+    uint8_t *packet;
+    uint16_t length;
+
+    /* Part of packet to decrypt into plain. */
+    uint16_t encrypted_start;
+    uint16_t encrypted_length;
+
+    uint8_t *plain;
+    int plain_length; /* -1 if the packet failed to decrypt. */
+
+    /* Size of packet and plain, set by the pool. They only grow as large as
+     * the largest packet the job was used for.
+     */
+    uint16_t capacity;
+
+    bool done; /* Set by the pool. */
+};
+
+/* Start a pool of num_threads worker threads.
+ *
+ * return NULL on failure.
+ * return the new pool on success.
+ */
+Crypto_Workers *new_crypto_workers(uint32_t num_threads);
+
+/* Stop the worker threads and free the pool.
+ * Jobs that were not handed back yet are dropped.
+ */
+void kill_crypto_workers(Crypto_Workers *workers);
+
+/* Get an empty job for a packet of length bytes to fill in and then pass to
+ * crypto_workers_submit. If the queue is full, finished jobs are handed back
+ * first.
+ *
+ * Must not be called from a crypto_job_cb.
+ *
+ * return NULL if the job could not hold the packet.
+ * return the job on success.
+ */
+Crypto_Job *crypto_workers_job(Crypto_Workers *workers, uint16_t length, void *userdata);
+
+/* Queue the job last returned by crypto_workers_job. */
+void crypto_workers_submit(Crypto_Workers *workers);
+
+/* Wait for all queued jobs to finish and hand them back in order. The calling
+ * thread decrypts jobs itself instead of waiting while some are still queued.
+ */
+void crypto_workers_drain(Crypto_Workers *workers, void *userdata);
+
+#endif
@@ -82,9 +82,12 @@ static int create_friend_conn(Friend_Connections *fr_c)
 {
     uint32_t i;
 
-    for (i = 0; i < fr_c->num_cons; ++i) {
-        if (fr_c->conns[i].status == FRIENDCONN_STATUS_NONE) {
-            return i;
+    /* If every connection is in the index there are no free slots to reuse. */
+    if (fr_c->conn_index.size != fr_c->num_cons) {
+        for (i = 0; i < fr_c->num_cons; ++i) {
+            if (fr_c->conns[i].status == FRIENDCONN_STATUS_NONE) {
+                return i;
+            }
         }
     }
 
@@ -111,6 +114,8 @@ static int wipe_friend_conn(Friend_Connections *fr_c, int friendcon_id)
     }
 
     uint32_t i;
+    pk_index_remove(&fr_c->conn_index, fr_c->conns[friendcon_id].real_public_key);
+    timer_stop(fr_c->timers, friendcon_id);
     memset(&(fr_c->conns[friendcon_id]), 0 , sizeof(Friend_Conn));
 
     for (i = fr_c->num_cons; i != 0; --i) {
@@ -127,6 +132,12 @@ static int wipe_friend_conn(Friend_Connections *fr_c, int friendcon_id)
     return 0;
 }
 
+/* Run do_friend_connection for the friend connection at the next do_friend_connections. */
+static void wake_friend_conn(Friend_Connections *fr_c, int friendcon_id)
+{
+    timer_set(fr_c->timers, friendcon_id, 0);
+}
+
 static Friend_Conn *get_conn(const Friend_Connections *fr_c, int friendcon_id)
 {
     if (friendconn_id_not_valid(fr_c, friendcon_id)) {
@@ -141,19 +152,7 @@ static Friend_Conn *get_conn(const Friend_Connections *fr_c, int friendcon_id)
  */
 int getfriend_conn_id_pk(Friend_Connections *fr_c, const uint8_t *real_pk)
 {
-    uint32_t i;
-
-    for (i = 0; i < fr_c->num_cons; ++i) {
-        Friend_Conn *friend_con = get_conn(fr_c, i);
-
-        if (friend_con) {
-            if (public_key_cmp(friend_con->real_public_key, real_pk) == 0) {
-                return i;
-            }
-        }
-    }
-
-    return -1;
+    return pk_index_get(&fr_c->conn_index, real_pk);
 }
 
 /* Add a TCP relay associated to the friend.
@@ -293,6 +292,7 @@ static void dht_ip_callback(void *object, int32_t number, IP_Port ip_port)
     set_direct_ip_port(fr_c->net_crypto, friend_con->crypt_connection_id, ip_port, 1);
     friend_con->dht_ip_port = ip_port;
     friend_con->dht_ip_port_lastrecv = unix_time();
+    wake_friend_conn(fr_c, number);
 
     if (friend_con->hosting_tcp_relay) {
         friend_add_tcp_relay(fr_c, number, ip_port, friend_con->dht_temp_pk);
@@ -321,6 +321,7 @@ static void change_dht_pk(Friend_Connections *fr_c, int friendcon_id, const uint
 
     DHT_addfriend(fr_c->dht, dht_public_key, dht_ip_callback, fr_c, friendcon_id, &friend_con->dht_lock);
     memcpy(friend_con->dht_temp_pk, dht_public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    wake_friend_conn(fr_c, friendcon_id);
 }
 
 static int handle_status(void *object, int number, uint8_t status, void *userdata)
@@ -352,6 +353,8 @@ static int handle_status(void *object, int number, uint8_t status, void *userdat
         friend_con->hosting_tcp_relay = 0;
     }
 
+    wake_friend_conn(fr_c, number);
+
     if (call_cb) {
         unsigned int i;
 
@@ -516,6 +519,7 @@ static int handle_new_connections(void *object, New_Connection *n_c)
         } else {
             friend_con->dht_ip_port = n_c->source;
             friend_con->dht_ip_port_lastrecv = unix_time();
+            wake_friend_conn(fr_c, friendcon_id);
         }
 
         if (public_key_cmp(friend_con->dht_temp_pk, n_c->dht_public_key) != 0) {
@@ -718,6 +722,18 @@ int new_friend_connection(Friend_Connections *fr_c, const uint8_t *real_public_k
         return -1;
     }
 
+    if (pk_index_set(&fr_c->conn_index, real_public_key, friendcon_id) == -1) {
+        onion_delfriend(fr_c->onion_c, onion_friendnum);
+        return -1;
+    }
+
+    /* Setting the timer here makes room for it, so waking the friend connection later can't fail. */
+    if (timer_set(fr_c->timers, friendcon_id, 0) == -1) {
+        pk_index_remove(&fr_c->conn_index, real_public_key);
+        onion_delfriend(fr_c->onion_c, onion_friendnum);
+        return -1;
+    }
+
     Friend_Conn *friend_con = &fr_c->conns[friendcon_id];
 
     friend_con->crypt_connection_id = -1;
@@ -810,6 +826,8 @@ int send_friend_request_packet(Friend_Connections *fr_c, int friendcon_id, uint3
     return num;
 }
 
+static void do_friend_connection(void *object, uint32_t number, void *userdata);
+
 /* Create new friend_connections instance. */
 Friend_Connections *new_friend_connections(Onion_Client *onion_c, bool local_discovery_enabled)
 {
@@ -827,6 +845,12 @@ Friend_Connections *new_friend_connections(Onion_Client *onion_c, bool local_dis
     temp->net_crypto = onion_c->c;
     temp->onion_c = onion_c;
     temp->local_discovery_enabled = local_discovery_enabled;
+    temp->timers = new_timer_wheel(&do_friend_connection, temp, unix_time());
+
+    if (temp->timers == NULL) {
+        free(temp);
+        return NULL;
+    }
 
     new_connection_handler(temp->net_crypto, &handle_new_connections, temp);
 
@@ -846,53 +870,90 @@ static void LANdiscovery(Friend_Connections *fr_c)
     }
 }
 
-/* main friend_connections loop. */
-void do_friend_connections(Friend_Connections *fr_c, void *userdata)
+/* Periodic work of a friend connection, called when its timer expires. */
+static void do_friend_connection(void *object, uint32_t number, void *userdata)
 {
-    uint32_t i;
+    Friend_Connections *fr_c = (Friend_Connections *)object;
+    const int i = number;
+    Friend_Conn *friend_con = get_conn(fr_c, i);
+
+    if (!friend_con) {
+        return;
+    }
+
     uint64_t temp_time = unix_time();
 
-    for (i = 0; i < fr_c->num_cons; ++i) {
-        Friend_Conn *friend_con = get_conn(fr_c, i);
-
-        if (friend_con) {
-            if (friend_con->status == FRIENDCONN_STATUS_CONNECTING) {
-                if (friend_con->dht_pk_lastrecv + FRIEND_DHT_TIMEOUT < temp_time) {
-                    if (friend_con->dht_lock) {
-                        DHT_delfriend(fr_c->dht, friend_con->dht_temp_pk, friend_con->dht_lock);
-                        friend_con->dht_lock = 0;
-                    }
-                }
-
-                if (friend_con->dht_ip_port_lastrecv + FRIEND_DHT_TIMEOUT < temp_time) {
-                    friend_con->dht_ip_port.ip.family = 0;
-                }
-
-                if (friend_con->dht_lock) {
-                    if (friend_new_connection(fr_c, i) == 0) {
-                        set_direct_ip_port(fr_c->net_crypto, friend_con->crypt_connection_id, friend_con->dht_ip_port, 0);
-                        connect_to_saved_tcp_relays(fr_c, i, (MAX_FRIEND_TCP_CONNECTIONS / 2)); /* Only fill it half up. */
-                    }
-                }
-            } else if (friend_con->status == FRIENDCONN_STATUS_CONNECTED) {
-                if (friend_con->ping_lastsent + FRIEND_PING_INTERVAL < temp_time) {
-                    send_ping(fr_c, i);
-                }
-
-                if (friend_con->share_relays_lastsent + SHARE_RELAYS_INTERVAL < temp_time) {
-                    send_relays(fr_c, i);
-                }
-
-                if (friend_con->ping_lastrecv + FRIEND_CONNECTION_TIMEOUT < temp_time) {
-                    /* If we stopped receiving ping packets, kill it. */
-                    crypto_kill(fr_c->net_crypto, friend_con->crypt_connection_id);
-                    friend_con->crypt_connection_id = -1;
-                    handle_status(fr_c, i, 0, userdata); /* Going offline. */
-                }
+    if (friend_con->status == FRIENDCONN_STATUS_CONNECTING) {
+        if (friend_con->dht_pk_lastrecv + FRIEND_DHT_TIMEOUT < temp_time) {
+            if (friend_con->dht_lock) {
+                DHT_delfriend(fr_c->dht, friend_con->dht_temp_pk, friend_con->dht_lock);
+                friend_con->dht_lock = 0;
+            }
+        }
+
+        if (friend_con->dht_ip_port_lastrecv + FRIEND_DHT_TIMEOUT < temp_time) {
+            friend_con->dht_ip_port.ip.family = 0;
+        }
+
+        if (friend_con->dht_lock) {
+            if (friend_new_connection(fr_c, i) == 0) {
+                set_direct_ip_port(fr_c->net_crypto, friend_con->crypt_connection_id, friend_con->dht_ip_port, 0);
+                connect_to_saved_tcp_relays(fr_c, i, (MAX_FRIEND_TCP_CONNECTIONS / 2)); /* Only fill it half up. */
             }
         }
+    } else if (friend_con->status == FRIENDCONN_STATUS_CONNECTED) {
+        if (friend_con->ping_lastsent + FRIEND_PING_INTERVAL < temp_time) {
+            send_ping(fr_c, i);
+        }
+
+        if (friend_con->share_relays_lastsent + SHARE_RELAYS_INTERVAL < temp_time) {
+            send_relays(fr_c, i);
+        }
+
+        if (friend_con->ping_lastrecv + FRIEND_CONNECTION_TIMEOUT < temp_time) {
+            /* If we stopped receiving ping packets, kill it. */
+            crypto_kill(fr_c->net_crypto, friend_con->crypt_connection_id);
+            friend_con->crypt_connection_id = -1;
+            handle_status(fr_c, i, 0, userdata); /* Going offline, wakes the friend connection again. */
+            return;
+        }
     }
 
+    /* Everything that can make the checks above pass sooner than the times
+     * below wakes the friend connection. */
+    uint64_t next = UINT64_MAX;
+
+    if (friend_con->status == FRIENDCONN_STATUS_CONNECTING) {
+        if (friend_con->dht_lock) {
+            if (friend_con->crypt_connection_id == -1) {
+                /* Keep trying to connect. */
+                next = 0;
+            } else {
+                next = friend_con->dht_pk_lastrecv + FRIEND_DHT_TIMEOUT + 1;
+            }
+        }
+
+        if (friend_con->dht_ip_port.ip.family != 0) {
+            next = MIN(next, friend_con->dht_ip_port_lastrecv + FRIEND_DHT_TIMEOUT + 1);
+        }
+    } else if (friend_con->status == FRIENDCONN_STATUS_CONNECTED) {
+        next = friend_con->ping_lastsent + FRIEND_PING_INTERVAL + 1;
+        next = MIN(next, friend_con->share_relays_lastsent + SHARE_RELAYS_INTERVAL + 1);
+        next = MIN(next, friend_con->ping_lastrecv + FRIEND_CONNECTION_TIMEOUT + 1);
+    }
+
+    if (next == UINT64_MAX) {
+        timer_stop(fr_c->timers, i);
+    } else {
+        timer_set(fr_c->timers, i, next);
+    }
+}
+
+/* main friend_connections loop. */
+void do_friend_connections(Friend_Connections *fr_c, void *userdata)
+{
+    do_timer_wheel(fr_c->timers, unix_time(), userdata);
+
     if (fr_c->local_discovery_enabled) {
         LANdiscovery(fr_c);
     }
@@ -915,5 +976,7 @@ void kill_friend_connections(Friend_Connections *fr_c)
         LANdiscovery_kill(fr_c->dht);
     }
 
+    pk_index_free(&fr_c->conn_index);
+    kill_timer_wheel(fr_c->timers);
     free(fr_c);
 }
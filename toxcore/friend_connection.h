@@ -28,6 +28,7 @@
 #include "LAN_discovery.h"
 #include "net_crypto.h"
 #include "onion_client.h"
+#include "timer_wheel.h"
 
 #define MAX_FRIEND_CONNECTION_CALLBACKS 2
 #define MESSENGER_CALLBACK_INDEX 0
@@ -101,6 +102,8 @@ typedef struct {
 
     Friend_Conn *conns;
     uint32_t num_cons;
+    PK_Index conn_index; /* Friend connection ids by real_public_key. */
+    Timer_Wheel *timers; /* When each friend connection next needs do_friend_connection. */
 
     int (*fr_request_callback)(void *object, const uint8_t *source_pubkey, const uint8_t *data, uint16_t len,
                                void *userdata);
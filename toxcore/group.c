@@ -113,6 +113,7 @@ static int wipe_group_chat(Group_Chats *g_c, int groupnumber)
     }
 
     uint32_t i;
+    pk_index_free(&g_c->chats[groupnumber].peer_index);
     crypto_memzero(&(g_c->chats[groupnumber]), sizeof(Group_c));
 
     for (i = g_c->num_chats; i != 0; --i) {
@@ -143,21 +144,11 @@ static Group_c *get_group_c(const Group_Chats *g_c, int groupnumber)
  *
  * return peer index if peer is in chat.
  * return -1 if peer is not in chat.
- *
- * TODO(irungentoo): make this more efficient.
  */
 
 static int peer_in_chat(const Group_c *chat, const uint8_t *real_pk)
 {
-    uint32_t i;
-
-    for (i = 0; i < chat->numpeers; ++i) {
-        if (id_equal(chat->group[i].real_pk, real_pk)) {
-            return i;
-        }
-    }
-
-    return -1;
+    return pk_index_get(&chat->peer_index, real_pk);
 }
 
 /*
@@ -442,9 +433,14 @@ static int addpeer(Group_Chats *g_c, int groupnumber, const uint8_t *real_pk, co
         return -1;
     }
 
-    memset(&(temp[g->numpeers]), 0, sizeof(Group_Peer));
     g->group = temp;
 
+    if (pk_index_set(&g->peer_index, real_pk, g->numpeers) == -1) {
+        return -1;
+    }
+
+    memset(&(g->group[g->numpeers]), 0, sizeof(Group_Peer));
+
     id_copy(g->group[g->numpeers].real_pk, real_pk);
     id_copy(g->group[g->numpeers].temp_pk, temp_pk);
     g->group[g->numpeers].peer_number = peer_number;
@@ -522,6 +518,7 @@ static int delpeer(Group_Chats *g_c, int groupnumber, int peer_index, void *user
     }
 
     --g->numpeers;
+    pk_index_remove(&g->peer_index, g->group[peer_index].real_pk);
 
     void *peer_object = g->group[peer_index].object;
 
@@ -531,6 +528,7 @@ static int delpeer(Group_Chats *g_c, int groupnumber, int peer_index, void *user
     } else {
         if (g->numpeers != (uint32_t)peer_index) {
             memcpy(&g->group[peer_index], &g->group[g->numpeers], sizeof(Group_Peer));
+            pk_index_set(&g->peer_index, g->group[peer_index].real_pk, peer_index);
         }
 
         Group_Peer *temp = (Group_Peer *)realloc(g->group, sizeof(Group_Peer) * (g->numpeers));
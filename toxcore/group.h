@@ -72,6 +72,7 @@ typedef struct {
 
     Group_Peer *group;
     uint32_t numpeers;
+    PK_Index peer_index; /* Peer indices by real_pk. */
 
     struct {
         uint8_t type; /* GROUPCHAT_CLOSE_* */
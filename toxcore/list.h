@@ -1,7 +1,7 @@
 /*
  * Simple struct with functions to create a list which associates ids with data
  * -Allows for finding ids associated with data such as IPs or public keys in a short time
- * -Should only be used if there are relatively few add/remove calls to the list
+ * -Adding and removing elements takes constant time on average
  */
 
 /*
@@ -26,20 +26,20 @@
 #ifndef LIST_H
 #define LIST_H
 
+#include "util.h"
+
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 typedef struct {
-    uint32_t n; //number of elements
-    uint32_t capacity; //number of elements memory is allocated for
     uint32_t element_size; //size of the elements
-    uint8_t *data; //array of elements
-    int *ids; //array of element ids
+    Hash_Index index; //ids by element
 } BS_LIST;
 
 /* Initialize a list, element_size is the size of the elements in the list and
- * initial_capacity is the number of elements the memory will be initially allocated for
+ * initial_capacity is the number of elements expected; the memory is allocated
+ * as elements are added
  *
  * return value:
  *  1 : success
@@ -58,7 +58,7 @@ void bs_list_free(BS_LIST *list);
  */
 int bs_list_find(const BS_LIST *list, const uint8_t *data);
 
-/* Add an element with associated id to the list
+/* Add an element with associated id to the list, id must not be negative
  *
  * return value:
  *  1 : success
@@ -29,6 +29,7 @@
 
 #include "net_crypto.h"
 
+#include "crypto_workers.h"
 #include "util.h"
 
 #include <math.h>
@@ -544,6 +545,12 @@ static int send_packet_to(Net_Crypto *c, int crypt_connection_id, const uint8_t
     }
 
     pthread_mutex_unlock(&conn->mutex);
+
+    /* TCP relays don't take packets larger than that, see MAX_CRYPTO_MTU. */
+    if (length > MAX_CRYPTO_STREAM_PACKET_SIZE) {
+        return -1;
+    }
+
     pthread_mutex_lock(&c->tcp_mutex);
     int ret = send_packet_tcp_connection(c->tcp_c, conn->connection_number_tcp, data, length);
     pthread_mutex_unlock(&c->tcp_mutex);
@@ -566,6 +573,266 @@ static int send_packet_to(Net_Crypto *c, int crypt_connection_id, const uint8_t
 /** START: Array Related functions **/
 
 
+static int packet_pool_init(Packet_Pool *pool)
+{
+    pool->free_packets = NULL;
+    pool->num_free_packets = 0;
+    pool->free_chunks = NULL;
+    pool->num_free_chunks = 0;
+    return pthread_mutex_init(&pool->mutex, NULL);
+}
+
+static void packet_pool_free_list(void *list)
+{
+    while (list != NULL) {
+        void *next = *(void **)list;
+        free(list);
+        list = next;
+    }
+}
+
+static void packet_pool_kill(Packet_Pool *pool)
+{
+    packet_pool_free_list(pool->free_packets);
+    packet_pool_free_list(pool->free_chunks);
+    pthread_mutex_destroy(&pool->mutex);
+}
+
+/* Take an item from a free list, the first bytes of each free item hold the
+ * pointer to the next one.
+ *
+ * return NULL if the list is empty.
+ */
+static void *packet_pool_take(Packet_Pool *pool, void **list, uint32_t *count)
+{
+    pthread_mutex_lock(&pool->mutex);
+    void *item = *list;
+
+    if (item != NULL) {
+        *list = *(void **)item;
+        --*count;
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+    return item;
+}
+
+static void packet_pool_give(Packet_Pool *pool, void **list, uint32_t *count, uint32_t max_count, void *item)
+{
+    pthread_mutex_lock(&pool->mutex);
+
+    if (*count < max_count) {
+        *(void **)item = *list;
+        *list = item;
+        ++*count;
+        item = NULL;
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+    free(item);
+}
+
+static Packet_Data *packet_pool_new_packet(Packet_Pool *pool)
+{
+    Packet_Data *packet = (Packet_Data *)packet_pool_take(pool, &pool->free_packets, &pool->num_free_packets);
+
+    if (packet == NULL) {
+        packet = (Packet_Data *)malloc(sizeof(Packet_Data));
+    }
+
+    return packet;
+}
+
+static void packet_pool_free_packet(Packet_Pool *pool, Packet_Data *packet)
+{
+    packet_pool_give(pool, &pool->free_packets, &pool->num_free_packets, CRYPTO_POOL_MAX_FREE_PACKETS, packet);
+}
+
+static Packets_Chunk *packet_pool_new_chunk(Packet_Pool *pool)
+{
+    Packets_Chunk *chunk = (Packets_Chunk *)packet_pool_take(pool, &pool->free_chunks, &pool->num_free_chunks);
+
+    if (chunk == NULL) {
+        return (Packets_Chunk *)calloc(1, sizeof(Packets_Chunk));
+    }
+
+    memset(chunk, 0, sizeof(Packets_Chunk));
+    return chunk;
+}
+
+static void packet_pool_free_chunk(Packet_Pool *pool, Packets_Chunk *chunk)
+{
+    packet_pool_give(pool, &pool->free_chunks, &pool->num_free_chunks, CRYPTO_POOL_MAX_FREE_CHUNKS, chunk);
+}
+
+static uint32_t packet_chunk_index(uint32_t number)
+{
+    return (number % CRYPTO_PACKET_BUFFER_SIZE) / CRYPTO_PACKET_CHUNK_SIZE;
+}
+
+/* return the packet stored at packet number or NULL if there is none.
+ */
+static Packet_Data *get_packet(const Packets_Array *array, uint32_t number)
+{
+    const Packets_Chunk *chunk = array->chunks[packet_chunk_index(number)];
+
+    if (chunk == NULL) {
+        return NULL;
+    }
+
+    return chunk->buffer[number % CRYPTO_PACKET_CHUNK_SIZE];
+}
+
+/* Store a copy of data at packet number, allocating its chunk if needed.
+ * There must be no packet at number yet.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int set_packet(Packet_Pool *pool, Packets_Array *array, uint32_t number, const Packet_Data *data)
+{
+    Packets_Chunk **chunk = &array->chunks[packet_chunk_index(number)];
+
+    if (*chunk == NULL) {
+        *chunk = packet_pool_new_chunk(pool);
+
+        if (*chunk == NULL) {
+            return -1;
+        }
+    }
+
+    Packet_Data *new_d = packet_pool_new_packet(pool);
+
+    if (new_d == NULL) {
+        if ((*chunk)->num_packets == 0) {
+            packet_pool_free_chunk(pool, *chunk);
+            *chunk = NULL;
+        }
+
+        return -1;
+    }
+
+    memcpy(new_d, data, sizeof(Packet_Data));
+    const uint32_t offset = number % CRYPTO_PACKET_CHUNK_SIZE;
+    (*chunk)->buffer[offset] = new_d;
+    (*chunk)->present[offset / 64] |= (uint64_t)1 << (offset % 64);
+    ++(*chunk)->num_packets;
+    return 0;
+}
+
+/* Free the packet at packet number if there is one, and its chunk if it was
+ * the last packet in it.
+ */
+static void remove_packet(Packet_Pool *pool, Packets_Array *array, uint32_t number)
+{
+    Packets_Chunk **chunk = &array->chunks[packet_chunk_index(number)];
+
+    if (*chunk == NULL) {
+        return;
+    }
+
+    const uint32_t offset = number % CRYPTO_PACKET_CHUNK_SIZE;
+    Packet_Data **slot = &(*chunk)->buffer[offset];
+
+    if (*slot == NULL) {
+        return;
+    }
+
+    packet_pool_free_packet(pool, *slot);
+    *slot = NULL;
+    (*chunk)->present[offset / 64] &= ~((uint64_t)1 << (offset % 64));
+    --(*chunk)->num_packets;
+
+    if ((*chunk)->num_packets == 0) {
+        packet_pool_free_chunk(pool, *chunk);
+        *chunk = NULL;
+    }
+}
+
+/* return the index of the lowest set bit of word, which must not be 0.
+ */
+static uint32_t lowest_bit(uint64_t word)
+{
+    uint32_t bit = 0;
+
+    if ((word & 0xffffffff) == 0) {
+        word >>= 32;
+        bit += 32;
+    }
+
+    if ((word & 0xffff) == 0) {
+        word >>= 16;
+        bit += 16;
+    }
+
+    if ((word & 0xff) == 0) {
+        word >>= 8;
+        bit += 8;
+    }
+
+    if ((word & 0xf) == 0) {
+        word >>= 4;
+        bit += 4;
+    }
+
+    if ((word & 0x3) == 0) {
+        word >>= 2;
+        bit += 2;
+    }
+
+    if ((word & 0x1) == 0) {
+        bit += 1;
+    }
+
+    return bit;
+}
+
+/* Find the first packet number from number up to end (not included) that
+ * holds a packet if present is set, or that holds none if it isn't. Empty
+ * chunks and 64 packet runs are skipped at once.
+ *
+ * return the packet number found, or end if there is none.
+ */
+static uint32_t find_packet(const Packets_Array *array, uint32_t number, uint32_t end, bool present)
+{
+    while (number != end) {
+        const Packets_Chunk *chunk = array->chunks[packet_chunk_index(number)];
+        const uint32_t offset = number % CRYPTO_PACKET_CHUNK_SIZE;
+        uint32_t skip;
+
+        if (chunk == NULL) {
+            if (!present) {
+                return number;
+            }
+
+            skip = CRYPTO_PACKET_CHUNK_SIZE - offset;
+        } else {
+            uint64_t word = chunk->present[offset / 64];
+
+            if (!present) {
+                word = ~word;
+            }
+
+            word >>= offset % 64;
+
+            if (word != 0) {
+                const uint32_t bit = lowest_bit(word);
+                return bit < end - number ? number + bit : end;
+            }
+
+            skip = 64 - offset % 64;
+        }
+
+        if (skip >= end - number) {
+            return end;
+        }
+
+        number += skip;
+    }
+
+    return end;
+}
+
 /* Return number of packets in array
  * Note that holes are counted too.
  */
@@ -579,27 +846,20 @@ static uint32_t num_packets_array(const Packets_Array *array)
  * return -1 on failure.
  * return 0 on success.
  */
-static int add_data_to_buffer(Packets_Array *array, uint32_t number, const Packet_Data *data)
+static int add_data_to_buffer(Packet_Pool *pool, Packets_Array *array, uint32_t number, const Packet_Data *data)
 {
     if (number - array->buffer_start > CRYPTO_PACKET_BUFFER_SIZE) {
         return -1;
     }
 
-    uint32_t num = number % CRYPTO_PACKET_BUFFER_SIZE;
-
-    if (array->buffer[num]) {
+    if (get_packet(array, number)) {
         return -1;
     }
 
-    Packet_Data *new_d = (Packet_Data *)malloc(sizeof(Packet_Data));
-
-    if (new_d == NULL) {
+    if (set_packet(pool, array, number, data) != 0) {
         return -1;
     }
 
-    memcpy(new_d, data, sizeof(Packet_Data));
-    array->buffer[num] = new_d;
-
     if ((number - array->buffer_start) >= (array->buffer_end - array->buffer_start)) {
         array->buffer_end = number + 1;
     }
@@ -621,13 +881,13 @@ static int get_data_pointer(const Packets_Array *array, Packet_Data **data, uint
         return -1;
     }
 
-    uint32_t num = number % CRYPTO_PACKET_BUFFER_SIZE;
+    Packet_Data *packet = get_packet(array, number);
 
-    if (!array->buffer[num]) {
+    if (!packet) {
         return 0;
     }
 
-    *data = array->buffer[num];
+    *data = packet;
     return 1;
 }
 
@@ -636,21 +896,18 @@ static int get_data_pointer(const Packets_Array *array, Packet_Data **data, uint
  * return -1 on failure.
  * return packet number on success.
  */
-static int64_t add_data_end_of_buffer(Packets_Array *array, const Packet_Data *data)
+static int64_t add_data_end_of_buffer(Packet_Pool *pool, Packets_Array *array, const Packet_Data *data)
 {
     if (num_packets_array(array) >= CRYPTO_PACKET_BUFFER_SIZE) {
         return -1;
     }
 
-    Packet_Data *new_d = (Packet_Data *)malloc(sizeof(Packet_Data));
+    uint32_t id = array->buffer_end;
 
-    if (new_d == NULL) {
+    if (set_packet(pool, array, id, data) != 0) {
         return -1;
     }
 
-    memcpy(new_d, data, sizeof(Packet_Data));
-    uint32_t id = array->buffer_end;
-    array->buffer[id % CRYPTO_PACKET_BUFFER_SIZE] = new_d;
     ++array->buffer_end;
     return id;
 }
@@ -660,32 +917,53 @@ static int64_t add_data_end_of_buffer(Packets_Array *array, const Packet_Data *d
  * return -1 on failure.
  * return packet number on success.
  */
-static int64_t read_data_beg_buffer(Packets_Array *array, Packet_Data *data)
+static int64_t read_data_beg_buffer(Packet_Pool *pool, Packets_Array *array, Packet_Data *data)
 {
     if (array->buffer_end == array->buffer_start) {
         return -1;
     }
 
-    uint32_t num = array->buffer_start % CRYPTO_PACKET_BUFFER_SIZE;
+    const Packet_Data *packet = get_packet(array, array->buffer_start);
 
-    if (!array->buffer[num]) {
+    if (!packet) {
         return -1;
     }
 
-    memcpy(data, array->buffer[num], sizeof(Packet_Data));
+    memcpy(data, packet, sizeof(Packet_Data));
     uint32_t id = array->buffer_start;
+    remove_packet(pool, array, id);
     ++array->buffer_start;
-    free(array->buffer[num]);
-    array->buffer[num] = NULL;
     return id;
 }
 
-/* Delete all packets in array before number (but not number)
+/* Update latest_sent_time with the sent time of packet, a sent packet that
+ * the peer acknowledged, if it can be used as a round trip time sample, and
+ * set bundled_lost to 0 if it was sent in a PACKET_ID_BUNDLE packet.
+ */
+static void acked_packet(const Packet_Data *packet, uint64_t *latest_sent_time, uint32_t *bundled_lost)
+{
+    if (packet == NULL) {
+        return;
+    }
+
+    if (!packet->resent && *latest_sent_time < packet->sent_time) {
+        *latest_sent_time = packet->sent_time;
+    }
+
+    if (packet->bundled) {
+        *bundled_lost = 0;
+    }
+}
+
+/* Delete all packets in the send array before number (but not number), the
+ * packets that the peer acknowledged. latest_sent_time and bundled_lost are
+ * updated like with acked_packet.
  *
  * return -1 on failure.
  * return 0 on success
  */
-static int clear_buffer_until(Packets_Array *array, uint32_t number)
+static int clear_buffer_until(Packet_Pool *pool, Packets_Array *array, uint32_t number, uint64_t *latest_sent_time,
+                              uint32_t *bundled_lost)
 {
     uint32_t num_spots = array->buffer_end - array->buffer_start;
 
@@ -696,32 +974,36 @@ static int clear_buffer_until(Packets_Array *array, uint32_t number)
     uint32_t i;
 
     for (i = array->buffer_start; i != number; ++i) {
-        uint32_t num = i % CRYPTO_PACKET_BUFFER_SIZE;
-
-        if (array->buffer[num]) {
-            free(array->buffer[num]);
-            array->buffer[num] = NULL;
-        }
+        acked_packet(get_packet(array, i), latest_sent_time, bundled_lost);
+        remove_packet(pool, array, i);
     }
 
     array->buffer_start = i;
     return 0;
 }
 
-static int clear_buffer(Packets_Array *array)
+static int clear_buffer(Packet_Pool *pool, Packets_Array *array)
 {
-    uint32_t i;
+    uint32_t i, j;
 
-    for (i = array->buffer_start; i != array->buffer_end; ++i) {
-        uint32_t num = i % CRYPTO_PACKET_BUFFER_SIZE;
+    for (i = 0; i < CRYPTO_PACKET_NUM_CHUNKS; ++i) {
+        Packets_Chunk *chunk = array->chunks[i];
 
-        if (array->buffer[num]) {
-            free(array->buffer[num]);
-            array->buffer[num] = NULL;
+        if (chunk == NULL) {
+            continue;
+        }
+
+        for (j = 0; j < CRYPTO_PACKET_CHUNK_SIZE; ++j) {
+            if (chunk->buffer[j]) {
+                packet_pool_free_packet(pool, chunk->buffer[j]);
+            }
         }
+
+        packet_pool_free_chunk(pool, chunk);
+        array->chunks[i] = NULL;
     }
 
-    array->buffer_start = i;
+    array->buffer_start = array->buffer_end;
     return 0;
 }
 
@@ -771,9 +1053,7 @@ static int generate_request_packet(uint8_t *data, uint16_t length, const Packets
     uint32_t i, n = 1;
 
     for (i = recv_array->buffer_start; i != recv_array->buffer_end; ++i) {
-        uint32_t num = i % CRYPTO_PACKET_BUFFER_SIZE;
-
-        if (!recv_array->buffer[num]) {
+        if (!get_packet(recv_array, i)) {
             data[cur_len] = n;
             n = 0;
             ++cur_len;
@@ -798,13 +1078,16 @@ static int generate_request_packet(uint8_t *data, uint16_t length, const Packets
 }
 
 /* Handle a request data packet.
- * Remove all the packets the other received from the array.
+ * Remove all the packets the other received from the array, updating
+ * latest_send_time and bundled_lost like acked_packet. bundled_lost is also
+ * increased for every packet sent in a PACKET_ID_BUNDLE packet that is
+ * requested again.
  *
  * return -1 on failure.
  * return number of requested packets on success.
  */
-static int handle_request_packet(Packets_Array *send_array, const uint8_t *data, uint16_t length,
-                                 uint64_t *latest_send_time, uint64_t rtt_time)
+static int handle_request_packet(Packet_Pool *pool, Packets_Array *send_array, const uint8_t *data, uint16_t length,
+                                 uint64_t *latest_send_time, uint64_t rtt_time, uint32_t *bundled_lost)
 {
     if (length < 1) {
         return -1;
@@ -825,21 +1108,24 @@ static int handle_request_packet(Packets_Array *send_array, const uint8_t *data,
     uint32_t requested = 0;
 
     uint64_t temp_time = current_time_monotonic();
-    uint64_t l_sent_time = ~0;
 
     for (i = send_array->buffer_start; i != send_array->buffer_end; ++i) {
         if (length == 0) {
             break;
         }
 
-        uint32_t num = i % CRYPTO_PACKET_BUFFER_SIZE;
+        Packet_Data *packet = get_packet(send_array, i);
 
         if (n == data[0]) {
-            if (send_array->buffer[num]) {
-                uint64_t sent_time = send_array->buffer[num]->sent_time;
-
-                if ((sent_time + rtt_time) < temp_time) {
-                    send_array->buffer[num]->sent_time = 0;
+            /* Packets that were never sent are still waiting for the pacer. */
+            if (packet && packet->sent_time) {
+                if ((packet->sent_time + rtt_time) < temp_time) {
+                    packet->sent_time = 0;
+                    packet->resent = 1;
+
+                    if (packet->bundled) {
+                        ++*bundled_lost;
+                    }
                 }
             }
 
@@ -848,15 +1134,9 @@ static int handle_request_packet(Packets_Array *send_array, const uint8_t *data,
             n = 0;
             ++requested;
         } else {
-            if (send_array->buffer[num]) {
-                uint64_t sent_time = send_array->buffer[num]->sent_time;
-
-                if (l_sent_time < sent_time) {
-                    l_sent_time = sent_time;
-                }
-
-                free(send_array->buffer[num]);
-                send_array->buffer[num] = NULL;
+            if (packet) {
+                acked_packet(packet, latest_send_time, bundled_lost);
+                remove_packet(pool, send_array, i);
             }
         }
 
@@ -874,120 +1154,501 @@ static int handle_request_packet(Packets_Array *send_array, const uint8_t *data,
         }
     }
 
-    if (*latest_send_time < l_sent_time) {
-        *latest_send_time = l_sent_time;
-    }
-
     return requested;
 }
 
-/** END: Array Related functions **/
+/* Write value as a variable length integer: values up to 239 take 1 byte,
+ * up to 2287 2 bytes, up to 67823 3 bytes and larger ones 5 bytes.
+ *
+ * return number of bytes written.
+ */
+static uint16_t write_varint(uint8_t *data, uint32_t value)
+{
+    if (value < 240) {
+        data[0] = value;
+        return 1;
+    }
+
+    if (value < 2288) {
+        data[0] = 240 + (value - 240) / 256;
+        data[1] = (value - 240) % 256;
+        return 2;
+    }
+
+    if (value < 67824) {
+        data[0] = 248;
+        data[1] = (value - 2288) / 256;
+        data[2] = (value - 2288) % 256;
+        return 3;
+    }
 
-#define MAX_DATA_DATA_PACKET_SIZE (MAX_CRYPTO_PACKET_SIZE - (1 + sizeof(uint16_t) + CRYPTO_MAC_SIZE))
+    data[0] = 249;
+    value = net_htonl(value);
+    memcpy(data + 1, &value, sizeof(uint32_t));
+    return 5;
+}
 
-/* Creates and sends a data packet to the peer using the fastest route.
+/* Read a variable length integer written by write_varint from data of length.
  *
  * return -1 on failure.
- * return 0 on success.
+ * return number of bytes read on success.
  */
-static int send_data_packet(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length)
+static int read_varint(const uint8_t *data, uint16_t length, uint32_t *value)
 {
-    if (length == 0 || length + (1 + sizeof(uint16_t) + CRYPTO_MAC_SIZE) > MAX_CRYPTO_PACKET_SIZE) {
+    if (length < 1) {
         return -1;
     }
 
-    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+    if (data[0] < 240) {
+        *value = data[0];
+        return 1;
+    }
 
-    if (conn == 0) {
-        return -1;
+    if (data[0] < 248) {
+        if (length < 2) {
+            return -1;
+        }
+
+        *value = 240 + (data[0] - 240) * 256 + data[1];
+        return 2;
     }
 
-    pthread_mutex_lock(&conn->mutex);
-    VLA(uint8_t, packet, 1 + sizeof(uint16_t) + length + CRYPTO_MAC_SIZE);
-    packet[0] = NET_PACKET_CRYPTO_DATA;
-    memcpy(packet + 1, conn->sent_nonce + (CRYPTO_NONCE_SIZE - sizeof(uint16_t)), sizeof(uint16_t));
-    int len = encrypt_data_symmetric(conn->shared_key, conn->sent_nonce, data, length, packet + 1 + sizeof(uint16_t));
+    if (data[0] == 248) {
+        if (length < 3) {
+            return -1;
+        }
 
-    if (len + 1 + sizeof(uint16_t) != SIZEOF_VLA(packet)) {
-        pthread_mutex_unlock(&conn->mutex);
-        return -1;
+        *value = 2288 + data[1] * 256 + data[2];
+        return 3;
     }
 
-    increment_nonce(conn->sent_nonce);
-    pthread_mutex_unlock(&conn->mutex);
+    if (data[0] == 249) {
+        if (length < 5) {
+            return -1;
+        }
+
+        memcpy(value, data + 1, sizeof(uint32_t));
+        *value = net_ntohl(*value);
+        return 5;
+    }
 
-    return send_packet_to(c, crypt_connection_id, packet, SIZEOF_VLA(packet));
+    return -1;
 }
 
-/* Creates and sends a data packet with buffer_start and num to the peer using the fastest route.
+/* Create a PACKET_ID_REQUEST_RANGES packet from recv_array into data of length.
+ *
+ * Going from buffer_start to buffer_end, each run of missing packets is
+ * written as the number n of packets from the end of the previous run to the
+ * missing packet if only one packet is missing: n - 1 received packets and
+ * the missing one. Longer runs are written as 0 followed by the number of
+ * received packets and the number of missing packets. The received packets
+ * after the last run are written as a run of 0 missing packets. If they
+ * don't all fit, the packet holds the first runs.
  *
  * return -1 on failure.
- * return 0 on success.
+ * return length of packet on success.
  */
-static int send_data_packet_helper(Net_Crypto *c, int crypt_connection_id, uint32_t buffer_start, uint32_t num,
-                                   const uint8_t *data, uint16_t length)
+static int generate_request_ranges_packet(uint8_t *data, uint16_t length, const Packets_Array *recv_array)
 {
-    if (length == 0 || length > MAX_CRYPTO_DATA_SIZE) {
+    if (length == 0) {
         return -1;
     }
 
-    num = net_htonl(num);
-    buffer_start = net_htonl(buffer_start);
-    uint16_t padding_length = (MAX_CRYPTO_DATA_SIZE - length) % CRYPTO_MAX_PADDING;
-    VLA(uint8_t, packet, sizeof(uint32_t) + sizeof(uint32_t) + padding_length + length);
-    memcpy(packet, &buffer_start, sizeof(uint32_t));
-    memcpy(packet + sizeof(uint32_t), &num, sizeof(uint32_t));
-    memset(packet + (sizeof(uint32_t) * 2), PACKET_ID_PADDING, padding_length);
-    memcpy(packet + (sizeof(uint32_t) * 2) + padding_length, data, length);
-
-    return send_data_packet(c, crypt_connection_id, packet, SIZEOF_VLA(packet));
-}
-
-static int reset_max_speed_reached(Net_Crypto *c, int crypt_connection_id)
-{
-    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+    data[0] = PACKET_ID_REQUEST_RANGES;
 
-    if (conn == 0) {
-        return -1;
-    }
+    uint16_t cur_len = 1;
+    uint32_t number = recv_array->buffer_start;
+    const uint32_t end = recv_array->buffer_end;
 
-    /* If last packet send failed, try to send packet again.
-       If sending it fails we won't be able to send the new packet. */
-    if (conn->maximum_speed_reached) {
-        Packet_Data *dt = NULL;
-        uint32_t packet_num = conn->send_array.buffer_end - 1;
-        int ret = get_data_pointer(&conn->send_array, &dt, packet_num);
+    while (number != end) {
+        const uint32_t missing = find_packet(recv_array, number, end, 0);
+        const uint32_t missing_end = find_packet(recv_array, missing, end, 1);
 
-        uint8_t send_failed = 0;
+        uint8_t run[1 + 5 + 5];
+        uint16_t run_len;
 
-        if (ret == 1) {
-            if (!dt->sent_time) {
-                if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num, dt->data,
-                                            dt->length) != 0) {
-                    send_failed = 1;
-                } else {
-                    dt->sent_time = current_time_monotonic();
-                }
-            }
+        if (missing_end - missing == 1) {
+            run_len = write_varint(run, missing_end - number);
+        } else {
+            run[0] = 0;
+            run_len = 1;
+            run_len += write_varint(run + run_len, missing - number);
+            run_len += write_varint(run + run_len, missing_end - missing);
         }
 
-        if (!send_failed) {
-            conn->maximum_speed_reached = 0;
-        } else {
-            return -1;
+        if (length - cur_len < run_len) {
+            break;
         }
+
+        memcpy(data + cur_len, run, run_len);
+        cur_len += run_len;
+        number = missing_end;
     }
 
-    return 0;
+    return cur_len;
 }
 
-/*  return -1 if data could not be put in packet queue.
- *  return positive packet number if data was put into the queue.
+/* Handle a PACKET_ID_REQUEST_RANGES packet like handle_request_packet.
+ *
+ * Only the packets still in the array are looked at, so the work depends on
+ * the number of runs and the packets acknowledged or requested, not on the
+ * size of the window.
+ *
+ * return -1 on failure.
+ * return number of requested packets on success.
  */
-static int64_t send_lossless_packet(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length,
-                                    uint8_t congestion_control)
+static int handle_request_ranges_packet(Packet_Pool *pool, Packets_Array *send_array, const uint8_t *data,
+                                        uint16_t length, uint64_t *latest_send_time, uint64_t rtt_time,
+                                        uint32_t *bundled_lost)
 {
-    if (length == 0 || length > MAX_CRYPTO_DATA_SIZE) {
+    if (length < 1) {
+        return -1;
+    }
+
+    if (data[0] != PACKET_ID_REQUEST_RANGES) {
+        return -1;
+    }
+
+    ++data;
+    --length;
+
+    uint32_t number = send_array->buffer_start;
+    uint32_t requested = 0;
+
+    uint64_t temp_time = current_time_monotonic();
+
+    while (length != 0) {
+        uint32_t received, missing = 1;
+        int len = read_varint(data, length, &received);
+
+        if (len == -1) {
+            return -1;
+        }
+
+        data += len;
+        length -= len;
+
+        if (received != 0) {
+            --received;
+        } else {
+            len = read_varint(data, length, &received);
+
+            if (len == -1) {
+                return -1;
+            }
+
+            data += len;
+            length -= len;
+            len = read_varint(data, length, &missing);
+
+            if (len == -1) {
+                return -1;
+            }
+
+            data += len;
+            length -= len;
+        }
+
+        const uint32_t left = send_array->buffer_end - number;
+
+        if (received > left || missing > left - received) {
+            return -1;
+        }
+
+        const uint32_t received_end = number + received;
+        const uint32_t missing_end = received_end + missing;
+
+        for (number = find_packet(send_array, number, received_end, 1); number != received_end;
+                number = find_packet(send_array, number + 1, received_end, 1)) {
+            acked_packet(get_packet(send_array, number), latest_send_time, bundled_lost);
+            remove_packet(pool, send_array, number);
+        }
+
+        for (number = find_packet(send_array, received_end, missing_end, 1); number != missing_end;
+                number = find_packet(send_array, number + 1, missing_end, 1)) {
+            Packet_Data *packet = get_packet(send_array, number);
+
+            /* Packets that were never sent are still waiting for the pacer. */
+            if (packet->sent_time && (packet->sent_time + rtt_time) < temp_time) {
+                packet->sent_time = 0;
+                packet->resent = 1;
+
+                if (packet->bundled) {
+                    ++*bundled_lost;
+                }
+            }
+        }
+
+        requested += missing;
+    }
+
+    return requested;
+}
+
+/* return the stream that packet, a lossless packet, was sent on.
+ */
+static uint8_t packet_stream(const Packet_Data *packet)
+{
+    if (packet->data[0] != PACKET_ID_STREAM) {
+        return CRYPTO_STREAM_DEFAULT;
+    }
+
+    return packet->data[1];
+}
+
+/* return the stream packet number of packet, a PACKET_ID_STREAM packet.
+ */
+static uint16_t packet_stream_number(const Packet_Data *packet)
+{
+    uint16_t number;
+    memcpy(&number, packet->data + 2, sizeof(uint16_t));
+    return net_ntohs(number);
+}
+
+/* Find the received packet that has stream packet number stream_number on
+ * stream in recv_array and hasn't been delivered yet.
+ *
+ * return NULL if it wasn't received.
+ */
+static Packet_Data *get_stream_packet(const Packets_Array *recv_array, const Crypto_Stream *stream,
+                                      uint8_t stream_id, uint16_t stream_number)
+{
+    if (stream->reorder_size == 0) {
+        return NULL;
+    }
+
+    Packet_Data *packet;
+
+    /* Entries aren't cleared, so check that the packet is the one. Stream
+     * packet numbers of the packets in the window are unique. */
+    if (get_data_pointer(recv_array, &packet,
+                         stream->reorder[stream_number % stream->reorder_size]) != 1) {
+        return NULL;
+    }
+
+    if (packet->length == 0 || packet->data[0] != PACKET_ID_STREAM || packet_stream(packet) != stream_id
+            || packet_stream_number(packet) != stream_number) {
+        return NULL;
+    }
+
+    return packet;
+}
+
+/* Note that the packet with packet number number, received on stream with
+ * stream packet number stream_number, waits for the packets before it on
+ * stream.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int add_stream_reorder(const Packets_Array *recv_array, Crypto_Stream *stream, uint8_t stream_id,
+                              uint16_t stream_number, uint32_t number)
+{
+    const uint16_t distance = stream_number - stream->recv_number;
+
+    if (distance >= CRYPTO_PACKET_BUFFER_SIZE) {
+        return -1;
+    }
+
+    if (distance >= stream->reorder_size) {
+        uint32_t size = stream->reorder_size ? stream->reorder_size : 16;
+
+        while (size <= distance) {
+            size *= 2;
+        }
+
+        uint32_t *reorder = (uint32_t *)calloc(size, sizeof(uint32_t));
+
+        if (reorder == NULL) {
+            return -1;
+        }
+
+        uint32_t i;
+
+        for (i = 0; i < stream->reorder_size; ++i) {
+            const uint16_t old_number = stream->recv_number + i;
+            const Packet_Data *packet = get_stream_packet(recv_array, stream, stream_id, old_number);
+
+            if (packet) {
+                reorder[old_number % size] = stream->reorder[old_number % stream->reorder_size];
+            }
+        }
+
+        free(stream->reorder);
+        stream->reorder = reorder;
+        stream->reorder_size = size;
+    }
+
+    stream->reorder[stream_number % stream->reorder_size] = number;
+    return 0;
+}
+
+/** END: Array Related functions **/
+
+/* Bytes in front of the plain text of a data packet: packet id, nonce bytes and MAC. */
+#define DATA_PACKET_HEADROOM (1 + sizeof(uint16_t) + CRYPTO_MAC_SIZE)
+
+/* Encrypts the length bytes of plain text at packet + DATA_PACKET_HEADROOM in
+ * place and fills in the rest of the data packet in front of it.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int encrypt_data_packet(Net_Crypto *c, int crypt_connection_id, uint8_t *packet, uint16_t length)
+{
+    if (length == 0 || length + DATA_PACKET_HEADROOM > MAX_CRYPTO_MTU) {
+        return -1;
+    }
+
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&conn->mutex);
+    packet[0] = NET_PACKET_CRYPTO_DATA;
+    memcpy(packet + 1, conn->sent_nonce + (CRYPTO_NONCE_SIZE - sizeof(uint16_t)), sizeof(uint16_t));
+    int len = encrypt_data_symmetric_detached(conn->shared_key, conn->sent_nonce, packet + DATA_PACKET_HEADROOM, length,
+              packet + 1 + sizeof(uint16_t));
+
+    if (len != length) {
+        pthread_mutex_unlock(&conn->mutex);
+        return -1;
+    }
+
+    increment_nonce(conn->sent_nonce);
+    pthread_mutex_unlock(&conn->mutex);
+    return 0;
+}
+
+/* Encrypts the length bytes of plain text at packet + DATA_PACKET_HEADROOM in
+ * place and sends the data packet to the peer using the fastest route.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int send_data_packet(Net_Crypto *c, int crypt_connection_id, uint8_t *packet, uint16_t length)
+{
+    if (encrypt_data_packet(c, crypt_connection_id, packet, length) != 0) {
+        return -1;
+    }
+
+    return send_packet_to(c, crypt_connection_id, packet, DATA_PACKET_HEADROOM + length);
+}
+
+/* Creates and sends a data packet with buffer_start and num to the peer using the fastest route.
+ *
+ * Only stream packets and bundles may be longer than MAX_CRYPTO_DATA_SIZE,
+ * and only bundles, which are sent over UDP, longer than MAX_CRYPTO_STREAM_DATA_SIZE.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int send_data_packet_helper(Net_Crypto *c, int crypt_connection_id, uint32_t buffer_start, uint32_t num,
+                                   const uint8_t *data, uint16_t length)
+{
+    if (length == 0 || length > MAX_CRYPTO_MTU - CRYPTO_DATA_PACKET_MIN_SIZE) {
+        return -1;
+    }
+
+    num = net_htonl(num);
+    buffer_start = net_htonl(buffer_start);
+    uint16_t padding_length = 0;
+
+    if (length <= MAX_CRYPTO_DATA_SIZE) {
+        padding_length = (MAX_CRYPTO_DATA_SIZE - length) % CRYPTO_MAX_PADDING;
+    }
+
+    VLA(uint8_t, packet, DATA_PACKET_HEADROOM + sizeof(uint32_t) + sizeof(uint32_t) + padding_length + length);
+    uint8_t *plain = packet + DATA_PACKET_HEADROOM;
+    memcpy(plain, &buffer_start, sizeof(uint32_t));
+    memcpy(plain + sizeof(uint32_t), &num, sizeof(uint32_t));
+    memset(plain + (sizeof(uint32_t) * 2), PACKET_ID_PADDING, padding_length);
+    memcpy(plain + (sizeof(uint32_t) * 2) + padding_length, data, length);
+
+    return send_data_packet(c, crypt_connection_id, packet, SIZEOF_VLA(packet) - DATA_PACKET_HEADROOM);
+}
+
+static int reset_max_speed_reached(Net_Crypto *c, int crypt_connection_id)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0) {
+        return -1;
+    }
+
+    /* If last packet send failed, try to send packet again.
+       If sending it fails we won't be able to send the new packet. */
+    if (conn->maximum_speed_reached) {
+        Packet_Data *dt = NULL;
+        uint32_t packet_num = conn->send_array.buffer_end - 1;
+        int ret = get_data_pointer(&conn->send_array, &dt, packet_num);
+
+        uint8_t send_failed = 0;
+
+        if (ret == 1) {
+            if (!dt->sent_time) {
+                if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num, dt->data,
+                                            dt->length) != 0) {
+                    send_failed = 1;
+                } else {
+                    dt->sent_time = current_time_monotonic();
+                }
+            }
+        }
+
+        if (!send_failed) {
+            conn->maximum_speed_reached = 0;
+        } else {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Add what the pacer allows to send since the last call to the pacing budget of conn.
+ *
+ * Packets go out at the send rate, or faster if more are waiting than the send
+ * rate would send in CRYPTO_PACING_INTERVAL ms, so that pacing only spreads
+ * out what congestion control allows and doesn't slow the connection down.
+ */
+static void pacing_refill(Crypto_Connection *conn, uint64_t temp_time)
+{
+    conn->pacing_rate = conn->congestion.send_rate_requested;
+
+    const double waiting_rate = conn->pacing_waiting * (1000.0 / CRYPTO_PACING_INTERVAL);
+
+    if (conn->pacing_rate < waiting_rate) {
+        conn->pacing_rate = waiting_rate;
+    }
+
+    if (temp_time > conn->pacing_time) {
+        conn->pacing_budget += conn->pacing_rate * ((double)(temp_time - conn->pacing_time) / 1000.0);
+        conn->pacing_time = temp_time;
+    }
+
+    /* Don't save up a burst while there is nothing to send, but do catch up
+     * when packets are waiting and we weren't run in time. */
+    double max_budget = conn->pacing_rate * (conn->pacing_waiting ? CRYPTO_PACING_INTERVAL : CRYPTO_PACING_BURST) / 1000.0;
+
+    if (max_budget < CRYPTO_PACING_MIN_BURST) {
+        max_budget = CRYPTO_PACING_MIN_BURST;
+    }
+
+    if (conn->pacing_budget > max_budget) {
+        conn->pacing_budget = max_budget;
+    }
+}
+
+/*  return -1 if data could not be put in packet queue.
+ *  return positive packet number if data was put into the queue.
+ */
+static int64_t send_lossless_packet(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length,
+                                    uint8_t congestion_control)
+{
+    if (length == 0 || length > MAX_CRYPTO_STREAM_DATA_SIZE) {
         return -1;
     }
 
@@ -1008,9 +1669,11 @@ static int64_t send_lossless_packet(Net_Crypto *c, int crypt_connection_id, cons
     Packet_Data dt;
     dt.sent_time = 0;
     dt.length = length;
+    dt.resent = 0;
+    dt.bundled = 0;
     memcpy(dt.data, data, length);
     pthread_mutex_lock(&conn->mutex);
-    int64_t packet_num = add_data_end_of_buffer(&conn->send_array, &dt);
+    int64_t packet_num = add_data_end_of_buffer(&c->packet_pool, &conn->send_array, &dt);
     pthread_mutex_unlock(&conn->mutex);
 
     if (packet_num == -1) {
@@ -1021,12 +1684,30 @@ static int64_t send_lossless_packet(Net_Crypto *c, int crypt_connection_id, cons
         return packet_num;
     }
 
+    if (congestion_control) {
+        pacing_refill(conn, current_time_monotonic());
+
+        /* Leave it to send_crypto_packets, after the packets waiting before it. */
+        if (conn->pacing_waiting || conn->pacing_budget < 1.0) {
+            ++conn->pacing_waiting;
+            ++conn->stream[packet_stream(&dt)].waiting;
+            return packet_num;
+        }
+
+        conn->pacing_budget -= 1.0;
+    }
+
     if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num, data, length) == 0) {
         Packet_Data *dt1 = NULL;
 
+        /* The packet may have been acknowledged and freed meanwhile. */
+        pthread_mutex_lock(&conn->mutex);
+
         if (get_data_pointer(&conn->send_array, &dt1, packet_num) == 1) {
             dt1->sent_time = current_time_monotonic();
         }
+
+        pthread_mutex_unlock(&conn->mutex);
     } else {
         conn->maximum_speed_reached = 1;
         LOGGER_ERROR(c->log, "send_data_packet failed\n");
@@ -1047,9 +1728,26 @@ static uint16_t get_nonce_uint16(const uint8_t *nonce)
 
 #define DATA_NUM_THRESHOLD 21845
 
+/* Put the nonce used to encrypt data packet into nonce, based on the
+ * 2 least significant bytes of it that are sent in the packet.
+ *
+ * return how far the nonce is ahead of recv_nonce.
+ */
+static uint16_t data_packet_nonce(const uint8_t *recv_nonce, const uint8_t *packet, uint8_t *nonce)
+{
+    memcpy(nonce, recv_nonce, CRYPTO_NONCE_SIZE);
+    uint16_t num_cur_nonce = get_nonce_uint16(nonce);
+    uint16_t num;
+    memcpy(&num, packet + 1, sizeof(uint16_t));
+    num = net_ntohs(num);
+    uint16_t diff = num - num_cur_nonce;
+    increment_nonce_number(nonce, diff);
+    return diff;
+}
+
 /* Handle a data packet.
  * Decrypt packet of length and put it into data.
- * data must be at least MAX_DATA_DATA_PACKET_SIZE big.
+ * data must be at least length - DATA_PACKET_HEADROOM big.
  *
  * return -1 on failure.
  * return length of data on success.
@@ -1057,36 +1755,134 @@ static uint16_t get_nonce_uint16(const uint8_t *nonce)
 static int handle_data_packet(const Net_Crypto *c, int crypt_connection_id, uint8_t *data, const uint8_t *packet,
                               uint16_t length)
 {
-    if (length <= (1 + sizeof(uint16_t) + CRYPTO_MAC_SIZE) || length > MAX_CRYPTO_PACKET_SIZE) {
+    if (length <= (1 + sizeof(uint16_t) + CRYPTO_MAC_SIZE) || length > MAX_CRYPTO_MTU) {
+        return -1;
+    }
+
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0) {
+        return -1;
+    }
+
+    uint8_t nonce[CRYPTO_NONCE_SIZE];
+    uint16_t diff = data_packet_nonce(conn->recv_nonce, packet, nonce);
+    int len = decrypt_data_symmetric(conn->shared_key, nonce, packet + 1 + sizeof(uint16_t),
+                                     length - (1 + sizeof(uint16_t)), data);
+
+    if ((unsigned int)len != length - (1 + sizeof(uint16_t) + CRYPTO_MAC_SIZE)) {
+        return -1;
+    }
+
+    if (diff > DATA_NUM_THRESHOLD * 2) {
+        increment_nonce_number(conn->recv_nonce, DATA_NUM_THRESHOLD);
+    }
+
+    return len;
+}
+
+/* Packet sizes probed in this order until the peer acknowledges one: jumbo
+ * frame paths and 4470 byte MTU paths, over IPv6 or IPv4. */
+static const uint16_t mtu_probe_sizes[] = {MAX_CRYPTO_MTU, 4422};
+
+#define NUM_MTU_PROBE_SIZES (sizeof(mtu_probe_sizes) / sizeof(mtu_probe_sizes[0]))
+
+/* return true if size is one of the packet sizes that are probed. */
+static bool mtu_probe_size_valid(uint16_t size)
+{
+    uint32_t i;
+
+    for (i = 0; i < NUM_MTU_PROBE_SIZES; ++i) {
+        if (mtu_probe_sizes[i] == size) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Send a PACKET_ID_MTU_PROBE data packet of size bytes directly to the peer,
+ * without letting it be fragmented on the way.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int send_mtu_probe(Net_Crypto *c, int crypt_connection_id, uint16_t size)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0) {
+        return -1;
+    }
+
+    const uint32_t buffer_start = net_htonl(conn->recv_array.buffer_start);
+    const uint32_t num = net_htonl(conn->send_array.buffer_end);
+    const uint16_t net_size = net_htons(size);
+
+    VLA(uint8_t, packet, size);
+    uint8_t *plain = packet + DATA_PACKET_HEADROOM;
+    memset(plain, PACKET_ID_PADDING, size - DATA_PACKET_HEADROOM);
+    memcpy(plain, &buffer_start, sizeof(uint32_t));
+    memcpy(plain + sizeof(uint32_t), &num, sizeof(uint32_t));
+    plain[sizeof(uint32_t) * 2] = PACKET_ID_MTU_PROBE;
+    memcpy(plain + (sizeof(uint32_t) * 2) + 1, &net_size, sizeof(uint16_t));
+
+    if (encrypt_data_packet(c, crypt_connection_id, packet, size - DATA_PACKET_HEADROOM) != 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&conn->mutex);
+    IP_Port ip_port = return_ip_port_connection(c, crypt_connection_id);
+    pthread_mutex_unlock(&conn->mutex);
+
+    if (ip_port.ip.family == 0 || sendpacket_nofrag(c->dht->net, ip_port, packet, size) != size) {
         return -1;
     }
 
+    return 0;
+}
+
+/* Probe the next packet size over the direct UDP path to the peer, or forget
+ * the packet size of the path when there is no direct path.
+ */
+static void probe_mtu(Net_Crypto *c, int crypt_connection_id)
+{
     Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
 
     if (conn == 0) {
-        return -1;
+        return;
     }
 
-    uint8_t nonce[CRYPTO_NONCE_SIZE];
-    memcpy(nonce, conn->recv_nonce, CRYPTO_NONCE_SIZE);
-    uint16_t num_cur_nonce = get_nonce_uint16(nonce);
-    uint16_t num;
-    memcpy(&num, packet + 1, sizeof(uint16_t));
-    num = net_ntohs(num);
-    uint16_t diff = num - num_cur_nonce;
-    increment_nonce_number(nonce, diff);
-    int len = decrypt_data_symmetric(conn->shared_key, nonce, packet + 1 + sizeof(uint16_t),
-                                     length - (1 + sizeof(uint16_t)), data);
+    bool direct_connected = 0;
+    crypto_connection_status(c, crypt_connection_id, &direct_connected, NULL);
 
-    if ((unsigned int)len != length - (1 + sizeof(uint16_t) + CRYPTO_MAC_SIZE)) {
-        return -1;
+    if (!direct_connected) {
+        /* The next direct path may take less. */
+        conn->mtu = MAX_CRYPTO_STREAM_PACKET_SIZE;
+        conn->mtu_probe = 0;
+        conn->mtu_probes = 0;
+        return;
     }
 
-    if (diff > DATA_NUM_THRESHOLD * 2) {
-        increment_nonce_number(conn->recv_nonce, DATA_NUM_THRESHOLD);
+    if (conn->mtu_probe >= NUM_MTU_PROBE_SIZES) {
+        return;
     }
 
-    return len;
+    const uint16_t size = mtu_probe_sizes[conn->mtu_probe];
+
+    if (size <= conn->mtu) {
+        conn->mtu_probe = NUM_MTU_PROBE_SIZES;
+        return;
+    }
+
+    /* Probes that can't be sent, e.g. because they are larger than the MTU
+     * of our own interface, count as unacknowledged. */
+    send_mtu_probe(c, crypt_connection_id, size);
+
+    if (++conn->mtu_probes >= CRYPTO_MTU_PROBES) {
+        ++conn->mtu_probe;
+        conn->mtu_probes = 0;
+    }
 }
 
 /* Send a request packet.
@@ -1102,8 +1898,40 @@ static int send_request_packet(Net_Crypto *c, int crypt_connection_id)
         return -1;
     }
 
+    /* Peers that don't know PACKET_ID_STREAMS drop it, the ones that do
+     * send stream packets once they got one. */
+    if (conn->streams_probes < CRYPTO_STREAMS_PROBES) {
+        const uint8_t streams = PACKET_ID_STREAMS;
+
+        if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, conn->send_array.buffer_end,
+                                    &streams, sizeof(streams)) == 0) {
+            ++conn->streams_probes;
+        }
+    }
+
+    /* Peers that don't know PACKET_ID_MTU_PROBE drop it, the ones that do
+     * acknowledge the probes that got through. */
+    probe_mtu(c, crypt_connection_id);
+
     uint8_t data[MAX_CRYPTO_DATA_SIZE];
-    int len = generate_request_packet(data, sizeof(data), &conn->recv_array);
+    int len;
+
+    if (conn->request_ranges) {
+        len = generate_request_ranges_packet(data, sizeof(data), &conn->recv_array);
+    } else {
+        /* Old peers drop the packets they don't know, so offer the new format
+         * with the old one until the peer uses it too. */
+        if (conn->request_ranges_probes < CRYPTO_REQUEST_RANGES_PROBES) {
+            len = generate_request_ranges_packet(data, sizeof(data), &conn->recv_array);
+
+            if (len != -1 && send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start,
+                    conn->send_array.buffer_end, data, len) == 0) {
+                ++conn->request_ranges_probes;
+            }
+        }
+
+        len = generate_request_packet(data, sizeof(data), &conn->recv_array);
+    }
 
     if (len == -1) {
         return -1;
@@ -1113,12 +1941,147 @@ static int send_request_packet(Net_Crypto *c, int crypt_connection_id)
                                    len);
 }
 
-/* Send up to max num previously requested data packets.
+/* Give each stream that has packets waiting for the pacer its share of
+ * max_num packets, by the weights of the streams.
+ *
+ * return the number of streams with packets waiting.
+ */
+static uint32_t share_stream_deficits(const Net_Crypto *c, Crypto_Connection *conn, uint32_t max_num)
+{
+    uint32_t i, num_waiting = 0, total_weight = 0;
+
+    for (i = 0; i < CRYPTO_MAX_STREAMS; ++i) {
+        if (conn->stream[i].waiting) {
+            ++num_waiting;
+            total_weight += c->stream_weights[i];
+        } else {
+            /* Streams don't save up their share while they have nothing to send. */
+            conn->stream[i].deficit = 0;
+        }
+    }
+
+    if (num_waiting < 2) {
+        return num_waiting;
+    }
+
+    for (i = 0; i < CRYPTO_MAX_STREAMS; ++i) {
+        Crypto_Stream *stream = &conn->stream[i];
+
+        if (stream->waiting) {
+            stream->deficit += (double)max_num * c->stream_weights[i] / total_weight;
+
+            if (stream->deficit > max_num + 1) {
+                stream->deficit = max_num + 1;
+            }
+        }
+    }
+
+    return num_waiting;
+}
+
+/* Lossless packets that send_requested_packets collects to send in one
+ * PACKET_ID_BUNDLE packet. */
+#define CRYPTO_BUNDLE_MAX_PACKETS 64
+#define BUNDLE_ENTRY_HEADER_SIZE (sizeof(uint32_t) + sizeof(uint16_t))
+
+typedef struct {
+    uint8_t *data; /* PACKET_ID_BUNDLE followed by the entries. */
+    uint16_t capacity; /* Size of data, 0 if packets aren't bundled. */
+    uint16_t length;
+
+    Packet_Data *packets[CRYPTO_BUNDLE_MAX_PACKETS];
+    uint32_t numbers[CRYPTO_BUNDLE_MAX_PACKETS];
+    uint32_t num_packets;
+} Packet_Bundle;
+
+/* Add packet number num to bundle.
+ *
+ * return -1 if it doesn't fit.
+ * return 0 on success.
+ */
+static int bundle_add(Packet_Bundle *bundle, uint32_t num, Packet_Data *dt)
+{
+    if (bundle->num_packets == CRYPTO_BUNDLE_MAX_PACKETS
+            || bundle->length + BUNDLE_ENTRY_HEADER_SIZE + dt->length > bundle->capacity) {
+        return -1;
+    }
+
+    uint8_t *entry = bundle->data + bundle->length;
+    const uint32_t net_num = net_htonl(num);
+    const uint16_t net_length = net_htons(dt->length);
+    memcpy(entry, &net_num, sizeof(uint32_t));
+    memcpy(entry + sizeof(uint32_t), &net_length, sizeof(uint16_t));
+    memcpy(entry + BUNDLE_ENTRY_HEADER_SIZE, dt->data, dt->length);
+    bundle->length += BUNDLE_ENTRY_HEADER_SIZE + dt->length;
+
+    bundle->packets[bundle->num_packets] = dt;
+    bundle->numbers[bundle->num_packets] = num;
+    ++bundle->num_packets;
+    return 0;
+}
+
+/* Send the packets in bundle, in one packet if there are several, and empty it.
+ * If the bundle can't be sent the connection stops bundling packets and they
+ * are sent one by one.
+ *
+ * return the number of packets that couldn't be sent, their sent_time is reset.
+ */
+static uint32_t send_bundle(Net_Crypto *c, int crypt_connection_id, Packet_Bundle *bundle)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+    uint32_t i, num_failed = 0;
+
+    if (conn == 0 || bundle->num_packets == 0) {
+        bundle->num_packets = 0;
+        return 0;
+    }
+
+    if (bundle->num_packets == 1 || send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start,
+            conn->send_array.buffer_end, bundle->data, bundle->length) != 0) {
+        if (bundle->num_packets != 1) {
+            /* The path doesn't take large packets anymore. */
+            conn->mtu = MAX_CRYPTO_STREAM_PACKET_SIZE;
+            bundle->capacity = 0;
+        }
+
+        for (i = 0; i < bundle->num_packets; ++i) {
+            Packet_Data *dt = bundle->packets[i];
+            dt->bundled = 0;
+
+            if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, bundle->numbers[i],
+                                        dt->data, dt->length) != 0) {
+                dt->sent_time = 0;
+                ++num_failed;
+            }
+        }
+    } else {
+        for (i = 0; i < bundle->num_packets; ++i) {
+            bundle->packets[i]->bundled = 1;
+        }
+    }
+
+    bundle->length = 1;
+    bundle->num_packets = 0;
+    return num_failed;
+}
+
+/* Send up to max_num data packets that are waiting for the pacer or were
+ * requested again by the peer, up to max_resent of them requested again.
+ *
+ * When packets of several streams wait for the pacer, each stream first gets
+ * to send its share of max_num, and what the streams leave goes to the
+ * packets in order.
+ *
+ * Once the peer took larger packets over the direct path, packets that weren't
+ * requested again are bundled into packets of up to that size. They still
+ * count one by one towards max_num.
  *
  * return -1 on failure.
- * return number of packets sent on success.
+ * return number of packets sent on success, put how many of them were
+ * requested again in resent and how many could not be sent in failed.
  */
-static int send_requested_packets(Net_Crypto *c, int crypt_connection_id, uint32_t max_num)
+static int send_requested_packets(Net_Crypto *c, int crypt_connection_id, uint32_t max_num, uint32_t max_resent,
+                                  uint32_t *resent, uint32_t *failed)
 {
     if (max_num == 0) {
         return -1;
@@ -1131,36 +2094,101 @@ static int send_requested_packets(Net_Crypto *c, int crypt_connection_id, uint32
     }
 
     uint64_t temp_time = current_time_monotonic();
-    uint32_t i, num_sent = 0, array_size = num_packets_array(&conn->send_array);
+    uint32_t i, num_sent = 0, num_resent = 0, num_failed = 0, array_size = num_packets_array(&conn->send_array);
+    bool weighted = share_stream_deficits(c, conn, max_num) > 1;
 
-    for (i = 0; i < array_size; ++i) {
-        Packet_Data *dt;
-        uint32_t packet_num = (i + conn->send_array.buffer_start);
-        int ret = get_data_pointer(&conn->send_array, &dt, packet_num);
+    Packet_Bundle bundle;
+    bundle.capacity = 0;
+    bundle.length = 1;
+    bundle.num_packets = 0;
 
-        if (ret == -1) {
-            return -1;
-        }
+    if (conn->mtu > MAX_CRYPTO_STREAM_PACKET_SIZE) {
+        bundle.capacity = conn->mtu - CRYPTO_DATA_PACKET_MIN_SIZE;
+    }
 
-        if (ret == 0) {
-            continue;
-        }
+    VLA(uint8_t, bundle_data, bundle.capacity + 1);
+    bundle.data = bundle_data;
+    bundle.data[0] = PACKET_ID_BUNDLE;
 
-        if (dt->sent_time) {
-            continue;
-        }
+    while (1) {
+        for (i = 0; i < array_size && num_sent < max_num; ++i) {
+            Packet_Data *dt;
+            uint32_t packet_num = (i + conn->send_array.buffer_start);
+            int ret = get_data_pointer(&conn->send_array, &dt, packet_num);
+
+            if (ret == -1) {
+                send_bundle(c, crypt_connection_id, &bundle);
+                return -1;
+            }
+
+            if (ret == 0) {
+                continue;
+            }
+
+            if (dt->sent_time) {
+                continue;
+            }
+
+            if (dt->resent && num_resent >= max_resent) {
+                continue;
+            }
+
+            Crypto_Stream *stream = &conn->stream[packet_stream(dt)];
+
+            if (weighted && !dt->resent && stream->deficit < 1.0) {
+                continue;
+            }
+
+            ret = -1;
+
+            if (bundle.capacity != 0 && !dt->resent) {
+                ret = bundle_add(&bundle, packet_num, dt);
+
+                if (ret == -1) {
+                    const uint32_t bundle_failed = send_bundle(c, crypt_connection_id, &bundle);
+                    num_sent -= bundle_failed;
+                    num_failed += bundle_failed;
+                    ret = bundle_add(&bundle, packet_num, dt);
+                }
+            }
+
+            if (ret == -1) {
+                dt->bundled = 0;
+                ret = send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num,
+                                              dt->data, dt->length);
+            }
+
+            if (ret == 0) {
+                dt->sent_time = temp_time;
+                ++num_sent;
+
+                if (dt->resent) {
+                    ++num_resent;
+                } else {
+                    if (stream->waiting) {
+                        --stream->waiting;
+                    }
 
-        if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num, dt->data,
-                                    dt->length) == 0) {
-            dt->sent_time = temp_time;
-            ++num_sent;
+                    if (weighted) {
+                        stream->deficit -= 1.0;
+                    }
+                }
+            } else {
+                ++num_failed;
+            }
         }
 
-        if (num_sent >= max_num) {
+        if (!weighted || num_sent >= max_num) {
             break;
         }
+
+        weighted = 0;
     }
 
+    const uint32_t bundle_failed = send_bundle(c, crypt_connection_id, &bundle);
+    num_sent -= bundle_failed;
+    *resent = num_resent;
+    *failed = num_failed + bundle_failed;
     return num_sent;
 }
 
@@ -1315,47 +2343,242 @@ static void connection_kill(Net_Crypto *c, int crypt_connection_id, void *userda
     crypto_kill(c, crypt_connection_id);
 }
 
-/* Handle a received data packet.
+/* Pass a received lossless packet to the data callback of the connection,
+ * without the stream header if it has one.
  *
- * return -1 on failure.
- * return 0 on success.
+ * return -1 if the connection was killed in the callback.
+ * return 0 otherwise.
  */
-static int handle_data_packet_core(Net_Crypto *c, int crypt_connection_id, const uint8_t *packet, uint16_t length,
-                                   bool udp, void *userdata)
+static int deliver_lossless_packet(Net_Crypto *c, int crypt_connection_id, const Packet_Data *dt, void *userdata)
 {
-    if (length > MAX_CRYPTO_PACKET_SIZE || length <= CRYPTO_DATA_PACKET_MIN_SIZE) {
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0) {
+        return -1;
+    }
+
+    const uint8_t *data = dt->data;
+    uint16_t length = dt->length;
+
+    if (data[0] == PACKET_ID_STREAM) {
+        data += CRYPTO_STREAM_HEADER_SIZE;
+        length -= CRYPTO_STREAM_HEADER_SIZE;
+    }
+
+    if (conn->connection_data_callback) {
+        conn->connection_data_callback(conn->connection_data_callback_object, conn->connection_data_callback_id, data,
+                                       length, userdata);
+    }
+
+    /* conn might get killed in callback. */
+    if (get_crypto_connection(c, crypt_connection_id) == 0) {
         return -1;
     }
 
+    return 0;
+}
+
+/* Deliver the packets of stream that were received before it was their turn
+ * and are next in it now.
+ *
+ * return -1 if the connection was killed in the data callback.
+ * return 0 otherwise.
+ */
+static int deliver_stream_packets(Net_Crypto *c, int crypt_connection_id, uint8_t stream_id, void *userdata)
+{
+    while (1) {
+        Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+        if (conn == 0) {
+            return -1;
+        }
+
+        Crypto_Stream *stream = &conn->stream[stream_id];
+        Packet_Data dt;
+
+        pthread_mutex_lock(&conn->mutex);
+        Packet_Data *packet = get_stream_packet(&conn->recv_array, stream, stream_id, stream->recv_number);
+
+        if (packet == NULL) {
+            pthread_mutex_unlock(&conn->mutex);
+            return 0;
+        }
+
+        memcpy(&dt, packet, sizeof(Packet_Data));
+        /* Delivered packets stay in recv_array, empty, so that they aren't
+         * requested again, until the packets before them are received. */
+        packet->length = 0;
+        ++stream->recv_number;
+        pthread_mutex_unlock(&conn->mutex);
+
+        if (deliver_lossless_packet(c, crypt_connection_id, &dt, userdata) == -1) {
+            return -1;
+        }
+    }
+}
+
+/* Deliver the received lossless packets that are next: in their stream for
+ * stream packets, and in the connection for the others.
+ *
+ * The first packet delivered on each stream is delivered in the connection,
+ * after the packets sent before it on any stream, as packets sent before the
+ * peer used streams have no stream.
+ *
+ * number is the packet number of the packet that was just received.
+ *
+ * return -1 if the connection was killed in the data callback.
+ * return 0 otherwise.
+ */
+static int deliver_lossless_packets(Net_Crypto *c, int crypt_connection_id, uint32_t number, void *userdata)
+{
     Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
 
     if (conn == 0) {
         return -1;
     }
 
-    uint8_t data[MAX_DATA_DATA_PACKET_SIZE];
-    int len = handle_data_packet(c, crypt_connection_id, data, packet, length);
+    Packet_Data *packet;
+    uint8_t stream_id = 0;
+    bool in_stream = 0;
+    pthread_mutex_lock(&conn->mutex);
+
+    if (get_data_pointer(&conn->recv_array, &packet, number) == 1 && packet->data[0] == PACKET_ID_STREAM) {
+        stream_id = packet_stream(packet);
+        Crypto_Stream *stream = &conn->stream[stream_id];
+
+        /* If it can't be added it waits for the packets before it on any stream. */
+        in_stream = stream->recv_started && add_stream_reorder(&conn->recv_array, stream, stream_id,
+                    packet_stream_number(packet), number) == 0;
+    }
+
+    pthread_mutex_unlock(&conn->mutex);
+
+    if (in_stream && deliver_stream_packets(c, crypt_connection_id, stream_id, userdata) == -1) {
+        return -1;
+    }
+
+    while (1) {
+        conn = get_crypto_connection(c, crypt_connection_id);
 
+        if (conn == 0) {
+            return -1;
+        }
+
+        Packet_Data dt;
+        pthread_mutex_lock(&conn->mutex);
+        int64_t ret = read_data_beg_buffer(&c->packet_pool, &conn->recv_array, &dt);
+        pthread_mutex_unlock(&conn->mutex);
+
+        if (ret == -1) {
+            return 0;
+        }
+
+        if (dt.length == 0) {
+            continue;
+        }
+
+        if (dt.data[0] != PACKET_ID_STREAM) {
+            if (deliver_lossless_packet(c, crypt_connection_id, &dt, userdata) == -1) {
+                return -1;
+            }
+
+            continue;
+        }
+
+        /* Everything before it was delivered, so it is next on its stream. */
+        const uint8_t stream_id = packet_stream(&dt);
+        conn->stream[stream_id].recv_started = 1;
+        conn->stream[stream_id].recv_number = packet_stream_number(&dt) + 1;
+
+        if (deliver_lossless_packet(c, crypt_connection_id, &dt, userdata) == -1
+                || deliver_stream_packets(c, crypt_connection_id, stream_id, userdata) == -1) {
+            return -1;
+        }
+    }
+}
+
+static int handle_data_packet_plain(Net_Crypto *c, int crypt_connection_id, uint8_t *data, int len, bool udp,
+                                    void *userdata);
+
+/* Handle the lossless packets in a PACKET_ID_BUNDLE packet of length bytes
+ * as if each came in its own data packet, with the data packet header at header.
+ *
+ * return -1 if the bundle is malformed.
+ * return 0 on success.
+ */
+static int handle_bundle_packet(Net_Crypto *c, int crypt_connection_id, const uint8_t *header, const uint8_t *data,
+                                uint16_t length, bool udp, void *userdata)
+{
+    uint8_t plain[(sizeof(uint32_t) * 2) + MAX_CRYPTO_STREAM_DATA_SIZE];
+    memcpy(plain, header, sizeof(uint32_t));
+    uint16_t pos = 1;
+
+    while (pos < length) {
+        if (length - pos <= BUNDLE_ENTRY_HEADER_SIZE) {
+            return -1;
+        }
+
+        uint16_t entry_length;
+        memcpy(&entry_length, data + pos + sizeof(uint32_t), sizeof(uint16_t));
+        entry_length = net_ntohs(entry_length);
+
+        if (entry_length == 0 || entry_length > MAX_CRYPTO_STREAM_DATA_SIZE
+                || entry_length > length - pos - BUNDLE_ENTRY_HEADER_SIZE) {
+            return -1;
+        }
+
+        const uint8_t *entry = data + pos + BUNDLE_ENTRY_HEADER_SIZE;
+
+        if (entry[0] != PACKET_ID_STREAM
+                && (entry[0] < CRYPTO_RESERVED_PACKETS || entry[0] >= PACKET_ID_LOSSY_RANGE_START)) {
+            return -1;
+        }
+
+        /* Packets we already have fail like they would on their own. */
+        memcpy(plain + sizeof(uint32_t), data + pos, sizeof(uint32_t));
+        memcpy(plain + (sizeof(uint32_t) * 2), entry, entry_length);
+        handle_data_packet_plain(c, crypt_connection_id, plain, (sizeof(uint32_t) * 2) + entry_length, udp, userdata);
+
+        pos += BUNDLE_ENTRY_HEADER_SIZE + entry_length;
+    }
+
+    return 0;
+}
+
+/* Handle the decrypted contents data of length len of a received data packet.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int handle_data_packet_plain(Net_Crypto *c, int crypt_connection_id, uint8_t *data, int len, bool udp,
+                                    void *userdata)
+{
     if (len <= (int)(sizeof(uint32_t) * 2)) {
         return -1;
     }
 
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0) {
+        return -1;
+    }
+
     uint32_t buffer_start, num;
     memcpy(&buffer_start, data, sizeof(uint32_t));
     memcpy(&num, data + sizeof(uint32_t), sizeof(uint32_t));
     buffer_start = net_ntohl(buffer_start);
     num = net_ntohl(num);
 
+    /* Time at which the last packet that this packet acknowledges was sent. */
     uint64_t rtt_calc_time = 0;
 
-    if (buffer_start != conn->send_array.buffer_start) {
-        Packet_Data *packet_time;
-
-        if (get_data_pointer(&conn->send_array, &packet_time, conn->send_array.buffer_start) == 1) {
-            rtt_calc_time = packet_time->sent_time;
-        }
+    if (buffer_start != conn->send_array.buffer_start) {
+        pthread_mutex_lock(&conn->mutex);
+        int ret = clear_buffer_until(&c->packet_pool, &conn->send_array, buffer_start, &rtt_calc_time,
+                                     &conn->bundled_lost);
+        pthread_mutex_unlock(&conn->mutex);
 
-        if (clear_buffer_until(&conn->send_array, buffer_start) != 0) {
+        if (ret != 0) {
             return -1;
         }
     }
@@ -1372,6 +2595,13 @@ static int handle_data_packet_core(Net_Crypto *c, int crypt_connection_id, const
         }
     }
 
+    /* Only stream packets are longer than the largest data of other packets,
+     * and only MTU probes and bundles longer than that. */
+    if (real_data[0] != PACKET_ID_MTU_PROBE && real_data[0] != PACKET_ID_BUNDLE
+            && real_length > (real_data[0] == PACKET_ID_STREAM ? MAX_CRYPTO_STREAM_DATA_SIZE : MAX_CRYPTO_DATA_SIZE)) {
+        return -1;
+    }
+
     if (real_data[0] == PACKET_ID_KILL) {
         connection_kill(c, crypt_connection_id, userdata);
         return 0;
@@ -1387,16 +2617,37 @@ static int handle_data_packet_core(Net_Crypto *c, int crypt_connection_id, const
         }
     }
 
-    if (real_data[0] == PACKET_ID_REQUEST) {
+    if (real_data[0] == PACKET_ID_REQUEST || real_data[0] == PACKET_ID_REQUEST_RANGES) {
         uint64_t rtt_time;
 
         if (udp) {
-            rtt_time = conn->rtt_time;
+            rtt_time = congestion_min_rtt(&conn->congestion, DEFAULT_PING_CONNECTION);
         } else {
             rtt_time = DEFAULT_TCP_PING_CONNECTION;
         }
 
-        int requested = handle_request_packet(&conn->send_array, real_data, real_length, &rtt_calc_time, rtt_time);
+        int requested;
+        pthread_mutex_lock(&conn->mutex);
+
+        if (real_data[0] == PACKET_ID_REQUEST_RANGES) {
+            conn->request_ranges = 1;
+            requested = handle_request_ranges_packet(&c->packet_pool, &conn->send_array, real_data, real_length, &rtt_calc_time,
+                        rtt_time, &conn->bundled_lost);
+        } else {
+            requested = handle_request_packet(&c->packet_pool, &conn->send_array, real_data, real_length, &rtt_calc_time,
+                                              rtt_time, &conn->bundled_lost);
+        }
+
+        if (conn->bundled_lost >= CRYPTO_MTU_BUNDLES_LOST) {
+            /* Large packets started to vanish on the path, e.g. because it
+             * changed: go back to the default size and probe it again. */
+            conn->mtu = MAX_CRYPTO_STREAM_PACKET_SIZE;
+            conn->mtu_probe = 0;
+            conn->mtu_probes = 0;
+            conn->bundled_lost = 0;
+        }
+
+        pthread_mutex_unlock(&conn->mutex);
 
         if (requested == -1) {
             return -1;
@@ -1405,37 +2656,81 @@ static int handle_data_packet_core(Net_Crypto *c, int crypt_connection_id, const
         // else { /* TODO(irungentoo): ? */ }
 
         set_buffer_end(&conn->recv_array, num);
-    } else if (real_data[0] >= CRYPTO_RESERVED_PACKETS && real_data[0] < PACKET_ID_LOSSY_RANGE_START) {
-        Packet_Data dt;
-        dt.length = real_length;
-        memcpy(dt.data, real_data, real_length);
+    } else if (real_data[0] == PACKET_ID_STREAMS) {
+        conn->streams = 1;
+        set_buffer_end(&conn->recv_array, num);
+    } else if (real_data[0] == PACKET_ID_MTU_PROBE) {
+        set_buffer_end(&conn->recv_array, num);
 
-        if (add_data_to_buffer(&conn->recv_array, num, &dt) != 0) {
+        if (real_length < 1 + sizeof(uint16_t)) {
             return -1;
         }
 
-        while (1) {
-            pthread_mutex_lock(&conn->mutex);
-            int ret = read_data_beg_buffer(&conn->recv_array, &dt);
-            pthread_mutex_unlock(&conn->mutex);
+        uint16_t size;
+        memcpy(&size, real_data + 1, sizeof(uint16_t));
 
-            if (ret == -1) {
-                break;
-            }
+        /* Tell the peer the probe came through whole. */
+        if (udp && net_ntohs(size) == DATA_PACKET_HEADROOM + len) {
+            uint8_t ack[1 + sizeof(uint16_t)];
+            ack[0] = PACKET_ID_MTU_ACK;
+            memcpy(ack + 1, &size, sizeof(uint16_t));
+            send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, conn->send_array.buffer_end,
+                                    ack, sizeof(ack));
+        }
+    } else if (real_data[0] == PACKET_ID_MTU_ACK) {
+        set_buffer_end(&conn->recv_array, num);
 
-            if (conn->connection_data_callback) {
-                conn->connection_data_callback(conn->connection_data_callback_object, conn->connection_data_callback_id, dt.data,
-                                               dt.length, userdata);
-            }
+        if (real_length < 1 + sizeof(uint16_t)) {
+            return -1;
+        }
+
+        uint16_t size;
+        memcpy(&size, real_data + 1, sizeof(uint16_t));
+        size = net_ntohs(size);
+
+        if (mtu_probe_size_valid(size) && size > conn->mtu) {
+            conn->mtu = size;
+            conn->mtu_probe = NUM_MTU_PROBE_SIZES;
+        }
+    } else if (real_data[0] == PACKET_ID_BUNDLE) {
+        set_buffer_end(&conn->recv_array, num);
+
+        if (handle_bundle_packet(c, crypt_connection_id, data, real_data, real_length, udp, userdata) != 0) {
+            return -1;
+        }
 
-            /* conn might get killed in callback. */
-            conn = get_crypto_connection(c, crypt_connection_id);
+        conn = get_crypto_connection(c, crypt_connection_id);
 
-            if (conn == 0) {
+        if (conn == 0) {
+            return 0;
+        }
+    } else if (real_data[0] == PACKET_ID_STREAM
+               || (real_data[0] >= CRYPTO_RESERVED_PACKETS && real_data[0] < PACKET_ID_LOSSY_RANGE_START)) {
+        if (real_data[0] == PACKET_ID_STREAM) {
+            if (real_length <= CRYPTO_STREAM_HEADER_SIZE || real_data[1] >= CRYPTO_MAX_STREAMS
+                    || real_data[CRYPTO_STREAM_HEADER_SIZE] < CRYPTO_RESERVED_PACKETS
+                    || real_data[CRYPTO_STREAM_HEADER_SIZE] >= PACKET_ID_LOSSY_RANGE_START) {
                 return -1;
             }
+
+            /* A peer that sends stream packets takes them too. */
+            conn->streams = 1;
+        }
+
+        Packet_Data dt;
+        dt.length = real_length;
+        memcpy(dt.data, real_data, real_length);
+
+        if (add_data_to_buffer(&c->packet_pool, &conn->recv_array, num, &dt) != 0) {
+            return -1;
+        }
+
+        if (deliver_lossless_packets(c, crypt_connection_id, num, userdata) == -1) {
+            return -1;
         }
 
+        conn = get_crypto_connection(c, crypt_connection_id);
+
         /* Packet counter. */
         ++conn->packet_counter;
     } else if (real_data[0] >= PACKET_ID_LOSSY_RANGE_START &&
@@ -1452,16 +2747,35 @@ static int handle_data_packet_core(Net_Crypto *c, int crypt_connection_id, const
     }
 
     if (rtt_calc_time != 0) {
-        uint64_t rtt_time = current_time_monotonic() - rtt_calc_time;
-
-        if (rtt_time < conn->rtt_time) {
-            conn->rtt_time = rtt_time;
-        }
+        const uint64_t temp_time = current_time_monotonic();
+        congestion_rtt_sample(&conn->congestion, temp_time - rtt_calc_time, temp_time);
     }
 
     return 0;
 }
 
+/* Handle a received data packet.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int handle_data_packet_core(Net_Crypto *c, int crypt_connection_id, const uint8_t *packet, uint16_t length,
+                                   bool udp, void *userdata)
+{
+    if (length > MAX_CRYPTO_MTU || length <= CRYPTO_DATA_PACKET_MIN_SIZE) {
+        return -1;
+    }
+
+    VLA(uint8_t, data, length - DATA_PACKET_HEADROOM);
+    int len = handle_data_packet(c, crypt_connection_id, data, packet, length);
+
+    if (len == -1) {
+        return -1;
+    }
+
+    return handle_data_packet_plain(c, crypt_connection_id, data, len, udp, userdata);
+}
+
 /* Handle a packet that was received for the connection.
  *
  * return -1 on failure.
@@ -1470,7 +2784,7 @@ static int handle_data_packet_core(Net_Crypto *c, int crypt_connection_id, const
 static int handle_packet_connection(Net_Crypto *c, int crypt_connection_id, const uint8_t *packet, uint16_t length,
                                     bool udp, void *userdata)
 {
-    if (length == 0 || length > MAX_CRYPTO_PACKET_SIZE) {
+    if (length == 0 || length > MAX_CRYPTO_MTU) {
         return -1;
     }
 
@@ -1587,9 +2901,12 @@ static int create_crypto_connection(Net_Crypto *c)
 {
     uint32_t i;
 
-    for (i = 0; i < c->crypto_connections_length; ++i) {
-        if (c->crypto_connections[i].status == CRYPTO_CONN_NO_CONNECTION) {
-            return i;
+    /* If every connection is in the index there are no free slots to reuse. */
+    if (c->connection_index.size != c->crypto_connections_length) {
+        for (i = 0; i < c->crypto_connections_length; ++i) {
+            if (c->crypto_connections[i].status == CRYPTO_CONN_NO_CONNECTION) {
+                return i;
+            }
         }
     }
 
@@ -1611,10 +2928,10 @@ static int create_crypto_connection(Net_Crypto *c)
         memset(&(c->crypto_connections[id]), 0, sizeof(Crypto_Connection));
         // Memsetting float/double to 0 is non-portable, so we explicitly set them to 0
         c->crypto_connections[id].packet_recv_rate = 0;
-        c->crypto_connections[id].packet_send_rate = 0;
         c->crypto_connections[id].last_packets_left_rem = 0;
-        c->crypto_connections[id].packet_send_rate_requested = 0;
         c->crypto_connections[id].last_packets_left_requested_rem = 0;
+        c->crypto_connections[id].pacing_budget = 0;
+        c->crypto_connections[id].pacing_rate = 0;
 
         if (pthread_mutex_init(&c->crypto_connections[id].mutex, NULL) != 0) {
             pthread_mutex_unlock(&c->connections_mutex);
@@ -1667,17 +2984,7 @@ static int wipe_crypto_connection(Net_Crypto *c, int crypt_connection_id)
  */
 static int getcryptconnection_id(const Net_Crypto *c, const uint8_t *public_key)
 {
-    uint32_t i;
-
-    for (i = 0; i < c->crypto_connections_length; ++i) {
-        if (c->crypto_connections[i].status != CRYPTO_CONN_NO_CONNECTION) {
-            if (public_key_cmp(public_key, c->crypto_connections[i].public_key) == 0) {
-                return i;
-            }
-        }
-    }
-
-    return -1;
+    return pk_index_get(&c->connection_index, public_key);
 }
 
 /* Add a source to the crypto connection.
@@ -1830,7 +3137,9 @@ int accept_crypto_connection(Net_Crypto *c, New_Connection *n_c)
     encrypt_precompute(conn->peersessionpublic_key, conn->sessionsecret_key, conn->shared_key);
     conn->status = CRYPTO_CONN_NOT_CONFIRMED;
 
-    if (create_send_handshake(c, crypt_connection_id, n_c->cookie, n_c->dht_public_key) != 0) {
+    if (pk_index_set(&c->connection_index, conn->public_key, crypt_connection_id) == -1
+            || create_send_handshake(c, crypt_connection_id, n_c->cookie, n_c->dht_public_key) != 0) {
+        pk_index_remove(&c->connection_index, conn->public_key);
         pthread_mutex_lock(&c->tcp_mutex);
         kill_tcp_connection_to(c->tcp_c, conn->connection_number_tcp);
         pthread_mutex_unlock(&c->tcp_mutex);
@@ -1839,10 +3148,9 @@ int accept_crypto_connection(Net_Crypto *c, New_Connection *n_c)
     }
 
     memcpy(conn->dht_public_key, n_c->dht_public_key, CRYPTO_PUBLIC_KEY_SIZE);
-    conn->packet_send_rate = CRYPTO_PACKET_MIN_RATE;
-    conn->packet_send_rate_requested = CRYPTO_PACKET_MIN_RATE;
+    congestion_init(&conn->congestion, c->congestion_algorithm, current_time_monotonic());
     conn->packets_left = CRYPTO_MIN_QUEUE_LENGTH;
-    conn->rtt_time = DEFAULT_PING_CONNECTION;
+    conn->mtu = MAX_CRYPTO_STREAM_PACKET_SIZE;
     crypto_connection_add_source(c, crypt_connection_id, n_c->source);
     return crypt_connection_id;
 }
@@ -1886,18 +3194,19 @@ int new_crypto_connection(Net_Crypto *c, const uint8_t *real_public_key, const u
     random_nonce(conn->sent_nonce);
     crypto_new_keypair(conn->sessionpublic_key, conn->sessionsecret_key);
     conn->status = CRYPTO_CONN_COOKIE_REQUESTING;
-    conn->packet_send_rate = CRYPTO_PACKET_MIN_RATE;
-    conn->packet_send_rate_requested = CRYPTO_PACKET_MIN_RATE;
+    congestion_init(&conn->congestion, c->congestion_algorithm, current_time_monotonic());
     conn->packets_left = CRYPTO_MIN_QUEUE_LENGTH;
-    conn->rtt_time = DEFAULT_PING_CONNECTION;
+    conn->mtu = MAX_CRYPTO_STREAM_PACKET_SIZE;
     memcpy(conn->dht_public_key, dht_public_key, CRYPTO_PUBLIC_KEY_SIZE);
 
     conn->cookie_request_number = random_64b();
     uint8_t cookie_request[COOKIE_REQUEST_LENGTH];
 
-    if (create_cookie_request(c, cookie_request, conn->dht_public_key, conn->cookie_request_number,
-                              conn->shared_key) != sizeof(cookie_request)
+    if (pk_index_set(&c->connection_index, conn->public_key, crypt_connection_id) == -1
+            || create_cookie_request(c, cookie_request, conn->dht_public_key, conn->cookie_request_number,
+                                     conn->shared_key) != sizeof(cookie_request)
             || new_temp_packet(c, crypt_connection_id, cookie_request, sizeof(cookie_request)) != 0) {
+        pk_index_remove(&c->connection_index, conn->public_key);
         pthread_mutex_lock(&c->tcp_mutex);
         kill_tcp_connection_to(c->tcp_c, conn->connection_number_tcp);
         pthread_mutex_unlock(&c->tcp_mutex);
@@ -1947,7 +3256,7 @@ int set_direct_ip_port(Net_Crypto *c, int crypt_connection_id, IP_Port ip_port,
 
 static int tcp_data_callback(void *object, int id, const uint8_t *data, uint16_t length, void *userdata)
 {
-    if (length == 0 || length > MAX_CRYPTO_PACKET_SIZE) {
+    if (length == 0 || length > MAX_CRYPTO_STREAM_PACKET_SIZE) {
         return -1;
     }
 
@@ -2238,9 +3547,107 @@ static int crypto_id_ip_port(const Net_Crypto *c, IP_Port ip_port)
  * Crypto data packets.
  *
  */
+static void set_direct_lastrecv_time(Net_Crypto *c, int crypt_connection_id, IP_Port source)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&conn->mutex);
+
+    if (source.ip.family == AF_INET) {
+        conn->direct_lastrecv_timev4 = unix_time();
+    } else {
+        conn->direct_lastrecv_timev6 = unix_time();
+    }
+
+    pthread_mutex_unlock(&conn->mutex);
+}
+
+static void handle_data_packet_decrypted(void *object, Crypto_Job *job, void *userdata)
+{
+    Net_Crypto *c = (Net_Crypto *)object;
+    Crypto_Connection *conn = get_crypto_connection(c, job->number);
+
+    if (conn == 0) {
+        return;
+    }
+
+    uint8_t nonce[CRYPTO_NONCE_SIZE];
+    uint16_t diff = data_packet_nonce(conn->recv_nonce, job->packet, nonce);
+
+    if (crypto_memcmp(nonce, job->nonce, CRYPTO_NONCE_SIZE) != 0
+            || crypto_memcmp(conn->shared_key, job->shared_key, CRYPTO_SHARED_KEY_SIZE) != 0) {
+        /* A packet handled before this one moved recv_nonce forward or the
+         * connection was replaced, so the worker used the wrong key. */
+        if (handle_packet_connection(c, job->number, job->packet, job->length, 1, userdata) == 0) {
+            set_direct_lastrecv_time(c, job->number, job->source);
+        }
+
+        return;
+    }
+
+    if (conn->status != CRYPTO_CONN_NOT_CONFIRMED && conn->status != CRYPTO_CONN_ESTABLISHED) {
+        return;
+    }
+
+    if (job->plain_length != job->encrypted_length - CRYPTO_MAC_SIZE) {
+        return;
+    }
+
+    if (diff > DATA_NUM_THRESHOLD * 2) {
+        increment_nonce_number(conn->recv_nonce, DATA_NUM_THRESHOLD);
+    }
+
+    if (handle_data_packet_plain(c, job->number, job->plain, job->plain_length, 1, userdata) == 0) {
+        set_direct_lastrecv_time(c, job->number, job->source);
+    }
+}
+
+/* Hand the decryption of a data packet received over UDP to the crypto
+ * workers. The rest of it is handled by handle_data_packet_decrypted.
+ *
+ * return 1 if the packet was dropped.
+ * return 0 if it was queued.
+ */
+static int queue_data_packet(Net_Crypto *c, int crypt_connection_id, IP_Port source, const uint8_t *packet,
+                             uint16_t length, void *userdata)
+{
+    if (length <= CRYPTO_DATA_PACKET_MIN_SIZE) {
+        return 1;
+    }
+
+    /* This may hand back earlier jobs, which can kill connections. */
+    Crypto_Job *job = crypto_workers_job(c->dht->net->crypto_workers, length, userdata);
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (job == NULL || conn == 0) {
+        return 1;
+    }
+
+    if (conn->status != CRYPTO_CONN_NOT_CONFIRMED && conn->status != CRYPTO_CONN_ESTABLISHED) {
+        return 1;
+    }
+
+    job->function = &handle_data_packet_decrypted;
+    job->object = c;
+    job->number = crypt_connection_id;
+    job->source = source;
+    memcpy(job->shared_key, conn->shared_key, CRYPTO_SHARED_KEY_SIZE);
+    data_packet_nonce(conn->recv_nonce, packet, job->nonce);
+    memcpy(job->packet, packet, length);
+    job->length = length;
+    job->encrypted_start = 1 + sizeof(uint16_t);
+    job->encrypted_length = length - job->encrypted_start;
+    crypto_workers_submit(c->dht->net->crypto_workers);
+    return 0;
+}
+
 static int udp_handle_packet(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
 {
-    if (length <= CRYPTO_MIN_PACKET_SIZE || length > MAX_CRYPTO_PACKET_SIZE) {
+    if (length <= CRYPTO_MIN_PACKET_SIZE || length > MAX_CRYPTO_MTU) {
         return 1;
     }
 
@@ -2259,52 +3666,34 @@ static int udp_handle_packet(void *object, IP_Port source, const uint8_t *packet
         return 0;
     }
 
-    if (handle_packet_connection(c, crypt_connection_id, packet, length, 1, userdata) != 0) {
-        return 1;
-    }
-
-    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
-
-    if (conn == 0) {
-        return -1;
+    if (packet[0] == NET_PACKET_CRYPTO_DATA && c->dht->net->crypto_workers != NULL) {
+        return queue_data_packet(c, crypt_connection_id, source, packet, length, userdata);
     }
 
-    pthread_mutex_lock(&conn->mutex);
-
-    if (source.ip.family == AF_INET) {
-        conn->direct_lastrecv_timev4 = unix_time();
-    } else {
-        conn->direct_lastrecv_timev6 = unix_time();
+    if (handle_packet_connection(c, crypt_connection_id, packet, length, 1, userdata) != 0) {
+        return 1;
     }
 
-    pthread_mutex_unlock(&conn->mutex);
+    set_direct_lastrecv_time(c, crypt_connection_id, source);
     return 0;
 }
 
 /* The dT for the average packet receiving rate calculations.
    Also used as the */
-#define PACKET_COUNTER_AVERAGE_INTERVAL 50
+#define PACKET_COUNTER_AVERAGE_INTERVAL CONGESTION_UPDATE_INTERVAL
 
 /* Ratio of recv queue size / recv packet rate (in seconds) times
  * the number of ms between request packets to send at that ratio
  */
 #define REQUEST_PACKETS_COMPARE_CONSTANT (0.125 * 100.0)
 
-/* Timeout for increasing speed after congestion event (in ms). */
-#define CONGESTION_EVENT_TIMEOUT 1000
-
-/* If the send queue is SEND_QUEUE_RATIO times larger than the
- * calculated link speed the packet send speed will be reduced
- * by a value depending on this number.
- */
-#define SEND_QUEUE_RATIO 2.0
-
 static void send_crypto_packets(Net_Crypto *c)
 {
     uint32_t i;
     uint64_t temp_time = current_time_monotonic();
     double total_send_rate = 0;
     uint32_t peak_request_packet_interval = ~0;
+    uint32_t peak_pacing_sleep_time = ~0;
 
     for (i = 0; i < c->crypto_connections_length; ++i) {
         Crypto_Connection *conn = get_crypto_connection(c, i);
@@ -2363,100 +3752,40 @@ static void send_crypto_packets(Net_Crypto *c)
                 conn->packet_counter = 0;
                 conn->packet_counter_set = temp_time;
 
-                uint32_t packets_sent = conn->packets_sent;
-                conn->packets_sent = 0;
-
-                uint32_t packets_resent = conn->packets_resent;
-                conn->packets_resent = 0;
-
-                /* conjestion control
-                    calculate a new value of conn->packet_send_rate based on some data
-                 */
-
-                unsigned int pos = conn->last_sendqueue_counter % CONGESTION_QUEUE_ARRAY_SIZE;
-                conn->last_sendqueue_size[pos] = num_packets_array(&conn->send_array);
-                ++conn->last_sendqueue_counter;
-
-                unsigned int j;
-                long signed int sum = 0;
-                sum = (long signed int)conn->last_sendqueue_size[(pos) % CONGESTION_QUEUE_ARRAY_SIZE] -
-                      (long signed int)conn->last_sendqueue_size[(pos - (CONGESTION_QUEUE_ARRAY_SIZE - 1)) % CONGESTION_QUEUE_ARRAY_SIZE];
-
-                unsigned int n_p_pos = conn->last_sendqueue_counter % CONGESTION_LAST_SENT_ARRAY_SIZE;
-                conn->last_num_packets_sent[n_p_pos] = packets_sent;
-                conn->last_num_packets_resent[n_p_pos] = packets_resent;
-
+                /* Let the congestion control algorithm of the connection set new send rates. */
                 bool direct_connected = 0;
                 crypto_connection_status(c, i, &direct_connected, NULL);
 
-                if (direct_connected && conn->last_tcp_sent + CONGESTION_EVENT_TIMEOUT > temp_time) {
-                    /* When switching from TCP to UDP, don't change the packet send rate for CONGESTION_EVENT_TIMEOUT ms. */
-                } else {
-                    long signed int total_sent = 0, total_resent = 0;
-
-                    // TODO(irungentoo): use real delay
-                    unsigned int delay = (unsigned int)((conn->rtt_time / PACKET_COUNTER_AVERAGE_INTERVAL) + 0.5);
-                    unsigned int packets_set_rem_array = (CONGESTION_LAST_SENT_ARRAY_SIZE - CONGESTION_QUEUE_ARRAY_SIZE);
-
-                    if (delay > packets_set_rem_array) {
-                        delay = packets_set_rem_array;
-                    }
-
-                    for (j = 0; j < CONGESTION_QUEUE_ARRAY_SIZE; ++j) {
-                        unsigned int ind = (j + (packets_set_rem_array  - delay) + n_p_pos) % CONGESTION_LAST_SENT_ARRAY_SIZE;
-                        total_sent += conn->last_num_packets_sent[ind];
-                        total_resent += conn->last_num_packets_resent[ind];
-                    }
-
-                    if (sum > 0) {
-                        total_sent -= sum;
-                    } else {
-                        if (total_resent > -sum) {
-                            total_resent = -sum;
-                        }
-                    }
-
-                    /* if queue is too big only allow resending packets. */
-                    uint32_t npackets = num_packets_array(&conn->send_array);
-                    double min_speed = 1000.0 * (((double)(total_sent)) / ((double)(CONGESTION_QUEUE_ARRAY_SIZE) *
-                                                 PACKET_COUNTER_AVERAGE_INTERVAL));
+                Congestion_Update update;
+                update.time = temp_time;
+                update.interval = dt;
+                update.packets_sent = conn->packets_sent;
+                update.packets_resent = conn->packets_resent;
+                /* Packets waiting for the pacer aren't on the path yet. */
+                update.send_queue_size = num_packets_array(&conn->send_array);
 
-                    double min_speed_request = 1000.0 * (((double)(total_sent + total_resent)) / ((double)(
-                            CONGESTION_QUEUE_ARRAY_SIZE) * PACKET_COUNTER_AVERAGE_INTERVAL));
-
-                    if (min_speed < CRYPTO_PACKET_MIN_RATE) {
-                        min_speed = CRYPTO_PACKET_MIN_RATE;
-                    }
-
-                    double send_array_ratio = (((double)npackets) / min_speed);
-
-                    // TODO(irungentoo): Improve formula?
-                    if (send_array_ratio > SEND_QUEUE_RATIO && CRYPTO_MIN_QUEUE_LENGTH < npackets) {
-                        conn->packet_send_rate = min_speed * (1.0 / (send_array_ratio / SEND_QUEUE_RATIO));
-                    } else if (conn->last_congestion_event + CONGESTION_EVENT_TIMEOUT < temp_time) {
-                        conn->packet_send_rate = min_speed * 1.2;
-                    } else {
-                        conn->packet_send_rate = min_speed * 0.9;
-                    }
-
-                    conn->packet_send_rate_requested = min_speed_request * 1.2;
+                if (update.send_queue_size > conn->pacing_waiting) {
+                    update.send_queue_size -= conn->pacing_waiting;
+                } else {
+                    update.send_queue_size = 0;
+                }
 
-                    if (conn->packet_send_rate < CRYPTO_PACKET_MIN_RATE) {
-                        conn->packet_send_rate = CRYPTO_PACKET_MIN_RATE;
-                    }
+                update.last_congestion_event = conn->last_congestion_event;
+                update.direct = direct_connected;
+                /* When switching from TCP to UDP, don't change the packet send rate for CONGESTION_EVENT_TIMEOUT ms. */
+                update.hold = direct_connected && conn->last_tcp_sent + CONGESTION_EVENT_TIMEOUT > temp_time;
+                congestion_update(&conn->congestion, &update);
 
-                    if (conn->packet_send_rate_requested < conn->packet_send_rate) {
-                        conn->packet_send_rate_requested = conn->packet_send_rate;
-                    }
-                }
+                conn->packets_sent = 0;
+                conn->packets_resent = 0;
             }
 
             if (conn->last_packets_left_set == 0 || conn->last_packets_left_requested_set == 0) {
                 conn->last_packets_left_requested_set = conn->last_packets_left_set = temp_time;
                 conn->packets_left_requested = conn->packets_left = CRYPTO_MIN_QUEUE_LENGTH;
             } else {
-                if (((uint64_t)((1000.0 / conn->packet_send_rate) + 0.5) + conn->last_packets_left_set) <= temp_time) {
-                    double n_packets = conn->packet_send_rate * (((double)(temp_time - conn->last_packets_left_set)) / 1000.0);
+                if (((uint64_t)((1000.0 / conn->congestion.send_rate) + 0.5) + conn->last_packets_left_set) <= temp_time) {
+                    double n_packets = conn->congestion.send_rate * (((double)(temp_time - conn->last_packets_left_set)) / 1000.0);
                     n_packets += conn->last_packets_left_rem;
 
                     uint32_t num_packets = n_packets;
@@ -2472,9 +3801,9 @@ static void send_crypto_packets(Net_Crypto *c)
                     conn->last_packets_left_rem = rem;
                 }
 
-                if (((uint64_t)((1000.0 / conn->packet_send_rate_requested) + 0.5) + conn->last_packets_left_requested_set) <=
+                if (((uint64_t)((1000.0 / conn->congestion.send_rate_requested) + 0.5) + conn->last_packets_left_requested_set) <=
                         temp_time) {
-                    double n_packets = conn->packet_send_rate_requested * (((double)(temp_time - conn->last_packets_left_requested_set)) /
+                    double n_packets = conn->congestion.send_rate_requested * (((double)(temp_time - conn->last_packets_left_requested_set)) /
                                        1000.0);
                     n_packets += conn->last_packets_left_requested_rem;
 
@@ -2491,22 +3820,64 @@ static void send_crypto_packets(Net_Crypto *c)
                 }
             }
 
-            int ret = send_requested_packets(c, i, conn->packets_left_requested);
+            /* Packets written since the last run were counted against
+             * packets_left then, requested ones are counted here. */
+            pacing_refill(conn, temp_time);
+            const uint32_t max_num = conn->pacing_budget;
+            uint32_t resent = 0, failed = 0;
+            int ret = send_requested_packets(c, i, max_num, conn->packets_left_requested, &resent, &failed);
 
             if (ret != -1) {
-                conn->packets_left_requested -= ret;
-                conn->packets_resent += ret;
+                conn->pacing_budget -= ret;
+
+                if (failed != 0) {
+                    /* The packets that failed still wait, try them on the next run. */
+                    if ((unsigned int)ret - resent < conn->pacing_waiting) {
+                        conn->pacing_waiting -= ret - resent;
+                    } else {
+                        conn->pacing_waiting = failed;
+                    }
+                } else if ((unsigned int)ret < max_num || (unsigned int)ret - resent >= conn->pacing_waiting) {
+                    /* Nothing is left waiting. */
+                    uint32_t j;
+
+                    for (j = 0; j < CRYPTO_MAX_STREAMS; ++j) {
+                        conn->stream[j].waiting = 0;
+                    }
+
+                    conn->pacing_waiting = 0;
+                } else {
+                    conn->pacing_waiting -= ret - resent;
+                }
+            }
+
+            if (conn->packets_left_requested != 0) {
+                conn->packets_left_requested -= resent;
+                conn->packets_resent += resent;
 
-                if ((unsigned int)ret < conn->packets_left) {
-                    conn->packets_left -= ret;
+                if (resent < conn->packets_left) {
+                    conn->packets_left -= resent;
                 } else {
                     conn->last_congestion_event = temp_time;
                     conn->packets_left = 0;
                 }
             }
 
-            if (conn->packet_send_rate > CRYPTO_PACKET_MIN_RATE * 1.5) {
-                total_send_rate += conn->packet_send_rate;
+            if (conn->pacing_waiting) {
+                /* Run again when the pacer allows the next packet. */
+                uint32_t pacing_sleep_time = 0;
+
+                if (conn->pacing_budget < 1.0) {
+                    pacing_sleep_time = ((1.0 - conn->pacing_budget) * 1000.0 / conn->pacing_rate) + 1;
+                }
+
+                if (pacing_sleep_time < peak_pacing_sleep_time) {
+                    peak_pacing_sleep_time = pacing_sleep_time;
+                }
+            }
+
+            if (conn->congestion.send_rate > CRYPTO_PACKET_MIN_RATE * 1.5) {
+                total_send_rate += conn->congestion.send_rate;
             }
         }
     }
@@ -2526,6 +3897,10 @@ static void send_crypto_packets(Net_Crypto *c)
         }
     }
 
+    if (c->current_sleep_time > peak_pacing_sleep_time) {
+        c->current_sleep_time = peak_pacing_sleep_time;
+    }
+
     sleep_time = CRYPTO_SEND_PACKET_INTERVAL;
 
     if (c->current_sleep_time > sleep_time) {
@@ -2571,7 +3946,17 @@ uint32_t crypto_num_free_sendqueue_slots(const Net_Crypto *c, int crypt_connecti
 int64_t write_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length,
                           uint8_t congestion_control)
 {
-    if (length == 0) {
+    return write_cryptpacket_stream(c, crypt_connection_id, CRYPTO_STREAM_DEFAULT, data, length, congestion_control);
+}
+
+int64_t write_cryptpacket_stream(Net_Crypto *c, int crypt_connection_id, uint8_t stream, const uint8_t *data,
+                                 uint16_t length, uint8_t congestion_control)
+{
+    if (length == 0 || length > MAX_CRYPTO_DATA_SIZE) {
+        return -1;
+    }
+
+    if (stream >= CRYPTO_MAX_STREAMS) {
         return -1;
     }
 
@@ -2597,7 +3982,24 @@ int64_t write_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t
         return -1;
     }
 
-    int64_t ret = send_lossless_packet(c, crypt_connection_id, data, length, congestion_control);
+    int64_t ret;
+
+    if (conn->streams) {
+        uint8_t packet[MAX_CRYPTO_STREAM_DATA_SIZE];
+        const uint16_t stream_number = net_htons(conn->stream[stream].send_number);
+        packet[0] = PACKET_ID_STREAM;
+        packet[1] = stream;
+        memcpy(packet + 2, &stream_number, sizeof(uint16_t));
+        memcpy(packet + CRYPTO_STREAM_HEADER_SIZE, data, length);
+        ret = send_lossless_packet(c, crypt_connection_id, packet, CRYPTO_STREAM_HEADER_SIZE + length,
+                                   congestion_control);
+
+        if (ret != -1) {
+            ++conn->stream[stream].send_number;
+        }
+    } else {
+        ret = send_lossless_packet(c, crypt_connection_id, data, length, congestion_control);
+    }
 
     if (ret == -1) {
         return -1;
@@ -2711,9 +4113,17 @@ int crypto_kill(Net_Crypto *c, int crypt_connection_id)
 
         bs_list_remove(&c->ip_port_list, (uint8_t *)&conn->ip_portv4, crypt_connection_id);
         bs_list_remove(&c->ip_port_list, (uint8_t *)&conn->ip_portv6, crypt_connection_id);
+        pk_index_remove(&c->connection_index, conn->public_key);
         clear_temp_packet(c, crypt_connection_id);
-        clear_buffer(&conn->send_array);
-        clear_buffer(&conn->recv_array);
+        clear_buffer(&c->packet_pool, &conn->send_array);
+        clear_buffer(&c->packet_pool, &conn->recv_array);
+
+        uint32_t i;
+
+        for (i = 0; i < CRYPTO_MAX_STREAMS; ++i) {
+            free(conn->stream[i].reorder);
+        }
+
         ret = wipe_crypto_connection(c, crypt_connection_id);
     }
 
@@ -2818,6 +4228,14 @@ Net_Crypto *new_net_crypto(Logger *log, DHT *dht, TCP_Proxy_Info *proxy_info)
         return NULL;
     }
 
+    if (packet_pool_init(&temp->packet_pool) != 0) {
+        pthread_mutex_destroy(&temp->tcp_mutex);
+        pthread_mutex_destroy(&temp->connections_mutex);
+        kill_tcp_connections(temp->tcp_c);
+        free(temp);
+        return NULL;
+    }
+
     temp->dht = dht;
 
     new_keys(temp);
@@ -2825,6 +4243,12 @@ Net_Crypto *new_net_crypto(Logger *log, DHT *dht, TCP_Proxy_Info *proxy_info)
 
     temp->current_sleep_time = CRYPTO_SEND_PACKET_INTERVAL;
 
+    uint32_t i;
+
+    for (i = 0; i < CRYPTO_MAX_STREAMS; ++i) {
+        temp->stream_weights[i] = 1;
+    }
+
     networking_registerhandler(dht->net, NET_PACKET_COOKIE_REQUEST, &udp_handle_cookie_request, temp);
     networking_registerhandler(dht->net, NET_PACKET_COOKIE_RESPONSE, &udp_handle_packet, temp);
     networking_registerhandler(dht->net, NET_PACKET_CRYPTO_HS, &udp_handle_packet, temp);
@@ -2870,6 +4294,26 @@ static void kill_timedout(Net_Crypto *c, void *userdata)
     }
 }
 
+int net_crypto_set_congestion_algorithm(Net_Crypto *c, Congestion_Algorithm algorithm)
+{
+    if ((unsigned int)algorithm >= CONGESTION_NUM_ALGORITHMS) {
+        return -1;
+    }
+
+    c->congestion_algorithm = algorithm;
+    return 0;
+}
+
+int net_crypto_set_stream_weight(Net_Crypto *c, uint8_t stream, uint8_t weight)
+{
+    if (stream >= CRYPTO_MAX_STREAMS || weight == 0) {
+        return -1;
+    }
+
+    c->stream_weights[stream] = weight;
+    return 0;
+}
+
 /* return the optimal interval in ms for running do_net_crypto.
  */
 uint32_t crypto_run_interval(const Net_Crypto *c)
@@ -2896,9 +4340,11 @@ void kill_net_crypto(Net_Crypto *c)
 
     pthread_mutex_destroy(&c->tcp_mutex);
     pthread_mutex_destroy(&c->connections_mutex);
+    packet_pool_kill(&c->packet_pool);
 
     kill_tcp_connections(c->tcp_c);
     bs_list_free(&c->ip_port_list);
+    pk_index_free(&c->connection_index);
     networking_registerhandler(c->dht->net, NET_PACKET_COOKIE_REQUEST, NULL, NULL);
     networking_registerhandler(c->dht->net, NET_PACKET_COOKIE_RESPONSE, NULL, NULL);
     networking_registerhandler(c->dht->net, NET_PACKET_CRYPTO_HS, NULL, NULL);
@@ -27,7 +27,9 @@
 #include "DHT.h"
 #include "LAN_discovery.h"
 #include "TCP_connection.h"
+#include "congestion.h"
 #include "logger.h"
+#include "util.h"
 
 #include <pthread.h>
 
@@ -40,11 +42,12 @@
 /* Maximum size of receiving and sending packet buffers. */
 #define CRYPTO_PACKET_BUFFER_SIZE 32768 /* Must be a power of 2 */
 
-/* Minimum packet rate per second. */
-#define CRYPTO_PACKET_MIN_RATE 4.0
-
-/* Minimum packet queue max length. */
-#define CRYPTO_MIN_QUEUE_LENGTH 64
+/* Packets sent with congestion control are paced: at most CRYPTO_PACING_BURST ms
+   worth of the send rate, or CRYPTO_PACING_MIN_BURST packets, go out at once, and
+   packets waiting for the pacer are sent within CRYPTO_PACING_INTERVAL ms. */
+#define CRYPTO_PACING_BURST 2
+#define CRYPTO_PACING_MIN_BURST 2.0
+#define CRYPTO_PACING_INTERVAL 50
 
 /* Maximum total size of packets that net_crypto sends. */
 #define MAX_CRYPTO_PACKET_SIZE 1400
@@ -54,6 +57,12 @@
 /* Max size of data in packets */
 #define MAX_CRYPTO_DATA_SIZE (MAX_CRYPTO_PACKET_SIZE - CRYPTO_DATA_PACKET_MIN_SIZE)
 
+/* Lossless packets sent on a stream carry a header of this size in front of
+   their data, so peers that use streams take packets that much larger. */
+#define CRYPTO_STREAM_HEADER_SIZE (1 + 1 + sizeof(uint16_t))
+#define MAX_CRYPTO_STREAM_PACKET_SIZE (MAX_CRYPTO_PACKET_SIZE + CRYPTO_STREAM_HEADER_SIZE)
+#define MAX_CRYPTO_STREAM_DATA_SIZE (MAX_CRYPTO_DATA_SIZE + CRYPTO_STREAM_HEADER_SIZE)
+
 /* Interval in ms between sending cookie request/handshake packets. */
 #define CRYPTO_SEND_PACKET_INTERVAL 1000
 
@@ -67,6 +76,41 @@
 #define PACKET_ID_PADDING 0 /* Denotes padding */
 #define PACKET_ID_REQUEST 1 /* Used to request unreceived packets */
 #define PACKET_ID_KILL    2 /* Used to kill connection */
+#define PACKET_ID_REQUEST_RANGES 3 /* Used to request unreceived packets, as runs of packet numbers */
+
+/* Request packets in the PACKET_ID_REQUEST_RANGES format are sent along with
+   the old ones this many times, and only them once the peer sent one back. */
+#define CRYPTO_REQUEST_RANGES_PROBES 8
+
+#define PACKET_ID_STREAMS 4 /* Used to tell the peer that it can send stream packets */
+#define PACKET_ID_STREAM 5 /* Lossless packet sent on one of the streams of the connection */
+
+/* Lossless packets are sent on one of CRYPTO_MAX_STREAMS streams, each
+   delivered in order independently of the others. Packets sent without a
+   stream go on CRYPTO_STREAM_DEFAULT. */
+#define CRYPTO_MAX_STREAMS 4
+#define CRYPTO_STREAM_DEFAULT 0
+
+/* PACKET_ID_STREAMS packets are sent along with this many request packets. */
+#define CRYPTO_STREAMS_PROBES 8
+
+#define PACKET_ID_MTU_PROBE 6 /* Padded to the packet size it probes, sent without fragmentation */
+#define PACKET_ID_MTU_ACK 7 /* Tells the peer a PACKET_ID_MTU_PROBE of that size got through */
+#define PACKET_ID_BUNDLE 8 /* Several lossless packets sent in one */
+
+/* Largest packet sent to a peer over a direct UDP path. Connections send
+   packets of up to MAX_CRYPTO_STREAM_PACKET_SIZE until the peer acknowledged
+   a larger PACKET_ID_MTU_PROBE, and only over UDP: TCP relays don't take more. */
+#define MAX_CRYPTO_MTU 8952
+
+/* A packet size is given up on after this many PACKET_ID_MTU_PROBE packets of
+   it, sent along with request packets, weren't acknowledged. */
+#define CRYPTO_MTU_PROBES 4
+
+/* Once this many packets sent in PACKET_ID_BUNDLE packets in a row were
+   requested again, the path is taken to have stopped taking large packets:
+   the connection goes back to MAX_CRYPTO_STREAM_PACKET_SIZE and probes again. */
+#define CRYPTO_MTU_BUNDLES_LOST 16
 
 /* Packet ids 0 to CRYPTO_RESERVED_PACKETS - 1 are reserved for use by net_crypto. */
 #define CRYPTO_RESERVED_PACKETS 16
@@ -80,27 +124,63 @@
 
 #define CRYPTO_MAX_PADDING 8 /* All packets will be padded a number of bytes based on this number. */
 
-/* Base current transfer speed on last CONGESTION_QUEUE_ARRAY_SIZE number of points taken
-   at the dT defined in net_crypto.c */
-#define CONGESTION_QUEUE_ARRAY_SIZE 12
-#define CONGESTION_LAST_SENT_ARRAY_SIZE (CONGESTION_QUEUE_ARRAY_SIZE * 2)
-
-/* Default connection ping in ms. */
-#define DEFAULT_PING_CONNECTION 1000
+/* Default connection ping in ms over TCP, see DEFAULT_PING_CONNECTION. */
 #define DEFAULT_TCP_PING_CONNECTION 500
 
 typedef struct {
     uint64_t sent_time;
     uint16_t length;
-    uint8_t data[MAX_CRYPTO_DATA_SIZE];
+    bool resent; /* Whether the packet was sent again after the peer requested it. */
+    bool bundled; /* Whether the packet was last sent in a PACKET_ID_BUNDLE packet. */
+    uint8_t data[MAX_CRYPTO_STREAM_DATA_SIZE];
 } Packet_Data;
 
+/* Packets_Array slots are allocated in chunks of this many packets, and only
+ * for the parts of the window that currently hold packets. */
+#define CRYPTO_PACKET_CHUNK_SIZE 256 /* Must be a power of 2, at least 64 */
+#define CRYPTO_PACKET_NUM_CHUNKS (CRYPTO_PACKET_BUFFER_SIZE / CRYPTO_PACKET_CHUNK_SIZE)
+
+typedef struct {
+    Packet_Data *buffer[CRYPTO_PACKET_CHUNK_SIZE];
+    uint64_t present[CRYPTO_PACKET_CHUNK_SIZE / 64]; /* Bit set for each non-NULL entry in buffer. */
+    uint16_t num_packets; /* Number of non-NULL entries in buffer. */
+} Packets_Chunk;
+
 typedef struct {
-    Packet_Data *buffer[CRYPTO_PACKET_BUFFER_SIZE];
+    Packets_Chunk *chunks[CRYPTO_PACKET_NUM_CHUNKS];
     uint32_t  buffer_start;
     uint32_t  buffer_end; /* packet numbers in array: {buffer_start, buffer_end) */
 } Packets_Array;
 
+/* Maximum number of freed packets and chunks kept around for reuse. */
+#define CRYPTO_POOL_MAX_FREE_PACKETS 1024
+#define CRYPTO_POOL_MAX_FREE_CHUNKS 64
+
+/* Free lists of Packet_Data and Packets_Chunk shared by all connections. */
+typedef struct {
+    pthread_mutex_t mutex;
+
+    void *free_packets;
+    uint32_t num_free_packets;
+
+    void *free_chunks;
+    uint32_t num_free_chunks;
+} Packet_Pool;
+
+typedef struct {
+    uint16_t send_number; /* Stream packet number of the next packet sent on the stream. */
+    uint32_t waiting; /* Packets of the stream waiting for the pacer. */
+    double deficit; /* Packets of the stream the pacer may send before the other streams. */
+
+    bool recv_started; /* Whether a packet of the stream was delivered. */
+    uint16_t recv_number; /* Stream packet number of the next packet to deliver. */
+
+    /* Packet numbers of received packets ahead of recv_number, at their
+       stream packet number modulo reorder_size. */
+    uint32_t *reorder;
+    uint32_t reorder_size;
+} Crypto_Stream;
+
 typedef struct {
     uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE]; /* The real public key of the peer. */
     uint8_t recv_nonce[CRYPTO_NONCE_SIZE]; /* Nonce of received packets. */
@@ -145,28 +225,40 @@ typedef struct {
     int connection_lossy_data_callback_id;
 
     uint64_t last_request_packet_sent;
+    bool request_ranges; /* The peer sent a PACKET_ID_REQUEST_RANGES packet. */
+    uint8_t request_ranges_probes;
+    bool streams; /* The peer sent a PACKET_ID_STREAMS or PACKET_ID_STREAM packet. */
+    uint8_t streams_probes;
+    Crypto_Stream stream[CRYPTO_MAX_STREAMS];
+    uint16_t mtu; /* Largest packet to send to the peer over UDP. */
+    uint8_t mtu_probe; /* Index of the packet size being probed. */
+    uint8_t mtu_probes; /* PACKET_ID_MTU_PROBE packets sent of that size. */
+    uint32_t bundled_lost; /* Bundled packets requested again since one got through. */
     uint64_t direct_send_attempt_time;
 
     uint32_t packet_counter;
     double packet_recv_rate;
     uint64_t packet_counter_set;
 
-    double packet_send_rate;
+    Congestion_Control congestion;
+
     uint32_t packets_left;
     uint64_t last_packets_left_set;
     double last_packets_left_rem;
 
-    double packet_send_rate_requested;
     uint32_t packets_left_requested;
     uint64_t last_packets_left_requested_set;
     double last_packets_left_requested_rem;
 
-    uint32_t last_sendqueue_size[CONGESTION_QUEUE_ARRAY_SIZE], last_sendqueue_counter;
-    long signed int last_num_packets_sent[CONGESTION_LAST_SENT_ARRAY_SIZE],
-         last_num_packets_resent[CONGESTION_LAST_SENT_ARRAY_SIZE];
     uint32_t packets_sent, packets_resent;
     uint64_t last_congestion_event;
-    uint64_t rtt_time;
+
+    /* Packets the pacer allows to be sent now, at pacing_rate per second.
+       pacing_waiting packets in send_array wait for it. */
+    double pacing_budget;
+    double pacing_rate;
+    uint64_t pacing_time;
+    uint32_t pacing_waiting;
 
     /* TCP_connection connection_number */
     unsigned int connection_number_tcp;
@@ -218,6 +310,12 @@ typedef struct {
     uint32_t current_sleep_time;
 
     BS_LIST ip_port_list;
+    PK_Index connection_index; /* Crypto connection ids by the real public key of the peer. */
+
+    Congestion_Algorithm congestion_algorithm; /* Used by the connections set up from now on. */
+    uint8_t stream_weights[CRYPTO_MAX_STREAMS]; /* Share of the pacer each stream gets. */
+
+    Packet_Pool packet_pool;
 } Net_Crypto;
 
 
@@ -327,6 +425,18 @@ bool max_speed_reached(Net_Crypto *c, int crypt_connection_id);
 int64_t write_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length,
                           uint8_t congestion_control);
 
+/* Sends a lossless cryptopacket on stream, the same as write_cryptpacket.
+ *
+ * If the peer supports streams, the packet is delivered once the packets
+ * sent on the same stream before it were, without waiting for the packets
+ * of the other streams. Otherwise all of them are delivered in order.
+ *
+ * return -1 if data could not be put in packet queue.
+ * return positive packet number if data was put into the queue.
+ */
+int64_t write_cryptpacket_stream(Net_Crypto *c, int crypt_connection_id, uint8_t stream, const uint8_t *data,
+                                 uint16_t length, uint8_t congestion_control);
+
 /* Check if packet_number was received by the other side.
  *
  * packet_number must be a valid packet number of a packet sent on this connection.
@@ -414,6 +524,22 @@ void load_secret_key(Net_Crypto *c, const uint8_t *sk);
  */
 Net_Crypto *new_net_crypto(Logger *log, DHT *dht, TCP_Proxy_Info *proxy_info);
 
+/* Set the congestion control algorithm of the connections set up from now on.
+ * Connections that already exist keep theirs.
+ *
+ * return -1 if algorithm is not a valid algorithm.
+ * return 0 on success.
+ */
+int net_crypto_set_congestion_algorithm(Net_Crypto *c, Congestion_Algorithm algorithm);
+
+/* Set the share of the packets waiting for the pacer that stream gets when
+ * other streams have packets waiting too, on all connections.
+ *
+ * return -1 if stream or weight is not valid.
+ * return 0 on success.
+ */
+int net_crypto_set_stream_weight(Net_Crypto *c, uint8_t stream, uint8_t weight);
+
 /* return the optimal interval in ms for running do_net_crypto.
  */
 uint32_t crypto_run_interval(const Net_Crypto *c);
@@ -28,16 +28,23 @@
 #define _DARWIN_C_SOURCE
 #define _XOPEN_SOURCE 600
 
+#if defined(__linux__)
+/* Needed for recvmmsg and sendmmsg. */
+#define _GNU_SOURCE
+#endif
+
 #if defined(_WIN32) && _WIN32_WINNT >= _WIN32_WINNT_WINXP
 #define _WIN32_WINNT  0x501
 #endif
 
 #include "network.h"
 
+#include "crypto_workers.h"
 #include "logger.h"
 #include "util.h"
 
 #include <assert.h>
+#include <stdbool.h>
 #ifdef __APPLE__
 #include <mach/clock.h>
 #include <mach/mach.h>
@@ -58,6 +65,22 @@
 #include <sys/time.h>
 #include <sys/types.h>
 
+/* _GNU_SOURCE above has no effect if the system headers were included before
+ * this file, e.g. in the monolith build. glibc then doesn't declare struct
+ * mmsghdr, and packets are sent and received one at a time. */
+#if defined(__linux__) && defined(MSG_WAITFORONE) && (defined(__USE_GNU) || !defined(__GLIBC__))
+#define USE_RECVMMSG
+#endif
+
+#if defined(__linux__)
+#define USE_EPOLL
+#include <sys/epoll.h>
+
+#ifndef EPOLLRDHUP
+#define EPOLLRDHUP 0x2000
+#endif
+#endif
+
 #else
 
 #ifndef IPV6_V6ONLY
@@ -357,30 +380,23 @@ void fill_addr6(IP6 ip, struct in6_addr *addr)
     memcpy(addr->s6_addr, ip.uint8, sizeof(ip.uint8));
 }
 
-/* Basic network functions:
- * Function to send packet(data) of length length to ip_port.
+/* Fill addr with the socket address to use when sending to ip_port from net's socket.
+ *
+ * return the size of the address on success.
+ * return 0 if ip_port can't be reached from this socket.
  */
-int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length)
+static size_t ipport_to_sockaddr(const Networking_Core *net, IP_Port ip_port, struct sockaddr_storage *addr)
 {
-    if (net->family == 0) { /* Socket not initialized */
-        return -1;
-    }
-
     /* socket AF_INET, but target IP NOT: can't send */
     if ((net->family == AF_INET) && (ip_port.ip.family != AF_INET)) {
-        return -1;
+        return 0;
     }
 
-    struct sockaddr_storage addr;
-
-    size_t addrsize = 0;
-
     if (ip_port.ip.family == AF_INET) {
         if (net->family == AF_INET6) {
             /* must convert to IPV4-in-IPV6 address */
-            struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)&addr;
+            struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)addr;
 
-            addrsize = sizeof(struct sockaddr_in6);
             addr6->sin6_family = AF_INET6;
             addr6->sin6_port = ip_port.port;
 
@@ -396,36 +412,370 @@ int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint1
 
             addr6->sin6_flowinfo = 0;
             addr6->sin6_scope_id = 0;
-        } else {
-            struct sockaddr_in *addr4 = (struct sockaddr_in *)&addr;
-
-            addrsize = sizeof(struct sockaddr_in);
-            addr4->sin_family = AF_INET;
-            fill_addr4(ip_port.ip.ip4, &addr4->sin_addr);
-            addr4->sin_port = ip_port.port;
+            return sizeof(struct sockaddr_in6);
         }
-    } else if (ip_port.ip.family == AF_INET6) {
-        struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)&addr;
 
-        addrsize = sizeof(struct sockaddr_in6);
+        struct sockaddr_in *addr4 = (struct sockaddr_in *)addr;
+
+        addr4->sin_family = AF_INET;
+        fill_addr4(ip_port.ip.ip4, &addr4->sin_addr);
+        addr4->sin_port = ip_port.port;
+        return sizeof(struct sockaddr_in);
+    }
+
+    if (ip_port.ip.family == AF_INET6) {
+        struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)addr;
+
         addr6->sin6_family = AF_INET6;
         addr6->sin6_port = ip_port.port;
         fill_addr6(ip_port.ip.ip6, &addr6->sin6_addr);
 
         addr6->sin6_flowinfo = 0;
         addr6->sin6_scope_id = 0;
-    } else {
-        /* unknown address type*/
+        return sizeof(struct sockaddr_in6);
+    }
+
+    /* unknown address type*/
+    return 0;
+}
+
+#ifdef USE_RECVMMSG
+/* Maximum number of datagrams held by the send queue. */
+#define NET_SEND_QUEUE_SIZE 256
+/* Maximum number of payload bytes held by the send queue. */
+#define NET_SEND_QUEUE_BYTES (128 * 1024)
+
+/* Only used with net->send_mutex held. */
+struct Net_Send_Queue {
+    /* Set between networking_send_queue_begin and networking_send_queue_flush. */
+    bool active;
+
+    uint32_t count;
+    uint32_t used_bytes;
+
+    IP_Port ip_ports[NET_SEND_QUEUE_SIZE];
+    struct mmsghdr msgs[NET_SEND_QUEUE_SIZE];
+    struct iovec iovecs[NET_SEND_QUEUE_SIZE];
+    struct sockaddr_storage addrs[NET_SEND_QUEUE_SIZE];
+    uint8_t data[NET_SEND_QUEUE_BYTES];
+};
+
+/* Send every queued datagram, leaving the queue empty but still active if it
+ * was. net->send_mutex must be held.
+ *
+ * return the number of datagrams that could not be sent.
+ */
+static uint32_t send_queue_send(Networking_Core *net, Net_Send_Queue *queue)
+{
+    uint32_t sent = 0, failed = 0;
+
+    while (sent < queue->count) {
+        int res = sendmmsg(net->sock, queue->msgs + sent, queue->count - sent, 0);
+
+        if (res <= 0) {
+            /* The datagram at the head of the queue failed, report and skip it. */
+            loglogdata(net->log, "O=>", (const uint8_t *)queue->iovecs[sent].iov_base, queue->iovecs[sent].iov_len,
+                       queue->ip_ports[sent], -1);
+            ++sent;
+            ++failed;
+            continue;
+        }
+
+        for (int i = 0; i < res; ++i) {
+            const uint32_t j = sent + i;
+            loglogdata(net->log, "O=>", (const uint8_t *)queue->iovecs[j].iov_base, queue->iovecs[j].iov_len,
+                       queue->ip_ports[j], queue->msgs[j].msg_len);
+        }
+
+        sent += res;
+    }
+
+    queue->count = 0;
+    queue->used_bytes = 0;
+    return failed;
+}
+
+/* Append a datagram to the queue, sending what it holds first if it is full.
+ * net->send_mutex must be held.
+ *
+ * return -1 if the queue was full and the socket didn't take all of it, e.g.
+ *   because its buffer is full. The datagram is not queued then.
+ * return 0 on success.
+ */
+static int send_queue_add(Networking_Core *net, Net_Send_Queue *queue, IP_Port ip_port, const uint8_t *data,
+                          uint16_t length, const struct sockaddr_storage *addr, size_t addrsize)
+{
+    if (queue->count == NET_SEND_QUEUE_SIZE || queue->used_bytes + length > NET_SEND_QUEUE_BYTES) {
+        if (send_queue_send(net, queue) != 0) {
+            return -1;
+        }
+    }
+
+    uint32_t i = queue->count;
+    uint8_t *buf = queue->data + queue->used_bytes;
+    memcpy(buf, data, length);
+    memcpy(&queue->addrs[i], addr, addrsize);
+    queue->ip_ports[i] = ip_port;
+    queue->iovecs[i].iov_base = buf;
+    queue->iovecs[i].iov_len = length;
+    queue->msgs[i].msg_hdr.msg_namelen = addrsize;
+    ++queue->count;
+    queue->used_bytes += length;
+    return 0;
+}
+#endif
+
+/* Basic network functions:
+ * Function to send packet(data) of length length to ip_port.
+ */
+int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length)
+{
+    if (net->family == 0) { /* Socket not initialized */
         return -1;
     }
 
+    struct sockaddr_storage addr;
+
+    size_t addrsize = ipport_to_sockaddr(net, ip_port, &addr);
+
+    if (addrsize == 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&net->send_mutex);
+
+#ifdef USE_RECVMMSG
+    Net_Send_Queue *queue = net->send_queue;
+
+    if (queue != NULL && queue->active) {
+        if (send_queue_add(net, queue, ip_port, data, length, &addr, addrsize) == -1) {
+            loglogdata(net->log, "O=>", data, length, ip_port, -1);
+            pthread_mutex_unlock(&net->send_mutex);
+            return -1;
+        }
+
+        pthread_mutex_unlock(&net->send_mutex);
+
+        /* Errors of queued packets are only known once the queue is flushed. */
+        return length;
+    }
+
+#endif
+
     int res = sendto(net->sock, (const char *) data, length, 0, (struct sockaddr *)&addr, addrsize);
 
     loglogdata(net->log, "O=>", data, length, ip_port, res);
 
+    pthread_mutex_unlock(&net->send_mutex);
+
     return res;
 }
 
+#if defined(IP_MTU_DISCOVER) && defined(IP_PMTUDISC_PROBE) && defined(IPV6_MTU_DISCOVER) && defined(IPV6_PMTUDISC_PROBE)
+#define USE_PMTUDISC_PROBE
+#endif
+
+/* Function to send packet(data) of length length to ip_port without letting
+ * it be fragmented, right away.
+ */
+int sendpacket_nofrag(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length)
+{
+#ifdef USE_PMTUDISC_PROBE
+
+    if (net->family == 0) { /* Socket not initialized */
+        return -1;
+    }
+
+    struct sockaddr_storage addr;
+
+    size_t addrsize = ipport_to_sockaddr(net, ip_port, &addr);
+
+    if (addrsize == 0) {
+        return -1;
+    }
+
+    /* The socket options below apply to every packet sent while they are set,
+     * so nothing else may be sent until they are restored. */
+    pthread_mutex_lock(&net->send_mutex);
+
+#ifdef USE_RECVMMSG
+
+    /* Peers drop data packets that arrive after ones that were created after
+     * them, so don't overtake the packets that are waiting to be sent. */
+    if (net->send_queue != NULL) {
+        send_queue_send(net, net->send_queue);
+    }
+
+#endif
+
+    /* Sent with the don't fragment bit, and without the kernel limiting it
+     * to the path MTU it has seen so far. IPv4 packets on an IPv6 socket use
+     * the IPv4 setting. */
+    int old_v4 = 0, old_v6 = 0;
+    socklen_t optlen = sizeof(int);
+    const int probe_v4 = IP_PMTUDISC_PROBE, probe_v6 = IPV6_PMTUDISC_PROBE;
+    const bool v4 = getsockopt(net->sock, IPPROTO_IP, IP_MTU_DISCOVER, (char *)&old_v4, &optlen) == 0
+                    && setsockopt(net->sock, IPPROTO_IP, IP_MTU_DISCOVER, (const char *)&probe_v4, sizeof(int)) == 0;
+    optlen = sizeof(int);
+    const bool v6 = net->family == AF_INET6
+                    && getsockopt(net->sock, IPPROTO_IPV6, IPV6_MTU_DISCOVER, (char *)&old_v6, &optlen) == 0
+                    && setsockopt(net->sock, IPPROTO_IPV6, IPV6_MTU_DISCOVER, (const char *)&probe_v6,
+                                  sizeof(int)) == 0;
+
+    int res = -1;
+
+    if (v4 || v6) {
+        res = sendto(net->sock, (const char *) data, length, 0, (struct sockaddr *)&addr, addrsize);
+        loglogdata(net->log, "O=>", data, length, ip_port, res);
+    }
+
+    if (v4) {
+        setsockopt(net->sock, IPPROTO_IP, IP_MTU_DISCOVER, (const char *)&old_v4, sizeof(int));
+    }
+
+    if (v6) {
+        setsockopt(net->sock, IPPROTO_IPV6, IPV6_MTU_DISCOVER, (const char *)&old_v6, sizeof(int));
+    }
+
+    pthread_mutex_unlock(&net->send_mutex);
+    return res;
+#else
+    return -1;
+#endif
+}
+
+/* Set whether sendpacket may queue datagrams between networking_send_queue_begin
+ * and networking_send_queue_flush (sendmmsg on Linux).
+ *
+ * return 1 if the send queue is enabled after the call.
+ * return 0 if it is disabled or not supported on this platform.
+ */
+int networking_set_send_queue(Networking_Core *net, bool enable)
+{
+#ifdef USE_RECVMMSG
+    int ret = 1;
+
+    pthread_mutex_lock(&net->send_mutex);
+
+    if (!enable) {
+        if (net->send_queue != NULL) {
+            send_queue_send(net, net->send_queue);
+            free(net->send_queue);
+            net->send_queue = NULL;
+        }
+
+        ret = 0;
+    } else if (net->send_queue == NULL) {
+        Net_Send_Queue *queue = (Net_Send_Queue *)calloc(1, sizeof(Net_Send_Queue));
+
+        if (queue == NULL) {
+            ret = 0;
+        } else {
+            for (size_t i = 0; i < NET_SEND_QUEUE_SIZE; ++i) {
+                queue->msgs[i].msg_hdr.msg_iov = &queue->iovecs[i];
+                queue->msgs[i].msg_hdr.msg_iovlen = 1;
+                queue->msgs[i].msg_hdr.msg_name = &queue->addrs[i];
+            }
+
+            net->send_queue = queue;
+        }
+    }
+
+    pthread_mutex_unlock(&net->send_mutex);
+
+    return ret;
+#else
+    return 0;
+#endif
+}
+
+/* Start collecting packets passed to sendpacket instead of sending them
+ * right away. Does nothing if the send queue is disabled.
+ */
+void networking_send_queue_begin(Networking_Core *net)
+{
+#ifdef USE_RECVMMSG
+    pthread_mutex_lock(&net->send_mutex);
+
+    if (net->send_queue != NULL) {
+        net->send_queue->active = true;
+    }
+
+    pthread_mutex_unlock(&net->send_mutex);
+#endif
+}
+
+/* Send all packets collected since networking_send_queue_begin and stop
+ * collecting. Packets that fail to send are logged individually.
+ */
+void networking_send_queue_flush(Networking_Core *net)
+{
+#ifdef USE_RECVMMSG
+    pthread_mutex_lock(&net->send_mutex);
+
+    if (net->send_queue != NULL) {
+        send_queue_send(net, net->send_queue);
+        net->send_queue->active = false;
+    }
+
+    pthread_mutex_unlock(&net->send_mutex);
+#endif
+}
+
+/* Decrypt received packets on num_threads worker threads, or on the thread
+ * calling networking_poll if num_threads is 0.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+int networking_set_crypto_workers(Networking_Core *net, uint32_t num_threads)
+{
+    Crypto_Workers *workers = NULL;
+
+    if (num_threads != 0) {
+        workers = new_crypto_workers(num_threads);
+
+        if (workers == NULL) {
+            return -1;
+        }
+    }
+
+    /* networking_poll always drains the pool, so nothing is pending here. */
+    kill_crypto_workers(net->crypto_workers);
+    net->crypto_workers = workers;
+    return 0;
+}
+
+/* Convert a socket address filled in by recvfrom/recvmmsg into an IP_Port.
+ *
+ * return 0 on success.
+ * return -1 if the address family is unknown.
+ */
+static int sockaddr_to_ipport(const struct sockaddr_storage *addr, IP_Port *ip_port)
+{
+    if (addr->ss_family == AF_INET) {
+        const struct sockaddr_in *addr_in = (const struct sockaddr_in *)addr;
+
+        ip_port->ip.family = addr_in->sin_family;
+        get_ip4(&ip_port->ip.ip4, &addr_in->sin_addr);
+        ip_port->port = addr_in->sin_port;
+    } else if (addr->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *addr_in6 = (const struct sockaddr_in6 *)addr;
+        ip_port->ip.family = addr_in6->sin6_family;
+        get_ip6(&ip_port->ip.ip6, &addr_in6->sin6_addr);
+        ip_port->port = addr_in6->sin6_port;
+
+        if (IPV6_IPV4_IN_V6(ip_port->ip.ip6)) {
+            ip_port->ip.family = AF_INET;
+            ip_port->ip.ip4.uint32 = ip_port->ip.ip6.uint32[3];
+        }
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
 /* Function to receive data
  *  ip and port of sender is put into ip_port.
  *  Packet data is put into data.
@@ -454,37 +804,263 @@ static int receivepacket(Logger *log, Socket sock, IP_Port *ip_port, uint8_t *da
 
     *length = (uint32_t)fail_or_len;
 
-    if (addr.ss_family == AF_INET) {
-        struct sockaddr_in *addr_in = (struct sockaddr_in *)&addr;
+    if (sockaddr_to_ipport(&addr, ip_port) == -1) {
+        return -1;
+    }
 
-        ip_port->ip.family = addr_in->sin_family;
-        get_ip4(&ip_port->ip.ip4, &addr_in->sin_addr);
-        ip_port->port = addr_in->sin_port;
-    } else if (addr.ss_family == AF_INET6) {
-        struct sockaddr_in6 *addr_in6 = (struct sockaddr_in6 *)&addr;
-        ip_port->ip.family = addr_in6->sin6_family;
-        get_ip6(&ip_port->ip.ip6, &addr_in6->sin6_addr);
-        ip_port->port = addr_in6->sin6_port;
+    loglogdata(log, "=>O", data, MAX_UDP_PACKET_SIZE, *ip_port, *length);
 
-        if (IPV6_IPV4_IN_V6(ip_port->ip.ip6)) {
-            ip_port->ip.family = AF_INET;
-            ip_port->ip.ip4.uint32 = ip_port->ip.ip6.uint32[3];
-        }
-    } else {
+    return 0;
+}
+
+#ifdef USE_RECVMMSG
+/* Number of datagrams read with a single recvmmsg call. */
+#define NET_RECV_BATCH_SIZE 64
+
+/* Size of the buffers of a batch until a larger datagram was received. Only
+ * peers that probe jumbo frame paths send more.
+ */
+#define NET_RECV_BATCH_BUFFER_SIZE 2048
+
+struct Net_Recv_Batch {
+    struct mmsghdr msgs[NET_RECV_BATCH_SIZE];
+    struct iovec iovecs[NET_RECV_BATCH_SIZE];
+    struct sockaddr_storage addrs[NET_RECV_BATCH_SIZE];
+    uint8_t *buffers; /* NET_RECV_BATCH_SIZE buffers of buffer_size bytes. */
+    uint16_t buffer_size;
+};
+
+/* Give every datagram of batch a buffer of size bytes.
+ *
+ * return -1 on failure, batch is left as it was.
+ * return 0 on success.
+ */
+static int recv_batch_set_buffer_size(Net_Recv_Batch *batch, uint16_t size)
+{
+    uint8_t *buffers = (uint8_t *)malloc((size_t)NET_RECV_BATCH_SIZE * size);
+
+    if (buffers == NULL) {
         return -1;
     }
 
-    loglogdata(log, "=>O", data, MAX_UDP_PACKET_SIZE, *ip_port, *length);
+    free(batch->buffers);
+    batch->buffers = buffers;
+    batch->buffer_size = size;
+
+    for (size_t i = 0; i < NET_RECV_BATCH_SIZE; ++i) {
+        batch->iovecs[i].iov_base = batch->buffers + i * size;
+        batch->iovecs[i].iov_len = size;
+    }
 
     return 0;
 }
 
+static Net_Recv_Batch *new_recv_batch(void)
+{
+    Net_Recv_Batch *batch = (Net_Recv_Batch *)calloc(1, sizeof(Net_Recv_Batch));
+
+    if (batch == NULL) {
+        return NULL;
+    }
+
+    if (recv_batch_set_buffer_size(batch, NET_RECV_BATCH_BUFFER_SIZE) == -1) {
+        free(batch);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < NET_RECV_BATCH_SIZE; ++i) {
+        batch->msgs[i].msg_hdr.msg_iov = &batch->iovecs[i];
+        batch->msgs[i].msg_hdr.msg_iovlen = 1;
+        batch->msgs[i].msg_hdr.msg_name = &batch->addrs[i];
+    }
+
+    return batch;
+}
+
+static void kill_recv_batch(Net_Recv_Batch *batch)
+{
+    if (batch == NULL) {
+        return;
+    }
+
+    free(batch->buffers);
+    free(batch);
+}
+#endif
+
 void networking_registerhandler(Networking_Core *net, uint8_t byte, packet_handler_callback cb, void *object)
 {
     net->packethandlers[byte].function = cb;
     net->packethandlers[byte].object = object;
 }
 
+#define NET_POLL_DRAIN_EVENTS 64
+
+int net_poll_fd_add(int poll_fd, int fd, bool edge_triggered)
+{
+#ifdef USE_EPOLL
+    struct epoll_event ev;
+    ev.events = edge_triggered ? EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP : EPOLLIN;
+    ev.data.fd = fd;
+
+    if (epoll_ctl(poll_fd, EPOLL_CTL_ADD, fd, &ev) == -1 && errno != EEXIST) {
+        return -1;
+    }
+
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+int networking_poll_fd(Networking_Core *net)
+{
+#ifdef USE_EPOLL
+
+    if (net->has_poll_fd) {
+        return net->poll_fd;
+    }
+
+    int poll_fd = epoll_create(8);
+
+    if (poll_fd == -1) {
+        return -1;
+    }
+
+    if (net->family != 0 && net_poll_fd_add(poll_fd, net->sock, false) == -1) {
+        close(poll_fd);
+        return -1;
+    }
+
+    net->poll_fd = poll_fd;
+    net->has_poll_fd = 1;
+    return poll_fd;
+#else
+    return -1;
+#endif
+}
+
+void networking_poll_fd_clear(Networking_Core *net)
+{
+#ifdef USE_EPOLL
+
+    if (!net->has_poll_fd) {
+        return;
+    }
+
+    struct epoll_event events[NET_POLL_DRAIN_EVENTS];
+
+    while (epoll_wait(net->poll_fd, events, NET_POLL_DRAIN_EVENTS, 0) == NET_POLL_DRAIN_EVENTS) {
+        continue;
+    }
+
+#endif
+}
+
+/* Set whether networking_poll reads datagrams in batches (recvmmsg).
+ *
+ * return 1 if batched receiving is enabled after the call.
+ * return 0 if it is disabled or not supported on this platform.
+ */
+int networking_set_batch_receive(Networking_Core *net, bool enable)
+{
+#ifdef USE_RECVMMSG
+
+    if (!enable) {
+        kill_recv_batch(net->recv_batch);
+        net->recv_batch = NULL;
+        return 0;
+    }
+
+    if (net->recv_batch == NULL) {
+        net->recv_batch = new_recv_batch();
+    }
+
+    return net->recv_batch != NULL;
+#else
+    return 0;
+#endif
+}
+
+static void networking_dispatch(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint32_t length,
+                                void *userdata)
+{
+    if (length < 1) {
+        return;
+    }
+
+    if (!(net->packethandlers[data[0]].function)) {
+        LOGGER_WARNING(net->log, "[%02u] -- Packet has no handler", data[0]);
+        return;
+    }
+
+    net->packethandlers[data[0]].function(net->packethandlers[data[0]].object, ip_port, data, length, userdata);
+}
+
+#ifdef USE_RECVMMSG
+/* Drain the socket with recvmmsg, dispatching each batch before reading the next.
+ *
+ * return 0 once the socket has no more pending datagrams.
+ * return -1 if recvmmsg is unusable and the caller should fall back to recvfrom.
+ */
+static int networking_poll_batch(Networking_Core *net, void *userdata)
+{
+    Net_Recv_Batch *batch = net->recv_batch;
+
+    while (1) {
+        for (size_t i = 0; i < NET_RECV_BATCH_SIZE; ++i) {
+            batch->msgs[i].msg_hdr.msg_namelen = sizeof(batch->addrs[i]);
+        }
+
+        int count = recvmmsg(net->sock, batch->msgs, NET_RECV_BATCH_SIZE, MSG_DONTWAIT, NULL);
+
+        if (count < 0) {
+            if (errno == ENOSYS) {
+                return -1;
+            }
+
+            if (errno != EWOULDBLOCK && errno != EAGAIN) {
+                LOGGER_ERROR(net->log, "Unexpected error reading from socket: %u, %s\n", errno, strerror(errno));
+            }
+
+            return 0;
+        }
+
+        bool truncated = false;
+
+        for (int i = 0; i < count; ++i) {
+            IP_Port ip_port;
+            memset(&ip_port, 0, sizeof(ip_port));
+
+            if (sockaddr_to_ipport(&batch->addrs[i], &ip_port) == -1) {
+                continue;
+            }
+
+            if (batch->msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+                truncated = true;
+                continue;
+            }
+
+            uint8_t *data = (uint8_t *)batch->iovecs[i].iov_base;
+            const uint32_t length = batch->msgs[i].msg_len;
+            loglogdata(net->log, "=>O", data, batch->buffer_size, ip_port, length);
+            networking_dispatch(net, ip_port, data, length, userdata);
+        }
+
+        /* The datagrams that didn't fit are lost, but MTU probes are sent
+         * several times, so the next ones get through. */
+        if (truncated && batch->buffer_size < MAX_UDP_PACKET_SIZE
+                && recv_batch_set_buffer_size(batch, MAX_UDP_PACKET_SIZE) == -1) {
+            LOGGER_WARNING(net->log, "could not grow the receive buffers for large datagrams");
+        }
+
+        if (count < NET_RECV_BATCH_SIZE) {
+            return 0;
+        }
+    }
+}
+#endif
+
 void networking_poll(Networking_Core *net, void *userdata)
 {
     if (net->family == 0) { /* Socket not initialized */
@@ -493,21 +1069,33 @@ void networking_poll(Networking_Core *net, void *userdata)
 
     unix_time_update();
 
-    IP_Port ip_port;
-    uint8_t data[MAX_UDP_PACKET_SIZE];
-    uint32_t length;
+    bool received = false;
 
-    while (receivepacket(net->log, net->sock, &ip_port, data, &length) != -1) {
-        if (length < 1) {
-            continue;
+#ifdef USE_RECVMMSG
+
+    if (net->recv_batch != NULL) {
+        if (networking_poll_batch(net, userdata) == 0) {
+            received = true;
+        } else {
+            LOGGER_WARNING(net->log, "recvmmsg not supported, falling back to recvfrom");
+            networking_set_batch_receive(net, false);
         }
+    }
 
-        if (!(net->packethandlers[data[0]].function)) {
-            LOGGER_WARNING(net->log, "[%02u] -- Packet has no handler", data[0]);
-            continue;
+#endif
+
+    if (!received) {
+        IP_Port ip_port;
+        uint8_t data[MAX_UDP_PACKET_SIZE];
+        uint32_t length;
+
+        while (receivepacket(net->log, net->sock, &ip_port, data, &length) != -1) {
+            networking_dispatch(net, ip_port, data, length, userdata);
         }
+    }
 
-        net->packethandlers[data[0]].function(net->packethandlers[data[0]].object, ip_port, data, length, userdata);
+    if (net->crypto_workers != NULL) {
+        crypto_workers_drain(net->crypto_workers, userdata);
     }
 }
 
@@ -568,6 +1156,28 @@ Networking_Core *new_networking(Logger *log, IP ip, uint16_t port)
     return new_networking_ex(log, ip, port, port + (TOX_PORTRANGE_TO - TOX_PORTRANGE_FROM), 0);
 }
 
+/* Initialize networking without a socket, for when UDP is disabled.
+ *
+ * return NULL on failure.
+ * return the Networking_Core on success.
+ */
+Networking_Core *new_networking_no_udp(Logger *log)
+{
+    Networking_Core *net = (Networking_Core *)calloc(1, sizeof(Networking_Core));
+
+    if (net == NULL) {
+        return NULL;
+    }
+
+    if (pthread_mutex_init(&net->send_mutex, NULL) != 0) {
+        free(net);
+        return NULL;
+    }
+
+    net->log = log;
+    return net;
+}
+
 /* Initialize networking.
  * Bind to ip and port.
  * ip must be in network order EX: 127.0.0.1 = (7F000001).
@@ -617,6 +1227,11 @@ Networking_Core *new_networking_ex(Logger *log, IP ip, uint16_t port_from, uint1
         return NULL;
     }
 
+    if (pthread_mutex_init(&temp->send_mutex, NULL) != 0) {
+        free(temp);
+        return NULL;
+    }
+
     temp->log = log;
     temp->family = ip.family;
     temp->port = 0;
@@ -628,6 +1243,7 @@ Networking_Core *new_networking_ex(Logger *log, IP ip, uint16_t port_from, uint1
     /* Check for socket error. */
     if (!sock_valid(temp->sock)) {
         LOGGER_ERROR(log, "Failed to get a socket?! %u, %s\n", errno, strerror(errno));
+        pthread_mutex_destroy(&temp->send_mutex);
         free(temp);
 
         if (error) {
@@ -696,6 +1312,7 @@ Networking_Core *new_networking_ex(Logger *log, IP ip, uint16_t port_from, uint1
 
         portptr = &addr6->sin6_port;
     } else {
+        pthread_mutex_destroy(&temp->send_mutex);
         free(temp);
         return NULL;
     }
@@ -758,6 +1375,9 @@ Networking_Core *new_networking_ex(Logger *log, IP ip, uint16_t port_from, uint1
                 *error = 0;
             }
 
+            networking_set_batch_receive(temp, true);
+            networking_set_send_queue(temp, true);
+
             return temp;
         }
 
@@ -790,10 +1410,24 @@ void kill_networking(Networking_Core *net)
         return;
     }
 
+    networking_set_send_queue(net, false);
+
     if (net->family != 0) { /* Socket not initialized */
         kill_sock(net->sock);
     }
 
+    networking_set_batch_receive(net, false);
+    kill_crypto_workers(net->crypto_workers);
+
+#ifdef USE_EPOLL
+
+    if (net->has_poll_fd) {
+        close(net->poll_fd);
+    }
+
+#endif
+
+    pthread_mutex_destroy(&net->send_mutex);
     free(net);
 }
 
@@ -33,6 +33,8 @@
 #include "ccompat.h"
 #include "logger.h"
 
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -72,7 +74,8 @@ typedef short Family;
 typedef int Socket;
 Socket net_socket(int domain, int type, int protocol);
 
-#define MAX_UDP_PACKET_SIZE 2048
+/* Large enough for the packets net_crypto sends on jumbo frame paths. */
+#define MAX_UDP_PACKET_SIZE 9000
 
 typedef enum NET_PACKET_TYPE {
     NET_PACKET_PING_REQUEST         = 0x00, /* Ping request packet ID. */
@@ -310,6 +313,10 @@ typedef struct {
     void *object;
 } Packet_Handles;
 
+typedef struct Net_Recv_Batch Net_Recv_Batch;
+typedef struct Net_Send_Queue Net_Send_Queue;
+typedef struct Crypto_Workers Crypto_Workers;
+
 typedef struct {
     Logger *log;
     Packet_Handles packethandlers[256];
@@ -318,6 +325,21 @@ typedef struct {
     uint16_t port;
     /* Our UDP socket. */
     Socket sock;
+
+    /* Preallocated receive buffers for recvmmsg, NULL when batching is off. */
+    Net_Recv_Batch *recv_batch;
+    /* Outgoing datagrams waiting for sendmmsg, NULL when queueing is off. */
+    Net_Send_Queue *send_queue;
+    /* Held by every send on sock and while send_queue is used, so packets
+     * sent from other threads neither race the queue nor overtake it. */
+    pthread_mutex_t send_mutex;
+    /* Threads that decrypt received packets, NULL when packets are decrypted
+     * by the thread calling networking_poll. */
+    Crypto_Workers *crypto_workers;
+
+    /* See networking_poll_fd. */
+    bool has_poll_fd;
+    int poll_fd;
 } Networking_Core;
 
 /* Run this before creating sockets.
@@ -371,15 +393,96 @@ uint64_t current_time_monotonic(void);
 
 /* Basic network functions: */
 
-/* Function to send packet(data) of length length to ip_port. */
+/* Function to send packet(data) of length length to ip_port.
+ *
+ * While the send queue is collecting (see networking_send_queue_begin), the
+ * packet is only copied into the queue and length is returned; send errors
+ * are then logged per packet by networking_send_queue_flush. If the queue is
+ * full and the socket doesn't take what it holds, the packet is dropped and
+ * -1 is returned. This holds for every thread, so packets always leave in the
+ * order they were passed here.
+ */
 int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length);
 
+/* Function to send packet(data) of length length to ip_port with the don't
+ * fragment bit set, so that it is dropped if it doesn't fit the path MTU.
+ * The packet is sent right away, after the ones the send queue collected so far.
+ *
+ * return -1 if it failed to send or the platform can't send unfragmented packets.
+ * return length if it was sent.
+ */
+int sendpacket_nofrag(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length);
+
+/* Set whether sendpacket may queue datagrams between networking_send_queue_begin
+ * and networking_send_queue_flush (sendmmsg on Linux). The queue is enabled by
+ * default where supported, but only collects packets once begun.
+ *
+ * return 1 if the send queue is enabled after the call.
+ * return 0 if it is disabled or not supported on this platform.
+ */
+int networking_set_send_queue(Networking_Core *net, bool enable);
+
+/* Start collecting packets passed to sendpacket instead of sending them
+ * right away. Does nothing if the send queue is disabled.
+ */
+void networking_send_queue_begin(Networking_Core *net);
+
+/* Send all packets collected since networking_send_queue_begin with as few
+ * syscalls as possible and stop collecting. The queue is also flushed
+ * automatically whenever it fills up.
+ */
+void networking_send_queue_flush(Networking_Core *net);
+
+/* Decrypt received packets on num_threads worker threads, or on the thread
+ * calling networking_poll if num_threads is 0. Packet handlers that support
+ * it queue their packets to net->crypto_workers, and networking_poll hands
+ * the results back to them in order before it returns.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+int networking_set_crypto_workers(Networking_Core *net, uint32_t num_threads);
+
 /* Function to call when packet beginning with byte is received. */
 void networking_registerhandler(Networking_Core *net, uint8_t byte, packet_handler_callback cb, void *object);
 
 /* Call this several times a second. */
 void networking_poll(Networking_Core *net, void *userdata);
 
+/* Set whether networking_poll reads datagrams in batches (recvmmsg on Linux).
+ * Batching is enabled by default where supported.
+ *
+ * return 1 if batched receiving is enabled after the call.
+ * return 0 if it is disabled or not supported on this platform.
+ */
+int networking_set_batch_receive(Networking_Core *net, bool enable);
+
+/* Get a file descriptor that becomes readable when our UDP socket or any
+ * descriptor added with net_poll_fd_add is readable (an epoll instance on
+ * Linux), so that a caller can sleep until there is something to do. It is
+ * created on first use and closed by kill_networking.
+ *
+ * return -1 on failure or if not supported on this platform.
+ * return the descriptor on success.
+ */
+int networking_poll_fd(Networking_Core *net);
+
+/* Add fd to a descriptor returned by networking_poll_fd. Level triggered
+ * descriptors make poll_fd readable for as long as they are readable. Edge
+ * triggered ones only when they become readable or writable, which is what
+ * TCP sockets that are only read once a whole packet arrived need.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+int net_poll_fd_add(int poll_fd, int fd, bool edge_triggered);
+
+/* Consume the readiness collected in the descriptor returned by
+ * networking_poll_fd. Call this before handling the traffic it announced so
+ * that it only becomes readable again for new traffic.
+ */
+void networking_poll_fd_clear(Networking_Core *net);
+
 /* Connect a socket to the address specified by the ip_port. */
 int net_connect(Socket sock, IP_Port ip_port);
 
@@ -420,6 +523,13 @@ size_t net_sendto_ip4(Socket sock, const char *buf, size_t n, IP_Port ip_port);
 Networking_Core *new_networking(Logger *log, IP ip, uint16_t port);
 Networking_Core *new_networking_ex(Logger *log, IP ip, uint16_t port_from, uint16_t port_to, unsigned int *error);
 
+/* Initialize networking without a socket, for when UDP is disabled.
+ *
+ * return NULL on failure.
+ * return the Networking_Core on success.
+ */
+Networking_Core *new_networking_no_udp(Logger *log);
+
 /* Function to cleanup networking stuff (doesn't do much right now). */
 void kill_networking(Networking_Core *net);
 
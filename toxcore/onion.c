@@ -27,6 +27,7 @@
 
 #include "onion.h"
 
+#include "crypto_workers.h"
 #include "util.h"
 
 #define RETURN_1 ONION_RETURN_1
@@ -117,13 +118,13 @@ static int ipport_unpack(IP_Port *target, const uint8_t *data, unsigned int data
  * return -1 on failure.
  * return 0 on success.
  */
-int create_onion_path(const DHT *dht, Onion_Path *new_path, const Node_format *nodes)
+int create_onion_path(DHT *dht, Onion_Path *new_path, const Node_format *nodes)
 {
     if (!new_path || !nodes) {
         return -1;
     }
 
-    encrypt_precompute(nodes[0].public_key, dht->self_secret_key, new_path->shared_key1);
+    DHT_get_shared_key_sent(dht, new_path->shared_key1, nodes[0].public_key);
     memcpy(new_path->public_key1, dht->self_public_key, CRYPTO_PUBLIC_KEY_SIZE);
 
     uint8_t random_public_key[CRYPTO_PUBLIC_KEY_SIZE];
@@ -325,6 +326,89 @@ int send_onion_response(Networking_Core *net, IP_Port dest, const uint8_t *data,
     return 0;
 }
 
+/* Hand the decryption of an onion send packet to the crypto workers. The
+ * shared key is computed by the worker if it isn't in shared_keys.
+ * return_length is the length of the return data at the end of packet.
+ *
+ * return -1 if it has to be decrypted on the calling thread.
+ * return 0 if it was queued.
+ */
+static int onion_queue_decrypt(Onion *onion, Shared_Keys *shared_keys, crypto_job_cb *function, IP_Port source,
+                               const uint8_t *packet, uint16_t length, uint16_t return_length, void *userdata)
+{
+    Crypto_Job *job = crypto_workers_job(onion->net->crypto_workers, length, userdata);
+
+    if (job == NULL) {
+        return -1;
+    }
+
+    const uint8_t *public_key = packet + 1 + CRYPTO_NONCE_SIZE;
+
+    if (shared_keys_lookup(shared_keys, job->shared_key, public_key) != 0) {
+        job->compute_shared_key = true;
+        memcpy(job->public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+        memcpy(job->secret_key, onion->dht->self_secret_key, CRYPTO_SECRET_KEY_SIZE);
+    }
+
+    job->function = function;
+    job->object = onion;
+    job->source = source;
+    memcpy(job->nonce, packet + 1, CRYPTO_NONCE_SIZE);
+    memcpy(job->packet, packet, length);
+    job->length = length;
+    job->encrypted_start = 1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE;
+    job->encrypted_length = length - (job->encrypted_start + return_length);
+    crypto_workers_submit(onion->net->crypto_workers);
+    return 0;
+}
+
+/* Decrypt an onion send packet on the calling thread.
+ *
+ * return -1 on failure.
+ * return length of plain on success.
+ */
+static int onion_decrypt(Onion *onion, Shared_Keys *shared_keys, const uint8_t *packet, uint16_t length,
+                         uint16_t return_length, uint8_t *plain)
+{
+    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
+    get_shared_key(shared_keys, shared_key, onion->dht->self_secret_key, packet + 1 + CRYPTO_NONCE_SIZE);
+    int len = decrypt_data_symmetric(shared_key, packet + 1, packet + 1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE,
+                                     length - (1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE + return_length), plain);
+
+    if (len != length - (1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE + return_length + CRYPTO_MAC_SIZE)) {
+        return -1;
+    }
+
+    return len;
+}
+
+/* Cache the shared key computed by the worker for job.
+ *
+ * return -1 if the packet failed to decrypt.
+ * return 0 on success.
+ */
+static int onion_job_done(Shared_Keys *shared_keys, const Crypto_Job *job)
+{
+    if (job->compute_shared_key) {
+        shared_keys_add(shared_keys, job->public_key, job->shared_key);
+    }
+
+    if (job->plain_length != job->encrypted_length - CRYPTO_MAC_SIZE) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static void handle_send_initial_decrypted(void *object, Crypto_Job *job, void *userdata)
+{
+    Onion *onion = (Onion *)object;
+
+    if (onion_job_done(&onion->shared_keys_1, job) == 0) {
+        onion_send_1(onion, job->plain, job->plain_length, job->source, job->packet + 1);
+    }
+}
+
 static int handle_send_initial(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
 {
     Onion *onion = (Onion *)object;
@@ -339,13 +423,16 @@ static int handle_send_initial(void *object, IP_Port source, const uint8_t *pack
 
     change_symmetric_key(onion);
 
+    if (onion->net->crypto_workers != NULL
+            && onion_queue_decrypt(onion, &onion->shared_keys_1, &handle_send_initial_decrypted, source, packet, length, 0,
+                                   userdata) == 0) {
+        return 0;
+    }
+
     uint8_t plain[ONION_MAX_PACKET_SIZE];
-    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
-    get_shared_key(&onion->shared_keys_1, shared_key, onion->dht->self_secret_key, packet + 1 + CRYPTO_NONCE_SIZE);
-    int len = decrypt_data_symmetric(shared_key, packet + 1, packet + 1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE,
-                                     length - (1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE), plain);
+    int len = onion_decrypt(onion, &onion->shared_keys_1, packet, length, 0, plain);
 
-    if (len != length - (1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_MAC_SIZE)) {
+    if (len == -1) {
         return 1;
     }
 
@@ -394,30 +481,12 @@ int onion_send_1(const Onion *onion, const uint8_t *plain, uint16_t len, IP_Port
     return 0;
 }
 
-static int handle_send_1(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
+/* Forward the decrypted layer plain of the onion send 1 packet to the next
+ * node, as an onion send 2 packet.
+ */
+static int onion_send_2(const Onion *onion, const uint8_t *plain, uint16_t len, IP_Port source, const uint8_t *packet,
+                        uint16_t length)
 {
-    Onion *onion = (Onion *)object;
-
-    if (length > ONION_MAX_PACKET_SIZE) {
-        return 1;
-    }
-
-    if (length <= 1 + SEND_2) {
-        return 1;
-    }
-
-    change_symmetric_key(onion);
-
-    uint8_t plain[ONION_MAX_PACKET_SIZE];
-    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
-    get_shared_key(&onion->shared_keys_2, shared_key, onion->dht->self_secret_key, packet + 1 + CRYPTO_NONCE_SIZE);
-    int len = decrypt_data_symmetric(shared_key, packet + 1, packet + 1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE,
-                                     length - (1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE + RETURN_1), plain);
-
-    if (len != length - (1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE + RETURN_1 + CRYPTO_MAC_SIZE)) {
-        return 1;
-    }
-
     IP_Port send_to;
 
     if (ipport_unpack(&send_to, plain, len, 0) == -1) {
@@ -450,7 +519,16 @@ static int handle_send_1(void *object, IP_Port source, const uint8_t *packet, ui
     return 0;
 }
 
-static int handle_send_2(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
+static void handle_send_1_decrypted(void *object, Crypto_Job *job, void *userdata)
+{
+    Onion *onion = (Onion *)object;
+
+    if (onion_job_done(&onion->shared_keys_2, job) == 0) {
+        onion_send_2(onion, job->plain, job->plain_length, job->source, job->packet, job->length);
+    }
+}
+
+static int handle_send_1(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
 {
     Onion *onion = (Onion *)object;
 
@@ -458,22 +536,34 @@ static int handle_send_2(void *object, IP_Port source, const uint8_t *packet, ui
         return 1;
     }
 
-    if (length <= 1 + SEND_3) {
+    if (length <= 1 + SEND_2) {
         return 1;
     }
 
     change_symmetric_key(onion);
 
+    if (onion->net->crypto_workers != NULL
+            && onion_queue_decrypt(onion, &onion->shared_keys_2, &handle_send_1_decrypted, source, packet, length, RETURN_1,
+                                   userdata) == 0) {
+        return 0;
+    }
+
     uint8_t plain[ONION_MAX_PACKET_SIZE];
-    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
-    get_shared_key(&onion->shared_keys_3, shared_key, onion->dht->self_secret_key, packet + 1 + CRYPTO_NONCE_SIZE);
-    int len = decrypt_data_symmetric(shared_key, packet + 1, packet + 1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE,
-                                     length - (1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE + RETURN_2), plain);
+    int len = onion_decrypt(onion, &onion->shared_keys_2, packet, length, RETURN_1, plain);
 
-    if (len != length - (1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE + RETURN_2 + CRYPTO_MAC_SIZE)) {
+    if (len == -1) {
         return 1;
     }
 
+    return onion_send_2(onion, plain, len, source, packet, length);
+}
+
+/* Forward the decrypted layer plain of the onion send 2 packet to its
+ * destination.
+ */
+static int onion_send_3(const Onion *onion, const uint8_t *plain, uint16_t len, IP_Port source, const uint8_t *packet,
+                        uint16_t length)
+{
     IP_Port send_to;
 
     if (ipport_unpack(&send_to, plain, len, 0) == -1) {
@@ -504,6 +594,44 @@ static int handle_send_2(void *object, IP_Port source, const uint8_t *packet, ui
     return 0;
 }
 
+static void handle_send_2_decrypted(void *object, Crypto_Job *job, void *userdata)
+{
+    Onion *onion = (Onion *)object;
+
+    if (onion_job_done(&onion->shared_keys_3, job) == 0) {
+        onion_send_3(onion, job->plain, job->plain_length, job->source, job->packet, job->length);
+    }
+}
+
+static int handle_send_2(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
+{
+    Onion *onion = (Onion *)object;
+
+    if (length > ONION_MAX_PACKET_SIZE) {
+        return 1;
+    }
+
+    if (length <= 1 + SEND_3) {
+        return 1;
+    }
+
+    change_symmetric_key(onion);
+
+    if (onion->net->crypto_workers != NULL
+            && onion_queue_decrypt(onion, &onion->shared_keys_3, &handle_send_2_decrypted, source, packet, length, RETURN_2,
+                                   userdata) == 0) {
+        return 0;
+    }
+
+    uint8_t plain[ONION_MAX_PACKET_SIZE];
+    int len = onion_decrypt(onion, &onion->shared_keys_3, packet, length, RETURN_2, plain);
+
+    if (len == -1) {
+        return 1;
+    }
+
+    return onion_send_3(onion, plain, len, source, packet, length);
+}
 
 static int handle_recv_3(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
 {
@@ -676,5 +804,8 @@ void kill_onion(Onion *onion)
     networking_registerhandler(onion->net, NET_PACKET_ONION_RECV_2, NULL, NULL);
     networking_registerhandler(onion->net, NET_PACKET_ONION_RECV_1, NULL, NULL);
 
+    shared_keys_free(&onion->shared_keys_1);
+    shared_keys_free(&onion->shared_keys_2);
+    shared_keys_free(&onion->shared_keys_3);
     free(onion);
 }
@@ -86,7 +86,7 @@ typedef struct {
  * return -1 on failure.
  * return 0 on success.
  */
-int create_onion_path(const DHT *dht, Onion_Path *new_path, const Node_format *nodes);
+int create_onion_path(DHT *dht, Onion_Path *new_path, const Node_format *nodes);
 
 /* Dump nodes in onion path to nodes of length num_nodes;
  *
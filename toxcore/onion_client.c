@@ -36,6 +36,9 @@
 #define ANNOUNCE_ARRAY_SIZE 256
 #define ANNOUNCE_TIMEOUT 10
 
+/* Friend number, node public key, node ip_port and path number of a sendback. */
+#define ANNOUNCE_SENDBACK_DATA_SIZE (sizeof(uint32_t) + CRYPTO_PUBLIC_KEY_SIZE + sizeof(IP_Port) + sizeof(uint32_t))
+
 /* Add a node to the path_nodes bootstrap array.
  *
  * return -1 on failure
@@ -378,7 +381,7 @@ static int send_onion_packet_tcp_udp(const Onion_Client *onion_c, const Onion_Pa
 static int new_sendback(Onion_Client *onion_c, uint32_t num, const uint8_t *public_key, IP_Port ip_port,
                         uint32_t path_num, uint64_t *sendback)
 {
-    uint8_t data[sizeof(uint32_t) + CRYPTO_PUBLIC_KEY_SIZE + sizeof(IP_Port) + sizeof(uint32_t)];
+    uint8_t data[ANNOUNCE_SENDBACK_DATA_SIZE];
     memcpy(data, &num, sizeof(uint32_t));
     memcpy(data + sizeof(uint32_t), public_key, CRYPTO_PUBLIC_KEY_SIZE);
     memcpy(data + sizeof(uint32_t) + CRYPTO_PUBLIC_KEY_SIZE, &ip_port, sizeof(IP_Port));
@@ -407,7 +410,7 @@ static uint32_t check_sendback(Onion_Client *onion_c, const uint8_t *sendback, u
 {
     uint64_t sback;
     memcpy(&sback, sendback, sizeof(uint64_t));
-    uint8_t data[sizeof(uint32_t) + CRYPTO_PUBLIC_KEY_SIZE + sizeof(IP_Port) + sizeof(uint32_t)];
+    uint8_t data[ANNOUNCE_SENDBACK_DATA_SIZE];
 
     if (ping_array_check(data, sizeof(data), &onion_c->announce_ping_array, sback) != sizeof(data)) {
         return ~0;
@@ -1091,19 +1094,7 @@ static int send_dhtpk_announce(Onion_Client *onion_c, uint16_t friend_num, uint8
  */
 int onion_friend_num(const Onion_Client *onion_c, const uint8_t *public_key)
 {
-    unsigned int i;
-
-    for (i = 0; i < onion_c->num_friends; ++i) {
-        if (onion_c->friends_list[i].status == 0) {
-            continue;
-        }
-
-        if (public_key_cmp(public_key, onion_c->friends_list[i].real_public_key) == 0) {
-            return i;
-        }
-    }
-
-    return -1;
+    return pk_index_get(&onion_c->friend_index, public_key);
 }
 
 /* Set the size of the friend list to num.
@@ -1144,10 +1135,13 @@ int onion_addfriend(Onion_Client *onion_c, const uint8_t *public_key)
 
     unsigned int i, index = ~0;
 
-    for (i = 0; i < onion_c->num_friends; ++i) {
-        if (onion_c->friends_list[i].status == 0) {
-            index = i;
-            break;
+    /* If every friend is in the index there are no free slots to reuse. */
+    if (onion_c->friend_index.size != onion_c->num_friends) {
+        for (i = 0; i < onion_c->num_friends; ++i) {
+            if (onion_c->friends_list[i].status == 0) {
+                index = i;
+                break;
+            }
         }
     }
 
@@ -1161,6 +1155,10 @@ int onion_addfriend(Onion_Client *onion_c, const uint8_t *public_key)
         ++onion_c->num_friends;
     }
 
+    if (pk_index_set(&onion_c->friend_index, public_key, index) == -1) {
+        return -1;
+    }
+
     onion_c->friends_list[index].status = 1;
     memcpy(onion_c->friends_list[index].real_public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
     crypto_new_keypair(onion_c->friends_list[index].temp_public_key, onion_c->friends_list[index].temp_secret_key);
@@ -1181,6 +1179,10 @@ int onion_delfriend(Onion_Client *onion_c, int friend_num)
     //if (onion_c->friends_list[friend_num].know_dht_public_key)
     //    DHT_delfriend(onion_c->dht, onion_c->friends_list[friend_num].dht_public_key, 0);
 
+    if (onion_c->friends_list[friend_num].status != 0) {
+        pk_index_remove(&onion_c->friend_index, onion_c->friends_list[friend_num].real_public_key);
+    }
+
     crypto_memzero(&(onion_c->friends_list[friend_num]), sizeof(Onion_Friend));
     unsigned int i;
 
@@ -1638,7 +1640,8 @@ Onion_Client *new_onion_client(Net_Crypto *c)
         return NULL;
     }
 
-    if (ping_array_init(&onion_c->announce_ping_array, ANNOUNCE_ARRAY_SIZE, ANNOUNCE_TIMEOUT) != 0) {
+    if (ping_array_init(&onion_c->announce_ping_array, ANNOUNCE_ARRAY_SIZE, ANNOUNCE_TIMEOUT,
+                        ANNOUNCE_SENDBACK_DATA_SIZE) != 0) {
         free(onion_c);
         return NULL;
     }
@@ -1665,6 +1668,7 @@ void kill_onion_client(Onion_Client *onion_c)
 
     ping_array_free_all(&onion_c->announce_ping_array);
     realloc_onion_friends(onion_c, 0);
+    pk_index_free(&onion_c->friend_index);
     networking_registerhandler(onion_c->net, NET_PACKET_ANNOUNCE_RESPONSE, NULL, NULL);
     networking_registerhandler(onion_c->net, NET_PACKET_ONION_DATA_RESPONSE, NULL, NULL);
     oniondata_registerhandler(onion_c, ONION_DATA_DHTPK, NULL, NULL);
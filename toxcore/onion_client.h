@@ -131,6 +131,7 @@ typedef struct {
     Networking_Core *net;
     Onion_Friend    *friends_list;
     uint16_t       num_friends;
+    PK_Index       friend_index; /* Friend numbers by real_public_key. */
 
     Onion_Node clients_announce_list[MAX_ONION_CLIENTS_ANNOUNCE];
 
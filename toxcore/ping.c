@@ -359,7 +359,7 @@ PING *new_ping(DHT *dht)
         return NULL;
     }
 
-    if (ping_array_init(&ping->ping_array, PING_NUM_MAX, PING_TIMEOUT) != 0) {
+    if (ping_array_init(&ping->ping_array, PING_NUM_MAX, PING_TIMEOUT, PING_DATA_SIZE) != 0) {
         free(ping);
         return NULL;
     }
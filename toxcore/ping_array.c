@@ -30,10 +30,13 @@
 #include "crypto_core.h"
 #include "util.h"
 
+static uint8_t *entry_data(const Ping_Array *array, uint32_t index)
+{
+    return array->data + (size_t)index * array->data_size;
+}
+
 static void clear_entry(Ping_Array *array, uint32_t index)
 {
-    free(array->entries[index].data);
-    array->entries[index].data = NULL;
     array->entries[index].length =
         array->entries[index].time =
             array->entries[index].ping_id = 0;
@@ -62,21 +65,19 @@ static void ping_array_clear_timedout(Ping_Array *array)
  */
 uint64_t ping_array_add(Ping_Array *array, const uint8_t *data, uint32_t length)
 {
+    if (length > array->data_size) {
+        return 0;
+    }
+
     ping_array_clear_timedout(array);
     uint32_t index = array->last_added % array->total_size;
 
-    if (array->entries[index].data != NULL) {
+    if (array->entries[index].ping_id != 0) {
         array->last_deleted = array->last_added - array->total_size;
         clear_entry(array, index);
     }
 
-    array->entries[index].data = malloc(length);
-
-    if (array->entries[index].data == NULL) {
-        return 0;
-    }
-
-    memcpy(array->entries[index].data, data, length);
+    memcpy(entry_data(array, index), data, length);
     array->entries[index].length = length;
     array->entries[index].time = unix_time();
     ++array->last_added;
@@ -121,11 +122,7 @@ int ping_array_check(uint8_t *data, uint32_t length, Ping_Array *array, uint64_t
         return -1;
     }
 
-    if (array->entries[index].data == NULL) {
-        return -1;
-    }
-
-    memcpy(data, array->entries[index].data, array->entries[index].length);
+    memcpy(data, entry_data(array, index), array->entries[index].length);
     uint32_t len = array->entries[index].length;
     clear_entry(array, index);
     return len;
@@ -134,11 +131,13 @@ int ping_array_check(uint8_t *data, uint32_t length, Ping_Array *array, uint64_t
 /* Initialize a Ping_Array.
  * size represents the total size of the array and should be a power of 2.
  * timeout represents the maximum timeout in seconds for the entry.
+ * data_size is the maximum length of the data of an entry, the memory for
+ * the data of all entries is allocated here.
  *
  * return 0 on success.
  * return -1 on failure.
  */
-int ping_array_init(Ping_Array *empty_array, uint32_t size, uint32_t timeout)
+int ping_array_init(Ping_Array *empty_array, uint32_t size, uint32_t timeout, uint32_t data_size)
 {
     if (size == 0 || timeout == 0 || empty_array == NULL) {
         return -1;
@@ -150,6 +149,15 @@ int ping_array_init(Ping_Array *empty_array, uint32_t size, uint32_t timeout)
         return -1;
     }
 
+    empty_array->data = (uint8_t *)malloc((size_t)size * data_size);
+
+    if (empty_array->data == NULL && data_size != 0) {
+        free(empty_array->entries);
+        empty_array->entries = NULL;
+        return -1;
+    }
+
+    empty_array->data_size = data_size;
     empty_array->last_deleted = empty_array->last_added = 0;
     empty_array->total_size = size;
     empty_array->timeout = timeout;
@@ -168,5 +176,7 @@ void ping_array_free_all(Ping_Array *array)
 
     free(array->entries);
     array->entries = NULL;
+    free(array->data);
+    array->data = NULL;
 }
 
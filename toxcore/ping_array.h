@@ -27,15 +27,16 @@
 #include "network.h"
 
 typedef struct {
-    void *data;
     uint32_t length;
     uint64_t time;
-    uint64_t ping_id;
+    uint64_t ping_id; /* 0 if the entry is empty. */
 } Ping_Array_Entry;
 
 
 typedef struct {
     Ping_Array_Entry *entries;
+    uint8_t *data; /* total_size slots of data_size bytes, one for each entry. */
+    uint32_t data_size; /* The maximum length of the data of an entry. */
 
     uint32_t last_deleted; /* number representing the next entry to be deleted. */
     uint32_t last_added; /* number representing the last entry to be added. */
@@ -45,6 +46,7 @@ typedef struct {
 
 
 /* Add a data with length to the Ping_Array list and return a ping_id.
+ * length must not be larger than the data_size the array was initialized with.
  *
  * return ping_id on success.
  * return 0 on failure.
@@ -63,11 +65,13 @@ int ping_array_check(uint8_t *data, uint32_t length, Ping_Array *array, uint64_t
 /* Initialize a Ping_Array.
  * size represents the total size of the array and should be a power of 2.
  * timeout represents the maximum timeout in seconds for the entry.
+ * data_size is the maximum length of the data of an entry, the memory for
+ * the data of all entries is allocated here.
  *
  * return 0 on success.
  * return -1 on failure.
  */
-int ping_array_init(Ping_Array *empty_array, uint32_t size, uint32_t timeout);
+int ping_array_init(Ping_Array *empty_array, uint32_t size, uint32_t timeout, uint32_t data_size);
 
 /* Free all the allocated memory in a Ping_Array.
  */
@@ -0,0 +1,306 @@
+/*
+ * Hierarchical timer wheel for periodic work on large numbers of friends or
+ * connections, so that only the ones whose timers expired are looked at.
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "timer_wheel.h"
+
+#include <stdlib.h>
+
+/* Each level has TIMER_WHEEL_SLOTS slots, and a slot of a level covers as much
+ * time as all the slots of the level below it. Level 0 slots cover one unit of
+ * time. When the wheel reaches the start of a slot of a higher level, the
+ * timers in it are moved down to the levels below (cascaded).
+ *
+ * Timers are kept in doubly linked lists by their number, so that the arrays
+ * of the callers, and the array of timers here, can be reallocated.
+ */
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS 4
+
+/* Timers that expired before they were set, run at the next do_timer_wheel. */
+#define TIMER_LIST_DUE (TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS)
+/* Timers that do_timer_wheel is running. */
+#define TIMER_LIST_FIRING (TIMER_LIST_DUE + 1)
+#define TIMER_NUM_LISTS (TIMER_LIST_FIRING + 1)
+
+#define TIMER_NONE UINT32_MAX
+
+typedef struct {
+    uint64_t expires;
+    uint32_t next;
+    uint32_t prev;
+    uint32_t list; /* TIMER_NONE if the timer is not set. */
+} Timer;
+
+struct Timer_Wheel {
+    timer_cb *function;
+    void *object;
+
+    Timer *timers;
+    uint32_t num_timers;
+
+    /* All the timers that expire before time have been taken out of the wheel. */
+    uint64_t time;
+
+    uint32_t heads[TIMER_NUM_LISTS];
+    uint32_t tails[TIMER_NUM_LISTS];
+    uint32_t level_count[TIMER_WHEEL_LEVELS];
+};
+
+static void timer_link(Timer_Wheel *wheel, uint32_t number, uint32_t list)
+{
+    Timer *timer = &wheel->timers[number];
+    timer->list = list;
+    timer->next = TIMER_NONE;
+    timer->prev = wheel->tails[list];
+
+    if (timer->prev == TIMER_NONE) {
+        wheel->heads[list] = number;
+    } else {
+        wheel->timers[timer->prev].next = number;
+    }
+
+    wheel->tails[list] = number;
+
+    if (list < TIMER_LIST_DUE) {
+        ++wheel->level_count[list / TIMER_WHEEL_SLOTS];
+    }
+}
+
+static void timer_unlink(Timer_Wheel *wheel, uint32_t number)
+{
+    Timer *timer = &wheel->timers[number];
+    const uint32_t list = timer->list;
+
+    if (timer->prev == TIMER_NONE) {
+        wheel->heads[list] = timer->next;
+    } else {
+        wheel->timers[timer->prev].next = timer->next;
+    }
+
+    if (timer->next == TIMER_NONE) {
+        wheel->tails[list] = timer->prev;
+    } else {
+        wheel->timers[timer->next].prev = timer->prev;
+    }
+
+    if (list < TIMER_LIST_DUE) {
+        --wheel->level_count[list / TIMER_WHEEL_SLOTS];
+    }
+
+    timer->list = TIMER_NONE;
+}
+
+/* Put a timer that is not in any list into the list for its expiry time. */
+static void timer_insert(Timer_Wheel *wheel, uint32_t number)
+{
+    uint64_t expires = wheel->timers[number].expires;
+
+    if (expires < wheel->time) {
+        timer_link(wheel, number, TIMER_LIST_DUE);
+        return;
+    }
+
+    const uint64_t max_delta = (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+
+    if (expires - wheel->time > max_delta) {
+        /* Too far ahead for the wheel, the timer is inserted again when it
+         * reaches the bottom of its slot. */
+        expires = wheel->time + max_delta;
+    }
+
+    const uint64_t delta = expires - wheel->time;
+    uint32_t level = 0;
+
+    while (delta >> (TIMER_WHEEL_BITS * (level + 1)) != 0) {
+        ++level;
+    }
+
+    const uint32_t slot = (expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+    timer_link(wheel, number, level * TIMER_WHEEL_SLOTS + slot);
+}
+
+/* Move the timers in list to the end of the list dest. */
+static void timer_move_list(Timer_Wheel *wheel, uint32_t list, uint32_t dest)
+{
+    while (wheel->heads[list] != TIMER_NONE) {
+        const uint32_t number = wheel->heads[list];
+        timer_unlink(wheel, number);
+        timer_link(wheel, number, dest);
+    }
+}
+
+/* Move the timers of the higher level slots that start at wheel->time down. */
+static void timer_cascade(Timer_Wheel *wheel)
+{
+    uint32_t level;
+
+    for (level = 1; level < TIMER_WHEEL_LEVELS; ++level) {
+        const uint32_t slot = (wheel->time >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+        const uint32_t list = level * TIMER_WHEEL_SLOTS + slot;
+
+        while (wheel->heads[list] != TIMER_NONE) {
+            const uint32_t number = wheel->heads[list];
+            timer_unlink(wheel, number);
+            timer_insert(wheel, number);
+        }
+
+        if (slot != 0) {
+            break;
+        }
+    }
+}
+
+/* return the first time from wheel->time on at which the wheel has a slot to
+ * run or to cascade.
+ * return UINT64_MAX if the wheel is empty.
+ */
+static uint64_t timer_next_step(const Timer_Wheel *wheel)
+{
+    uint64_t time = wheel->time;
+    uint32_t level;
+
+    for (level = 0; level < TIMER_WHEEL_LEVELS; ++level) {
+        if (wheel->level_count[level] != 0) {
+            return time;
+        }
+
+        /* Nothing on this level, skip to the next slot of the level above. */
+        const uint64_t span = 1ULL << (TIMER_WHEEL_BITS * (level + 1));
+        time = (time + span - 1) & ~(span - 1);
+    }
+
+    return UINT64_MAX;
+}
+
+Timer_Wheel *new_timer_wheel(timer_cb *function, void *object, uint64_t time)
+{
+    Timer_Wheel *wheel = (Timer_Wheel *)calloc(1, sizeof(Timer_Wheel));
+
+    if (wheel == NULL) {
+        return NULL;
+    }
+
+    wheel->function = function;
+    wheel->object = object;
+    wheel->time = time;
+
+    uint32_t i;
+
+    for (i = 0; i < TIMER_NUM_LISTS; ++i) {
+        wheel->heads[i] = wheel->tails[i] = TIMER_NONE;
+    }
+
+    return wheel;
+}
+
+void kill_timer_wheel(Timer_Wheel *wheel)
+{
+    if (wheel == NULL) {
+        return;
+    }
+
+    free(wheel->timers);
+    free(wheel);
+}
+
+int timer_set(Timer_Wheel *wheel, uint32_t number, uint64_t expires)
+{
+    if (number == TIMER_NONE) {
+        return -1;
+    }
+
+    if (number >= wheel->num_timers) {
+        uint32_t num_timers = wheel->num_timers ? wheel->num_timers : 8;
+
+        while (num_timers <= number) {
+            num_timers = num_timers * 2 > num_timers ? num_timers * 2 : TIMER_NONE;
+        }
+
+        Timer *timers = (Timer *)realloc(wheel->timers, num_timers * sizeof(Timer));
+
+        if (timers == NULL) {
+            return -1;
+        }
+
+        uint32_t i;
+
+        for (i = wheel->num_timers; i < num_timers; ++i) {
+            timers[i].list = TIMER_NONE;
+        }
+
+        wheel->timers = timers;
+        wheel->num_timers = num_timers;
+    }
+
+    if (wheel->timers[number].list != TIMER_NONE) {
+        timer_unlink(wheel, number);
+    }
+
+    wheel->timers[number].expires = expires;
+    timer_insert(wheel, number);
+    return 0;
+}
+
+void timer_stop(Timer_Wheel *wheel, uint32_t number)
+{
+    if (number < wheel->num_timers && wheel->timers[number].list != TIMER_NONE) {
+        timer_unlink(wheel, number);
+    }
+}
+
+void do_timer_wheel(Timer_Wheel *wheel, uint64_t time, void *userdata)
+{
+    timer_move_list(wheel, TIMER_LIST_DUE, TIMER_LIST_FIRING);
+
+    while (wheel->time <= time) {
+        const uint64_t step = timer_next_step(wheel);
+
+        if (step > time) {
+            wheel->time = time + 1;
+            break;
+        }
+
+        wheel->time = step;
+
+        if ((step & TIMER_WHEEL_MASK) == 0) {
+            timer_cascade(wheel);
+        }
+
+        timer_move_list(wheel, step & TIMER_WHEEL_MASK, TIMER_LIST_FIRING);
+        wheel->time = step + 1;
+    }
+
+    /* Timers set again by the function go to the due list or the wheel, so
+     * this runs every expired timer once. */
+    while (wheel->heads[TIMER_LIST_FIRING] != TIMER_NONE) {
+        const uint32_t number = wheel->heads[TIMER_LIST_FIRING];
+        timer_unlink(wheel, number);
+        wheel->function(wheel->object, number, userdata);
+    }
+}
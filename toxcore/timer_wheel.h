@@ -0,0 +1,64 @@
+/*
+ * Hierarchical timer wheel for periodic work on large numbers of friends or
+ * connections, so that only the ones whose timers expired are looked at.
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+
+/* Called with the number of a timer when it expires. The timer is stopped
+ * before the call, so the function may set it again.
+ */
+typedef void timer_cb(void *object, uint32_t number, void *userdata);
+
+typedef struct Timer_Wheel Timer_Wheel;
+
+/* Create a timer wheel whose timers call function with object.
+ * time is the current time, in the unit used for all times given to the
+ * wheel, usually unix_time().
+ *
+ * return NULL on failure.
+ */
+Timer_Wheel *new_timer_wheel(timer_cb *function, void *object, uint64_t time);
+
+void kill_timer_wheel(Timer_Wheel *wheel);
+
+/* Set the timer with number to expire at the first call to do_timer_wheel
+ * with a time of at least expires. If expires has already passed, the timer
+ * expires at the next call. A timer that was already set is moved.
+ *
+ * Numbers are indices into the array of the caller, so the wheel grows to
+ * hold number + 1 timers.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+int timer_set(Timer_Wheel *wheel, uint32_t number, uint64_t expires);
+
+/* Stop the timer with number if it is set. */
+void timer_stop(Timer_Wheel *wheel, uint32_t number);
+
+/* Call the function of the wheel for every timer that expired at time. */
+void do_timer_wheel(Timer_Wheel *wheel, uint64_t time, void *userdata);
+
+#endif
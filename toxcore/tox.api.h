@@ -384,6 +384,22 @@ enum class SAVEDATA_TYPE {
   SECRET_KEY,
 }
 
+/**
+ * Congestion control algorithm that sets how fast data is sent to friends.
+ */
+enum class CONGESTION_CONTROL {
+  /**
+   * Estimate the speed of the link from how fast the queue of sent but not
+   * yet received packets grows.
+   */
+  QUEUE,
+  /**
+   * LEDBAT: send as fast as possible while keeping the delay added to the
+   * round trip time of the link low. Yields to other traffic on the link.
+   */
+  LEDBAT,
+}
+
 
 /**
  * Severity level of log messages.
@@ -569,6 +585,21 @@ static class options {
        */
       any user_data;
     }
+
+    /**
+     * Number of threads used to decrypt received UDP packets. If 0, packets
+     * are decrypted by the thread calling ${tox.iterate}. (Default: 0).
+     *
+     * Handling of the decrypted packets, including all callbacks, still
+     * happens in ${tox.iterate}.
+     */
+    uint32_t crypto_worker_threads;
+
+    /**
+     * The congestion control algorithm of connections to friends.
+     * (Default: QUEUE).
+     */
+    CONGESTION_CONTROL congestion_control;
   }
 
 
@@ -839,6 +870,33 @@ const uint32_t iteration_interval();
 void iterate(any user_data);
 
 
+/**
+ * Return a file descriptor that becomes readable when there is network
+ * traffic for $iterate() to handle. It covers the UDP socket, the sockets of
+ * the connections to TCP relays and the TCP server, if any.
+ *
+ * Instead of calling $iterate() every $iteration_interval() milliseconds, a
+ * client can wait with poll(), select() or epoll for this descriptor to
+ * become readable, for at most $event_timeout() milliseconds, and then call
+ * $iterate(). This lets idle instances sleep far longer.
+ *
+ * The descriptor must not be read from or closed by the client. It is valid
+ * until $kill() is called.
+ *
+ * @return the file descriptor, or -1 if this is not supported on this
+ *   platform.
+ */
+int32_t event_fd();
+
+
+/**
+ * Return the time in milliseconds until $iterate() has work to do that is not
+ * started by traffic on $event_fd(). Only meaningful after $event_fd() was
+ * called.
+ */
+const uint32_t event_timeout();
+
+
 /*******************************************************************************
  *
  * :: Internal client information (Tox address/id)
@@ -122,6 +122,17 @@ Tox *tox_new(const struct Tox_Options *options, TOX_ERR_NEW *error)
         m_options.tcp_server_port = tox_options_get_tcp_port(options);
         m_options.hole_punching_enabled = tox_options_get_hole_punching_enabled(options);
         m_options.local_discovery_enabled = tox_options_get_local_discovery_enabled(options);
+        m_options.crypto_worker_threads = tox_options_get_crypto_worker_threads(options);
+
+        switch (tox_options_get_congestion_control(options)) {
+            case TOX_CONGESTION_CONTROL_LEDBAT:
+                m_options.congestion_algorithm = CONGESTION_ALGORITHM_LEDBAT;
+                break;
+
+            default:
+                m_options.congestion_algorithm = CONGESTION_ALGORITHM_QUEUE;
+                break;
+        }
 
         m_options.log_callback = (logger_cb *)tox_options_get_log_callback(options);
         m_options.log_user_data = tox_options_get_log_user_data(options);
@@ -344,6 +355,18 @@ void tox_iterate(Tox *tox, void *user_data)
     do_groupchats((Group_Chats *)m->conferences_object, user_data);
 }
 
+int32_t tox_event_fd(Tox *tox)
+{
+    Messenger *m = tox;
+    return messenger_poll_fd(m);
+}
+
+uint32_t tox_event_timeout(const Tox *tox)
+{
+    const Messenger *m = tox;
+    return messenger_poll_timeout(m);
+}
+
 void tox_self_get_address(const Tox *tox, uint8_t *address)
 {
     if (address) {
@@ -429,6 +429,26 @@ typedef enum TOX_SAVEDATA_TYPE {
 } TOX_SAVEDATA_TYPE;
 
 
+/**
+ * Congestion control algorithm that sets how fast data is sent to friends.
+ */
+typedef enum TOX_CONGESTION_CONTROL {
+
+    /**
+     * Estimate the speed of the link from how fast the queue of sent but not
+     * yet received packets grows.
+     */
+    TOX_CONGESTION_CONTROL_QUEUE,
+
+    /**
+     * LEDBAT: send as fast as possible while keeping the delay added to the
+     * round trip time of the link low. Yields to other traffic on the link.
+     */
+    TOX_CONGESTION_CONTROL_LEDBAT,
+
+} TOX_CONGESTION_CONTROL;
+
+
 /**
  * Severity level of log messages.
  */
@@ -630,6 +650,23 @@ struct Tox_Options {
      */
     void *log_user_data;
 
+
+    /**
+     * Number of threads used to decrypt received UDP packets. If 0, packets
+     * are decrypted by the thread calling tox_iterate. (Default: 0).
+     *
+     * Handling of the decrypted packets, including all callbacks, still
+     * happens in tox_iterate.
+     */
+    uint32_t crypto_worker_threads;
+
+
+    /**
+     * The congestion control algorithm of connections to friends.
+     * (Default: QUEUE).
+     */
+    TOX_CONGESTION_CONTROL congestion_control;
+
 };
 
 
@@ -693,6 +730,14 @@ void *tox_options_get_log_user_data(const struct Tox_Options *options);
 
 void tox_options_set_log_user_data(struct Tox_Options *options, void *user_data);
 
+uint32_t tox_options_get_crypto_worker_threads(const struct Tox_Options *options);
+
+void tox_options_set_crypto_worker_threads(struct Tox_Options *options, uint32_t crypto_worker_threads);
+
+TOX_CONGESTION_CONTROL tox_options_get_congestion_control(const struct Tox_Options *options);
+
+void tox_options_set_congestion_control(struct Tox_Options *options, TOX_CONGESTION_CONTROL congestion_control);
+
 /**
  * Initialises a Tox_Options object with the default options.
  *
@@ -990,6 +1035,31 @@ uint32_t tox_iteration_interval(const Tox *tox);
  */
 void tox_iterate(Tox *tox, void *user_data);
 
+/**
+ * Return a file descriptor that becomes readable when there is network
+ * traffic for tox_iterate() to handle. It covers the UDP socket, the sockets of
+ * the connections to TCP relays and the TCP server, if any.
+ *
+ * Instead of calling tox_iterate() every tox_iteration_interval() milliseconds, a
+ * client can wait with poll(), select() or epoll for this descriptor to
+ * become readable, for at most tox_event_timeout() milliseconds, and then call
+ * tox_iterate(). This lets idle instances sleep far longer.
+ *
+ * The descriptor must not be read from or closed by the client. It is valid
+ * until tox_kill() is called.
+ *
+ * @return the file descriptor, or -1 if this is not supported on this
+ *   platform.
+ */
+int32_t tox_event_fd(Tox *tox);
+
+/**
+ * Return the time in milliseconds until tox_iterate() has work to do that is not
+ * started by traffic on tox_event_fd(). Only meaningful after tox_event_fd() was
+ * called.
+ */
+uint32_t tox_event_timeout(const Tox *tox);
+
 
 /*******************************************************************************
  *
@@ -52,6 +52,8 @@ ACCESSORS(size_t, savedata_, length)
 ACCESSORS(tox_log_cb *, log_, callback)
 ACCESSORS(void *, log_, user_data)
 ACCESSORS(bool, , local_discovery_enabled)
+ACCESSORS(uint32_t, , crypto_worker_threads)
+ACCESSORS(TOX_CONGESTION_CONTROL, , congestion_control)
 
 const uint8_t *tox_options_get_savedata_data(const struct Tox_Options *options)
 {
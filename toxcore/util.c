@@ -75,6 +75,226 @@ uint32_t id_copy(uint8_t *dest, const uint8_t *src)
     return CRYPTO_PUBLIC_KEY_SIZE;
 }
 
+#define HASH_INDEX_FREE (-1)
+#define HASH_INDEX_REMOVED (-2)
+#define HASH_INDEX_MIN_CAPACITY 8
+
+static uint32_t hash_index_hash(const Hash_Index *hash_index, const uint8_t *key, uint32_t key_size)
+{
+    uint64_t hash = hash_index->seed;
+    uint32_t i;
+
+    for (i = 0; i + sizeof(uint64_t) <= key_size; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, key + i, sizeof(word));
+        hash = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+        hash ^= hash >> 29;
+    }
+
+    for (; i < key_size; ++i) {
+        hash = (hash ^ key[i]) * 0x9E3779B97F4A7C15ULL;
+    }
+
+    hash ^= hash >> 29;
+    return (uint32_t)(hash >> 32);
+}
+
+/* return slot holding key, or the first free slot on its probe sequence if it
+ * is not in hash_index.
+ */
+static uint32_t hash_index_find(const Hash_Index *hash_index, const uint8_t *key, uint32_t key_size)
+{
+    const uint32_t mask = hash_index->capacity - 1;
+    uint32_t slot = hash_index_hash(hash_index, key, key_size) & mask;
+
+    while (hash_index->indices[slot] != HASH_INDEX_FREE) {
+        if (hash_index->indices[slot] != HASH_INDEX_REMOVED
+                && memcmp(hash_index->keys + (size_t)key_size * slot, key, key_size) == 0) {
+            break;
+        }
+
+        slot = (slot + 1) & mask;
+    }
+
+    return slot;
+}
+
+/* return the smallest table size that holds size keys with at most half of
+ * the slots used.
+ */
+static uint32_t hash_index_capacity_for(uint32_t size)
+{
+    uint32_t capacity = HASH_INDEX_MIN_CAPACITY;
+
+    while (size * 2 > capacity) {
+        capacity *= 2;
+    }
+
+    return capacity;
+}
+
+/* Move the keys of hash_index into a new table of capacity slots, dropping the
+ * removed ones.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int hash_index_resize(Hash_Index *hash_index, uint32_t key_size, uint32_t capacity)
+{
+    uint8_t *keys = (uint8_t *)malloc((size_t)key_size * capacity);
+    int32_t *indices = (int32_t *)malloc(capacity * sizeof(int32_t));
+
+    if (keys == NULL || indices == NULL) {
+        free(keys);
+        free(indices);
+        return -1;
+    }
+
+    uint32_t i;
+
+    for (i = 0; i < capacity; ++i) {
+        indices[i] = HASH_INDEX_FREE;
+    }
+
+    Hash_Index old = *hash_index;
+    hash_index->keys = keys;
+    hash_index->indices = indices;
+    hash_index->capacity = capacity;
+    hash_index->used = hash_index->size;
+
+    for (i = 0; i < old.capacity; ++i) {
+        if (old.indices[i] >= 0) {
+            const uint8_t *key = old.keys + (size_t)key_size * i;
+            const uint32_t slot = hash_index_find(hash_index, key, key_size);
+            memcpy(hash_index->keys + (size_t)key_size * slot, key, key_size);
+            hash_index->indices[slot] = old.indices[i];
+        }
+    }
+
+    free(old.keys);
+    free(old.indices);
+    return 0;
+}
+
+void hash_index_free(Hash_Index *hash_index)
+{
+    free(hash_index->keys);
+    free(hash_index->indices);
+    memset(hash_index, 0, sizeof(Hash_Index));
+}
+
+int32_t hash_index_get(const Hash_Index *hash_index, const uint8_t *key, uint32_t key_size)
+{
+    if (hash_index->size == 0) {
+        return -1;
+    }
+
+    const int32_t index = hash_index->indices[hash_index_find(hash_index, key, key_size)];
+
+    if (index < 0) {
+        return -1;
+    }
+
+    return index;
+}
+
+int hash_index_set(Hash_Index *hash_index, const uint8_t *key, uint32_t key_size, int32_t index)
+{
+    if (index < 0) {
+        return -1;
+    }
+
+    if (hash_index->size != 0) {
+        const uint32_t slot = hash_index_find(hash_index, key, key_size);
+
+        if (hash_index->indices[slot] >= 0) {
+            hash_index->indices[slot] = index;
+            return 0;
+        }
+    }
+
+    if (hash_index->keys == NULL) {
+        hash_index->seed = random_64b();
+    }
+
+    /* Keep at least a quarter of the slots free so that probe sequences stay short. */
+    if ((hash_index->used + 1) * 4 > hash_index->capacity * 3) {
+        if (hash_index_resize(hash_index, key_size, hash_index_capacity_for(hash_index->size + 1)) == -1) {
+            return -1;
+        }
+    }
+
+    /* Take the slot of a removed key if there is one on the probe sequence. */
+    const uint32_t mask = hash_index->capacity - 1;
+    uint32_t slot = hash_index_hash(hash_index, key, key_size) & mask;
+
+    while (hash_index->indices[slot] >= 0) {
+        slot = (slot + 1) & mask;
+    }
+
+    if (hash_index->indices[slot] == HASH_INDEX_FREE) {
+        ++hash_index->used;
+    }
+
+    memcpy(hash_index->keys + (size_t)key_size * slot, key, key_size);
+    hash_index->indices[slot] = index;
+    ++hash_index->size;
+    return 0;
+}
+
+int hash_index_remove(Hash_Index *hash_index, const uint8_t *key, uint32_t key_size)
+{
+    if (hash_index->size == 0) {
+        return -1;
+    }
+
+    const uint32_t slot = hash_index_find(hash_index, key, key_size);
+
+    if (hash_index->indices[slot] < 0) {
+        return -1;
+    }
+
+    hash_index->indices[slot] = HASH_INDEX_REMOVED;
+    --hash_index->size;
+
+    /* Give memory back once most of the table is unused, failing is harmless. */
+    if (hash_index->capacity > HASH_INDEX_MIN_CAPACITY && hash_index->size < hash_index->capacity / 8) {
+        hash_index_trim(hash_index, key_size);
+    }
+
+    return 0;
+}
+
+int hash_index_trim(Hash_Index *hash_index, uint32_t key_size)
+{
+    if (hash_index->size == 0) {
+        hash_index_free(hash_index);
+        return 0;
+    }
+
+    return hash_index_resize(hash_index, key_size, hash_index_capacity_for(hash_index->size));
+}
+
+void pk_index_free(PK_Index *pk_index)
+{
+    hash_index_free(pk_index);
+}
+
+int32_t pk_index_get(const PK_Index *pk_index, const uint8_t *public_key)
+{
+    return hash_index_get(pk_index, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+}
+
+int pk_index_set(PK_Index *pk_index, const uint8_t *public_key, int32_t index)
+{
+    return hash_index_set(pk_index, public_key, CRYPTO_PUBLIC_KEY_SIZE, index);
+}
+
+int pk_index_remove(PK_Index *pk_index, const uint8_t *public_key)
+{
+    return hash_index_remove(pk_index, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+}
+
 void host_to_net(uint8_t *num, uint16_t numbytes)
 {
 #ifndef WORDS_BIGENDIAN
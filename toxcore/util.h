@@ -30,6 +30,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "crypto_core.h"
 #include "logger.h"
 
 #define MIN(a,b) (((a)<(b))?(a):(b))
@@ -44,6 +45,79 @@ int is_timeout(uint64_t timestamp, uint64_t timeout);
 bool id_equal(const uint8_t *dest, const uint8_t *src);
 uint32_t id_copy(uint8_t *dest, const uint8_t *src); /* return value is CLIENT_ID_SIZE */
 
+/* Open addressing hash map from keys of key_size bytes to non-negative
+ * indices, e.g. of arrays. Every call on a Hash_Index must pass the same
+ * key_size. The hash is seeded with a random value per index, so that peers
+ * can't choose keys that all land in the same slots.
+ * A zeroed Hash_Index is empty and valid.
+ */
+typedef struct Hash_Index {
+    uint8_t *keys;
+    int32_t *indices; /* -1 if the slot is free, -2 if the key in it was removed. */
+    uint32_t capacity; /* 0 or a power of 2. */
+    uint32_t size; /* Number of keys in the index. */
+    uint32_t used; /* Number of slots that are not free, including those of removed keys. */
+    uint64_t seed;
+} Hash_Index;
+
+/* Free the memory used by hash_index and empty it. */
+void hash_index_free(Hash_Index *hash_index);
+
+/* return index stored for key.
+ * return -1 if key is not in hash_index.
+ */
+int32_t hash_index_get(const Hash_Index *hash_index, const uint8_t *key, uint32_t key_size);
+
+/* Store index for key, replacing the index it had if it was already in hash_index.
+ * Replacing an index never fails.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+int hash_index_set(Hash_Index *hash_index, const uint8_t *key, uint32_t key_size, int32_t index);
+
+/* Remove key from hash_index.
+ *
+ * return -1 if key was not in hash_index.
+ * return 0 on success.
+ */
+int hash_index_remove(Hash_Index *hash_index, const uint8_t *key, uint32_t key_size);
+
+/* Shrink the table of hash_index to the smallest size that holds its keys.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+int hash_index_trim(Hash_Index *hash_index, uint32_t key_size);
+
+/* Hash_Index of public keys, used to find friends and connections by public
+ * key without scanning their arrays. A zeroed PK_Index is empty and valid.
+ */
+typedef Hash_Index PK_Index;
+
+/* Free the memory used by pk_index and empty it. */
+void pk_index_free(PK_Index *pk_index);
+
+/* return index stored for public_key.
+ * return -1 if public_key is not in pk_index.
+ */
+int32_t pk_index_get(const PK_Index *pk_index, const uint8_t *public_key);
+
+/* Store index for public_key, replacing the index it had if it was already in pk_index.
+ * Replacing an index never fails.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+int pk_index_set(PK_Index *pk_index, const uint8_t *public_key, int32_t index);
+
+/* Remove public_key from pk_index.
+ *
+ * return -1 if public_key was not in pk_index.
+ * return 0 on success.
+ */
+int pk_index_remove(PK_Index *pk_index, const uint8_t *public_key);
+
 void host_to_net(uint8_t *num, uint16_t numbytes);
 #define net_to_host(x, y) host_to_net(x, y)
 